@@ -0,0 +1,1749 @@
+#include "NvEncodeStub.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+
+#if defined(_WIN32)
+#include <deque>
+#include <condition_variable>
+#endif
+
+
+typedef std::chrono::steady_clock Clock;
+
+static NvEncStubConfig GetDefaultConfig()
+{
+	NvEncStubConfig config;
+	memset(&config, 0, sizeof(config));
+	config.maxSessions = 32;
+	return config;
+}
+
+// Guards the configuration and trace callback; counters are atomics so calls never contend on them
+static std::mutex s_configMutex;
+static NvEncStubConfig s_config = GetDefaultConfig();
+static NvEncStubTraceCallback s_traceCallback = nullptr;
+static void* s_traceUser = nullptr;
+
+// Checked on every call without taking the lock
+static std::atomic<bool> s_tracing(false);
+static std::atomic<bool> s_faultsEnabled(false);
+
+static std::atomic<uint64_t> s_faultCalls[NVENC_STUB_CALL_COUNT];
+static std::atomic<uint64_t> s_calls[NVENC_STUB_CALL_COUNT];
+static std::atomic<uint64_t> s_failures[NVENC_STUB_CALL_COUNT];
+static std::atomic<uint64_t> s_frames(0);
+static std::atomic<uint64_t> s_idrFrames(0);
+static std::atomic<uint64_t> s_bytes(0);
+static std::atomic<uint32_t> s_sessions(0);
+static std::atomic<uint32_t> s_bitstreamBuffers(0);
+static std::atomic<uint32_t> s_registrations(0);
+static std::atomic<uint32_t> s_mappings(0);
+static std::atomic<uint32_t> s_lockedBitstreams(0);
+
+static std::once_flag s_environmentOnce;
+
+static const char* s_callNames[NVENC_STUB_CALL_COUNT] =
+{
+	"nvEncOpenEncodeSessionEx",
+	"nvEncGetEncodeCaps",
+	"nvEncGetEncodePresetConfig",
+	"nvEncInitializeEncoder",
+	"nvEncReconfigureEncoder",
+	"nvEncGetSequenceParams",
+	"nvEncCreateBitstreamBuffer",
+	"nvEncDestroyBitstreamBuffer",
+	"nvEncRegisterResource",
+	"nvEncUnregisterResource",
+	"nvEncMapInputResource",
+	"nvEncUnmapInputResource",
+	"nvEncEncodePicture",
+	"nvEncLockBitstream",
+	"nvEncUnlockBitstream",
+	"nvEncRegisterAsyncEvent",
+	"nvEncUnregisterAsyncEvent",
+	"nvEncInvalidateRefFrames",
+	"nvEncGetEncodeStats",
+	"nvEncDestroyEncoder",
+	"other"
+};
+
+// Slice data after the header; never forms a start code or emulation prevention sequence
+static const uint8_t s_fillerByte = 0x55;
+
+
+
+/**
+ * @brief Writes RBSP bits for the synthetic parameter sets and slice headers.
+ */
+class StubBitWriter
+{
+public:
+	void PutBits(uint32_t value, uint32_t count)
+	{
+		while (count-- > 0)
+		{
+			m_current = (uint8_t)((m_current << 1) | ((value >> count) & 1));
+			if (++m_bits == 8)
+			{
+				m_data.push_back(m_current);
+				m_current = 0;
+				m_bits = 0;
+			}
+		}
+	}
+
+	void PutFlag(bool flag) { PutBits(flag ? 1 : 0, 1); }
+
+	void PutUE(uint32_t value)
+	{
+		uint64_t codeNum = (uint64_t)value + 1;
+		uint32_t length = 0;
+		while ((codeNum >> (length + 1)) != 0)
+			++length;
+
+		PutBits(0, length);
+		PutBits(1, 1);
+		PutBits((uint32_t)(codeNum & ((1ull << length) - 1)), length);
+	}
+
+	void PutSE(int32_t value)
+	{
+		PutUE(value > 0 ? (uint32_t)(2 * value - 1) : (uint32_t)(-2 * (int64_t)value));
+	}
+
+	// rbsp_trailing_bits(), also used for the slice header's byte_alignment()
+	void PutTrailingBits()
+	{
+		PutBits(1, 1);
+		while (m_bits != 0)
+			PutBits(0, 1);
+	}
+
+	const std::vector<uint8_t>& GetData() const { return m_data; }
+
+private:
+	std::vector<uint8_t> m_data;
+	uint8_t m_current = 0;
+	uint32_t m_bits = 0;
+};
+
+
+
+/**
+ * @brief Appends a start code, the NAL header and the escaped RBSP.
+ * @param output
+ * @param header
+ * @param headerSize One byte for H.264, two for HEVC
+ * @param rbsp
+ */
+static void AppendNAL(std::vector<uint8_t>& output, const uint8_t* header, size_t headerSize, const std::vector<uint8_t>& rbsp)
+{
+	static const uint8_t startCode[] = { 0, 0, 0, 1 };
+	output.insert(output.end(), startCode, startCode + sizeof(startCode));
+	output.insert(output.end(), header, header + headerSize);
+
+	uint32_t zeros = 0;
+	for (uint8_t byte : rbsp)
+	{
+		if (zeros >= 2 && byte <= 3)
+		{
+			output.push_back(3);
+			zeros = 0;
+		}
+
+		output.push_back(byte);
+		zeros = (byte == 0) ? zeros + 1 : 0;
+	}
+}
+
+
+
+/**
+ * @brief Common part of the H.264 and HEVC VUI: full range BT.709, like the encoder configures it, and the frame rate.
+ * @param writer
+ * @param hevc
+ * @param params
+ */
+static void PutVUI(StubBitWriter& writer, bool hevc, const NV_ENC_INITIALIZE_PARAMS& params)
+{
+	writer.PutFlag(false);                  // aspect_ratio_info_present_flag
+	writer.PutFlag(false);                  // overscan_info_present_flag
+	writer.PutFlag(true);                   // video_signal_type_present_flag
+	writer.PutBits(5, 3);                   // video_format: unspecified
+	writer.PutFlag(true);                   // video_full_range_flag
+	writer.PutFlag(true);                   // colour_description_present_flag
+	writer.PutBits(1, 8);
+	writer.PutBits(1, 8);
+	writer.PutBits(1, 8);
+	writer.PutFlag(false);                  // chroma_loc_info_present_flag
+
+	if (hevc)
+	{
+		writer.PutFlag(false);              // neutral_chroma_indication_flag
+		writer.PutFlag(false);              // field_seq_flag
+		writer.PutFlag(false);              // frame_field_info_present_flag
+		writer.PutFlag(false);              // default_display_window_flag
+	}
+
+	bool timing = params.frameRateNum != 0 && params.frameRateDen != 0;
+	writer.PutFlag(timing);
+	if (timing)
+	{
+		// H.264 counts fields
+		writer.PutBits(params.frameRateDen, 32);
+		writer.PutBits(hevc ? params.frameRateNum : 2 * params.frameRateNum, 32);
+		writer.PutFlag(false);              // fixed_frame_rate_flag, vui_poc_proportional_to_timing_flag
+		if (hevc)
+			writer.PutFlag(false);          // vui_hrd_parameters_present_flag
+	}
+
+	if (!hevc)
+	{
+		writer.PutFlag(false);              // nal_hrd_parameters_present_flag
+		writer.PutFlag(false);              // vcl_hrd_parameters_present_flag
+		writer.PutFlag(false);              // pic_struct_present_flag
+	}
+
+	writer.PutFlag(false);                  // bitstream_restriction_flag
+}
+
+
+
+/**
+ * @brief HEVC profile_tier_level() for Main profile, level 5.1.
+ * @param writer
+ */
+static void PutProfileTierLevel(StubBitWriter& writer)
+{
+	writer.PutBits(0, 2);                   // general_profile_space
+	writer.PutFlag(false);                  // general_tier_flag
+	writer.PutBits(1, 5);                   // general_profile_idc: Main
+	writer.PutBits(0x60000000, 32);         // Compatible with Main and Main 10
+	writer.PutFlag(true);                   // general_progressive_source_flag
+	writer.PutFlag(false);                  // general_interlaced_source_flag
+	writer.PutFlag(false);                  // general_non_packed_constraint_flag
+	writer.PutFlag(true);                   // general_frame_only_constraint_flag
+	writer.PutBits(0, 32);                  // general_reserved_zero_43bits and general_inbld_flag
+	writer.PutBits(0, 12);
+	writer.PutBits(153, 8);                 // general_level_idc
+}
+
+
+
+/**
+ * @brief Fake encode session: tracks its objects like the driver does and writes synthetic access units.
+ */
+class StubEncoder
+{
+public:
+	StubEncoder() : m_magic(s_magic) { ++s_sessions; }
+	~StubEncoder();
+
+	// Handles are only valid while the session that created them is; the magic number catches most stale ones
+	static StubEncoder* FromHandle(void* encoder)
+	{
+		StubEncoder* stub = static_cast<StubEncoder*>(encoder);
+		return (stub && stub->m_magic == s_magic) ? stub : nullptr;
+	}
+
+	NVENCSTATUS GetEncodeCaps(NV_ENC_CAPS_PARAM* capsParam, int* capsVal);
+	NVENCSTATUS GetEncodePresetConfig(NV_ENC_PRESET_CONFIG* presetConfig);
+	NVENCSTATUS Initialize(const NV_ENC_INITIALIZE_PARAMS* params);
+	NVENCSTATUS Reconfigure(const NV_ENC_RECONFIGURE_PARAMS* params);
+	NVENCSTATUS GetSequenceParams(NV_ENC_SEQUENCE_PARAM_PAYLOAD* payload);
+	NVENCSTATUS CreateBitstreamBuffer(NV_ENC_CREATE_BITSTREAM_BUFFER* params);
+	NVENCSTATUS DestroyBitstreamBuffer(NV_ENC_OUTPUT_PTR bitstreamBuffer);
+	NVENCSTATUS RegisterResource(NV_ENC_REGISTER_RESOURCE* params);
+	NVENCSTATUS UnregisterResource(NV_ENC_REGISTERED_PTR registeredResource);
+	NVENCSTATUS MapInputResource(NV_ENC_MAP_INPUT_RESOURCE* params);
+	NVENCSTATUS UnmapInputResource(NV_ENC_INPUT_PTR mappedResource);
+	NVENCSTATUS EncodePicture(const NV_ENC_PIC_PARAMS* params);
+	NVENCSTATUS LockBitstream(NV_ENC_LOCK_BITSTREAM* params);
+	NVENCSTATUS UnlockBitstream(NV_ENC_OUTPUT_PTR bitstreamBuffer);
+	NVENCSTATUS RegisterAsyncEvent(const NV_ENC_EVENT_PARAMS* params);
+	NVENCSTATUS UnregisterAsyncEvent(const NV_ENC_EVENT_PARAMS* params);
+	NVENCSTATUS InvalidateRefFrames(uint64_t timestamp);
+	NVENCSTATUS GetEncodeStats(NV_ENC_STAT* stats);
+
+private:
+	struct Bitstream
+	{
+		std::vector<uint8_t> data;
+		uint32_t size = 0;                  // Of the encoded access unit
+		uint32_t dirty = 0;                 // Bytes from the start that may not be filler
+		bool pending = false;               // Holds an access unit that has not been unlocked yet
+		bool locked = false;
+		Clock::time_point ready;
+		NV_ENC_PIC_TYPE pictureType = NV_ENC_PIC_TYPE_UNKNOWN;
+		uint32_t frameIdx = 0;
+		uint64_t timestamp = 0;
+		uint64_t duration = 0;
+		uint32_t qp = 0;
+	};
+
+	struct Registration
+	{
+		NV_ENC_REGISTER_RESOURCE params;
+		uint32_t mapCount = 0;
+	};
+
+	struct Mapping
+	{
+		Registration* registration;
+	};
+
+	void BuildParameterSets();
+	void BuildSliceHeader(bool idr, bool intra, uint32_t qp, std::vector<uint8_t>& output);
+	uint32_t GetFrameSize(bool idr, const NvEncStubConfig& config) const;
+	void Complete(void* event, Clock::time_point ready);
+
+private:
+	static const uint32_t s_magic = 0x5354554e;
+
+	uint32_t m_magic;
+	std::mutex m_mutex;
+
+	NV_ENC_INITIALIZE_PARAMS m_params;
+	NV_ENC_CONFIG m_config;
+	bool m_initialized = false;
+	bool m_hevc = false;
+
+	std::vector<uint8_t> m_parameterSets;
+	std::vector<uint8_t> m_header;
+	uint32_t m_frameNum = 0;                // frame_num (H.264) or POC (HEVC) since the last IDR
+	uint32_t m_idrPicId = 0;
+	uint32_t m_framesSinceIDR = 0;
+	bool m_forceIDR = true;
+
+	std::unordered_set<Bitstream*> m_bitstreams;
+	std::unordered_set<Registration*> m_registrations;
+	std::unordered_set<Mapping*> m_mappings;
+	std::unordered_set<void*> m_events;
+
+#if defined(_WIN32)
+	// Signals completion events once their frame's latency has passed
+	std::thread m_completionThread;
+	std::condition_variable m_completionSignal;
+	std::deque<std::pair<Clock::time_point, void*>> m_completions;
+	bool m_stopCompletion = false;
+#endif
+};
+
+
+
+/**
+ * @brief Releases everything the client did not; the live object counters keep the leaks visible.
+ */
+StubEncoder::~StubEncoder()
+{
+#if defined(_WIN32)
+	if (m_completionThread.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stopCompletion = true;
+		}
+		m_completionSignal.notify_all();
+		m_completionThread.join();
+	}
+#endif
+
+	for (Mapping* mapping : m_mappings)
+		delete mapping;
+	for (Registration* registration : m_registrations)
+		delete registration;
+	for (Bitstream* bitstream : m_bitstreams)
+		delete bitstream;
+
+	m_magic = 0;
+	--s_sessions;
+}
+
+
+
+/**
+ * @brief Answers the caps the encoder queries; everything else is reported as unsupported.
+ * @param capsParam
+ * @param capsVal
+ * @return
+ */
+NVENCSTATUS StubEncoder::GetEncodeCaps(NV_ENC_CAPS_PARAM* capsParam, int* capsVal)
+{
+	if (!capsParam || !capsVal)
+		return NV_ENC_ERR_INVALID_PTR;
+
+	NvEncStubConfig config;
+	NvEncStubGetConfig(&config);
+
+	switch (capsParam->capsToQuery)
+	{
+	case NV_ENC_CAPS_ASYNC_ENCODE_SUPPORT:
+#if defined(_WIN32)
+		*capsVal = config.asyncEncode ? 1 : 0;
+#else
+		*capsVal = 0;
+#endif
+		break;
+	case NV_ENC_CAPS_SUPPORT_REF_PIC_INVALIDATION:
+		*capsVal = 1;
+		break;
+	case NV_ENC_CAPS_WIDTH_MAX:
+	case NV_ENC_CAPS_HEIGHT_MAX:
+		*capsVal = 4096;
+		break;
+	default:
+		*capsVal = 0;
+		break;
+	}
+
+	return NV_ENC_SUCCESS;
+}
+
+
+
+/**
+ * @brief A low latency configuration: infinite GOP without B frames, CBR.
+ * @param presetConfig
+ * @return
+ */
+NVENCSTATUS StubEncoder::GetEncodePresetConfig(NV_ENC_PRESET_CONFIG* presetConfig)
+{
+	if (!presetConfig)
+		return NV_ENC_ERR_INVALID_PTR;
+
+	NV_ENC_CONFIG& config = presetConfig->presetCfg;
+	memset(&config, 0, sizeof(config));
+	config.version = NV_ENC_CONFIG_VER;
+	config.gopLength = NVENC_INFINITE_GOPLENGTH;
+	config.frameIntervalP = 1;
+	config.rcParams.version = NV_ENC_RC_PARAMS_VER;
+	config.rcParams.rateControlMode = NV_ENC_PARAMS_RC_CBR;
+	config.rcParams.averageBitRate = 10000000;
+	config.rcParams.maxBitRate = config.rcParams.averageBitRate;
+
+	return NV_ENC_SUCCESS;
+}
+
+
+
+/**
+ * @brief Takes over the parameters (and the configuration they point to) of nvEncInitializeEncoder.
+ * @param params
+ * @return
+ */
+NVENCSTATUS StubEncoder::Initialize(const NV_ENC_INITIALIZE_PARAMS* params)
+{
+	if (!params)
+		return NV_ENC_ERR_INVALID_PTR;
+	if (m_initialized)
+		return NV_ENC_ERR_INVALID_CALL;
+	if (params->encodeWidth == 0 || params->encodeHeight == 0 || params->encodeWidth > 4096 || params->encodeHeight > 4096)
+		return NV_ENC_ERR_INVALID_PARAM;
+
+	bool hevc = memcmp(&params->encodeGUID, &NV_ENC_CODEC_HEVC_GUID, sizeof(GUID)) == 0;
+	if (!hevc && memcmp(&params->encodeGUID, &NV_ENC_CODEC_H264_GUID, sizeof(GUID)) != 0)
+		return NV_ENC_ERR_INVALID_PARAM;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	m_hevc = hevc;
+	m_params = *params;
+	if (params->encodeConfig)
+		m_config = *params->encodeConfig;
+	else
+		memset(&m_config, 0, sizeof(m_config));
+	m_params.encodeConfig = &m_config;
+
+	m_initialized = true;
+	m_forceIDR = true;
+	BuildParameterSets();
+
+	return NV_ENC_SUCCESS;
+}
+
+
+
+/**
+ * @brief Applies new parameters; the codec can not change, and a reset or forced IDR makes the next frame an IDR.
+ * @param params
+ * @return
+ */
+NVENCSTATUS StubEncoder::Reconfigure(const NV_ENC_RECONFIGURE_PARAMS* params)
+{
+	if (!params)
+		return NV_ENC_ERR_INVALID_PTR;
+
+	const NV_ENC_INITIALIZE_PARAMS& newParams = params->reInitEncodeParams;
+	if (newParams.encodeWidth == 0 || newParams.encodeHeight == 0 ||
+		newParams.encodeWidth > newParams.maxEncodeWidth || newParams.encodeHeight > newParams.maxEncodeHeight)
+		return NV_ENC_ERR_INVALID_PARAM;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (!m_initialized)
+		return NV_ENC_ERR_ENCODER_NOT_INITIALIZED;
+	if (memcmp(&newParams.encodeGUID, &m_params.encodeGUID, sizeof(GUID)) != 0)
+		return NV_ENC_ERR_INVALID_PARAM;
+
+	m_params = newParams;
+	if (newParams.encodeConfig)
+		m_config = *newParams.encodeConfig;
+	m_params.encodeConfig = &m_config;
+
+	if (params->resetEncoder || params->forceIDR)
+		m_forceIDR = true;
+
+	BuildParameterSets();
+	return NV_ENC_SUCCESS;
+}
+
+
+
+/**
+ * @brief Copies out the current parameter sets.
+ * @param payload
+ * @return
+ */
+NVENCSTATUS StubEncoder::GetSequenceParams(NV_ENC_SEQUENCE_PARAM_PAYLOAD* payload)
+{
+	if (!payload || !payload->spsppsBuffer || !payload->outSPSPPSPayloadSize)
+		return NV_ENC_ERR_INVALID_PTR;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (!m_initialized)
+		return NV_ENC_ERR_ENCODER_NOT_INITIALIZED;
+	if (payload->inBufferSize < m_parameterSets.size())
+		return NV_ENC_ERR_INVALID_PARAM;
+
+	memcpy(payload->spsppsBuffer, m_parameterSets.data(), m_parameterSets.size());
+	*payload->outSPSPPSPayloadSize = (uint32_t)m_parameterSets.size();
+	return NV_ENC_SUCCESS;
+}
+
+
+
+/**
+ * @brief Allocates a system memory bitstream buffer of the requested size, prefilled with slice data.
+ * @param params
+ * @return
+ */
+NVENCSTATUS StubEncoder::CreateBitstreamBuffer(NV_ENC_CREATE_BITSTREAM_BUFFER* params)
+{
+	if (!params)
+		return NV_ENC_ERR_INVALID_PTR;
+	if (params->size == 0)
+		return NV_ENC_ERR_INVALID_PARAM;
+
+	Bitstream* bitstream = new Bitstream();
+	bitstream->data.assign(params->size, s_fillerByte);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_bitstreams.insert(bitstream);
+	++s_bitstreamBuffers;
+
+	params->bitstreamBuffer = bitstream;
+	return NV_ENC_SUCCESS;
+}
+
+
+
+/**
+ * @brief Frees a bitstream buffer; it must not be locked.
+ * @param bitstreamBuffer
+ * @return
+ */
+NVENCSTATUS StubEncoder::DestroyBitstreamBuffer(NV_ENC_OUTPUT_PTR bitstreamBuffer)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	Bitstream* bitstream = static_cast<Bitstream*>(bitstreamBuffer);
+	if (m_bitstreams.find(bitstream) == m_bitstreams.end())
+		return NV_ENC_ERR_INVALID_PARAM;
+	if (bitstream->locked)
+		return NV_ENC_ERR_INVALID_CALL;
+
+	m_bitstreams.erase(bitstream);
+	delete bitstream;
+	--s_bitstreamBuffers;
+	return NV_ENC_SUCCESS;
+}
+
+
+
+/**
+ * @brief Registers any non-null resource; it is never dereferenced.
+ * @param params
+ * @return
+ */
+NVENCSTATUS StubEncoder::RegisterResource(NV_ENC_REGISTER_RESOURCE* params)
+{
+	if (!params || !params->resourceToRegister)
+		return NV_ENC_ERR_INVALID_PTR;
+	if (params->width == 0 || params->height == 0)
+		return NV_ENC_ERR_INVALID_PARAM;
+
+	Registration* registration = new Registration();
+	registration->params = *params;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_registrations.insert(registration);
+	++s_registrations;
+
+	params->registeredResource = registration;
+	return NV_ENC_SUCCESS;
+}
+
+
+
+/**
+ * @brief Unregisters a resource that is not mapped anymore.
+ * @param registeredResource
+ * @return
+ */
+NVENCSTATUS StubEncoder::UnregisterResource(NV_ENC_REGISTERED_PTR registeredResource)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	Registration* registration = static_cast<Registration*>(registeredResource);
+	if (m_registrations.find(registration) == m_registrations.end())
+		return NV_ENC_ERR_RESOURCE_NOT_REGISTERED;
+	if (registration->mapCount > 0)
+		return NV_ENC_ERR_INVALID_CALL;
+
+	m_registrations.erase(registration);
+	delete registration;
+	--s_registrations;
+	return NV_ENC_SUCCESS;
+}
+
+
+
+/**
+ * @brief Maps a registered resource; every mapping gets its own handle.
+ * @param params
+ * @return
+ */
+NVENCSTATUS StubEncoder::MapInputResource(NV_ENC_MAP_INPUT_RESOURCE* params)
+{
+	if (!params)
+		return NV_ENC_ERR_INVALID_PTR;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	Registration* registration = static_cast<Registration*>(params->registeredResource);
+	if (m_registrations.find(registration) == m_registrations.end())
+		return NV_ENC_ERR_RESOURCE_NOT_REGISTERED;
+
+	Mapping* mapping = new Mapping();
+	mapping->registration = registration;
+	++registration->mapCount;
+
+	m_mappings.insert(mapping);
+	++s_mappings;
+
+	params->mappedResource = mapping;
+	params->mappedBufferFmt = registration->params.bufferFormat;
+	return NV_ENC_SUCCESS;
+}
+
+
+
+/**
+ * @brief Unmaps a mapped input.
+ * @param mappedResource
+ * @return
+ */
+NVENCSTATUS StubEncoder::UnmapInputResource(NV_ENC_INPUT_PTR mappedResource)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	Mapping* mapping = static_cast<Mapping*>(mappedResource);
+	if (m_mappings.find(mapping) == m_mappings.end())
+		return NV_ENC_ERR_RESOURCE_NOT_MAPPED;
+
+	--mapping->registration->mapCount;
+	m_mappings.erase(mapping);
+	delete mapping;
+	--s_mappings;
+	return NV_ENC_SUCCESS;
+}
+
+
+
+/**
+ * @brief "Encodes" a mapped input into a bitstream buffer: the access unit is written right away and
+ * becomes lockable once the configured latency has passed.
+ * @param params
+ * @return
+ */
+NVENCSTATUS StubEncoder::EncodePicture(const NV_ENC_PIC_PARAMS* params)
+{
+	if (!params)
+		return NV_ENC_ERR_INVALID_PTR;
+
+	NvEncStubConfig config;
+	NvEncStubGetConfig(&config);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (!m_initialized)
+		return NV_ENC_ERR_ENCODER_NOT_INITIALIZED;
+
+	Mapping* mapping = static_cast<Mapping*>(params->inputBuffer);
+	if (m_mappings.find(mapping) == m_mappings.end())
+		return NV_ENC_ERR_RESOURCE_NOT_MAPPED;
+
+	Bitstream* bitstream = static_cast<Bitstream*>(params->outputBitstream);
+	if (m_bitstreams.find(bitstream) == m_bitstreams.end())
+		return NV_ENC_ERR_INVALID_PARAM;
+
+	// The previous frame in this buffer has to be unlocked first
+	if (bitstream->pending || bitstream->locked)
+		return NV_ENC_ERR_INVALID_CALL;
+
+	const NV_ENC_REGISTER_RESOURCE& input = mapping->registration->params;
+	if (params->inputWidth != input.width || params->inputHeight != input.height ||
+		input.width < m_params.encodeWidth || input.height < m_params.encodeHeight)
+		return NV_ENC_ERR_INVALID_PARAM;
+
+	if (params->completionEvent && m_events.find(params->completionEvent) == m_events.end())
+		return NV_ENC_ERR_EVENT_NOT_REGISTERD;
+
+	bool idr = m_forceIDR || (params->encodePicFlags & NV_ENC_PIC_FLAG_FORCEIDR) ||
+		(m_config.gopLength != 0 && m_config.gopLength != NVENC_INFINITE_GOPLENGTH && m_framesSinceIDR >= m_config.gopLength);
+	bool intra = idr || (params->encodePicFlags & NV_ENC_PIC_FLAG_FORCEINTRA);
+
+	bool repeatParameterSets = m_hevc ? m_config.encodeCodecConfig.hevcConfig.repeatSPSPPS : m_config.encodeCodecConfig.h264Config.repeatSPSPPS;
+	bool parameterSets = (idr && (m_forceIDR || repeatParameterSets)) || (params->encodePicFlags & NV_ENC_PIC_FLAG_OUTPUT_SPSPPS);
+
+	if (idr)
+	{
+		m_frameNum = 0;
+		m_framesSinceIDR = 0;
+		++m_idrPicId;
+	}
+
+	uint32_t qp = intra ? 24 : 28;
+
+	m_header.clear();
+	if (parameterSets)
+		m_header = m_parameterSets;
+	BuildSliceHeader(idr, intra, qp, m_header);
+
+	// The header always fits; a buffer too small for the padding just gets a smaller frame
+	uint32_t headerSize = (uint32_t)m_header.size();
+	if (headerSize > bitstream->data.size())
+		bitstream->data.resize(headerSize, s_fillerByte);
+
+	uint32_t size = (std::min)((std::max)(GetFrameSize(idr, config), headerSize), (uint32_t)bitstream->data.size());
+
+	// Restore the filler a longer earlier header overwrote
+	memcpy(bitstream->data.data(), m_header.data(), headerSize);
+	if (bitstream->dirty > headerSize)
+		memset(bitstream->data.data() + headerSize, s_fillerByte, bitstream->dirty - headerSize);
+	bitstream->dirty = headerSize;
+
+	bitstream->size = size;
+	bitstream->pending = true;
+	bitstream->ready = Clock::now() + std::chrono::microseconds(config.encodeLatency);
+	bitstream->pictureType = idr ? NV_ENC_PIC_TYPE_IDR : (intra ? NV_ENC_PIC_TYPE_I : NV_ENC_PIC_TYPE_P);
+	bitstream->frameIdx = params->frameIdx;
+	bitstream->timestamp = params->inputTimeStamp;
+	bitstream->duration = params->inputDuration;
+	bitstream->qp = qp;
+
+	m_forceIDR = false;
+	++m_frameNum;
+	++m_framesSinceIDR;
+
+	++s_frames;
+	if (idr)
+		++s_idrFrames;
+	s_bytes += size;
+
+	if (params->completionEvent)
+		Complete(params->completionEvent, bitstream->ready);
+
+	return NV_ENC_SUCCESS;
+}
+
+
+
+/**
+ * @brief Waits for (or polls) the frame in a bitstream buffer and locks it.
+ * @param params
+ * @return NV_ENC_ERR_LOCK_BUSY if the frame is not ready yet and doNotWait is set.
+ */
+NVENCSTATUS StubEncoder::LockBitstream(NV_ENC_LOCK_BITSTREAM* params)
+{
+	if (!params)
+		return NV_ENC_ERR_INVALID_PTR;
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	Bitstream* bitstream = static_cast<Bitstream*>(params->outputBitstream);
+	if (m_bitstreams.find(bitstream) == m_bitstreams.end())
+		return NV_ENC_ERR_INVALID_PARAM;
+	if (!bitstream->pending || bitstream->locked)
+		return NV_ENC_ERR_INVALID_CALL;
+
+	Clock::time_point ready = bitstream->ready;
+	if (Clock::now() < ready)
+	{
+		if (params->doNotWait)
+			return NV_ENC_ERR_LOCK_BUSY;
+
+		// Other calls on this session (e.g. unlocks from other threads) go on meanwhile
+		lock.unlock();
+		std::this_thread::sleep_until(ready);
+		lock.lock();
+
+		if (m_bitstreams.find(bitstream) == m_bitstreams.end() || !bitstream->pending || bitstream->locked)
+			return NV_ENC_ERR_INVALID_CALL;
+	}
+
+	bitstream->locked = true;
+	++s_lockedBitstreams;
+
+	params->bitstreamBufferPtr = bitstream->data.data();
+	params->bitstreamSizeInBytes = bitstream->size;
+	params->frameIdx = bitstream->frameIdx;
+	params->outputTimeStamp = bitstream->timestamp;
+	params->outputDuration = bitstream->duration;
+	params->pictureType = bitstream->pictureType;
+	params->pictureStruct = NV_ENC_PIC_STRUCT_FRAME;
+	params->frameAvgQP = bitstream->qp;
+	params->numSlices = 1;
+	params->hwEncodeStatus = 0;
+	if (params->sliceOffsets)
+		params->sliceOffsets[0] = 0;
+
+	return NV_ENC_SUCCESS;
+}
+
+
+
+/**
+ * @brief Unlocks a locked bitstream buffer, which can then be encoded into again.
+ * @param bitstreamBuffer
+ * @return
+ */
+NVENCSTATUS StubEncoder::UnlockBitstream(NV_ENC_OUTPUT_PTR bitstreamBuffer)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	Bitstream* bitstream = static_cast<Bitstream*>(bitstreamBuffer);
+	if (m_bitstreams.find(bitstream) == m_bitstreams.end())
+		return NV_ENC_ERR_INVALID_PARAM;
+	if (!bitstream->locked)
+		return NV_ENC_ERR_INVALID_CALL;
+
+	bitstream->locked = false;
+	bitstream->pending = false;
+	--s_lockedBitstreams;
+	return NV_ENC_SUCCESS;
+}
+
+
+
+/**
+ * @brief Registers a completion event (Windows only, like the driver).
+ * @param params
+ * @return
+ */
+NVENCSTATUS StubEncoder::RegisterAsyncEvent(const NV_ENC_EVENT_PARAMS* params)
+{
+#if defined(_WIN32)
+	if (!params || !params->completionEvent)
+		return NV_ENC_ERR_INVALID_PTR;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (!m_events.insert(params->completionEvent).second)
+		return NV_ENC_ERR_INVALID_PARAM;
+
+	return NV_ENC_SUCCESS;
+#else
+	(void)params;
+	return NV_ENC_ERR_UNIMPLEMENTED;
+#endif
+}
+
+
+
+/**
+ * @brief Unregisters a completion event.
+ * @param params
+ * @return
+ */
+NVENCSTATUS StubEncoder::UnregisterAsyncEvent(const NV_ENC_EVENT_PARAMS* params)
+{
+	if (!params)
+		return NV_ENC_ERR_INVALID_PTR;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_events.erase(params->completionEvent) == 0)
+		return NV_ENC_ERR_EVENT_NOT_REGISTERD;
+
+	return NV_ENC_SUCCESS;
+}
+
+
+
+/**
+ * @brief Accepted without effect: the synthetic frames do not reference anything.
+ * @param timestamp
+ * @return
+ */
+NVENCSTATUS StubEncoder::InvalidateRefFrames(uint64_t timestamp)
+{
+	(void)timestamp;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_initialized ? NV_ENC_SUCCESS : NV_ENC_ERR_ENCODER_NOT_INITIALIZED;
+}
+
+
+
+/**
+ * @brief Statistics of an encoded, not yet unlocked frame.
+ * @param stats
+ * @return
+ */
+NVENCSTATUS StubEncoder::GetEncodeStats(NV_ENC_STAT* stats)
+{
+	if (!stats)
+		return NV_ENC_ERR_INVALID_PTR;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	Bitstream* bitstream = static_cast<Bitstream*>(stats->outputBitStream);
+	if (m_bitstreams.find(bitstream) == m_bitstreams.end())
+		return NV_ENC_ERR_INVALID_PARAM;
+	if (!bitstream->pending)
+		return NV_ENC_ERR_INVALID_CALL;
+
+	stats->bitStreamSize = bitstream->size;
+	stats->picType = bitstream->pictureType;
+	stats->lastValidByteOffset = bitstream->size;
+	stats->sliceOffsets[0] = 0;
+	stats->picIdx = bitstream->frameIdx;
+	return NV_ENC_SUCCESS;
+}
+
+
+
+/**
+ * @brief Writes the Annex-B parameter sets for the current parameters: H.264 Main profile or HEVC
+ * Main profile, 4:2:0 8 bit, one reference frame, CABAC.
+ */
+void StubEncoder::BuildParameterSets()
+{
+	uint32_t width = m_params.encodeWidth;
+	uint32_t height = m_params.encodeHeight;
+
+	m_parameterSets.clear();
+
+	if (!m_hevc)
+	{
+		uint32_t widthInMbs = (width + 15) / 16;
+		uint32_t heightInMbs = (height + 15) / 16;
+
+		StubBitWriter sps;
+		sps.PutBits(77, 8);                 // profile_idc: Main
+		sps.PutBits(0, 8);                  // Constraint flags
+		sps.PutBits(51, 8);                 // level_idc
+		sps.PutUE(0);                       // seq_parameter_set_id
+		sps.PutUE(12);                      // log2_max_frame_num_minus4
+		sps.PutUE(2);                       // pic_order_cnt_type: output order is decoding order
+		sps.PutUE(1);                       // max_num_ref_frames
+		sps.PutFlag(false);                 // gaps_in_frame_num_value_allowed_flag
+		sps.PutUE(widthInMbs - 1);
+		sps.PutUE(heightInMbs - 1);
+		sps.PutFlag(true);                  // frame_mbs_only_flag
+		sps.PutFlag(true);                  // direct_8x8_inference_flag
+
+		bool cropping = (widthInMbs * 16 != width) || (heightInMbs * 16 != height);
+		sps.PutFlag(cropping);
+		if (cropping)
+		{
+			// In chroma samples
+			sps.PutUE(0);
+			sps.PutUE((widthInMbs * 16 - width) / 2);
+			sps.PutUE(0);
+			sps.PutUE((heightInMbs * 16 - height) / 2);
+		}
+
+		sps.PutFlag(true);                  // vui_parameters_present_flag
+		PutVUI(sps, false, m_params);
+		sps.PutTrailingBits();
+
+		StubBitWriter pps;
+		pps.PutUE(0);                       // pic_parameter_set_id
+		pps.PutUE(0);                       // seq_parameter_set_id
+		pps.PutFlag(true);                  // entropy_coding_mode_flag
+		pps.PutFlag(false);                 // bottom_field_pic_order_in_frame_present_flag
+		pps.PutUE(0);                       // num_slice_groups_minus1
+		pps.PutUE(0);                       // num_ref_idx_l0_default_active_minus1
+		pps.PutUE(0);                       // num_ref_idx_l1_default_active_minus1
+		pps.PutFlag(false);                 // weighted_pred_flag
+		pps.PutBits(0, 2);                  // weighted_bipred_idc
+		pps.PutSE(0);                       // pic_init_qp_minus26
+		pps.PutSE(0);                       // pic_init_qs_minus26
+		pps.PutSE(0);                       // chroma_qp_index_offset
+		pps.PutFlag(true);                  // deblocking_filter_control_present_flag
+		pps.PutFlag(false);                 // constrained_intra_pred_flag
+		pps.PutFlag(false);                 // redundant_pic_cnt_present_flag
+		pps.PutTrailingBits();
+
+		static const uint8_t spsHeader[] = { 0x67 };
+		static const uint8_t ppsHeader[] = { 0x68 };
+		AppendNAL(m_parameterSets, spsHeader, sizeof(spsHeader), sps.GetData());
+		AppendNAL(m_parameterSets, ppsHeader, sizeof(ppsHeader), pps.GetData());
+	}
+	else
+	{
+		// Coded size in minimum coding blocks (8x8)
+		uint32_t codedWidth = (width + 7) & ~7u;
+		uint32_t codedHeight = (height + 7) & ~7u;
+
+		StubBitWriter vps;
+		vps.PutBits(0, 4);                  // vps_video_parameter_set_id
+		vps.PutFlag(true);                  // vps_base_layer_internal_flag
+		vps.PutFlag(true);                  // vps_base_layer_available_flag
+		vps.PutBits(0, 6);                  // vps_max_layers_minus1
+		vps.PutBits(0, 3);                  // vps_max_sub_layers_minus1
+		vps.PutFlag(true);                  // vps_temporal_id_nesting_flag
+		vps.PutBits(0xffff, 16);
+		PutProfileTierLevel(vps);
+		vps.PutFlag(true);                  // vps_sub_layer_ordering_info_present_flag
+		vps.PutUE(1);                       // vps_max_dec_pic_buffering_minus1
+		vps.PutUE(0);                       // vps_max_num_reorder_pics
+		vps.PutUE(0);                       // vps_max_latency_increase_plus1
+		vps.PutBits(0, 6);                  // vps_max_layer_id
+		vps.PutUE(0);                       // vps_num_layer_sets_minus1
+		vps.PutFlag(false);                 // vps_timing_info_present_flag
+		vps.PutFlag(false);                 // vps_extension_flag
+		vps.PutTrailingBits();
+
+		StubBitWriter sps;
+		sps.PutBits(0, 4);                  // sps_video_parameter_set_id
+		sps.PutBits(0, 3);                  // sps_max_sub_layers_minus1
+		sps.PutFlag(true);                  // sps_temporal_id_nesting_flag
+		PutProfileTierLevel(sps);
+		sps.PutUE(0);                       // sps_seq_parameter_set_id
+		sps.PutUE(1);                       // chroma_format_idc
+		sps.PutUE(codedWidth);
+		sps.PutUE(codedHeight);
+
+		bool conformanceWindow = (codedWidth != width) || (codedHeight != height);
+		sps.PutFlag(conformanceWindow);
+		if (conformanceWindow)
+		{
+			sps.PutUE(0);
+			sps.PutUE((codedWidth - width) / 2);
+			sps.PutUE(0);
+			sps.PutUE((codedHeight - height) / 2);
+		}
+
+		sps.PutUE(0);                       // bit_depth_luma_minus8
+		sps.PutUE(0);                       // bit_depth_chroma_minus8
+		sps.PutUE(4);                       // log2_max_pic_order_cnt_lsb_minus4
+		sps.PutFlag(true);                  // sps_sub_layer_ordering_info_present_flag
+		sps.PutUE(1);                       // sps_max_dec_pic_buffering_minus1
+		sps.PutUE(0);                       // sps_max_num_reorder_pics
+		sps.PutUE(0);                       // sps_max_latency_increase_plus1
+		sps.PutUE(0);                       // log2_min_luma_coding_block_size_minus3
+		sps.PutUE(2);                       // log2_diff_max_min_luma_coding_block_size: 32x32 CTBs
+		sps.PutUE(0);                       // log2_min_luma_transform_block_size_minus2
+		sps.PutUE(3);                       // log2_diff_max_min_luma_transform_block_size
+		sps.PutUE(0);                       // max_transform_hierarchy_depth_inter
+		sps.PutUE(0);                       // max_transform_hierarchy_depth_intra
+		sps.PutFlag(false);                 // scaling_list_enabled_flag
+		sps.PutFlag(false);                 // amp_enabled_flag
+		sps.PutFlag(false);                 // sample_adaptive_offset_enabled_flag
+		sps.PutFlag(false);                 // pcm_enabled_flag
+		sps.PutUE(1);                       // num_short_term_ref_pic_sets: the previous picture
+		sps.PutUE(1);                       // num_negative_pics
+		sps.PutUE(0);                       // num_positive_pics
+		sps.PutUE(0);                       // delta_poc_s0_minus1
+		sps.PutFlag(true);                  // used_by_curr_pic_s0_flag
+		sps.PutFlag(false);                 // long_term_ref_pics_present_flag
+		sps.PutFlag(false);                 // sps_temporal_mvp_enabled_flag
+		sps.PutFlag(false);                 // strong_intra_smoothing_enabled_flag
+		sps.PutFlag(true);                  // vui_parameters_present_flag
+		PutVUI(sps, true, m_params);
+		sps.PutFlag(false);                 // sps_extension_present_flag
+		sps.PutTrailingBits();
+
+		StubBitWriter pps;
+		pps.PutUE(0);                       // pps_pic_parameter_set_id
+		pps.PutUE(0);                       // pps_seq_parameter_set_id
+		pps.PutFlag(false);                 // dependent_slice_segments_enabled_flag
+		pps.PutFlag(false);                 // output_flag_present_flag
+		pps.PutBits(0, 3);                  // num_extra_slice_header_bits
+		pps.PutFlag(false);                 // sign_data_hiding_enabled_flag
+		pps.PutFlag(false);                 // cabac_init_present_flag
+		pps.PutUE(0);                       // num_ref_idx_l0_default_active_minus1
+		pps.PutUE(0);                       // num_ref_idx_l1_default_active_minus1
+		pps.PutSE(0);                       // init_qp_minus26
+		pps.PutFlag(false);                 // constrained_intra_pred_flag
+		pps.PutFlag(false);                 // transform_skip_enabled_flag
+		pps.PutFlag(false);                 // cu_qp_delta_enabled_flag
+		pps.PutSE(0);                       // pps_cb_qp_offset
+		pps.PutSE(0);                       // pps_cr_qp_offset
+		pps.PutFlag(false);                 // pps_slice_chroma_qp_offsets_present_flag
+		pps.PutFlag(false);                 // weighted_pred_flag
+		pps.PutFlag(false);                 // weighted_bipred_flag
+		pps.PutFlag(false);                 // transquant_bypass_enabled_flag
+		pps.PutFlag(false);                 // tiles_enabled_flag
+		pps.PutFlag(false);                 // entropy_coding_sync_enabled_flag
+		pps.PutFlag(false);                 // pps_loop_filter_across_slices_enabled_flag
+		pps.PutFlag(false);                 // deblocking_filter_control_present_flag
+		pps.PutFlag(false);                 // pps_scaling_list_data_present_flag
+		pps.PutFlag(false);                 // lists_modification_present_flag
+		pps.PutUE(0);                       // log2_parallel_merge_level_minus2
+		pps.PutFlag(false);                 // slice_segment_header_extension_present_flag
+		pps.PutFlag(false);                 // pps_extension_present_flag
+		pps.PutTrailingBits();
+
+		static const uint8_t vpsHeader[] = { 0x40, 0x01 };
+		static const uint8_t spsHeader[] = { 0x42, 0x01 };
+		static const uint8_t ppsHeader[] = { 0x44, 0x01 };
+		AppendNAL(m_parameterSets, vpsHeader, sizeof(vpsHeader), vps.GetData());
+		AppendNAL(m_parameterSets, spsHeader, sizeof(spsHeader), sps.GetData());
+		AppendNAL(m_parameterSets, ppsHeader, sizeof(ppsHeader), pps.GetData());
+	}
+}
+
+
+
+/**
+ * @brief Appends the NAL unit with the (only) slice of the next picture, up to where its slice data begins.
+ * @param idr
+ * @param intra
+ * @param qp
+ * @param output
+ */
+void StubEncoder::BuildSliceHeader(bool idr, bool intra, uint32_t qp, std::vector<uint8_t>& output)
+{
+	StubBitWriter slice;
+
+	if (!m_hevc)
+	{
+		slice.PutUE(0);                     // first_mb_in_slice
+		slice.PutUE(intra ? 7 : 5);         // slice_type: all slices I or P
+		slice.PutUE(0);                     // pic_parameter_set_id
+		slice.PutBits(m_frameNum & 0xffff, 16);
+		if (idr)
+			slice.PutUE(m_idrPicId & 0xffff);
+
+		if (!intra)
+		{
+			slice.PutFlag(false);           // num_ref_idx_active_override_flag
+			slice.PutFlag(false);           // ref_pic_list_modification_flag_l0
+		}
+
+		// dec_ref_pic_marking()
+		if (idr)
+		{
+			slice.PutFlag(false);           // no_output_of_prior_pics_flag
+			slice.PutFlag(false);           // long_term_reference_flag
+		}
+		else
+		{
+			slice.PutFlag(false);           // adaptive_ref_pic_marking_mode_flag
+		}
+
+		if (!intra)
+			slice.PutUE(0);                 // cabac_init_idc
+
+		slice.PutSE((int32_t)qp - 26);      // slice_qp_delta
+		slice.PutUE(0);                     // disable_deblocking_filter_idc
+		slice.PutSE(0);                     // slice_alpha_c0_offset_div2
+		slice.PutSE(0);                     // slice_beta_offset_div2
+		slice.PutTrailingBits();            // cabac_alignment_one_bit, as far as the stop bit goes
+
+		uint8_t header[] = { (uint8_t)(idr ? 0x65 : 0x41) };
+		AppendNAL(output, header, sizeof(header), slice.GetData());
+	}
+	else
+	{
+		slice.PutFlag(true);                // first_slice_segment_in_pic_flag
+		if (idr)
+			slice.PutFlag(false);           // no_output_of_prior_pics_flag
+		slice.PutUE(0);                     // slice_pic_parameter_set_id
+		slice.PutUE(intra ? 2 : 1);         // slice_type
+
+		if (!idr)
+		{
+			slice.PutBits(m_frameNum & 0xff, 8);    // slice_pic_order_cnt_lsb
+			slice.PutFlag(true);            // short_term_ref_pic_set_sps_flag
+		}
+
+		if (!intra)
+		{
+			slice.PutFlag(false);           // num_ref_idx_active_override_flag
+			slice.PutUE(0);                 // five_minus_max_num_merge_cand
+		}
+
+		slice.PutSE((int32_t)qp - 26);      // slice_qp_delta
+		slice.PutTrailingBits();            // byte_alignment()
+
+		// IDR_W_RADL, or TRAIL_R for P and non-IDR I pictures
+		uint8_t header[] = { (uint8_t)((idr ? 19 : 1) << 1), 0x01 };
+		AppendNAL(output, header, sizeof(header), slice.GetData());
+	}
+}
+
+
+
+/**
+ * @brief Size of the next access unit: the configured one, or one frame's share of the target bitrate
+ * (IDRs four times that) if none is configured.
+ * @param idr
+ * @param config
+ * @return
+ */
+uint32_t StubEncoder::GetFrameSize(bool idr, const NvEncStubConfig& config) const
+{
+	uint32_t size = idr ? config.idrFrameSize : config.frameSize;
+	if (size != 0)
+		return size;
+
+	uint64_t bitrate = m_config.rcParams.averageBitRate ? m_config.rcParams.averageBitRate : m_config.rcParams.maxBitRate;
+	if (bitrate == 0 || m_params.frameRateNum == 0)
+		return 0;
+
+	uint64_t frameSize = bitrate * (m_params.frameRateDen ? m_params.frameRateDen : 1) / m_params.frameRateNum / 8;
+	return (uint32_t)(std::min)(idr ? 4 * frameSize : frameSize, (uint64_t)UINT32_MAX);
+}
+
+
+
+/**
+ * @brief Signals a completion event once the frame is ready (Windows only).
+ * @param event
+ * @param ready
+ */
+void StubEncoder::Complete(void* event, Clock::time_point ready)
+{
+#if defined(_WIN32)
+	// Called with m_mutex held
+	m_completions.push_back(std::make_pair(ready, event));
+
+	if (!m_completionThread.joinable())
+	{
+		m_completionThread = std::thread([this]()
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			while (!m_stopCompletion)
+			{
+				if (m_completions.empty())
+				{
+					m_completionSignal.wait(lock);
+					continue;
+				}
+
+				// Frames complete in submission order
+				std::pair<Clock::time_point, void*> completion = m_completions.front();
+				if (Clock::now() < completion.first)
+				{
+					m_completionSignal.wait_until(lock, completion.first);
+					continue;
+				}
+
+				m_completions.pop_front();
+				SetEvent(completion.second);
+			}
+		});
+	}
+
+	m_completionSignal.notify_all();
+#else
+	(void)event;
+	(void)ready;
+#endif
+}
+
+
+
+/**
+ * @brief Applies the fault rules to a call.
+ * @param call
+ * @return The status to fail with, NV_ENC_SUCCESS to go ahead.
+ */
+static NVENCSTATUS GetInjectedFault(NvEncStubCall call)
+{
+	if (!s_faultsEnabled)
+		return NV_ENC_SUCCESS;
+
+	uint64_t number = ++s_faultCalls[call];
+
+	std::lock_guard<std::mutex> lock(s_configMutex);
+	for (const NvEncStubFault& fault : s_config.faults)
+	{
+		if (fault.call != (uint32_t)call || fault.first == 0 || number < fault.first)
+			continue;
+
+		if (number == fault.first || (fault.interval != 0 && (number - fault.first) % fault.interval == 0))
+			return fault.status;
+	}
+
+	return NV_ENC_SUCCESS;
+}
+
+
+
+/**
+ * @brief Counts, logs and reports a call's result.
+ * @param call
+ * @param encoder
+ * @param status
+ * @return status
+ */
+static NVENCSTATUS FinishCall(NvEncStubCall call, void* encoder, NVENCSTATUS status)
+{
+	if (status != NV_ENC_SUCCESS)
+		++s_failures[call];
+
+	if (s_tracing)
+	{
+		NvEncStubTraceCallback callback = nullptr;
+		void* user = nullptr;
+		bool trace = false;
+		{
+			std::lock_guard<std::mutex> lock(s_configMutex);
+			callback = s_traceCallback;
+			user = s_traceUser;
+			trace = s_config.trace != 0;
+		}
+
+		if (trace)
+			fprintf(stderr, "[NvEncodeStub] %p %s: %d\n", encoder, s_callNames[call], (int)status);
+		if (callback)
+			callback(call, status, encoder, user);
+	}
+
+	return status;
+}
+
+
+
+/**
+ * @brief Common path of all session entry points: counters, fault injection, handle check and tracing.
+ * @param call
+ * @param encoder
+ * @param function Called with the session if the call goes ahead
+ * @return
+ */
+template<typename Function>
+static NVENCSTATUS Dispatch(NvEncStubCall call, void* encoder, Function function)
+{
+	++s_calls[call];
+
+	NVENCSTATUS status = GetInjectedFault(call);
+	if (status == NV_ENC_SUCCESS)
+	{
+		StubEncoder* stub = StubEncoder::FromHandle(encoder);
+		status = stub ? function(stub) : NV_ENC_ERR_INVALID_ENCODERDEVICE;
+	}
+
+	return FinishCall(call, encoder, status);
+}
+
+
+
+static NVENCSTATUS NVENCAPI StubOpenEncodeSessionEx(NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS* openSessionExParams, void** encoder)
+{
+	++s_calls[NVENC_STUB_CALL_OPEN_ENCODE_SESSION_EX];
+
+	NVENCSTATUS status = GetInjectedFault(NVENC_STUB_CALL_OPEN_ENCODE_SESSION_EX);
+	if (status == NV_ENC_SUCCESS)
+	{
+		NvEncStubConfig config;
+		NvEncStubGetConfig(&config);
+
+		if (!openSessionExParams || !encoder)
+			status = NV_ENC_ERR_INVALID_PTR;
+		else if (openSessionExParams->version != NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS_VER || openSessionExParams->apiVersion != NVENCAPI_VERSION)
+			status = NV_ENC_ERR_INVALID_VERSION;
+		else if (s_sessions >= config.maxSessions)
+			status = NV_ENC_ERR_OUT_OF_MEMORY;
+		else
+			*encoder = new StubEncoder();
+	}
+
+	return FinishCall(NVENC_STUB_CALL_OPEN_ENCODE_SESSION_EX, encoder ? *encoder : nullptr, status);
+}
+
+
+
+static NVENCSTATUS NVENCAPI StubGetEncodeCaps(void* encoder, GUID encodeGUID, NV_ENC_CAPS_PARAM* capsParam, int* capsVal)
+{
+	(void)encodeGUID;
+	return Dispatch(NVENC_STUB_CALL_GET_ENCODE_CAPS, encoder, [&](StubEncoder* stub) { return stub->GetEncodeCaps(capsParam, capsVal); });
+}
+
+
+
+static NVENCSTATUS NVENCAPI StubGetEncodePresetConfig(void* encoder, GUID encodeGUID, GUID presetGUID, NV_ENC_PRESET_CONFIG* presetConfig)
+{
+	(void)encodeGUID;
+	(void)presetGUID;
+	return Dispatch(NVENC_STUB_CALL_GET_ENCODE_PRESET_CONFIG, encoder, [&](StubEncoder* stub) { return stub->GetEncodePresetConfig(presetConfig); });
+}
+
+
+
+static NVENCSTATUS NVENCAPI StubInitializeEncoder(void* encoder, NV_ENC_INITIALIZE_PARAMS* createEncodeParams)
+{
+	return Dispatch(NVENC_STUB_CALL_INITIALIZE_ENCODER, encoder, [&](StubEncoder* stub) { return stub->Initialize(createEncodeParams); });
+}
+
+
+
+static NVENCSTATUS NVENCAPI StubReconfigureEncoder(void* encoder, NV_ENC_RECONFIGURE_PARAMS* reInitEncodeParams)
+{
+	return Dispatch(NVENC_STUB_CALL_RECONFIGURE_ENCODER, encoder, [&](StubEncoder* stub) { return stub->Reconfigure(reInitEncodeParams); });
+}
+
+
+
+static NVENCSTATUS NVENCAPI StubGetSequenceParams(void* encoder, NV_ENC_SEQUENCE_PARAM_PAYLOAD* sequenceParamPayload)
+{
+	return Dispatch(NVENC_STUB_CALL_GET_SEQUENCE_PARAMS, encoder, [&](StubEncoder* stub) { return stub->GetSequenceParams(sequenceParamPayload); });
+}
+
+
+
+static NVENCSTATUS NVENCAPI StubCreateBitstreamBuffer(void* encoder, NV_ENC_CREATE_BITSTREAM_BUFFER* createBitstreamBufferParams)
+{
+	return Dispatch(NVENC_STUB_CALL_CREATE_BITSTREAM_BUFFER, encoder, [&](StubEncoder* stub) { return stub->CreateBitstreamBuffer(createBitstreamBufferParams); });
+}
+
+
+
+static NVENCSTATUS NVENCAPI StubDestroyBitstreamBuffer(void* encoder, NV_ENC_OUTPUT_PTR bitstreamBuffer)
+{
+	return Dispatch(NVENC_STUB_CALL_DESTROY_BITSTREAM_BUFFER, encoder, [&](StubEncoder* stub) { return stub->DestroyBitstreamBuffer(bitstreamBuffer); });
+}
+
+
+
+static NVENCSTATUS NVENCAPI StubRegisterResource(void* encoder, NV_ENC_REGISTER_RESOURCE* registerResParams)
+{
+	return Dispatch(NVENC_STUB_CALL_REGISTER_RESOURCE, encoder, [&](StubEncoder* stub) { return stub->RegisterResource(registerResParams); });
+}
+
+
+
+static NVENCSTATUS NVENCAPI StubUnregisterResource(void* encoder, NV_ENC_REGISTERED_PTR registeredRes)
+{
+	return Dispatch(NVENC_STUB_CALL_UNREGISTER_RESOURCE, encoder, [&](StubEncoder* stub) { return stub->UnregisterResource(registeredRes); });
+}
+
+
+
+static NVENCSTATUS NVENCAPI StubMapInputResource(void* encoder, NV_ENC_MAP_INPUT_RESOURCE* mapInputResParams)
+{
+	return Dispatch(NVENC_STUB_CALL_MAP_INPUT_RESOURCE, encoder, [&](StubEncoder* stub) { return stub->MapInputResource(mapInputResParams); });
+}
+
+
+
+static NVENCSTATUS NVENCAPI StubUnmapInputResource(void* encoder, NV_ENC_INPUT_PTR mappedInputBuffer)
+{
+	return Dispatch(NVENC_STUB_CALL_UNMAP_INPUT_RESOURCE, encoder, [&](StubEncoder* stub) { return stub->UnmapInputResource(mappedInputBuffer); });
+}
+
+
+
+static NVENCSTATUS NVENCAPI StubEncodePicture(void* encoder, NV_ENC_PIC_PARAMS* encodePicParams)
+{
+	return Dispatch(NVENC_STUB_CALL_ENCODE_PICTURE, encoder, [&](StubEncoder* stub) { return stub->EncodePicture(encodePicParams); });
+}
+
+
+
+static NVENCSTATUS NVENCAPI StubLockBitstream(void* encoder, NV_ENC_LOCK_BITSTREAM* lockBitstreamBufferParams)
+{
+	return Dispatch(NVENC_STUB_CALL_LOCK_BITSTREAM, encoder, [&](StubEncoder* stub) { return stub->LockBitstream(lockBitstreamBufferParams); });
+}
+
+
+
+static NVENCSTATUS NVENCAPI StubUnlockBitstream(void* encoder, NV_ENC_OUTPUT_PTR bitstreamBuffer)
+{
+	return Dispatch(NVENC_STUB_CALL_UNLOCK_BITSTREAM, encoder, [&](StubEncoder* stub) { return stub->UnlockBitstream(bitstreamBuffer); });
+}
+
+
+
+static NVENCSTATUS NVENCAPI StubRegisterAsyncEvent(void* encoder, NV_ENC_EVENT_PARAMS* eventParams)
+{
+	return Dispatch(NVENC_STUB_CALL_REGISTER_ASYNC_EVENT, encoder, [&](StubEncoder* stub) { return stub->RegisterAsyncEvent(eventParams); });
+}
+
+
+
+static NVENCSTATUS NVENCAPI StubUnregisterAsyncEvent(void* encoder, NV_ENC_EVENT_PARAMS* eventParams)
+{
+	return Dispatch(NVENC_STUB_CALL_UNREGISTER_ASYNC_EVENT, encoder, [&](StubEncoder* stub) { return stub->UnregisterAsyncEvent(eventParams); });
+}
+
+
+
+static NVENCSTATUS NVENCAPI StubInvalidateRefFrames(void* encoder, uint64_t invalidRefFrameTimeStamp)
+{
+	return Dispatch(NVENC_STUB_CALL_INVALIDATE_REF_FRAMES, encoder, [&](StubEncoder* stub) { return stub->InvalidateRefFrames(invalidRefFrameTimeStamp); });
+}
+
+
+
+static NVENCSTATUS NVENCAPI StubGetEncodeStats(void* encoder, NV_ENC_STAT* encodeStats)
+{
+	return Dispatch(NVENC_STUB_CALL_GET_ENCODE_STATS, encoder, [&](StubEncoder* stub) { return stub->GetEncodeStats(encodeStats); });
+}
+
+
+
+static NVENCSTATUS NVENCAPI StubDestroyEncoder(void* encoder)
+{
+	return Dispatch(NVENC_STUB_CALL_DESTROY_ENCODER, encoder, [&](StubEncoder* stub)
+	{
+		delete stub;
+		return NV_ENC_SUCCESS;
+	});
+}
+
+
+
+/**
+ * @brief Fills the entry points the stub does not implement.
+ * @return NV_ENC_ERR_UNIMPLEMENTED
+ */
+template<typename... Args>
+static NVENCSTATUS NVENCAPI StubUnimplemented(void* encoder, Args...)
+{
+	++s_calls[NVENC_STUB_CALL_OTHER];
+	return FinishCall(NVENC_STUB_CALL_OTHER, encoder, NV_ENC_ERR_UNIMPLEMENTED);
+}
+
+
+
+/**
+ * @brief Parses an unsigned environment variable.
+ * @param name
+ * @param value Left alone if the variable is not set
+ */
+static void ReadEnvironment(const char* name, uint32_t& value)
+{
+	const char* text = getenv(name);
+	if (text && *text)
+		value = (uint32_t)strtoul(text, nullptr, 0);
+}
+
+
+
+/**
+ * @brief Applies the NVENC_STUB_* environment variables to the configuration, see NvEncodeStub.h.
+ */
+static void ConfigureFromEnvironment()
+{
+	NvEncStubConfig config;
+	NvEncStubGetConfig(&config);
+
+	ReadEnvironment("NVENC_STUB_LATENCY_US", config.encodeLatency);
+	ReadEnvironment("NVENC_STUB_IDR_SIZE", config.idrFrameSize);
+	ReadEnvironment("NVENC_STUB_FRAME_SIZE", config.frameSize);
+	ReadEnvironment("NVENC_STUB_MAX_SESSIONS", config.maxSessions);
+	ReadEnvironment("NVENC_STUB_TRACE", config.trace);
+
+	const char* fault = getenv("NVENC_STUB_FAULT");
+	if (fault && *fault)
+	{
+		std::string spec(fault);
+		std::string name = spec.substr(0, spec.find(':'));
+
+		for (uint32_t call = 0; call < NVENC_STUB_CALL_COUNT; ++call)
+		{
+			if (name != s_callNames[call])
+				continue;
+
+			unsigned long long first = 0;
+			unsigned long long interval = 0;
+			int status = 0;
+			if (sscanf(spec.c_str() + name.size(), ":%d:%llu:%llu", &status, &first, &interval) >= 2)
+			{
+				config.faults[0].call = call;
+				config.faults[0].status = (NVENCSTATUS)status;
+				config.faults[0].first = first;
+				config.faults[0].interval = interval;
+			}
+			else
+			{
+				fprintf(stderr, "[NvEncodeStub] Ignoring malformed NVENC_STUB_FAULT \"%s\"\n", fault);
+			}
+		}
+	}
+
+	NvEncStubSetConfig(&config);
+}
+
+
+
+__declspec(dllexport) NVENCSTATUS NVENCAPI NvEncodeAPIGetMaxSupportedVersion(uint32_t* version)
+{
+	if (!version)
+		return NV_ENC_ERR_INVALID_PTR;
+
+	*version = (NVENCAPI_MAJOR_VERSION << 4) | NVENCAPI_MINOR_VERSION;
+	return NV_ENC_SUCCESS;
+}
+
+
+
+__declspec(dllexport) NVENCSTATUS NVENCAPI NvEncodeAPICreateInstance(NV_ENCODE_API_FUNCTION_LIST* functionList)
+{
+	std::call_once(s_environmentOnce, ConfigureFromEnvironment);
+
+	if (!functionList)
+		return NV_ENC_ERR_INVALID_PTR;
+	if (functionList->version != NV_ENCODE_API_FUNCTION_LIST_VER)
+		return NV_ENC_ERR_INVALID_VERSION;
+
+	functionList->nvEncOpenEncodeSession = StubUnimplemented;
+	functionList->nvEncGetEncodeGUIDCount = StubUnimplemented;
+	functionList->nvEncGetEncodeProfileGUIDCount = StubUnimplemented;
+	functionList->nvEncGetEncodeProfileGUIDs = StubUnimplemented;
+	functionList->nvEncGetEncodeGUIDs = StubUnimplemented;
+	functionList->nvEncGetInputFormatCount = StubUnimplemented;
+	functionList->nvEncGetInputFormats = StubUnimplemented;
+	functionList->nvEncGetEncodeCaps = StubGetEncodeCaps;
+	functionList->nvEncGetEncodePresetCount = StubUnimplemented;
+	functionList->nvEncGetEncodePresetGUIDs = StubUnimplemented;
+	functionList->nvEncGetEncodePresetConfig = StubGetEncodePresetConfig;
+	functionList->nvEncInitializeEncoder = StubInitializeEncoder;
+	functionList->nvEncCreateInputBuffer = StubUnimplemented;
+	functionList->nvEncDestroyInputBuffer = StubUnimplemented;
+	functionList->nvEncCreateBitstreamBuffer = StubCreateBitstreamBuffer;
+	functionList->nvEncDestroyBitstreamBuffer = StubDestroyBitstreamBuffer;
+	functionList->nvEncEncodePicture = StubEncodePicture;
+	functionList->nvEncLockBitstream = StubLockBitstream;
+	functionList->nvEncUnlockBitstream = StubUnlockBitstream;
+	functionList->nvEncLockInputBuffer = StubUnimplemented;
+	functionList->nvEncUnlockInputBuffer = StubUnimplemented;
+	functionList->nvEncGetEncodeStats = StubGetEncodeStats;
+	functionList->nvEncGetSequenceParams = StubGetSequenceParams;
+	functionList->nvEncRegisterAsyncEvent = StubRegisterAsyncEvent;
+	functionList->nvEncUnregisterAsyncEvent = StubUnregisterAsyncEvent;
+	functionList->nvEncMapInputResource = StubMapInputResource;
+	functionList->nvEncUnmapInputResource = StubUnmapInputResource;
+	functionList->nvEncDestroyEncoder = StubDestroyEncoder;
+	functionList->nvEncInvalidateRefFrames = StubInvalidateRefFrames;
+	functionList->nvEncOpenEncodeSessionEx = StubOpenEncodeSessionEx;
+	functionList->nvEncRegisterResource = StubRegisterResource;
+	functionList->nvEncUnregisterResource = StubUnregisterResource;
+	functionList->nvEncReconfigureEncoder = StubReconfigureEncoder;
+	functionList->nvEncCreateMVBuffer = StubUnimplemented;
+	functionList->nvEncDestroyMVBuffer = StubUnimplemented;
+	functionList->nvEncRunMotionEstimationOnly = StubUnimplemented;
+
+	return NV_ENC_SUCCESS;
+}
+
+
+
+__declspec(dllexport) void NvEncStubGetDefaultConfig(NvEncStubConfig* config)
+{
+	*config = GetDefaultConfig();
+}
+
+
+
+__declspec(dllexport) void NvEncStubGetConfig(NvEncStubConfig* config)
+{
+	std::lock_guard<std::mutex> lock(s_configMutex);
+	*config = s_config;
+}
+
+
+
+__declspec(dllexport) void NvEncStubSetConfig(const NvEncStubConfig* config)
+{
+	bool faults = false;
+	for (const NvEncStubFault& fault : config->faults)
+		faults = faults || (fault.first != 0 && fault.call < NVENC_STUB_CALL_COUNT);
+
+	std::lock_guard<std::mutex> lock(s_configMutex);
+	s_config = *config;
+
+	for (std::atomic<uint64_t>& calls : s_faultCalls)
+		calls = 0;
+
+	s_faultsEnabled = faults;
+	s_tracing = (s_config.trace != 0) || (s_traceCallback != nullptr);
+}
+
+
+
+__declspec(dllexport) void NvEncStubGetStats(NvEncStubStats* stats)
+{
+	for (uint32_t call = 0; call < NVENC_STUB_CALL_COUNT; ++call)
+	{
+		stats->calls[call] = s_calls[call];
+		stats->failures[call] = s_failures[call];
+	}
+
+	stats->frames = s_frames;
+	stats->idrFrames = s_idrFrames;
+	stats->bytes = s_bytes;
+	stats->sessions = s_sessions;
+	stats->bitstreamBuffers = s_bitstreamBuffers;
+	stats->registrations = s_registrations;
+	stats->mappings = s_mappings;
+	stats->lockedBitstreams = s_lockedBitstreams;
+}
+
+
+
+__declspec(dllexport) void NvEncStubResetStats()
+{
+	for (uint32_t call = 0; call < NVENC_STUB_CALL_COUNT; ++call)
+	{
+		s_calls[call] = 0;
+		s_failures[call] = 0;
+	}
+
+	s_frames = 0;
+	s_idrFrames = 0;
+	s_bytes = 0;
+}
+
+
+
+__declspec(dllexport) void NvEncStubSetTraceCallback(NvEncStubTraceCallback callback, void* user)
+{
+	std::lock_guard<std::mutex> lock(s_configMutex);
+	s_traceCallback = callback;
+	s_traceUser = user;
+	s_tracing = (s_config.trace != 0) || (s_traceCallback != nullptr);
+}
+
+
+
+__declspec(dllexport) const char* NvEncStubGetCallName(uint32_t call)
+{
+	return call < NVENC_STUB_CALL_COUNT ? s_callNames[call] : "unknown";
+}
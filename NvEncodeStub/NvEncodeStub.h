@@ -0,0 +1,119 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "nvEncodeAPI.h"
+
+// Stand-in for the NVENC driver library (nvEncodeAPI64.dll, libnvidia-encode.so.1) that needs no GPU.
+// It implements the NV_ENCODE_API_FUNCTION_LIST entry points on system memory: registrations, mappings
+// and bitstream buffers are checked like the driver would, and "encoding" writes a syntactically valid
+// Annex-B access unit (parameter sets and a slice header, padded to the configured size) after the
+// configured latency. Installed under the driver's file name, it lets Encoder, EncoderPool and the
+// DLL interface run on machines without an NVIDIA GPU.
+//
+// Besides the configuration functions below, the NVENC_STUB_* environment variables are read when the
+// first instance is created:
+//   NVENC_STUB_LATENCY_US     encode latency in microseconds
+//   NVENC_STUB_IDR_SIZE       bytes per IDR access unit
+//   NVENC_STUB_FRAME_SIZE     bytes per other access unit
+//   NVENC_STUB_MAX_SESSIONS   open sessions before nvEncOpenEncodeSessionEx fails
+//   NVENC_STUB_FAULT          <call name>:<status>:<first>[:<interval>], e.g. nvEncEncodePicture:18:100:10
+//   NVENC_STUB_TRACE          1 to log every call to stderr
+
+// Entry points, for counters and fault injection
+enum NvEncStubCall
+{
+	NVENC_STUB_CALL_OPEN_ENCODE_SESSION_EX,
+	NVENC_STUB_CALL_GET_ENCODE_CAPS,
+	NVENC_STUB_CALL_GET_ENCODE_PRESET_CONFIG,
+	NVENC_STUB_CALL_INITIALIZE_ENCODER,
+	NVENC_STUB_CALL_RECONFIGURE_ENCODER,
+	NVENC_STUB_CALL_GET_SEQUENCE_PARAMS,
+	NVENC_STUB_CALL_CREATE_BITSTREAM_BUFFER,
+	NVENC_STUB_CALL_DESTROY_BITSTREAM_BUFFER,
+	NVENC_STUB_CALL_REGISTER_RESOURCE,
+	NVENC_STUB_CALL_UNREGISTER_RESOURCE,
+	NVENC_STUB_CALL_MAP_INPUT_RESOURCE,
+	NVENC_STUB_CALL_UNMAP_INPUT_RESOURCE,
+	NVENC_STUB_CALL_ENCODE_PICTURE,
+	NVENC_STUB_CALL_LOCK_BITSTREAM,
+	NVENC_STUB_CALL_UNLOCK_BITSTREAM,
+	NVENC_STUB_CALL_REGISTER_ASYNC_EVENT,
+	NVENC_STUB_CALL_UNREGISTER_ASYNC_EVENT,
+	NVENC_STUB_CALL_INVALIDATE_REF_FRAMES,
+	NVENC_STUB_CALL_GET_ENCODE_STATS,
+	NVENC_STUB_CALL_DESTROY_ENCODER,
+	NVENC_STUB_CALL_OTHER,                  // Anything else in the function list; always NV_ENC_ERR_UNIMPLEMENTED
+	NVENC_STUB_CALL_COUNT
+};
+
+// Makes calls to one entry point fail: call number first (counting from 1) and then every interval
+// calls after it. Failing calls do nothing but return status; NV_ENC_ERR_ENCODER_BUSY on
+// NVENC_STUB_CALL_ENCODE_PICTURE simulates a saturated engine.
+struct NvEncStubFault
+{
+	uint32_t call;                          // NvEncStubCall
+	NVENCSTATUS status;
+	uint64_t first;                         // 0 disables the fault
+	uint64_t interval;                      // 0 fails only once
+};
+
+#define NVENC_STUB_MAX_FAULTS 4
+
+struct NvEncStubConfig
+{
+	uint32_t encodeLatency;                 // Microseconds from nvEncEncodePicture until the output can be locked
+	uint32_t idrFrameSize;                  // Bytes per IDR access unit, including parameter sets
+	uint32_t frameSize;                     // Bytes per P access unit
+	uint32_t maxSessions;
+	uint32_t asyncEncode;                   // Reported by NV_ENC_CAPS_ASYNC_ENCODE_SUPPORT (Windows only)
+	uint32_t trace;                         // Logs every call to stderr
+	NvEncStubFault faults[NVENC_STUB_MAX_FAULTS];
+};
+
+// Counters since the library was loaded or NvEncStubResetStats
+struct NvEncStubStats
+{
+	uint64_t calls[NVENC_STUB_CALL_COUNT];
+	uint64_t failures[NVENC_STUB_CALL_COUNT];  // Injected faults and rejected calls
+	uint64_t frames;
+	uint64_t idrFrames;
+	uint64_t bytes;
+
+	// Objects alive right now, across all sessions; anything left after the last session is gone leaked
+	uint32_t sessions;
+	uint32_t bitstreamBuffers;
+	uint32_t registrations;
+	uint32_t mappings;
+	uint32_t lockedBitstreams;
+};
+
+// Called after every call when set, with the entry point's result
+typedef void (*NvEncStubTraceCallback)(uint32_t call, NVENCSTATUS status, void* encoder, void* user);
+
+extern "C" __declspec(dllexport) void NvEncStubGetDefaultConfig(NvEncStubConfig* config);
+extern "C" __declspec(dllexport) void NvEncStubGetConfig(NvEncStubConfig* config);
+
+//************************************
+// Method:    NvEncStubSetConfig
+// FullName:  NvEncStubSetConfig
+// Access:    public
+// Returns:   void
+// Qualifier:
+// Parameter: const NvEncStubConfig * config - applies to all sessions from their next call on; fault call counters restart
+//************************************
+extern "C" __declspec(dllexport) void NvEncStubSetConfig(const NvEncStubConfig* config);
+
+extern "C" __declspec(dllexport) void NvEncStubGetStats(NvEncStubStats* stats);
+extern "C" __declspec(dllexport) void NvEncStubResetStats();
+extern "C" __declspec(dllexport) void NvEncStubSetTraceCallback(NvEncStubTraceCallback callback, void* user);
+extern "C" __declspec(dllexport) const char* NvEncStubGetCallName(uint32_t call);
+
+// For callers that load the stub at runtime, like the encoder loads the driver
+typedef void (*NvEncStubGetDefaultConfig_Type)(NvEncStubConfig*);
+typedef void (*NvEncStubGetConfig_Type)(NvEncStubConfig*);
+typedef void (*NvEncStubSetConfig_Type)(const NvEncStubConfig*);
+typedef void (*NvEncStubGetStats_Type)(NvEncStubStats*);
+typedef void (*NvEncStubResetStats_Type)();
+typedef void (*NvEncStubSetTraceCallback_Type)(NvEncStubTraceCallback, void*);
+typedef const char* (*NvEncStubGetCallName_Type)(uint32_t);
@@ -0,0 +1,1817 @@
+#include "Bitstream.h"
+
+#include <cstring>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <stdlib.h>
+#endif
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define BITSTREAM_X86
+#include <immintrin.h>
+#endif
+
+// The NEON search needs a horizontal maximum, which only AArch64 has
+#if defined(__aarch64__) || defined(_M_ARM64)
+#define BITSTREAM_NEON
+#include <arm_neon.h>
+#endif
+
+// GCC/Clang only emit SIMD instructions in functions that ask for them; MSVC always does
+#if defined(__GNUC__)
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_SSE2
+#define TARGET_AVX2
+#endif
+
+
+static const uint8_t s_h264NalIDR = 5;
+static const uint8_t s_h264NalSPS = 7;
+static const uint8_t s_h264NalPPS = 8;
+static const uint8_t s_hevcNalVPS = 32;
+static const uint8_t s_hevcNalSPS = 33;
+static const uint8_t s_hevcNalPPS = 34;
+
+// Largest parameter set IDs plus one
+static const uint32_t s_h264MaxSPS = 32;
+static const uint32_t s_h264MaxPPS = 256;
+static const uint32_t s_hevcMaxVPS = 16;
+static const uint32_t s_hevcMaxSPS = 16;
+static const uint32_t s_hevcMaxPPS = 64;
+
+
+static inline uint32_t CountLeadingZeros64(uint64_t value)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+#if defined(_M_X64) || defined(_M_ARM64)
+	_BitScanReverse64(&index, value);
+	return 63 - index;
+#else
+	if (value >> 32)
+	{
+		_BitScanReverse(&index, static_cast<unsigned long>(value >> 32));
+		return 31 - index;
+	}
+	_BitScanReverse(&index, static_cast<unsigned long>(value));
+	return 63 - index;
+#endif
+#else
+	return __builtin_clzll(value);
+#endif
+}
+
+static inline uint64_t LoadBigEndian64(const uint8_t* p)
+{
+	uint64_t value;
+	memcpy(&value, p, sizeof(value));
+#if defined(_MSC_VER)
+	return _byteswap_uint64(value);
+#else
+	return __builtin_bswap64(value);
+#endif
+}
+
+/// Smallest n with 2^n >= value, as Ceil(Log2(value)) in the specifications
+static inline uint32_t CeilLog2(uint32_t value)
+{
+	uint32_t bits = 0;
+	while (bits < 32 && (1ull << bits) < value)
+		++bits;
+	return bits;
+}
+
+
+
+/**
+ * @brief Returns the next 64 bits without consuming them, zero-padded past the end.
+ */
+uint64_t BitReader::Peek() const
+{
+	size_t byte = m_position >> 3;
+	uint32_t shift = m_position & 7;
+
+	uint8_t padded[9] = {};
+	const uint8_t* p = m_data + byte;
+	if (byte + sizeof(padded) > m_size)
+	{
+		if (byte < m_size)
+			memcpy(padded, p, m_size - byte);
+		p = padded;
+	}
+
+	uint64_t value = LoadBigEndian64(p);
+	if (shift)
+		value = (value << shift) | (p[8] >> (8 - shift));
+	return value;
+}
+
+
+
+/**
+ * @brief Reads an unsigned fixed-length field, u(n).
+ * @param count Number of bits, up to 32.
+ * @return
+ */
+uint32_t BitReader::ReadBits(uint32_t count)
+{
+	if (count == 0)
+		return 0;
+
+	uint32_t value = static_cast<uint32_t>(Peek() >> (64 - count));
+	SkipBits(count);
+	return value;
+}
+
+
+
+/**
+ * @brief Skips bits; skipping past the end marks the reader as failed.
+ * @param count
+ */
+void BitReader::SkipBits(size_t count)
+{
+	m_position += count;
+	if (m_position > m_size * 8)
+		m_error = true;
+}
+
+
+
+/**
+ * @brief Reads an unsigned Exp-Golomb code, ue(v). Codes longer than 32 bits are invalid and mark
+ * the reader as failed.
+ * @return
+ */
+uint32_t BitReader::ReadUE()
+{
+	uint64_t bits = Peek();
+	if (bits == 0)
+	{
+		m_error = true;
+		return 0;
+	}
+
+	// The whole code fits into the 64 peeked bits as long as it is valid
+	uint32_t zeros = CountLeadingZeros64(bits);
+	if (zeros > 31)
+	{
+		m_error = true;
+		return 0;
+	}
+
+	uint32_t length = 2 * zeros + 1;
+	SkipBits(length);
+	return static_cast<uint32_t>((bits >> (64 - length)) - 1);
+}
+
+
+
+/**
+ * @brief Reads a signed Exp-Golomb code, se(v).
+ * @return
+ */
+int32_t BitReader::ReadSE()
+{
+	uint32_t code = ReadUE();
+	if (code & 1)
+		return static_cast<int32_t>((static_cast<uint64_t>(code) + 1) / 2);
+	return -static_cast<int32_t>(code / 2);
+}
+
+
+
+/**
+ * @brief more_rbsp_data(): whether anything but the rbsp_trailing_bits follows.
+ * @return
+ */
+bool BitReader::HasMoreRBSPData() const
+{
+	size_t last = m_size;
+	while (last > 0 && m_data[last - 1] == 0)
+		--last;
+	if (last == 0)
+		return false;
+
+	// Position of the rbsp_stop_one_bit
+	uint8_t byte = m_data[last - 1];
+	uint32_t trailing = 0;
+	while (((byte >> trailing) & 1) == 0)
+		++trailing;
+
+	return m_position < (last - 1) * 8 + (7 - trailing);
+}
+
+
+
+/**
+ * @brief Number of pictures the current picture may reference.
+ * @return
+ */
+uint32_t HEVCShortTermRefPicSet::GetNumUsedByCurrPic() const
+{
+	uint32_t count = 0;
+	for (uint32_t bits = usedByCurrPic; bits; bits &= bits - 1)
+		++count;
+	return count;
+}
+
+
+
+/*
+ * Searches for 00 00 xx, with xx = 01 for start codes and 03 for emulation prevention bytes. The SIMD
+ * versions compare three overlapping loads, i.e. test 16 (32) positions per iteration.
+ */
+
+typedef const uint8_t* (*FindPatternFunc)(const uint8_t* p, const uint8_t* end, uint8_t last);
+
+static const uint8_t* FindPatternScalar(const uint8_t* p, const uint8_t* end, uint8_t last)
+{
+	for (; p + 3 <= end; ++p)
+	{
+		if (p[0] == 0 && p[1] == 0 && p[2] == last)
+			return p;
+	}
+	return end;
+}
+
+#if defined(BITSTREAM_X86)
+
+static inline uint32_t CountTrailingZeros(uint32_t mask)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+TARGET_SSE2 static const uint8_t* FindPatternSSE2(const uint8_t* p, const uint8_t* end, uint8_t last)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i third = _mm_set1_epi8(static_cast<char>(last));
+
+	for (; p + 18 <= end; p += 16)
+	{
+		__m128i b0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) p), zero);
+		__m128i b1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (p + 1)), zero);
+		__m128i b2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (p + 2)), third);
+
+		uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_and_si128(_mm_and_si128(b0, b1), b2)));
+		if (mask)
+			return p + CountTrailingZeros(mask);
+	}
+
+	return FindPatternScalar(p, end, last);
+}
+
+TARGET_AVX2 static const uint8_t* FindPatternAVX2(const uint8_t* p, const uint8_t* end, uint8_t last)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i third = _mm256_set1_epi8(static_cast<char>(last));
+
+	for (; p + 34 <= end; p += 32)
+	{
+		__m256i b0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) p), zero);
+		__m256i b1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (p + 1)), zero);
+		__m256i b2 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (p + 2)), third);
+
+		uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_and_si256(_mm256_and_si256(b0, b1), b2)));
+		if (mask)
+			return p + CountTrailingZeros(mask);
+	}
+
+	return FindPatternSSE2(p, end, last);
+}
+
+static bool CpuHasSSE2()
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	return (info[3] & (1 << 26)) != 0;
+#else
+	return __builtin_cpu_supports("sse2") != 0;
+#endif
+}
+
+static bool CpuHasAVX2()
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+
+	// AVX and OSXSAVE, plus the OS actually saving the YMM registers
+	if ((info[2] & (1 << 28)) == 0 || (info[2] & (1 << 27)) == 0)
+		return false;
+	if ((_xgetbv(0) & 0x6) != 0x6)
+		return false;
+
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+#endif // BITSTREAM_X86
+
+#if defined(BITSTREAM_NEON)
+
+// NEON has no movemask; blocks with a match are searched again byte by byte
+static const uint8_t* FindPatternNEON(const uint8_t* p, const uint8_t* end, uint8_t last)
+{
+	const uint8x16_t zero = vdupq_n_u8(0);
+	const uint8x16_t third = vdupq_n_u8(last);
+
+	for (; p + 18 <= end; p += 16)
+	{
+		uint8x16_t b0 = vceqq_u8(vld1q_u8(p), zero);
+		uint8x16_t b1 = vceqq_u8(vld1q_u8(p + 1), zero);
+		uint8x16_t b2 = vceqq_u8(vld1q_u8(p + 2), third);
+
+		if (vmaxvq_u8(vandq_u8(vandq_u8(b0, b1), b2)))
+			return FindPatternScalar(p, p + 18, last);
+	}
+
+	return FindPatternScalar(p, end, last);
+}
+
+#endif // BITSTREAM_NEON
+
+static FindPatternFunc SelectFindPattern()
+{
+#if defined(BITSTREAM_X86)
+	if (CpuHasAVX2())
+		return FindPatternAVX2;
+	if (CpuHasSSE2())
+		return FindPatternSSE2;
+#endif
+#if defined(BITSTREAM_NEON)
+	return FindPatternNEON;
+#else
+	return FindPatternScalar;
+#endif
+}
+
+static const FindPatternFunc s_findPattern = SelectFindPattern();
+
+
+
+/**
+ * @brief Finds the next three byte start code (00 00 01) with the fastest version the CPU supports.
+ * @param p Where to start looking.
+ * @param end The end of the byte stream.
+ * @return The start code's position, or end.
+ */
+const uint8_t* BitstreamParser::FindStartCode(const uint8_t* p, const uint8_t* end)
+{
+	return s_findPattern(p, end, 1);
+}
+
+
+
+/**
+ * @brief Converts (the start of) a NAL unit payload to its RBSP by dropping the emulation prevention
+ * bytes, i.e. the 03 of every 00 00 03.
+ * @param data The escaped bytes.
+ * @param size
+ * @param rbsp Receives the unescaped bytes.
+ * @param capacity Size of rbsp; only as much of the input is looked at as fits.
+ * @return Number of bytes written to rbsp.
+ */
+size_t BitstreamParser::RemoveEmulationPrevention(const uint8_t* data, size_t size, uint8_t* rbsp, size_t capacity)
+{
+	const uint8_t* p = data;
+	const uint8_t* end = data + size;
+	uint8_t* out = rbsp;
+	uint8_t* outEnd = rbsp + capacity;
+
+	while (p < end && out < outEnd)
+	{
+		// A pattern further away would only drop a byte that is not copied any more
+		size_t remaining = static_cast<size_t>(outEnd - out);
+		const uint8_t* limit = (static_cast<size_t>(end - p) > remaining + 2) ? p + remaining + 2 : end;
+
+		const uint8_t* found = s_findPattern(p, limit, 3);
+		const uint8_t* copyEnd = (found == limit) ? limit : found + 2;
+
+		size_t count = static_cast<size_t>(copyEnd - p);
+		if (count > remaining)
+			count = remaining;
+		memcpy(out, p, count);
+		out += count;
+
+		if (found == limit)
+			break;
+
+		// The search restarts after the dropped byte, so its zeros do not count twice
+		p = found + 3;
+	}
+
+	return static_cast<size_t>(out - rbsp);
+}
+
+
+
+/*
+ * Syntax shared between H.264 and HEVC.
+ */
+
+/// Read the VUI from aspect_ratio_info_present_flag to the chroma sample location, which both
+/// codecs code the same way
+template<typename SPS>
+static void ParseVideoSignal(BitReader& reader, SPS& sps)
+{
+	// aspect_ratio_idc, and sar_width/sar_height for Extended_SAR
+	if (reader.ReadFlag() && reader.ReadBits(8) == 255)
+		reader.SkipBits(32);
+
+	// overscan_appropriate_flag
+	if (reader.ReadFlag())
+		reader.SkipBits(1);
+
+	if (reader.ReadFlag())
+	{
+		// video_format
+		reader.SkipBits(3);
+		sps.fullRange = reader.ReadFlag();
+
+		if (reader.ReadFlag())
+		{
+			sps.colourPrimaries = static_cast<uint8_t>(reader.ReadBits(8));
+			sps.transferCharacteristics = static_cast<uint8_t>(reader.ReadBits(8));
+			sps.matrixCoefficients = static_cast<uint8_t>(reader.ReadBits(8));
+		}
+	}
+
+	// chroma_sample_loc_type_top_field, chroma_sample_loc_type_bottom_field
+	if (reader.ReadFlag())
+	{
+		reader.ReadUE();
+		reader.ReadUE();
+	}
+}
+
+
+
+/*
+ * H.264 (ITU-T H.264 7.3).
+ */
+
+static bool IsH264HighProfile(uint8_t profile)
+{
+	switch (profile)
+	{
+	case 100: case 110: case 122: case 244: case 44: case 83: case 86: case 118: case 128: case 138: case 139: case 134: case 135:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void SkipH264ScalingList(BitReader& reader, uint32_t size)
+{
+	int32_t lastScale = 8;
+	int32_t nextScale = 8;
+
+	for (uint32_t j = 0; j < size && !reader.HasError(); ++j)
+	{
+		if (nextScale != 0)
+			nextScale = (lastScale + reader.ReadSE() + 256) % 256;
+		lastScale = (nextScale == 0) ? lastScale : nextScale;
+	}
+}
+
+static void SkipH264RefPicListModification(BitReader& reader)
+{
+	// ref_pic_list_modification_flag_lX
+	if (!reader.ReadFlag())
+		return;
+
+	for (;;)
+	{
+		uint32_t idc = reader.ReadUE();
+		if (idc == 3 || idc > 5 || reader.HasError())
+			break;
+
+		// abs_diff_pic_num_minus1, long_term_pic_num, or (MVC) abs_diff_view_idx_minus1
+		reader.ReadUE();
+	}
+}
+
+static void SkipH264PredWeightTable(BitReader& reader, uint32_t chromaArrayType, uint32_t numRefIdxL0, uint32_t numRefIdxL1)
+{
+	// luma_log2_weight_denom, chroma_log2_weight_denom
+	reader.ReadUE();
+	if (chromaArrayType != 0)
+		reader.ReadUE();
+
+	for (uint32_t list = 0; list < 2; ++list)
+	{
+		uint32_t count = (list == 0) ? numRefIdxL0 : numRefIdxL1;
+		for (uint32_t i = 0; i < count && !reader.HasError(); ++i)
+		{
+			// luma weight and offset
+			if (reader.ReadFlag())
+			{
+				reader.ReadSE();
+				reader.ReadSE();
+			}
+
+			// weight and offset of both chroma components
+			if (chromaArrayType != 0 && reader.ReadFlag())
+			{
+				for (int j = 0; j < 4; ++j)
+					reader.ReadSE();
+			}
+		}
+	}
+}
+
+static void SkipH264DecRefPicMarking(BitReader& reader, bool idr)
+{
+	if (idr)
+	{
+		// no_output_of_prior_pics_flag, long_term_reference_flag
+		reader.SkipBits(2);
+		return;
+	}
+
+	// adaptive_ref_pic_marking_mode_flag
+	if (!reader.ReadFlag())
+		return;
+
+	for (;;)
+	{
+		uint32_t operation = reader.ReadUE();
+		if (operation == 0 || operation > 6 || reader.HasError())
+			break;
+
+		// difference_of_pic_nums_minus1
+		if (operation == 1 || operation == 3)
+			reader.ReadUE();
+
+		// long_term_pic_num
+		if (operation == 2)
+			reader.ReadUE();
+
+		// long_term_frame_idx
+		if (operation == 3 || operation == 6)
+			reader.ReadUE();
+
+		// max_long_term_frame_idx_plus1
+		if (operation == 4)
+			reader.ReadUE();
+	}
+}
+
+
+
+/**
+ * @brief Parses an H.264 SPS.
+ * @param nal The NAL unit, without start code.
+ * @param size
+ * @param sps Receives the fields.
+ * @return False if it is not an SPS or is malformed.
+ */
+bool BitstreamParser::ParseH264SPS(const uint8_t* nal, size_t size, H264SPS& sps)
+{
+	if (size < 2 || (nal[0] & 0x1f) != s_h264NalSPS)
+		return false;
+
+	uint8_t rbsp[s_maxHeaderSize];
+	BitReader reader(rbsp, RemoveEmulationPrevention(nal + 1, size - 1, rbsp, sizeof(rbsp)));
+
+	sps = H264SPS();
+	sps.profile = static_cast<uint8_t>(reader.ReadBits(8));
+	sps.constraintFlags = static_cast<uint8_t>(reader.ReadBits(8));
+	sps.level = static_cast<uint8_t>(reader.ReadBits(8));
+	sps.id = reader.ReadUE();
+	if (sps.id >= s_h264MaxSPS)
+		return false;
+
+	if (IsH264HighProfile(sps.profile))
+	{
+		sps.chromaFormat = reader.ReadUE();
+		if (sps.chromaFormat > 3)
+			return false;
+		if (sps.chromaFormat == 3)
+			sps.separateColourPlane = reader.ReadFlag();
+
+		sps.bitDepthLuma = reader.ReadUE() + 8;
+		sps.bitDepthChroma = reader.ReadUE() + 8;
+
+		// qpprime_y_zero_transform_bypass_flag
+		reader.SkipBits(1);
+
+		// seq_scaling_matrix_present_flag: six 4x4 lists, then two or six 8x8 ones
+		if (reader.ReadFlag())
+		{
+			uint32_t lists = (sps.chromaFormat != 3) ? 8 : 12;
+			for (uint32_t i = 0; i < lists; ++i)
+			{
+				if (reader.ReadFlag())
+					SkipH264ScalingList(reader, (i < 6) ? 16 : 64);
+			}
+		}
+	}
+
+	sps.log2MaxFrameNum = reader.ReadUE() + 4;
+	sps.picOrderCntType = reader.ReadUE();
+	if (sps.log2MaxFrameNum > 16 || sps.picOrderCntType > 2)
+		return false;
+
+	if (sps.picOrderCntType == 0)
+	{
+		sps.log2MaxPicOrderCntLsb = reader.ReadUE() + 4;
+		if (sps.log2MaxPicOrderCntLsb > 16)
+			return false;
+	}
+	else if (sps.picOrderCntType == 1)
+	{
+		sps.deltaPicOrderAlwaysZero = reader.ReadFlag();
+
+		// offset_for_non_ref_pic, offset_for_top_to_bottom_field, offset_for_ref_frame[]
+		reader.ReadSE();
+		reader.ReadSE();
+		uint32_t cycle = reader.ReadUE();
+		if (cycle > 255)
+			return false;
+		for (uint32_t i = 0; i < cycle; ++i)
+			reader.ReadSE();
+	}
+
+	sps.maxNumRefFrames = reader.ReadUE();
+
+	// gaps_in_frame_num_value_allowed_flag
+	reader.SkipBits(1);
+
+	uint32_t widthInMbs = reader.ReadUE() + 1;
+	uint32_t heightInMapUnits = reader.ReadUE() + 1;
+
+	sps.frameMbsOnly = reader.ReadFlag();
+	if (!sps.frameMbsOnly)
+		reader.SkipBits(1);
+
+	// direct_8x8_inference_flag
+	reader.SkipBits(1);
+
+	uint32_t crop[4] = {};
+	if (reader.ReadFlag())
+	{
+		for (uint32_t& offset : crop)
+			offset = reader.ReadUE();
+	}
+
+	uint32_t chromaArrayType = sps.separateColourPlane ? 0 : sps.chromaFormat;
+	uint32_t cropUnitX = (chromaArrayType == 1 || chromaArrayType == 2) ? 2 : 1;
+	uint32_t cropUnitY = ((chromaArrayType == 1) ? 2 : 1) * (sps.frameMbsOnly ? 1 : 2);
+
+	uint64_t width = static_cast<uint64_t>(widthInMbs) * 16;
+	uint64_t height = static_cast<uint64_t>(heightInMapUnits) * 16 * (sps.frameMbsOnly ? 1 : 2);
+	uint64_t cropX = static_cast<uint64_t>(cropUnitX) * (static_cast<uint64_t>(crop[0]) + crop[1]);
+	uint64_t cropY = static_cast<uint64_t>(cropUnitY) * (static_cast<uint64_t>(crop[2]) + crop[3]);
+	if (cropX >= width || cropY >= height)
+		return false;
+
+	sps.width = static_cast<uint32_t>(width - cropX);
+	sps.height = static_cast<uint32_t>(height - cropY);
+
+	if (reader.ReadFlag())
+	{
+		ParseVideoSignal(reader, sps);
+
+		if (reader.ReadFlag())
+		{
+			sps.numUnitsInTick = reader.ReadBits(32);
+			sps.timeScale = reader.ReadBits(32);
+		}
+	}
+
+	return !reader.HasError();
+}
+
+
+
+/**
+ * @brief Parses an H.264 PPS. Slice groups (FMO) are not supported.
+ * @param nal The NAL unit, without start code.
+ * @param size
+ * @param pps Receives the fields.
+ * @return False if it is not a PPS, is malformed or uses slice groups.
+ */
+bool BitstreamParser::ParseH264PPS(const uint8_t* nal, size_t size, H264PPS& pps)
+{
+	if (size < 2 || (nal[0] & 0x1f) != s_h264NalPPS)
+		return false;
+
+	uint8_t rbsp[s_maxHeaderSize];
+	BitReader reader(rbsp, RemoveEmulationPrevention(nal + 1, size - 1, rbsp, sizeof(rbsp)));
+
+	pps = H264PPS();
+	pps.id = reader.ReadUE();
+	pps.spsId = reader.ReadUE();
+	if (pps.id >= s_h264MaxPPS || pps.spsId >= s_h264MaxSPS)
+		return false;
+
+	pps.entropyCodingMode = reader.ReadFlag();
+	pps.bottomFieldPicOrderInFramePresent = reader.ReadFlag();
+
+	// nuslice_groups_minus1
+	if (reader.ReadUE() != 0)
+		return false;
+
+	pps.numRefIdxL0DefaultActive = reader.ReadUE() + 1;
+	pps.numRefIdxL1DefaultActive = reader.ReadUE() + 1;
+	if (pps.numRefIdxL0DefaultActive > 32 || pps.numRefIdxL1DefaultActive > 32)
+		return false;
+
+	pps.weightedPred = reader.ReadFlag();
+	pps.weightedBipredIdc = reader.ReadBits(2);
+	pps.picInitQp = 26 + reader.ReadSE();
+
+	// pic_init_qs_minus26
+	reader.ReadSE();
+
+	pps.chromaQpIndexOffset = reader.ReadSE();
+	pps.deblockingFilterControlPresent = reader.ReadFlag();
+
+	// constrained_intra_pred_flag
+	reader.SkipBits(1);
+
+	pps.redundantPicCntPresent = reader.ReadFlag();
+
+	if (reader.HasMoreRBSPData())
+		pps.transform8x8Mode = reader.ReadFlag();
+
+	return !reader.HasError();
+}
+
+
+
+/**
+ * @brief Parses an H.264 slice header up to slice_qp_delta.
+ * @param nal The NAL unit, without start code.
+ * @param size
+ * @param slice Receives the fields.
+ * @return False if its parameter sets are unknown or it is malformed.
+ */
+bool BitstreamParser::ParseH264Slice(const uint8_t* nal, size_t size, SliceHeader& slice) const
+{
+	if (size < 2)
+		return false;
+
+	uint32_t nalRefIdc = (nal[0] >> 5) & 0x03;
+	bool idr = (nal[0] & 0x1f) == s_h264NalIDR;
+
+	uint8_t rbsp[s_maxHeaderSize];
+	BitReader reader(rbsp, RemoveEmulationPrevention(nal + 1, size - 1, rbsp, sizeof(rbsp)));
+
+	slice = SliceHeader();
+	slice.firstInPicture = reader.ReadUE() == 0;
+
+	// 0/5 P, 1/6 B, 2/7 I, 3/8 SP, 4/9 SI
+	uint32_t sliceType = reader.ReadUE();
+	if (sliceType > 9)
+		return false;
+	sliceType %= 5;
+
+	bool p = sliceType == 0 || sliceType == 3;
+	bool b = sliceType == 1;
+	slice.type = b ? SliceHeader::TYPE_B : (p ? SliceHeader::TYPE_P : SliceHeader::TYPE_I);
+
+	slice.ppsId = reader.ReadUE();
+	const H264PPS* pps = GetH264PPS(slice.ppsId);
+	const H264SPS* sps = pps ? GetH264SPS(pps->spsId) : nullptr;
+	if (!sps)
+		return false;
+
+	// colour_plane_id
+	if (sps->separateColourPlane)
+		reader.SkipBits(2);
+
+	slice.frameNum = reader.ReadBits(sps->log2MaxFrameNum);
+
+	// field_pic_flag, bottom_field_flag
+	bool field = false;
+	if (!sps->frameMbsOnly)
+	{
+		field = reader.ReadFlag();
+		if (field)
+			reader.SkipBits(1);
+	}
+
+	// idr_pic_id
+	if (idr)
+		reader.ReadUE();
+
+	if (sps->picOrderCntType == 0)
+	{
+		slice.picOrderCntLsb = reader.ReadBits(sps->log2MaxPicOrderCntLsb);
+
+		// delta_pic_order_cnt_bottom
+		if (pps->bottomFieldPicOrderInFramePresent && !field)
+			reader.ReadSE();
+	}
+
+	// delta_pic_order_cnt[0..1]
+	if (sps->picOrderCntType == 1 && !sps->deltaPicOrderAlwaysZero)
+	{
+		reader.ReadSE();
+		if (pps->bottomFieldPicOrderInFramePresent && !field)
+			reader.ReadSE();
+	}
+
+	// redundant_pic_cnt
+	if (pps->redundantPicCntPresent)
+		reader.ReadUE();
+
+	// direct_spatial_mv_pred_flag
+	if (b)
+		reader.SkipBits(1);
+
+	if (p || b)
+	{
+		// Fields have twice the references of frames by default
+		slice.numRefIdxL0Active = pps->numRefIdxL0DefaultActive * (field ? 2 : 1);
+		slice.numRefIdxL1Active = b ? pps->numRefIdxL1DefaultActive * (field ? 2 : 1) : 0;
+
+		// num_ref_idx_active_override_flag
+		if (reader.ReadFlag())
+		{
+			slice.numRefIdxL0Active = reader.ReadUE() + 1;
+			if (b)
+				slice.numRefIdxL1Active = reader.ReadUE() + 1;
+		}
+
+		if (slice.numRefIdxL0Active > 32 || slice.numRefIdxL1Active > 32)
+			return false;
+
+		SkipH264RefPicListModification(reader);
+		if (b)
+			SkipH264RefPicListModification(reader);
+	}
+
+	if ((pps->weightedPred && p) || (pps->weightedBipredIdc == 1 && b))
+		SkipH264PredWeightTable(reader, sps->separateColourPlane ? 0 : sps->chromaFormat, slice.numRefIdxL0Active, slice.numRefIdxL1Active);
+
+	if (nalRefIdc != 0)
+		SkipH264DecRefPicMarking(reader, idr);
+
+	// cabac_init_idc
+	if (pps->entropyCodingMode && (p || b))
+		reader.ReadUE();
+
+	slice.qp = pps->picInitQp + reader.ReadSE();
+
+	return !reader.HasError();
+}
+
+
+
+/*
+ * HEVC (ITU-T H.265 7.3).
+ */
+
+static void ParseHEVCProfileTierLevel(BitReader& reader, uint32_t maxSubLayersMinus1, HEVCProfileTierLevel& ptl)
+{
+	for (uint8_t& byte : ptl.bytes)
+		byte = static_cast<uint8_t>(reader.ReadBits(8));
+
+	ptl.profileSpace = ptl.bytes[0] >> 6;
+	ptl.tier = (ptl.bytes[0] & 0x20) != 0;
+	ptl.profile = ptl.bytes[0] & 0x1f;
+	ptl.compatibilityFlags = (static_cast<uint32_t>(ptl.bytes[1]) << 24) | (static_cast<uint32_t>(ptl.bytes[2]) << 16) |
+		(static_cast<uint32_t>(ptl.bytes[3]) << 8) | ptl.bytes[4];
+	ptl.level = ptl.bytes[11];
+
+	// sub_layer_profile_present_flag, sub_layer_level_present_flag, padded to eight sub-layers
+	uint32_t subLayerFlags[7];
+	for (uint32_t i = 0; i < maxSubLayersMinus1; ++i)
+		subLayerFlags[i] = reader.ReadBits(2);
+	if (maxSubLayersMinus1 > 0)
+		reader.SkipBits(2 * (8 - maxSubLayersMinus1));
+
+	for (uint32_t i = 0; i < maxSubLayersMinus1; ++i)
+	{
+		if (subLayerFlags[i] & 0x02)
+			reader.SkipBits(88);
+		if (subLayerFlags[i] & 0x01)
+			reader.SkipBits(8);
+	}
+}
+
+static void SkipHEVCScalingListData(BitReader& reader)
+{
+	for (uint32_t sizeId = 0; sizeId < 4; ++sizeId)
+	{
+		for (uint32_t matrixId = 0; matrixId < 6; matrixId += (sizeId == 3) ? 3 : 1)
+		{
+			// scaling_list_pred_mode_flag; without it only scaling_list_pred_matrix_id_delta
+			if (!reader.ReadFlag())
+			{
+				reader.ReadUE();
+				continue;
+			}
+
+			uint32_t coefficients = (sizeId == 0) ? 16 : 64;
+
+			// scaling_list_dc_coef_minus8
+			if (sizeId > 1)
+				reader.ReadSE();
+
+			for (uint32_t i = 0; i < coefficients && !reader.HasError(); ++i)
+				reader.ReadSE();
+		}
+	}
+}
+
+/// Parse st_ref_pic_set(index); index == count is the one of a slice header
+static bool ParseHEVCShortTermRefPicSet(BitReader& reader, uint32_t index, const HEVCShortTermRefPicSet* sets, uint32_t count, HEVCShortTermRefPicSet& set)
+{
+	int32_t negative[16];
+	int32_t positive[16];
+	bool negativeUsed[16];
+	bool positiveUsed[16];
+	uint32_t numNegative = 0;
+	uint32_t numPositive = 0;
+
+	// inter_ref_pic_set_prediction_flag
+	if (index != 0 && reader.ReadFlag())
+	{
+		uint32_t deltaIdx = 1;
+		if (index == count)
+			deltaIdx = reader.ReadUE() + 1;
+		if (deltaIdx > index)
+			return false;
+
+		const HEVCShortTermRefPicSet& ref = sets[index - deltaIdx];
+		uint32_t refNegative = ref.numNegative;
+		uint32_t refDeltas = ref.GetNumDeltaPocs();
+
+		bool sign = reader.ReadFlag();
+		uint32_t absDeltaRps = reader.ReadUE() + 1;
+		if (absDeltaRps > (1u << 15))
+			return false;
+		int32_t deltaRps = sign ? -static_cast<int32_t>(absDeltaRps) : static_cast<int32_t>(absDeltaRps);
+
+		// used_by_curr_pic_flag and use_delta_flag for every picture of the reference set, and for
+		// the reference picture itself
+		bool used[17];
+		bool useDelta[17];
+		for (uint32_t j = 0; j <= refDeltas; ++j)
+		{
+			used[j] = reader.ReadFlag();
+			useDelta[j] = used[j] || reader.ReadFlag();
+		}
+
+		// Derivation as in (7-61) and (7-62), with all deltas shifted by deltaRps
+		auto add = [&](int32_t deltaPoc, uint32_t j)
+		{
+			if (!useDelta[j] || deltaPoc == 0)
+				return true;
+			if (numNegative + numPositive == 16)
+				return false;
+
+			if (deltaPoc < 0)
+			{
+				negativeUsed[numNegative] = used[j];
+				negative[numNegative++] = deltaPoc;
+			}
+			else
+			{
+				positiveUsed[numPositive] = used[j];
+				positive[numPositive++] = deltaPoc;
+			}
+			return true;
+		};
+
+		bool ok = true;
+		for (uint32_t j = refDeltas; j-- > refNegative; )
+		{
+			if (ref.deltaPoc[j] + deltaRps < 0)
+				ok = ok && add(ref.deltaPoc[j] + deltaRps, j);
+		}
+		if (deltaRps < 0)
+			ok = ok && add(deltaRps, refDeltas);
+		for (uint32_t j = 0; j < refNegative; ++j)
+		{
+			if (ref.deltaPoc[j] + deltaRps < 0)
+				ok = ok && add(ref.deltaPoc[j] + deltaRps, j);
+		}
+
+		for (uint32_t j = refNegative; j-- > 0; )
+		{
+			if (ref.deltaPoc[j] + deltaRps > 0)
+				ok = ok && add(ref.deltaPoc[j] + deltaRps, j);
+		}
+		if (deltaRps > 0)
+			ok = ok && add(deltaRps, refDeltas);
+		for (uint32_t j = refNegative; j < refDeltas; ++j)
+		{
+			if (ref.deltaPoc[j] + deltaRps > 0)
+				ok = ok && add(ref.deltaPoc[j] + deltaRps, j);
+		}
+
+		if (!ok)
+			return false;
+	}
+	else
+	{
+		numNegative = reader.ReadUE();
+		numPositive = reader.ReadUE();
+		if (numNegative > 16 || numPositive > 16 - numNegative)
+			return false;
+
+		int32_t poc = 0;
+		for (uint32_t i = 0; i < numNegative; ++i)
+		{
+			poc -= static_cast<int32_t>(reader.ReadUE() & 0x7fff) + 1;
+			negative[i] = poc;
+			negativeUsed[i] = reader.ReadFlag();
+		}
+
+		poc = 0;
+		for (uint32_t i = 0; i < numPositive; ++i)
+		{
+			poc += static_cast<int32_t>(reader.ReadUE() & 0x7fff) + 1;
+			positive[i] = poc;
+			positiveUsed[i] = reader.ReadFlag();
+		}
+	}
+
+	set = HEVCShortTermRefPicSet();
+	set.numNegative = static_cast<uint8_t>(numNegative);
+	set.numPositive = static_cast<uint8_t>(numPositive);
+	for (uint32_t i = 0; i < numNegative; ++i)
+	{
+		set.deltaPoc[i] = negative[i];
+		set.usedByCurrPic |= negativeUsed[i] ? (1 << i) : 0;
+	}
+	for (uint32_t i = 0; i < numPositive; ++i)
+	{
+		set.deltaPoc[numNegative + i] = positive[i];
+		set.usedByCurrPic |= positiveUsed[i] ? (1 << (numNegative + i)) : 0;
+	}
+
+	return !reader.HasError();
+}
+
+static void SkipHEVCPredWeightTable(BitReader& reader, uint32_t chromaArrayType, uint32_t numRefIdxL0, uint32_t numRefIdxL1)
+{
+	// luma_log2_weight_denom, delta_chroma_log2_weight_denom
+	reader.ReadUE();
+	if (chromaArrayType != 0)
+		reader.ReadSE();
+
+	for (uint32_t list = 0; list < 2; ++list)
+	{
+		uint32_t count = (list == 0) ? numRefIdxL0 : numRefIdxL1;
+
+		// All flags of a list come first, then the weights they announce
+		uint32_t lumaFlags = 0;
+		uint32_t chromaFlags = 0;
+		for (uint32_t i = 0; i < count; ++i)
+			lumaFlags |= reader.ReadFlag() ? (1u << i) : 0;
+		if (chromaArrayType != 0)
+		{
+			for (uint32_t i = 0; i < count; ++i)
+				chromaFlags |= reader.ReadFlag() ? (1u << i) : 0;
+		}
+
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			// delta_luma_weight, luma_offset
+			if (lumaFlags & (1u << i))
+			{
+				reader.ReadSE();
+				reader.ReadSE();
+			}
+
+			// delta_chroma_weight, delta_chroma_offset of both components
+			if (chromaFlags & (1u << i))
+			{
+				for (int j = 0; j < 4; ++j)
+					reader.ReadSE();
+			}
+		}
+	}
+}
+
+
+
+/**
+ * @brief Parses an HEVC VPS up to its profile_tier_level.
+ * @param nal The NAL unit, without start code.
+ * @param size
+ * @param vps Receives the fields.
+ * @return False if it is not a VPS or is malformed.
+ */
+bool BitstreamParser::ParseHEVCVPS(const uint8_t* nal, size_t size, HEVCVPS& vps)
+{
+	if (size < 3 || ((nal[0] >> 1) & 0x3f) != s_hevcNalVPS)
+		return false;
+
+	uint8_t rbsp[s_maxHeaderSize];
+	BitReader reader(rbsp, RemoveEmulationPrevention(nal + 2, size - 2, rbsp, sizeof(rbsp)));
+
+	vps = HEVCVPS();
+	vps.id = reader.ReadBits(4);
+
+	// vps_base_layer_internal_flag, vps_base_layer_available_flag, vps_max_layers_minus1
+	reader.SkipBits(8);
+
+	vps.maxSubLayers = reader.ReadBits(3) + 1;
+	vps.temporalIdNesting = reader.ReadFlag();
+	if (vps.maxSubLayers > 7)
+		return false;
+
+	// vps_reserved_0xffff_16bits
+	reader.SkipBits(16);
+
+	ParseHEVCProfileTierLevel(reader, vps.maxSubLayers - 1, vps.profileTierLevel);
+
+	return !reader.HasError();
+}
+
+
+
+/**
+ * @brief Parses an HEVC SPS.
+ * @param nal The NAL unit, without start code.
+ * @param size
+ * @param sps Receives the fields.
+ * @return False if it is not an SPS or is malformed.
+ */
+bool BitstreamParser::ParseHEVCSPS(const uint8_t* nal, size_t size, HEVCSPS& sps)
+{
+	if (size < 3 || ((nal[0] >> 1) & 0x3f) != s_hevcNalSPS)
+		return false;
+
+	uint8_t rbsp[s_maxHeaderSize];
+	BitReader reader(rbsp, RemoveEmulationPrevention(nal + 2, size - 2, rbsp, sizeof(rbsp)));
+
+	sps = HEVCSPS();
+	sps.vpsId = reader.ReadBits(4);
+	sps.maxSubLayers = reader.ReadBits(3) + 1;
+	sps.temporalIdNesting = reader.ReadFlag();
+	if (sps.maxSubLayers > 7)
+		return false;
+
+	ParseHEVCProfileTierLevel(reader, sps.maxSubLayers - 1, sps.profileTierLevel);
+
+	sps.id = reader.ReadUE();
+	sps.chromaFormat = reader.ReadUE();
+	if (sps.id >= s_hevcMaxSPS || sps.chromaFormat > 3)
+		return false;
+	if (sps.chromaFormat == 3)
+		sps.separateColourPlane = reader.ReadFlag();
+
+	sps.codedWidth = reader.ReadUE();
+	sps.codedHeight = reader.ReadUE();
+
+	// conf_win_*_offset, in chroma samples
+	uint32_t window[4] = {};
+	if (reader.ReadFlag())
+	{
+		for (uint32_t& offset : window)
+			offset = reader.ReadUE();
+	}
+
+	uint32_t subWidth = (sps.chromaFormat == 1 || sps.chromaFormat == 2) ? 2 : 1;
+	uint32_t subHeight = (sps.chromaFormat == 1) ? 2 : 1;
+	uint64_t cropX = static_cast<uint64_t>(subWidth) * (static_cast<uint64_t>(window[0]) + window[1]);
+	uint64_t cropY = static_cast<uint64_t>(subHeight) * (static_cast<uint64_t>(window[2]) + window[3]);
+	if (cropX >= sps.codedWidth || cropY >= sps.codedHeight)
+		return false;
+
+	sps.width = sps.codedWidth - static_cast<uint32_t>(cropX);
+	sps.height = sps.codedHeight - static_cast<uint32_t>(cropY);
+
+	sps.bitDepthLuma = reader.ReadUE() + 8;
+	sps.bitDepthChroma = reader.ReadUE() + 8;
+	sps.log2MaxPicOrderCntLsb = reader.ReadUE() + 4;
+	if (sps.log2MaxPicOrderCntLsb > 16)
+		return false;
+
+	// sps_max_dec_pic_buffering_minus1, sps_max_num_reorder_pics, sps_max_latency_increase_plus1, for
+	// all sub-layers or only the highest one
+	bool subLayerOrderingInfo = reader.ReadFlag();
+	for (uint32_t i = subLayerOrderingInfo ? 0 : sps.maxSubLayers - 1; i < sps.maxSubLayers; ++i)
+	{
+		reader.ReadUE();
+		reader.ReadUE();
+		reader.ReadUE();
+	}
+
+	sps.log2MinCodingBlockSize = reader.ReadUE() + 3;
+	sps.log2CtbSize = sps.log2MinCodingBlockSize + reader.ReadUE();
+	if (sps.log2CtbSize > 6)
+		return false;
+
+	// log2_min_luma_transform_block_size_minus2, log2_diff_max_min_luma_transform_block_size,
+	// max_transform_hierarchy_depth_inter, max_transform_hierarchy_depth_intra
+	for (int i = 0; i < 4; ++i)
+		reader.ReadUE();
+
+	// scaling_list_enabled_flag, sps_scaling_list_data_present_flag
+	if (reader.ReadFlag() && reader.ReadFlag())
+		SkipHEVCScalingListData(reader);
+
+	// amp_enabled_flag
+	reader.SkipBits(1);
+
+	sps.sampleAdaptiveOffset = reader.ReadFlag();
+
+	// pcm_enabled_flag: sample bit depths, block sizes, loop filter flag
+	if (reader.ReadFlag())
+	{
+		reader.SkipBits(8);
+		reader.ReadUE();
+		reader.ReadUE();
+		reader.SkipBits(1);
+	}
+
+	sps.numShortTermRefPicSets = reader.ReadUE();
+	if (sps.numShortTermRefPicSets > 64)
+		return false;
+	for (uint32_t i = 0; i < sps.numShortTermRefPicSets; ++i)
+	{
+		if (!ParseHEVCShortTermRefPicSet(reader, i, sps.shortTermRefPicSets, sps.numShortTermRefPicSets, sps.shortTermRefPicSets[i]))
+			return false;
+	}
+
+	sps.longTermRefPicsPresent = reader.ReadFlag();
+	if (sps.longTermRefPicsPresent)
+	{
+		sps.numLongTermRefPics = reader.ReadUE();
+		if (sps.numLongTermRefPics > 32)
+			return false;
+
+		// lt_ref_pic_poc_lsb_sps, used_by_curr_pic_lt_sps_flag
+		for (uint32_t i = 0; i < sps.numLongTermRefPics; ++i)
+		{
+			reader.SkipBits(sps.log2MaxPicOrderCntLsb);
+			sps.longTermUsedByCurrPic |= reader.ReadFlag() ? (1u << i) : 0;
+		}
+	}
+
+	sps.temporalMvp = reader.ReadFlag();
+
+	// strong_intra_smoothing_enabled_flag
+	reader.SkipBits(1);
+
+	if (reader.ReadFlag())
+	{
+		ParseVideoSignal(reader, sps);
+
+		// neutral_chroma_indication_flag, field_seq_flag, frame_field_info_present_flag
+		reader.SkipBits(3);
+
+		// default_display_window_flag
+		if (reader.ReadFlag())
+		{
+			for (int i = 0; i < 4; ++i)
+				reader.ReadUE();
+		}
+
+		if (reader.ReadFlag())
+		{
+			sps.numUnitsInTick = reader.ReadBits(32);
+			sps.timeScale = reader.ReadBits(32);
+		}
+	}
+
+	return !reader.HasError();
+}
+
+
+
+/**
+ * @brief Parses an HEVC PPS up to the syntax slice headers depend on.
+ * @param nal The NAL unit, without start code.
+ * @param size
+ * @param pps Receives the fields.
+ * @return False if it is not a PPS or is malformed.
+ */
+bool BitstreamParser::ParseHEVCPPS(const uint8_t* nal, size_t size, HEVCPPS& pps)
+{
+	if (size < 3 || ((nal[0] >> 1) & 0x3f) != s_hevcNalPPS)
+		return false;
+
+	uint8_t rbsp[s_maxHeaderSize];
+	BitReader reader(rbsp, RemoveEmulationPrevention(nal + 2, size - 2, rbsp, sizeof(rbsp)));
+
+	pps = HEVCPPS();
+	pps.id = reader.ReadUE();
+	pps.spsId = reader.ReadUE();
+	if (pps.id >= s_hevcMaxPPS || pps.spsId >= s_hevcMaxSPS)
+		return false;
+
+	pps.dependentSliceSegments = reader.ReadFlag();
+	pps.outputFlagPresent = reader.ReadFlag();
+	pps.numExtraSliceHeaderBits = reader.ReadBits(3);
+
+	// sign_data_hiding_enabled_flag
+	reader.SkipBits(1);
+
+	pps.cabacInitPresent = reader.ReadFlag();
+	pps.numRefIdxL0DefaultActive = reader.ReadUE() + 1;
+	pps.numRefIdxL1DefaultActive = reader.ReadUE() + 1;
+	if (pps.numRefIdxL0DefaultActive > 15 || pps.numRefIdxL1DefaultActive > 15)
+		return false;
+
+	pps.initQp = 26 + reader.ReadSE();
+
+	// constrained_intra_pred_flag, transform_skip_enabled_flag
+	reader.SkipBits(2);
+
+	// diff_cu_qp_delta_depth
+	pps.cuQpDelta = reader.ReadFlag();
+	if (pps.cuQpDelta)
+		reader.ReadUE();
+
+	// pps_cb_qp_offset, pps_cr_qp_offset, pps_slice_chroma_qp_offsets_present_flag
+	reader.ReadSE();
+	reader.ReadSE();
+	reader.SkipBits(1);
+
+	pps.weightedPred = reader.ReadFlag();
+	pps.weightedBipred = reader.ReadFlag();
+
+	// transquant_bypass_enabled_flag
+	reader.SkipBits(1);
+
+	pps.tiles = reader.ReadFlag();
+	pps.entropyCodingSync = reader.ReadFlag();
+
+	if (pps.tiles)
+	{
+		uint32_t columns = reader.ReadUE() + 1;
+		uint32_t rows = reader.ReadUE() + 1;
+
+		// Explicit column widths and row heights unless uniform_spacing_flag
+		if (!reader.ReadFlag())
+		{
+			for (uint32_t i = 1; i < columns && !reader.HasError(); ++i)
+				reader.ReadUE();
+			for (uint32_t i = 1; i < rows && !reader.HasError(); ++i)
+				reader.ReadUE();
+		}
+
+		// loop_filter_across_tiles_enabled_flag
+		reader.SkipBits(1);
+	}
+
+	// pps_loop_filter_across_slices_enabled_flag
+	reader.SkipBits(1);
+
+	// deblocking_filter_control_present_flag: override flag, and offsets unless disabled
+	if (reader.ReadFlag())
+	{
+		reader.SkipBits(1);
+		if (!reader.ReadFlag())
+		{
+			reader.ReadSE();
+			reader.ReadSE();
+		}
+	}
+
+	// pps_scaling_list_data_present_flag
+	if (reader.ReadFlag())
+		SkipHEVCScalingListData(reader);
+
+	pps.listsModificationPresent = reader.ReadFlag();
+
+	// log2_parallel_merge_level_minus2, slice_segment_header_extension_present_flag
+	reader.ReadUE();
+	reader.SkipBits(1);
+
+	return !reader.HasError();
+}
+
+
+
+/**
+ * @brief Parses an HEVC slice segment header up to slice_qp_delta. Dependent slice segments only get
+ * as far as their flag; the rest of their header is the one of the preceding slice segment.
+ * @param nal The NAL unit, without start code.
+ * @param size
+ * @param slice Receives the fields.
+ * @return False if its parameter sets are unknown or it is malformed.
+ */
+bool BitstreamParser::ParseHEVCSlice(const uint8_t* nal, size_t size, SliceHeader& slice) const
+{
+	if (size < 3)
+		return false;
+
+	uint8_t nalType = (nal[0] >> 1) & 0x3f;
+	bool irap = nalType >= 16 && nalType <= 23;
+	bool idr = nalType == 19 || nalType == 20;
+
+	uint8_t rbsp[s_maxHeaderSize];
+	BitReader reader(rbsp, RemoveEmulationPrevention(nal + 2, size - 2, rbsp, sizeof(rbsp)));
+
+	slice = SliceHeader();
+	slice.firstInPicture = reader.ReadFlag();
+
+	// no_output_of_prior_pics_flag
+	if (irap)
+		reader.SkipBits(1);
+
+	slice.ppsId = reader.ReadUE();
+	const HEVCPPS* pps = GetHEVCPPS(slice.ppsId);
+	const HEVCSPS* sps = pps ? GetHEVCSPS(pps->spsId) : nullptr;
+	if (!sps)
+		return false;
+
+	if (!slice.firstInPicture)
+	{
+		if (pps->dependentSliceSegments)
+			slice.dependent = reader.ReadFlag();
+
+		// slice_segment_address
+		uint32_t ctbSize = 1u << sps->log2CtbSize;
+		uint32_t ctbs = ((sps->codedWidth + ctbSize - 1) >> sps->log2CtbSize) * ((sps->codedHeight + ctbSize - 1) >> sps->log2CtbSize);
+		reader.SkipBits(CeilLog2(ctbs));
+	}
+
+	if (slice.dependent)
+		return !reader.HasError();
+
+	// slice_reserved_flag[]
+	reader.SkipBits(pps->numExtraSliceHeaderBits);
+
+	// 0 B, 1 P, 2 I
+	uint32_t sliceType = reader.ReadUE();
+	if (sliceType > 2)
+		return false;
+
+	bool p = sliceType == 1;
+	bool b = sliceType == 0;
+	slice.type = b ? SliceHeader::TYPE_B : (p ? SliceHeader::TYPE_P : SliceHeader::TYPE_I);
+
+	// pic_output_flag, colour_plane_id
+	if (pps->outputFlagPresent)
+		reader.SkipBits(1);
+	if (sps->separateColourPlane)
+		reader.SkipBits(2);
+
+	uint32_t numPicTotalCurr = 0;
+	bool temporalMvp = false;
+
+	if (!idr)
+	{
+		slice.picOrderCntLsb = reader.ReadBits(sps->log2MaxPicOrderCntLsb);
+
+		// short_term_ref_pic_set_sps_flag: a set of the SPS, or one of its own
+		if (!reader.ReadFlag())
+		{
+			HEVCShortTermRefPicSet set;
+			if (!ParseHEVCShortTermRefPicSet(reader, sps->numShortTermRefPicSets, sps->shortTermRefPicSets, sps->numShortTermRefPicSets, set))
+				return false;
+			numPicTotalCurr += set.GetNumUsedByCurrPic();
+		}
+		else
+		{
+			if (sps->numShortTermRefPicSets == 0)
+				return false;
+
+			uint32_t index = reader.ReadBits(CeilLog2(sps->numShortTermRefPicSets));
+			if (index >= sps->numShortTermRefPicSets)
+				return false;
+			numPicTotalCurr += sps->shortTermRefPicSets[index].GetNumUsedByCurrPic();
+		}
+
+		if (sps->longTermRefPicsPresent)
+		{
+			uint32_t numLongTermSps = (sps->numLongTermRefPics > 0) ? reader.ReadUE() : 0;
+			uint32_t numLongTermPics = reader.ReadUE();
+			if (numLongTermSps > sps->numLongTermRefPics || numLongTermPics > 32)
+				return false;
+
+			for (uint32_t i = 0; i < numLongTermSps + numLongTermPics; ++i)
+			{
+				bool used;
+				if (i < numLongTermSps)
+				{
+					// lt_idx_sps
+					uint32_t index = reader.ReadBits(CeilLog2(sps->numLongTermRefPics));
+					used = ((sps->longTermUsedByCurrPic >> index) & 1) != 0;
+				}
+				else
+				{
+					// poc_lsb_lt, used_by_curr_pic_lt_flag
+					reader.SkipBits(sps->log2MaxPicOrderCntLsb);
+					used = reader.ReadFlag();
+				}
+
+				if (used)
+					++numPicTotalCurr;
+
+				// delta_poc_msb_present_flag, delta_poc_msb_cycle_lt
+				if (reader.ReadFlag())
+					reader.ReadUE();
+			}
+		}
+
+		if (sps->temporalMvp)
+			temporalMvp = reader.ReadFlag();
+	}
+
+	uint32_t chromaArrayType = sps->separateColourPlane ? 0 : sps->chromaFormat;
+
+	// slice_sao_luma_flag, slice_sao_chroma_flag
+	if (sps->sampleAdaptiveOffset)
+		reader.SkipBits((chromaArrayType != 0) ? 2 : 1);
+
+	if (p || b)
+	{
+		slice.numRefIdxL0Active = pps->numRefIdxL0DefaultActive;
+		slice.numRefIdxL1Active = b ? pps->numRefIdxL1DefaultActive : 0;
+
+		// num_ref_idx_active_override_flag
+		if (reader.ReadFlag())
+		{
+			slice.numRefIdxL0Active = reader.ReadUE() + 1;
+			if (b)
+				slice.numRefIdxL1Active = reader.ReadUE() + 1;
+		}
+
+		if (slice.numRefIdxL0Active > 15 || slice.numRefIdxL1Active > 15)
+			return false;
+
+		// ref_pic_list_modification_flag_lX and list_entry_lX[]
+		if (pps->listsModificationPresent && numPicTotalCurr > 1)
+		{
+			uint32_t entryBits = CeilLog2(numPicTotalCurr);
+			if (reader.ReadFlag())
+				reader.SkipBits(slice.numRefIdxL0Active * entryBits);
+			if (b && reader.ReadFlag())
+				reader.SkipBits(slice.numRefIdxL1Active * entryBits);
+		}
+
+		// mvd_l1_zero_flag
+		if (b)
+			reader.SkipBits(1);
+
+		// cabac_init_flag
+		if (pps->cabacInitPresent)
+			reader.SkipBits(1);
+
+		if (temporalMvp)
+		{
+			// collocated_from_l0_flag, collocated_ref_idx
+			bool fromL0 = b ? reader.ReadFlag() : true;
+			if ((fromL0 && slice.numRefIdxL0Active > 1) || (!fromL0 && slice.numRefIdxL1Active > 1))
+				reader.ReadUE();
+		}
+
+		if ((pps->weightedPred && p) || (pps->weightedBipred && b))
+			SkipHEVCPredWeightTable(reader, chromaArrayType, slice.numRefIdxL0Active, slice.numRefIdxL1Active);
+
+		// five_minus_max_num_merge_cand
+		reader.ReadUE();
+	}
+
+	slice.qp = pps->initQp + reader.ReadSE();
+
+	return !reader.HasError();
+}
+
+
+
+/**
+ * @brief Constructor. Reserves room for every parameter set ID the codec allows, so parsing does not
+ * allocate later on.
+ * @param codec
+ */
+BitstreamParser::BitstreamParser(Codec codec):
+	m_codec(codec)
+{
+	if (codec == CODEC_H264)
+	{
+		m_h264SPS.resize(s_h264MaxSPS);
+		m_h264PPS.resize(s_h264MaxPPS);
+		m_spsSeen.resize(s_h264MaxSPS);
+		m_ppsSeen.resize(s_h264MaxPPS);
+	}
+	else
+	{
+		m_hevcVPS.resize(s_hevcMaxVPS);
+		m_hevcSPS.resize(s_hevcMaxSPS);
+		m_hevcPPS.resize(s_hevcMaxPPS);
+		m_vpsSeen.resize(s_hevcMaxVPS);
+		m_spsSeen.resize(s_hevcMaxSPS);
+		m_ppsSeen.resize(s_hevcMaxPPS);
+	}
+}
+
+
+
+/**
+ * @brief Parses an access unit: remembers its parameter sets and reads the first slice header.
+ * @param annexB The access unit in Annex-B format, e.g. as the encoder returns it.
+ * @param size
+ * @param info Receives what was found.
+ * @return False if there is no slice, or the first one could not be parsed.
+ */
+bool BitstreamParser::Parse(const uint8_t* annexB, size_t size, BitstreamFrameInfo& info)
+{
+	info = BitstreamFrameInfo();
+
+	const uint8_t* end = annexB + size;
+	const uint8_t* nal = nullptr;
+	SliceHeader slice;
+	bool parsed = false;
+
+	for (const uint8_t* p = FindStartCode(annexB, end); ; p = FindStartCode(p + 3, end))
+	{
+		// The zero_byte of a four byte start code belongs to the next one, trailing zeros to none
+		const uint8_t* nalEnd = p;
+		while (nal && nalEnd > nal && nalEnd[-1] == 0)
+			--nalEnd;
+
+		if (nal && nalEnd > nal)
+		{
+			size_t nalSize = static_cast<size_t>(nalEnd - nal);
+			uint8_t type = (m_codec == CODEC_HEVC) ? ((nal[0] >> 1) & 0x3f) : (nal[0] & 0x1f);
+			bool vcl = (m_codec == CODEC_HEVC) ? type < 32 : (type >= 1 && type <= 5);
+
+			if (vcl)
+			{
+				if (++info.slices == 1 && ParseSlice(nal, nalSize, slice))
+				{
+					parsed = true;
+
+					if (m_codec == CODEC_HEVC)
+					{
+						const HEVCSPS* sps = GetHEVCSPS(GetHEVCPPS(slice.ppsId)->spsId);
+						info.profile = sps->profileTierLevel.profile;
+						info.level = sps->profileTierLevel.level;
+						info.width = sps->width;
+						info.height = sps->height;
+						info.bitDepth = sps->bitDepthLuma;
+						info.temporalId = (nalSize > 1 && (nal[1] & 0x07) != 0) ? (nal[1] & 0x07) - 1 : 0;
+					}
+					else
+					{
+						const H264SPS* sps = GetH264SPS(GetH264PPS(slice.ppsId)->spsId);
+						info.profile = sps->profile;
+						info.level = sps->level;
+						info.width = sps->width;
+						info.height = sps->height;
+						info.bitDepth = sps->bitDepthLuma;
+					}
+
+					bool sync = (m_codec == CODEC_HEVC) ? (type >= 16 && type <= 23) : type == s_h264NalIDR;
+					switch (slice.type)
+					{
+					case SliceHeader::TYPE_I:
+						info.type = sync ? BitstreamFrameInfo::TYPE_IDR : BitstreamFrameInfo::TYPE_I;
+						break;
+					case SliceHeader::TYPE_P:
+						info.type = BitstreamFrameInfo::TYPE_P;
+						break;
+					case SliceHeader::TYPE_B:
+						info.type = BitstreamFrameInfo::TYPE_B;
+						break;
+					}
+					info.qp = slice.qp;
+				}
+			}
+			else if (ParseNAL(nal, nalSize))
+			{
+				info.parameterSets = true;
+			}
+		}
+
+		if (p == end)
+			break;
+
+		nal = p + 3;
+	}
+
+	return parsed;
+}
+
+
+
+/**
+ * @brief Remembers a parameter set; other NAL units are ignored.
+ * @param nal The NAL unit, without start code.
+ * @param size
+ * @return True if it was a parameter set and could be parsed.
+ */
+bool BitstreamParser::ParseNAL(const uint8_t* nal, size_t size)
+{
+	if (size < 1)
+		return false;
+
+	if (m_codec == CODEC_H264)
+	{
+		switch (nal[0] & 0x1f)
+		{
+		case s_h264NalSPS:
+		{
+			H264SPS sps;
+			if (!ParseH264SPS(nal, size, sps))
+				return false;
+			m_h264SPS[sps.id] = sps;
+			m_spsSeen[sps.id] = true;
+			return true;
+		}
+		case s_h264NalPPS:
+		{
+			H264PPS pps;
+			if (!ParseH264PPS(nal, size, pps))
+				return false;
+			m_h264PPS[pps.id] = pps;
+			m_ppsSeen[pps.id] = true;
+			return true;
+		}
+		default:
+			return false;
+		}
+	}
+
+	switch ((nal[0] >> 1) & 0x3f)
+	{
+	case s_hevcNalVPS:
+	{
+		HEVCVPS vps;
+		if (!ParseHEVCVPS(nal, size, vps))
+			return false;
+		m_hevcVPS[vps.id] = vps;
+		m_vpsSeen[vps.id] = true;
+		return true;
+	}
+	case s_hevcNalSPS:
+	{
+		HEVCSPS sps;
+		if (!ParseHEVCSPS(nal, size, sps))
+			return false;
+		m_hevcSPS[sps.id] = sps;
+		m_spsSeen[sps.id] = true;
+		return true;
+	}
+	case s_hevcNalPPS:
+	{
+		HEVCPPS pps;
+		if (!ParseHEVCPPS(nal, size, pps))
+			return false;
+		m_hevcPPS[pps.id] = pps;
+		m_ppsSeen[pps.id] = true;
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+
+
+/**
+ * @brief Parses a slice header with the parameter sets seen so far.
+ * @param nal The NAL unit, without start code.
+ * @param size
+ * @param slice Receives the fields.
+ * @return
+ */
+bool BitstreamParser::ParseSlice(const uint8_t* nal, size_t size, SliceHeader& slice) const
+{
+	return (m_codec == CODEC_HEVC) ? ParseHEVCSlice(nal, size, slice) : ParseH264Slice(nal, size, slice);
+}
+
+
+
+const H264SPS* BitstreamParser::GetH264SPS(uint32_t id) const
+{
+	return (id < m_h264SPS.size() && m_spsSeen[id]) ? &m_h264SPS[id] : nullptr;
+}
+
+const H264PPS* BitstreamParser::GetH264PPS(uint32_t id) const
+{
+	return (id < m_h264PPS.size() && m_ppsSeen[id]) ? &m_h264PPS[id] : nullptr;
+}
+
+const HEVCVPS* BitstreamParser::GetHEVCVPS(uint32_t id) const
+{
+	return (id < m_hevcVPS.size() && m_vpsSeen[id]) ? &m_hevcVPS[id] : nullptr;
+}
+
+const HEVCSPS* BitstreamParser::GetHEVCSPS(uint32_t id) const
+{
+	return (id < m_hevcSPS.size() && m_spsSeen[id]) ? &m_hevcSPS[id] : nullptr;
+}
+
+const HEVCPPS* BitstreamParser::GetHEVCPPS(uint32_t id) const
+{
+	return (id < m_hevcPPS.size() && m_ppsSeen[id]) ? &m_hevcPPS[id] : nullptr;
+}
@@ -0,0 +1,322 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+
+/**
+ * @brief Reads fixed-length fields and Exp-Golomb codes from an RBSP (emulation prevention removed).
+ * Reading past the end, or an Exp-Golomb code longer than 32 bits, yields zeros and marks the reader as
+ * failed, so parsers only need to check once at the end.
+ */
+class BitReader
+{
+public:
+	BitReader(const uint8_t* data, size_t size) : m_data(data), m_size(size) {}
+
+	uint32_t ReadBits(uint32_t count);          // Up to 32 bits
+	bool ReadFlag() { return ReadBits(1) != 0; }
+	void SkipBits(size_t count);
+	uint32_t ReadUE();
+	int32_t ReadSE();
+
+	bool IsByteAligned() const { return (m_position & 7) == 0; }
+	size_t GetBitPosition() const { return m_position; }
+	bool HasError() const { return m_error; }
+	bool HasMoreRBSPData() const;
+
+private:
+	uint64_t Peek() const;
+
+private:
+	const uint8_t* m_data;
+	size_t m_size;
+	size_t m_position = 0;
+	bool m_error = false;
+};
+
+
+
+/**
+ * @brief general_profile_space to general_level_idc of an HEVC profile_tier_level().
+ */
+struct HEVCProfileTierLevel
+{
+	uint8_t profileSpace = 0;
+	bool tier = false;
+	uint8_t profile = 0;
+	uint32_t compatibilityFlags = 0;
+	uint8_t level = 0;                      // 30 times the level number
+
+	// The same fields as coded (12 bytes), as hvcC repeats them
+	uint8_t bytes[12] = {};
+};
+
+
+
+/**
+ * @brief H.264 sequence parameter set, up to the VUI timing information.
+ */
+struct H264SPS
+{
+	uint8_t profile = 0;
+	uint8_t constraintFlags = 0;            // constraint_set0_flag in the most significant bit
+	uint8_t level = 0;                      // 10 times the level number
+	uint32_t id = 0;
+	uint32_t chromaFormat = 1;
+	bool separateColourPlane = false;
+	uint32_t bitDepthLuma = 8;
+	uint32_t bitDepthChroma = 8;
+	uint32_t log2MaxFrameNum = 4;
+	uint32_t picOrderCntType = 0;
+	uint32_t log2MaxPicOrderCntLsb = 4;
+	bool deltaPicOrderAlwaysZero = false;
+	uint32_t maxNumRefFrames = 0;
+	bool frameMbsOnly = true;
+	uint32_t width = 0;                     // Luma samples, after cropping
+	uint32_t height = 0;
+
+	bool fullRange = false;
+	uint8_t colourPrimaries = 2;            // 2 = unspecified
+	uint8_t transferCharacteristics = 2;
+	uint8_t matrixCoefficients = 2;
+	uint32_t numUnitsInTick = 0;            // 0 without timing information
+	uint32_t timeScale = 0;
+};
+
+
+
+/**
+ * @brief H.264 picture parameter set, as far as slice headers depend on it.
+ */
+struct H264PPS
+{
+	uint32_t id = 0;
+	uint32_t spsId = 0;
+	bool entropyCodingMode = false;         // CABAC
+	bool bottomFieldPicOrderInFramePresent = false;
+	uint32_t numRefIdxL0DefaultActive = 1;
+	uint32_t numRefIdxL1DefaultActive = 1;
+	bool weightedPred = false;
+	uint32_t weightedBipredIdc = 0;
+	int32_t picInitQp = 26;
+	int32_t chromaQpIndexOffset = 0;
+	bool deblockingFilterControlPresent = false;
+	bool redundantPicCntPresent = false;
+	bool transform8x8Mode = false;
+};
+
+
+
+/**
+ * @brief Short-term reference picture set of an HEVC SPS or slice header: the POC deltas of the
+ * negative pictures, then those of the positive ones.
+ */
+struct HEVCShortTermRefPicSet
+{
+	uint8_t numNegative = 0;
+	uint8_t numPositive = 0;
+	uint16_t usedByCurrPic = 0;             // One bit per delta, in the same order
+	int32_t deltaPoc[16] = {};
+
+	uint32_t GetNumDeltaPocs() const { return numNegative + numPositive; }
+	uint32_t GetNumUsedByCurrPic() const;
+};
+
+
+
+/**
+ * @brief HEVC video parameter set, up to the profile_tier_level.
+ */
+struct HEVCVPS
+{
+	uint32_t id = 0;
+	uint32_t maxSubLayers = 1;
+	bool temporalIdNesting = false;
+	HEVCProfileTierLevel profileTierLevel;
+};
+
+
+
+/**
+ * @brief HEVC sequence parameter set, up to the VUI timing information.
+ */
+struct HEVCSPS
+{
+	uint32_t vpsId = 0;
+	uint32_t maxSubLayers = 1;
+	bool temporalIdNesting = false;
+	HEVCProfileTierLevel profileTierLevel;
+	uint32_t id = 0;
+	uint32_t chromaFormat = 1;
+	bool separateColourPlane = false;
+	uint32_t width = 0;                     // Luma samples, after the conformance window
+	uint32_t height = 0;
+	uint32_t codedWidth = 0;
+	uint32_t codedHeight = 0;
+	uint32_t bitDepthLuma = 8;
+	uint32_t bitDepthChroma = 8;
+	uint32_t log2MaxPicOrderCntLsb = 4;
+	uint32_t log2MinCodingBlockSize = 3;
+	uint32_t log2CtbSize = 4;
+	bool sampleAdaptiveOffset = false;
+	uint32_t numShortTermRefPicSets = 0;
+	HEVCShortTermRefPicSet shortTermRefPicSets[64];
+	bool longTermRefPicsPresent = false;
+	uint32_t numLongTermRefPics = 0;
+	uint32_t longTermUsedByCurrPic = 0;     // One bit per lt_ref_pic_poc_lsb_sps
+	bool temporalMvp = false;
+
+	bool fullRange = false;
+	uint8_t colourPrimaries = 2;
+	uint8_t transferCharacteristics = 2;
+	uint8_t matrixCoefficients = 2;
+	uint32_t numUnitsInTick = 0;
+	uint32_t timeScale = 0;
+};
+
+
+
+/**
+ * @brief HEVC picture parameter set, as far as slice headers depend on it.
+ */
+struct HEVCPPS
+{
+	uint32_t id = 0;
+	uint32_t spsId = 0;
+	bool dependentSliceSegments = false;
+	bool outputFlagPresent = false;
+	uint32_t numExtraSliceHeaderBits = 0;
+	bool cabacInitPresent = false;
+	uint32_t numRefIdxL0DefaultActive = 1;
+	uint32_t numRefIdxL1DefaultActive = 1;
+	int32_t initQp = 26;
+	bool cuQpDelta = false;
+	bool weightedPred = false;
+	bool weightedBipred = false;
+	bool tiles = false;
+	bool entropyCodingSync = false;
+	bool listsModificationPresent = false;
+};
+
+
+
+/**
+ * @brief Slice (segment) header fields common to both codecs, up to and including the QP.
+ */
+struct SliceHeader
+{
+	enum Type
+	{
+		TYPE_P,
+		TYPE_B,
+		TYPE_I
+	};
+
+	Type type = TYPE_I;
+	uint32_t ppsId = 0;
+	bool firstInPicture = true;
+	bool dependent = false;                 // HEVC dependent slice segment, which has no header of its own
+	uint32_t frameNum = 0;                  // H.264 only
+	uint32_t picOrderCntLsb = 0;
+	uint32_t numRefIdxL0Active = 0;
+	uint32_t numRefIdxL1Active = 0;
+	int32_t qp = 26;                        // SliceQpY
+};
+
+
+
+/**
+ * @brief What an encoded access unit is, read from its parameter sets and first slice header.
+ */
+struct BitstreamFrameInfo
+{
+	enum Type
+	{
+		TYPE_UNKNOWN,
+		TYPE_IDR,                           // IDR, or any IRAP picture for HEVC
+		TYPE_I,
+		TYPE_P,
+		TYPE_B
+	};
+
+	Type type = TYPE_UNKNOWN;
+	int32_t qp = 0;                         // Of the first slice
+	uint32_t slices = 0;
+	uint8_t temporalId = 0;
+	bool parameterSets = false;             // The access unit carries parameter sets
+
+	// From the active SPS
+	uint8_t profile = 0;
+	uint8_t level = 0;
+	uint32_t width = 0;
+	uint32_t height = 0;
+	uint32_t bitDepth = 0;
+};
+
+
+
+/**
+ * @brief Parses H.264 and HEVC parameter sets and slice headers without a decoder, e.g. to read
+ * profile, level, resolution, frame type and QP from the encoder's output.
+ *
+ * A parser keeps the parameter sets it has seen, so slice headers can be interpreted. Parsing does
+ * not allocate: NAL units are only unescaped as far as the headers go, into a fixed buffer. The start
+ * code and emulation prevention searches use SSE2/AVX2 (NEON on ARM64) when the CPU supports them.
+ */
+class BitstreamParser
+{
+public:
+	enum Codec
+	{
+		CODEC_H264,
+		CODEC_HEVC
+	};
+
+	BitstreamParser(Codec codec);
+
+	BitstreamParser(const BitstreamParser&) = delete;
+	BitstreamParser& operator=(const BitstreamParser&) = delete;
+
+	bool Parse(const uint8_t* annexB, size_t size, BitstreamFrameInfo& info);
+	bool ParseNAL(const uint8_t* nal, size_t size);
+	bool ParseSlice(const uint8_t* nal, size_t size, SliceHeader& slice) const;
+
+	Codec GetCodec() const { return m_codec; }
+	const H264SPS* GetH264SPS(uint32_t id) const;
+	const H264PPS* GetH264PPS(uint32_t id) const;
+	const HEVCVPS* GetHEVCVPS(uint32_t id) const;
+	const HEVCSPS* GetHEVCSPS(uint32_t id) const;
+	const HEVCPPS* GetHEVCPPS(uint32_t id) const;
+
+	static bool ParseH264SPS(const uint8_t* nal, size_t size, H264SPS& sps);
+	static bool ParseH264PPS(const uint8_t* nal, size_t size, H264PPS& pps);
+	static bool ParseHEVCVPS(const uint8_t* nal, size_t size, HEVCVPS& vps);
+	static bool ParseHEVCSPS(const uint8_t* nal, size_t size, HEVCSPS& sps);
+	static bool ParseHEVCPPS(const uint8_t* nal, size_t size, HEVCPPS& pps);
+
+	static const uint8_t* FindStartCode(const uint8_t* p, const uint8_t* end);
+	static size_t RemoveEmulationPrevention(const uint8_t* data, size_t size, uint8_t* rbsp, size_t capacity);
+
+	// Bytes of a NAL unit that are unescaped for parsing; more than any header needs
+	static const size_t s_maxHeaderSize = 4096;
+
+private:
+	bool ParseH264Slice(const uint8_t* nal, size_t size, SliceHeader& slice) const;
+	bool ParseHEVCSlice(const uint8_t* nal, size_t size, SliceHeader& slice) const;
+
+private:
+	Codec m_codec;
+
+	// Indexed by parameter set ID, sized for the largest ID the codec allows; only the ones marked
+	// as seen are valid
+	std::vector<H264SPS> m_h264SPS;
+	std::vector<H264PPS> m_h264PPS;
+	std::vector<HEVCVPS> m_hevcVPS;
+	std::vector<HEVCSPS> m_hevcSPS;
+	std::vector<HEVCPPS> m_hevcPPS;
+	std::vector<bool> m_spsSeen;
+	std::vector<bool> m_ppsSeen;
+	std::vector<bool> m_vpsSeen;
+};
@@ -0,0 +1,550 @@
+#include "CMAFPackager.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cmath>
+#include <ctime>
+#include <stdexcept>
+
+
+/**
+ * @brief Creates or replaces a resource.
+ * @param name
+ * @param data
+ * @param size
+ */
+void MemorySegmentStore::Put(const std::string& name, const uint8_t* data, size_t size)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_resources[name].assign(data, data + size);
+}
+
+
+
+void MemorySegmentStore::Append(const std::string& name, const uint8_t* data, size_t size)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	std::vector<uint8_t>& resource = m_resources[name];
+	resource.insert(resource.end(), data, data + size);
+}
+
+
+
+void MemorySegmentStore::Remove(const std::string& name)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_resources.erase(name);
+}
+
+
+
+/**
+ * @brief Copies a resource, or what it has grown to so far.
+ * @param name
+ * @param data Receives the resource from offset on.
+ * @param offset
+ * @return false if there is no such resource.
+ */
+bool MemorySegmentStore::Get(const std::string& name, std::vector<uint8_t>& data, size_t offset) const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	auto it = m_resources.find(name);
+	if (it == m_resources.end())
+		return false;
+
+	offset = (std::min)(offset, it->second.size());
+	data.assign(it->second.begin() + offset, it->second.end());
+	return true;
+}
+
+
+
+FileSegmentStore::FileSegmentStore(const std::string& directory):
+	m_directory(directory)
+{
+	if (!m_directory.empty() && m_directory.back() != '/' && m_directory.back() != '\\')
+		m_directory += '/';
+}
+
+
+
+void FileSegmentStore::Put(const std::string& name, const uint8_t* data, size_t size)
+{
+	if (name == m_appendName)
+	{
+		m_appendFile.close();
+		m_appendName.clear();
+	}
+
+	std::string path = GetPath(name);
+	std::string temporaryPath = path + ".tmp";
+
+	{
+		std::ofstream file(temporaryPath, std::ios::out | std::ios::binary | std::ios::trunc);
+		file.write((const char*) data, size);
+		if (!file)
+			throw std::runtime_error("Failed to write " + temporaryPath);
+	}
+
+#ifdef _WIN32
+	// rename() does not replace existing files on Windows
+	std::remove(path.c_str());
+#endif
+	if (std::rename(temporaryPath.c_str(), path.c_str()) != 0)
+		throw std::runtime_error("Failed to replace " + path);
+}
+
+
+
+void FileSegmentStore::Append(const std::string& name, const uint8_t* data, size_t size)
+{
+	if (name != m_appendName)
+	{
+		m_appendFile.close();
+		m_appendFile.clear();
+		m_appendFile.open(GetPath(name), std::ios::out | std::ios::binary | std::ios::app);
+		m_appendName = name;
+	}
+
+	m_appendFile.write((const char*) data, size);
+	m_appendFile.flush();
+
+	if (!m_appendFile)
+		throw std::runtime_error("Failed to append to " + GetPath(name));
+}
+
+
+
+void FileSegmentStore::Remove(const std::string& name)
+{
+	if (name == m_appendName)
+	{
+		m_appendFile.close();
+		m_appendName.clear();
+	}
+
+	std::remove(GetPath(name).c_str());
+}
+
+
+
+std::string FileSegmentStore::GetPath(const std::string& name) const
+{
+	return m_directory + name;
+}
+
+
+
+
+/**
+ * @brief Formats a point in time as xs:dateTime (UTC).
+ */
+static std::string FormatDateTime(std::chrono::system_clock::time_point time)
+{
+	time_t seconds = std::chrono::system_clock::to_time_t(time);
+	int milliseconds = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(time.time_since_epoch()).count() % 1000);
+
+	tm utc;
+#ifdef _WIN32
+	gmtime_s(&utc, &seconds);
+#else
+	gmtime_r(&seconds, &utc);
+#endif
+
+	// Sized for any int the fields could hold, not just valid dates
+	char text[64];
+	snprintf(text, sizeof(text), "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ",
+		utc.tm_year + 1900, utc.tm_mon + 1, utc.tm_mday, utc.tm_hour, utc.tm_min, utc.tm_sec, milliseconds);
+	return text;
+}
+
+static std::string FormatSeconds(double seconds)
+{
+	char text[32];
+	snprintf(text, sizeof(text), "%.3f", seconds);
+	return text;
+}
+
+
+
+CMAFPackager::CMAFPackager(const std::shared_ptr<SegmentStore>& store):
+	CMAFPackager(store, Options())
+{
+
+}
+
+
+
+/**
+ * @brief Constructor.
+ * @param store Receives all resources.
+ * @param options
+ */
+CMAFPackager::CMAFPackager(const std::shared_ptr<SegmentStore>& store, const Options& options):
+	m_store(store),
+	m_options(options)
+{
+	if (!m_store)
+		throw std::runtime_error("CMAF packager needs a segment store");
+
+	m_options.windowSegments = (std::max)(m_options.windowSegments, 1u);
+	m_options.partDuration = (std::max)(m_options.partDuration, 1u);
+	m_options.segmentDuration = (std::max)(m_options.segmentDuration, m_options.partDuration);
+}
+
+
+
+/**
+ * @brief Packages a frame, timed by the muxer's frame rate. Segments and playlists are updated
+ * whenever a CMAF chunk is complete.
+ * @param frame Access unit in Annex-B format.
+ * @param size
+ * @param width
+ * @param height
+ */
+void CMAFPackager::Write(const uint8_t* frame, size_t size, uint32_t width, uint32_t height)
+{
+	WriteSample(frame, size, width, height, false, 0);
+}
+
+
+
+/**
+ * @brief Packages a frame with its presentation timestamp, see MP4::Wrap().
+ * @param frame Access unit in Annex-B format.
+ * @param size
+ * @param width
+ * @param height
+ * @param timestamp In the muxer's time base.
+ */
+void CMAFPackager::Write(const uint8_t* frame, size_t size, uint32_t width, uint32_t height, uint64_t timestamp)
+{
+	WriteSample(frame, size, width, height, true, timestamp);
+}
+
+
+
+void CMAFPackager::Write(const std::vector<uint8_t>& frame, uint32_t width, uint32_t height)
+{
+	Write(frame.data(), frame.size(), width, height);
+}
+
+
+
+void CMAFPackager::WriteSample(const uint8_t* frame, size_t size, uint32_t width, uint32_t height, bool hasTimestamp, uint64_t timestamp)
+{
+	if (m_closed)
+		throw std::runtime_error("CMAF packager is already closed");
+
+	if (!m_mp4)
+	{
+		m_mp4.reset(new MP4());
+		m_mp4->SetFileType(true);
+		if (m_options.setupMuxer)
+			m_options.setupMuxer(*m_mp4);
+
+		// Chunks never span a sync sample, so every segment boundary is a chunk boundary
+		m_mp4->SetFragmentSize(0, m_options.partDuration);
+		m_mp4->SetKeyframeAlignedFragments(true);
+
+		m_width = width;
+		m_height = height;
+		m_availabilityStartTime = std::chrono::system_clock::now();
+	}
+
+	if (MP4::IsSyncSample(frame, size, m_mp4->GetCodec()))
+		m_keyframePending = true;
+
+	if (hasTimestamp)
+		m_mp4->WrapChunks(frame, size, width, height, timestamp, m_chunks);
+	else
+		m_mp4->WrapChunks(frame, size, width, height, m_chunks);
+	AddFragments(m_chunks);
+}
+
+
+
+/**
+ * @brief Whether the open segment has reached its target duration, so the next frame should be an IDR
+ * (e.g. Encoder::Encode() with iFrame set) to start the next one.
+ * @return
+ */
+bool CMAFPackager::IsKeyframeDue() const
+{
+	// The keyframe that starts the next segment may already be in the open fragment
+	if (!m_mp4 || m_keyframePending || m_segments.empty() || m_segments.back().complete)
+		return false;
+
+	uint64_t target = static_cast<uint64_t>(m_options.segmentDuration) * m_mp4->GetTimescale();
+	return (m_mp4->GetDecodeEndTime() - m_segments.back().startTime) * 1000 >= target;
+}
+
+
+
+/**
+ * @brief Completes the last segment and marks the playlists as ended.
+ */
+void CMAFPackager::Close()
+{
+	if (m_closed)
+		return;
+
+	if (m_mp4)
+	{
+		m_mp4->FlushChunks(m_chunks);
+		AddFragments(m_chunks);
+	}
+
+	if (!m_segments.empty() && !m_segments.back().complete)
+		FinishSegment();
+
+	m_closed = true;
+	UpdatePlaylists();
+}
+
+
+
+/**
+ * @brief Gets the name of a media segment.
+ * @param number
+ * @return
+ */
+std::string CMAFPackager::GetSegmentName(uint64_t number) const
+{
+	return m_options.name + "_" + std::to_string(number) + ".m4s";
+}
+
+
+
+/**
+ * @brief Stores the init segment and distributes the fragments of the last muxer call to segments.
+ * @param chunks The muxer's output, described by MP4::GetEmittedFragments().
+ */
+void CMAFPackager::AddFragments(const std::vector<MP4Chunk>& chunks)
+{
+	m_buffer.clear();
+	for (const MP4Chunk& chunk : chunks)
+		m_buffer.insert(m_buffer.end(), chunk.data, chunk.data + chunk.size);
+
+	size_t position = 0;
+	if (!m_initWritten && !m_mp4->GetInitSegment().empty())
+	{
+		const std::vector<uint8_t>& init = m_mp4->GetInitSegment();
+		m_store->Put(m_options.name + "_init.mp4", init.data(), init.size());
+
+		position = init.size();
+		m_initWritten = true;
+	}
+
+	const std::vector<MP4FragmentInfo>& fragments = m_mp4->GetEmittedFragments();
+	for (const MP4FragmentInfo& fragment : fragments)
+	{
+		uint64_t target = static_cast<uint64_t>(m_options.segmentDuration) * m_mp4->GetTimescale();
+		if (m_segments.empty() || m_segments.back().complete || (fragment.sync && m_segments.back().duration * 1000 >= target))
+		{
+			if (!m_segments.empty() && !m_segments.back().complete)
+			{
+				// The last frame's duration was an estimate; the next segment's start is exact
+				m_segments.back().duration = fragment.decodeTime - m_segments.back().startTime;
+				FinishSegment();
+			}
+			StartSegment(fragment.decodeTime);
+		}
+
+		// Fragments are keyframe aligned, so a sync sample starts one
+		if (fragment.sync)
+			m_keyframePending = false;
+
+		Segment& segment = m_segments.back();
+		m_store->Append(GetSegmentName(segment.number), m_buffer.data() + position, fragment.size);
+
+		segment.parts.push_back({ segment.size, fragment.size, fragment.duration, fragment.sync });
+		segment.size += fragment.size;
+		segment.duration += fragment.duration;
+		position += fragment.size;
+	}
+
+	if (!fragments.empty())
+		UpdatePlaylists();
+}
+
+
+
+/**
+ * @brief Opens a new segment with its styp.
+ * @param time Decode time of the segment's first sample.
+ */
+void CMAFPackager::StartSegment(uint64_t time)
+{
+	Segment segment;
+	segment.number = m_nextSegment++;
+	segment.startTime = time;
+
+	std::vector<uint8_t> styp;
+	MP4::WriteSegmentType(styp);
+	m_store->Put(GetSegmentName(segment.number), styp.data(), styp.size());
+	segment.size = styp.size();
+
+	m_segments.push_back(std::move(segment));
+}
+
+
+
+/**
+ * @brief Completes the open segment and drops the segments that fell out of the window.
+ */
+void CMAFPackager::FinishSegment()
+{
+	Segment& segment = m_segments.back();
+	segment.complete = true;
+	m_maxSegmentDuration = (std::max)(m_maxSegmentDuration, segment.duration);
+
+	size_t complete = m_segments.size();
+	while (complete > m_options.windowSegments)
+	{
+		m_store->Remove(GetSegmentName(m_segments.front().number));
+		m_segments.pop_front();
+		--complete;
+	}
+}
+
+
+
+void CMAFPackager::UpdatePlaylists()
+{
+	if (m_options.hls)
+	{
+		m_playlist = BuildPlaylist();
+		m_store->Put(m_options.name + ".m3u8", (const uint8_t*) m_playlist.data(), m_playlist.size());
+	}
+
+	if (m_options.dash)
+	{
+		m_manifest = BuildManifest();
+		m_store->Put(m_options.name + ".mpd", (const uint8_t*) m_manifest.data(), m_manifest.size());
+	}
+}
+
+
+
+/**
+ * @brief Builds the LL-HLS media playlist. Parts are listed for the last three segments, as the spec
+ * asks for parts within three target durations of the live edge.
+ * @return
+ */
+std::string CMAFPackager::BuildPlaylist() const
+{
+	double timescale = m_mp4 ? m_mp4->GetTimescale() : 1.0;
+	double partTarget = m_options.partDuration / 1000.0;
+
+	uint64_t targetDuration = (std::max)(static_cast<uint64_t>(std::ceil(m_options.segmentDuration / 1000.0)),
+	                                     static_cast<uint64_t>(std::ceil(m_maxSegmentDuration / timescale)));
+
+	std::string playlist;
+	playlist += "#EXTM3U\n";
+	playlist += "#EXT-X-VERSION:9\n";
+	playlist += "#EXT-X-TARGETDURATION:" + std::to_string(targetDuration) + "\n";
+	playlist += "#EXT-X-PART-INF:PART-TARGET=" + FormatSeconds(partTarget) + "\n";
+	playlist += "#EXT-X-SERVER-CONTROL:CAN-BLOCK-RELOAD=YES,PART-HOLD-BACK=" + FormatSeconds(3 * partTarget) + "\n";
+	playlist += "#EXT-X-MEDIA-SEQUENCE:" + std::to_string(m_segments.empty() ? 0 : m_segments.front().number) + "\n";
+	playlist += "#EXT-X-MAP:URI=\"" + m_options.name + "_init.mp4\"\n";
+
+	for (size_t i = 0; i < m_segments.size(); ++i)
+	{
+		const Segment& segment = m_segments[i];
+		std::string name = GetSegmentName(segment.number);
+
+		if (i + 3 >= m_segments.size())
+		{
+			for (const Part& part : segment.parts)
+			{
+				playlist += "#EXT-X-PART:DURATION=" + FormatSeconds(part.duration / timescale) + ",URI=\"" + name + "\"" +
+				            ",BYTERANGE=\"" + std::to_string(part.size) + "@" + std::to_string(part.offset) + "\"" +
+				            (part.independent ? ",INDEPENDENT=YES" : "") + "\n";
+			}
+		}
+
+		if (segment.complete)
+		{
+			playlist += "#EXTINF:" + FormatSeconds(segment.duration / timescale) + ",\n";
+			playlist += name + "\n";
+		}
+	}
+
+	if (m_closed)
+		playlist += "#EXT-X-ENDLIST\n";
+	else if (!m_segments.empty())
+	{
+		// The next part goes into the open segment, or starts a new one
+		const Segment& segment = m_segments.back();
+		uint64_t number = segment.complete ? segment.number + 1 : segment.number;
+		uint64_t offset = segment.complete ? 0 : segment.size;
+		playlist += "#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"" + GetSegmentName(number) + "\",BYTERANGE-START=" + std::to_string(offset) + "\n";
+	}
+
+	return playlist;
+}
+
+
+
+/**
+ * @brief Builds the DASH manifest with a SegmentTimeline of the complete segments in the window.
+ * @return
+ */
+std::string CMAFPackager::BuildManifest() const
+{
+	uint32_t timescale = m_mp4 ? m_mp4->GetTimescale() : 1;
+	double window = m_options.windowSegments * (m_options.segmentDuration / 1000.0);
+
+	// Average over the window; at least one bit per second keeps the attribute valid
+	uint64_t bytes = 0, duration = 0;
+	uint64_t firstNumber = m_nextSegment;
+	for (const Segment& segment : m_segments)
+	{
+		if (!segment.complete)
+			continue;
+		bytes += segment.size;
+		duration += segment.duration;
+		firstNumber = (std::min)(firstNumber, segment.number);
+	}
+	uint64_t bandwidth = (duration > 0) ? (std::max)(bytes * 8 * timescale / duration, (uint64_t) 1) : 1;
+
+	std::string manifest;
+	manifest += "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+	manifest += "<MPD xmlns=\"urn:mpeg:dash:schema:mpd:2011\" profiles=\"urn:mpeg:dash:profile:isoff-live:2011\"";
+	if (m_closed)
+		manifest += " type=\"static\"";
+	else
+	{
+		manifest += " type=\"dynamic\" availabilityStartTime=\"" + FormatDateTime(m_availabilityStartTime) + "\"";
+		manifest += " publishTime=\"" + FormatDateTime(std::chrono::system_clock::now()) + "\"";
+		manifest += " minimumUpdatePeriod=\"PT" + FormatSeconds(m_options.segmentDuration / 1000.0) + "S\"";
+		manifest += " timeShiftBufferDepth=\"PT" + FormatSeconds(window) + "S\"";
+	}
+	manifest += " minBufferTime=\"PT" + FormatSeconds(m_options.segmentDuration / 1000.0) + "S\">\n";
+
+	manifest += "  <Period id=\"0\" start=\"PT0S\">\n";
+	manifest += "    <AdaptationSet id=\"0\" contentType=\"video\" mimeType=\"video/mp4\" segmentAlignment=\"true\" startWithSAP=\"1\">\n";
+	manifest += "      <Representation id=\"0\" codecs=\"" + (m_mp4 ? m_mp4->GetCodecString() : std::string()) + "\"" +
+	            " width=\"" + std::to_string(m_width) + "\" height=\"" + std::to_string(m_height) + "\"" +
+	            " bandwidth=\"" + std::to_string(bandwidth) + "\">\n";
+	manifest += "        <SegmentTemplate timescale=\"" + std::to_string(timescale) + "\" initialization=\"" + m_options.name + "_init.mp4\"" +
+	            " media=\"" + m_options.name + "_$Number$.m4s\" startNumber=\"" + std::to_string(firstNumber) + "\">\n";
+	manifest += "          <SegmentTimeline>\n";
+
+	for (const Segment& segment : m_segments)
+	{
+		if (segment.complete)
+			manifest += "            <S t=\"" + std::to_string(segment.startTime) + "\" d=\"" + std::to_string(segment.duration) + "\"/>\n";
+	}
+
+	manifest += "          </SegmentTimeline>\n";
+	manifest += "        </SegmentTemplate>\n";
+	manifest += "      </Representation>\n";
+	manifest += "    </AdaptationSet>\n";
+	manifest += "  </Period>\n";
+	manifest += "</MPD>\n";
+
+	return manifest;
+}
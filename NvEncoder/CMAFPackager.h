@@ -0,0 +1,174 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <string>
+#include <mutex>
+#include <fstream>
+#include <functional>
+#include <unordered_map>
+#include <chrono>
+
+#include "mp4.h"
+
+
+/**
+ * @brief Destination for the packager's resources (init segment, media segments, playlists).
+ */
+class SegmentStore
+{
+public:
+	virtual ~SegmentStore() {}
+
+	virtual void Put(const std::string& name, const uint8_t* data, size_t size) = 0;
+	virtual void Append(const std::string& name, const uint8_t* data, size_t size) = 0;
+	virtual void Remove(const std::string& name) = 0;
+};
+
+
+
+/**
+ * @brief Keeps the resources in memory, for an HTTP server in the same process. Safe to read from
+ * other threads while the packager writes.
+ */
+class MemorySegmentStore : public SegmentStore
+{
+public:
+	void Put(const std::string& name, const uint8_t* data, size_t size) override;
+	void Append(const std::string& name, const uint8_t* data, size_t size) override;
+	void Remove(const std::string& name) override;
+
+	bool Get(const std::string& name, std::vector<uint8_t>& data, size_t offset = 0) const;
+
+private:
+	mutable std::mutex m_mutex;
+	std::unordered_map<std::string, std::vector<uint8_t>> m_resources;
+};
+
+
+
+/**
+ * @brief Writes the resources to a directory, e.g. one served by a regular web server. Replaced
+ * resources (playlists) are written to a temporary file and renamed over the old one.
+ */
+class FileSegmentStore : public SegmentStore
+{
+public:
+	FileSegmentStore(const std::string& directory);
+
+	void Put(const std::string& name, const uint8_t* data, size_t size) override;
+	void Append(const std::string& name, const uint8_t* data, size_t size) override;
+	void Remove(const std::string& name) override;
+
+private:
+	std::string GetPath(const std::string& name) const;
+
+private:
+	std::string m_directory;
+
+	// The segment being appended to stays open
+	std::string m_appendName;
+	std::ofstream m_appendFile;
+};
+
+
+
+/**
+ * @brief Packages an encoded stream for HTTP delivery as CMAF: one init segment, and media segments
+ * that start at sync samples and consist of CMAF chunks (one moof/mdat each, LL-HLS parts). A rolling
+ * LL-HLS playlist and a live DASH manifest (SegmentTimeline) are kept up to date in the store; only
+ * the last few segments are retained.
+ *
+ * Parts are addressed as byte ranges of their segment. Blocking playlist reloads (_HLS_msn/_HLS_part)
+ * are up to the HTTP server.
+ *
+ * Segments can only end at sync samples, and the encoder runs with an infinite GOP: the caller has to
+ * force an IDR whenever IsKeyframeDue() returns true, or segments never end.
+ */
+class CMAFPackager
+{
+public:
+	struct Options
+	{
+		std::string name = "stream";        // <name>.m3u8, <name>.mpd, <name>_init.mp4, <name>_<n>.m4s
+		uint32_t segmentDuration = 2000;    // Milliseconds; a segment ends at the first sync sample after that
+		uint32_t partDuration = 200;        // Milliseconds per CMAF chunk at most
+		uint32_t windowSegments = 6;        // Complete segments kept in the playlists and the store
+		bool hls = true;
+		bool dash = true;
+
+		// Called for the muxer before the first frame (codec, parameter sets); fragmenting is set by the packager
+		std::function<void(MP4&)> setupMuxer;
+	};
+
+	CMAFPackager(const std::shared_ptr<SegmentStore>& store);
+	CMAFPackager(const std::shared_ptr<SegmentStore>& store, const Options& options);
+
+	CMAFPackager(const CMAFPackager&) = delete;
+	CMAFPackager& operator=(const CMAFPackager&) = delete;
+
+	void Write(const uint8_t* frame, size_t size, uint32_t width, uint32_t height);
+	void Write(const uint8_t* frame, size_t size, uint32_t width, uint32_t height, uint64_t timestamp);
+	void Write(const std::vector<uint8_t>& frame, uint32_t width, uint32_t height);
+	void Close();
+
+	bool IsKeyframeDue() const;
+
+	const std::string& GetPlaylist() const { return m_playlist; }
+	const std::string& GetManifest() const { return m_manifest; }
+	std::string GetSegmentName(uint64_t number) const;
+
+private:
+	/**
+	 * @brief A CMAF chunk, as a byte range of its segment.
+	 */
+	struct Part
+	{
+		uint64_t offset;
+		uint32_t size;
+		uint32_t duration;
+		bool independent;
+	};
+
+	struct Segment
+	{
+		uint64_t number;
+		uint64_t startTime;
+		uint64_t duration = 0;
+		uint64_t size = 0;
+		std::vector<Part> parts;
+		bool complete = false;
+	};
+
+	void WriteSample(const uint8_t* frame, size_t size, uint32_t width, uint32_t height, bool hasTimestamp, uint64_t timestamp);
+	void AddFragments(const std::vector<MP4Chunk>& chunks);
+	void StartSegment(uint64_t time);
+	void FinishSegment();
+	void UpdatePlaylists();
+	std::string BuildPlaylist() const;
+	std::string BuildManifest() const;
+
+private:
+	std::shared_ptr<SegmentStore> m_store;
+	Options m_options;
+
+	std::unique_ptr<MP4> m_mp4;
+	std::vector<MP4Chunk> m_chunks;
+	std::vector<uint8_t> m_buffer;
+	uint32_t m_width = 0;
+	uint32_t m_height = 0;
+	bool m_initWritten = false;
+	bool m_closed = false;
+	bool m_keyframePending = false;         // A sync sample was written, its fragment is not out yet
+
+	std::deque<Segment> m_segments;
+	uint64_t m_nextSegment = 0;
+	uint64_t m_maxSegmentDuration = 0;
+	std::chrono::system_clock::time_point m_availabilityStartTime;
+
+	std::string m_playlist;
+	std::string m_manifest;
+};
@@ -0,0 +1,669 @@
+#include "ColorConversion.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define COLOR_CONVERSION_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__ARM_NEON) || defined(_M_ARM64)
+#define COLOR_CONVERSION_NEON
+#include <arm_neon.h>
+#endif
+
+// GCC/Clang only emit SIMD instructions in functions that ask for them; MSVC always does
+#if defined(__GNUC__)
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_SSE41
+#define TARGET_AVX2
+#endif
+
+
+// BT.709 full range in Q14. Each row sums to exactly 1.0 (luma) or 0.5 (chroma), so white/grey map
+// to neutral chroma without bias. Chroma is computed from the sum of a 2x2 block, i.e. in Q16.
+static const int16_t s_yR = 3483;
+static const int16_t s_yG = 11718;
+static const int16_t s_yB = 1183;
+
+static const int16_t s_uR = -1878;
+static const int16_t s_uG = -6314;
+static const int16_t s_uB = 8192;
+
+static const int16_t s_vR = 8192;
+static const int16_t s_vG = -7442;
+static const int16_t s_vB = -750;
+
+static const int32_t s_lumaRound = 1 << 13;
+static const int32_t s_chromaOffset = (128 << 16) + (1 << 15);
+
+
+typedef void (*LumaRowFunc)(const uint8_t* rgba, uint8_t* y, uint32_t width);
+typedef void (*ChromaRowI420Func)(const uint8_t* rgba0, const uint8_t* rgba1, uint32_t width, uint8_t* u, uint8_t* v);
+typedef void (*ChromaRowNV12Func)(const uint8_t* rgba0, const uint8_t* rgba1, uint32_t width, uint8_t* uv);
+
+struct KernelFunctions
+{
+	LumaRowFunc lumaRow;
+	ChromaRowI420Func chromaRowI420;
+	ChromaRowNV12Func chromaRowNV12;
+};
+
+
+
+/*
+ * Scalar reference. The SIMD kernels convert the bulk of a row and hand the remainder to these.
+ */
+
+static inline uint8_t ClampToByte(int32_t v)
+{
+	return static_cast<uint8_t>((std::min)(v, 255));
+}
+
+static void LumaRowScalar(const uint8_t* rgba, uint8_t* y, uint32_t begin, uint32_t width)
+{
+	for (uint32_t x = begin; x < width; ++x)
+	{
+		const uint8_t* p = rgba + 4 * x;
+		y[x] = static_cast<uint8_t>((s_yR * p[0] + s_yG * p[1] + s_yB * p[2] + s_lumaRound) >> 14);
+	}
+}
+
+/// Sums the 2x2 block of chroma sample cx; the last column is duplicated for odd widths
+static inline void SumBlock(const uint8_t* rgba0, const uint8_t* rgba1, uint32_t cx, uint32_t width, int32_t& r, int32_t& g, int32_t& b)
+{
+	uint32_t x0 = 2 * cx;
+	uint32_t x1 = (std::min)(x0 + 1, width - 1);
+
+	const uint8_t* a0 = rgba0 + 4 * x0;
+	const uint8_t* a1 = rgba0 + 4 * x1;
+	const uint8_t* b0 = rgba1 + 4 * x0;
+	const uint8_t* b1 = rgba1 + 4 * x1;
+
+	r = a0[0] + a1[0] + b0[0] + b1[0];
+	g = a0[1] + a1[1] + b0[1] + b1[1];
+	b = a0[2] + a1[2] + b0[2] + b1[2];
+}
+
+static void ChromaRowI420Scalar(const uint8_t* rgba0, const uint8_t* rgba1, uint32_t begin, uint32_t width, uint8_t* u, uint8_t* v)
+{
+	uint32_t chromaWidth = (width + 1) / 2;
+	for (uint32_t cx = begin; cx < chromaWidth; ++cx)
+	{
+		int32_t r, g, b;
+		SumBlock(rgba0, rgba1, cx, width, r, g, b);
+
+		u[cx] = ClampToByte((s_uR * r + s_uG * g + s_uB * b + s_chromaOffset) >> 16);
+		v[cx] = ClampToByte((s_vR * r + s_vG * g + s_vB * b + s_chromaOffset) >> 16);
+	}
+}
+
+static void ChromaRowNV12Scalar(const uint8_t* rgba0, const uint8_t* rgba1, uint32_t begin, uint32_t width, uint8_t* uv)
+{
+	uint32_t chromaWidth = (width + 1) / 2;
+	for (uint32_t cx = begin; cx < chromaWidth; ++cx)
+	{
+		int32_t r, g, b;
+		SumBlock(rgba0, rgba1, cx, width, r, g, b);
+
+		uv[2 * cx] = ClampToByte((s_uR * r + s_uG * g + s_uB * b + s_chromaOffset) >> 16);
+		uv[2 * cx + 1] = ClampToByte((s_vR * r + s_vG * g + s_vB * b + s_chromaOffset) >> 16);
+	}
+}
+
+static void LumaRowScalarFull(const uint8_t* rgba, uint8_t* y, uint32_t width)
+{
+	LumaRowScalar(rgba, y, 0, width);
+}
+
+static void ChromaRowI420ScalarFull(const uint8_t* rgba0, const uint8_t* rgba1, uint32_t width, uint8_t* u, uint8_t* v)
+{
+	ChromaRowI420Scalar(rgba0, rgba1, 0, width, u, v);
+}
+
+static void ChromaRowNV12ScalarFull(const uint8_t* rgba0, const uint8_t* rgba1, uint32_t width, uint8_t* uv)
+{
+	ChromaRowNV12Scalar(rgba0, rgba1, 0, width, uv);
+}
+
+static const KernelFunctions s_scalarKernel = { LumaRowScalarFull, ChromaRowI420ScalarFull, ChromaRowNV12ScalarFull };
+
+
+
+#if defined(COLOR_CONVERSION_X86)
+
+/*
+ * SSE4.1: pixels are widened to 16 bit so that pmaddwd yields R*cR + G*cG and B*cB per pixel,
+ * and a horizontal add finishes the dot product in 32 bit.
+ */
+
+/// Luma dot products of 4 pixels (16 bytes)
+TARGET_SSE41 static inline __m128i LumaQuadSSE41(const uint8_t* p, __m128i k)
+{
+	__m128i px = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+	__m128i lo = _mm_cvtepu8_epi16(px);
+	__m128i hi = _mm_cvtepu8_epi16(_mm_srli_si128(px, 8));
+	return _mm_hadd_epi32(_mm_madd_epi16(lo, k), _mm_madd_epi16(hi, k));
+}
+
+TARGET_SSE41 static void LumaRowSSE41(const uint8_t* rgba, uint8_t* y, uint32_t width)
+{
+	const __m128i k = _mm_setr_epi16(s_yR, s_yG, s_yB, 0, s_yR, s_yG, s_yB, 0);
+	const __m128i round = _mm_set1_epi32(s_lumaRound);
+
+	uint32_t x = 0;
+	for (; x + 16 <= width; x += 16)
+	{
+		const uint8_t* p = rgba + 4 * x;
+
+		__m128i y0 = _mm_srli_epi32(_mm_add_epi32(LumaQuadSSE41(p, k), round), 14);
+		__m128i y1 = _mm_srli_epi32(_mm_add_epi32(LumaQuadSSE41(p + 16, k), round), 14);
+		__m128i y2 = _mm_srli_epi32(_mm_add_epi32(LumaQuadSSE41(p + 32, k), round), 14);
+		__m128i y3 = _mm_srli_epi32(_mm_add_epi32(LumaQuadSSE41(p + 48, k), round), 14);
+
+		__m128i packed = _mm_packus_epi16(_mm_packs_epi32(y0, y1), _mm_packs_epi32(y2, y3));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(y + x), packed);
+	}
+
+	LumaRowScalar(rgba, y, x, width);
+}
+
+/// 2x2 block sums (R, G, B, A as 16 bit) of the two chroma samples covering 4 pixels of both rows
+TARGET_SSE41 static inline __m128i BlockSumPairSSE41(const uint8_t* p0, const uint8_t* p1)
+{
+	__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p0));
+	__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p1));
+
+	// Vertical sums: pixels 0,1 and pixels 2,3
+	__m128i s01 = _mm_add_epi16(_mm_cvtepu8_epi16(a), _mm_cvtepu8_epi16(b));
+	__m128i s23 = _mm_add_epi16(_mm_cvtepu8_epi16(_mm_srli_si128(a, 8)), _mm_cvtepu8_epi16(_mm_srli_si128(b, 8)));
+
+	// Horizontal sums: (0 + 1), (2 + 3)
+	return _mm_add_epi16(_mm_unpacklo_epi64(s01, s23), _mm_unpackhi_epi64(s01, s23));
+}
+
+/// Converts 4 chroma samples; returns U in bytes 0-3 and V in bytes 4-7
+TARGET_SSE41 static inline __m128i ChromaQuadSSE41(const uint8_t* p0, const uint8_t* p1, __m128i kU, __m128i kV, __m128i offset)
+{
+	__m128i c01 = BlockSumPairSSE41(p0, p1);
+	__m128i c23 = BlockSumPairSSE41(p0 + 16, p1 + 16);
+
+	__m128i u = _mm_hadd_epi32(_mm_madd_epi16(c01, kU), _mm_madd_epi16(c23, kU));
+	__m128i v = _mm_hadd_epi32(_mm_madd_epi16(c01, kV), _mm_madd_epi16(c23, kV));
+
+	u = _mm_srli_epi32(_mm_add_epi32(u, offset), 16);
+	v = _mm_srli_epi32(_mm_add_epi32(v, offset), 16);
+
+	__m128i uv16 = _mm_packs_epi32(u, v);
+	return _mm_packus_epi16(uv16, uv16);
+}
+
+TARGET_SSE41 static void ChromaRowI420SSE41(const uint8_t* rgba0, const uint8_t* rgba1, uint32_t width, uint8_t* u, uint8_t* v)
+{
+	const __m128i kU = _mm_setr_epi16(s_uR, s_uG, s_uB, 0, s_uR, s_uG, s_uB, 0);
+	const __m128i kV = _mm_setr_epi16(s_vR, s_vG, s_vB, 0, s_vR, s_vG, s_vB, 0);
+	const __m128i offset = _mm_set1_epi32(s_chromaOffset);
+
+	uint32_t cx = 0;
+	for (; 2 * cx + 8 <= width; cx += 4)
+	{
+		__m128i uv = ChromaQuadSSE41(rgba0 + 8 * cx, rgba1 + 8 * cx, kU, kV, offset);
+
+		int32_t u4 = _mm_cvtsi128_si32(uv);
+		int32_t v4 = _mm_cvtsi128_si32(_mm_srli_si128(uv, 4));
+		memcpy(u + cx, &u4, 4);
+		memcpy(v + cx, &v4, 4);
+	}
+
+	ChromaRowI420Scalar(rgba0, rgba1, cx, width, u, v);
+}
+
+TARGET_SSE41 static void ChromaRowNV12SSE41(const uint8_t* rgba0, const uint8_t* rgba1, uint32_t width, uint8_t* uv)
+{
+	const __m128i kU = _mm_setr_epi16(s_uR, s_uG, s_uB, 0, s_uR, s_uG, s_uB, 0);
+	const __m128i kV = _mm_setr_epi16(s_vR, s_vG, s_vB, 0, s_vR, s_vG, s_vB, 0);
+	const __m128i offset = _mm_set1_epi32(s_chromaOffset);
+
+	uint32_t cx = 0;
+	for (; 2 * cx + 8 <= width; cx += 4)
+	{
+		__m128i planar = ChromaQuadSSE41(rgba0 + 8 * cx, rgba1 + 8 * cx, kU, kV, offset);
+		__m128i interleaved = _mm_unpacklo_epi8(planar, _mm_srli_si128(planar, 4));
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(uv + 2 * cx), interleaved);
+	}
+
+	ChromaRowNV12Scalar(rgba0, rgba1, cx, width, uv);
+}
+
+static const KernelFunctions s_sse41Kernel = { LumaRowSSE41, ChromaRowI420SSE41, ChromaRowNV12SSE41 };
+
+
+
+/*
+ * AVX2: same arithmetic on 8 pixels per register for luma. Chroma is a quarter of the work and
+ * reuses the SSE4.1 rows.
+ */
+
+/// Luma dot products of 8 pixels (32 bytes), in the lane order Y0 Y1 Y4 Y5 | Y2 Y3 Y6 Y7
+TARGET_AVX2 static inline __m256i LumaOctAVX2(const uint8_t* p, __m256i k)
+{
+	__m256i lo = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+	__m256i hi = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16)));
+	return _mm256_hadd_epi32(_mm256_madd_epi16(lo, k), _mm256_madd_epi16(hi, k));
+}
+
+TARGET_AVX2 static void LumaRowAVX2(const uint8_t* rgba, uint8_t* y, uint32_t width)
+{
+	const __m256i k = _mm256_setr_epi16(s_yR, s_yG, s_yB, 0, s_yR, s_yG, s_yB, 0, s_yR, s_yG, s_yB, 0, s_yR, s_yG, s_yB, 0);
+	const __m256i round = _mm256_set1_epi32(s_lumaRound);
+
+	// Undoes the lane interleaving of hadd/packs: the packed bytes come out as 0 1 4 5 8 9 12 13 2 3 6 7 10 11 14 15
+	const __m128i order = _mm_setr_epi8(0, 1, 8, 9, 2, 3, 10, 11, 4, 5, 12, 13, 6, 7, 14, 15);
+
+	uint32_t x = 0;
+	for (; x + 16 <= width; x += 16)
+	{
+		const uint8_t* p = rgba + 4 * x;
+
+		__m256i y0 = _mm256_srli_epi32(_mm256_add_epi32(LumaOctAVX2(p, k), round), 14);
+		__m256i y1 = _mm256_srli_epi32(_mm256_add_epi32(LumaOctAVX2(p + 32, k), round), 14);
+
+		__m256i y16 = _mm256_packs_epi32(y0, y1);
+		__m128i packed = _mm_packus_epi16(_mm256_castsi256_si128(y16), _mm256_extracti128_si256(y16, 1));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(y + x), _mm_shuffle_epi8(packed, order));
+	}
+
+	LumaRowScalar(rgba, y, x, width);
+}
+
+static const KernelFunctions s_avx2Kernel = { LumaRowAVX2, ChromaRowI420SSE41, ChromaRowNV12SSE41 };
+
+
+
+static bool CpuHasSSE41()
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	return (info[2] & (1 << 19)) != 0;
+#else
+	return __builtin_cpu_supports("sse4.1") != 0;
+#endif
+}
+
+static bool CpuHasAVX2()
+{
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+
+	// AVX and OSXSAVE, plus the OS actually saving the YMM registers
+	if ((info[2] & (1 << 28)) == 0 || (info[2] & (1 << 27)) == 0)
+		return false;
+	if ((_xgetbv(0) & 0x6) != 0x6)
+		return false;
+
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+#endif // COLOR_CONVERSION_X86
+
+
+
+#if defined(COLOR_CONVERSION_NEON)
+
+/*
+ * NEON: vld4 deinterleaves the channels for free, so the dot products are plain multiply-accumulates.
+ */
+
+static inline uint8x8_t LumaOctNEON(uint8x8x4_t px)
+{
+	int16x8_t r = vreinterpretq_s16_u16(vmovl_u8(px.val[0]));
+	int16x8_t g = vreinterpretq_s16_u16(vmovl_u8(px.val[1]));
+	int16x8_t b = vreinterpretq_s16_u16(vmovl_u8(px.val[2]));
+
+	int32x4_t lo = vmull_n_s16(vget_low_s16(r), s_yR);
+	lo = vmlal_n_s16(lo, vget_low_s16(g), s_yG);
+	lo = vmlal_n_s16(lo, vget_low_s16(b), s_yB);
+
+	int32x4_t hi = vmull_n_s16(vget_high_s16(r), s_yR);
+	hi = vmlal_n_s16(hi, vget_high_s16(g), s_yG);
+	hi = vmlal_n_s16(hi, vget_high_s16(b), s_yB);
+
+	lo = vshrq_n_s32(vaddq_s32(lo, vdupq_n_s32(s_lumaRound)), 14);
+	hi = vshrq_n_s32(vaddq_s32(hi, vdupq_n_s32(s_lumaRound)), 14);
+
+	return vqmovn_u16(vcombine_u16(vqmovun_s32(lo), vqmovun_s32(hi)));
+}
+
+static void LumaRowNEON(const uint8_t* rgba, uint8_t* y, uint32_t width)
+{
+	uint32_t x = 0;
+	for (; x + 8 <= width; x += 8)
+		vst1_u8(y + x, LumaOctNEON(vld4_u8(rgba + 4 * x)));
+
+	LumaRowScalar(rgba, y, x, width);
+}
+
+static inline uint8x8_t ChromaDotNEON(int16x8_t r, int16x8_t g, int16x8_t b, int16_t cR, int16_t cG, int16_t cB)
+{
+	int32x4_t lo = vmull_n_s16(vget_low_s16(r), cR);
+	lo = vmlal_n_s16(lo, vget_low_s16(g), cG);
+	lo = vmlal_n_s16(lo, vget_low_s16(b), cB);
+
+	int32x4_t hi = vmull_n_s16(vget_high_s16(r), cR);
+	hi = vmlal_n_s16(hi, vget_high_s16(g), cG);
+	hi = vmlal_n_s16(hi, vget_high_s16(b), cB);
+
+	lo = vshrq_n_s32(vaddq_s32(lo, vdupq_n_s32(s_chromaOffset)), 16);
+	hi = vshrq_n_s32(vaddq_s32(hi, vdupq_n_s32(s_chromaOffset)), 16);
+
+	return vqmovn_u16(vcombine_u16(vqmovun_s32(lo), vqmovun_s32(hi)));
+}
+
+/// Converts 8 chroma samples covering 16 pixels of both rows
+static inline uint8x8x2_t ChromaOctNEON(const uint8_t* p0, const uint8_t* p1)
+{
+	uint8x16x4_t a = vld4q_u8(p0);
+	uint8x16x4_t b = vld4q_u8(p1);
+
+	int16x8_t r = vreinterpretq_s16_u16(vaddq_u16(vpaddlq_u8(a.val[0]), vpaddlq_u8(b.val[0])));
+	int16x8_t g = vreinterpretq_s16_u16(vaddq_u16(vpaddlq_u8(a.val[1]), vpaddlq_u8(b.val[1])));
+	int16x8_t bl = vreinterpretq_s16_u16(vaddq_u16(vpaddlq_u8(a.val[2]), vpaddlq_u8(b.val[2])));
+
+	uint8x8x2_t uv;
+	uv.val[0] = ChromaDotNEON(r, g, bl, s_uR, s_uG, s_uB);
+	uv.val[1] = ChromaDotNEON(r, g, bl, s_vR, s_vG, s_vB);
+	return uv;
+}
+
+static void ChromaRowI420NEON(const uint8_t* rgba0, const uint8_t* rgba1, uint32_t width, uint8_t* u, uint8_t* v)
+{
+	uint32_t cx = 0;
+	for (; 2 * cx + 16 <= width; cx += 8)
+	{
+		uint8x8x2_t uv = ChromaOctNEON(rgba0 + 8 * cx, rgba1 + 8 * cx);
+		vst1_u8(u + cx, uv.val[0]);
+		vst1_u8(v + cx, uv.val[1]);
+	}
+
+	ChromaRowI420Scalar(rgba0, rgba1, cx, width, u, v);
+}
+
+static void ChromaRowNV12NEON(const uint8_t* rgba0, const uint8_t* rgba1, uint32_t width, uint8_t* uv)
+{
+	uint32_t cx = 0;
+	for (; 2 * cx + 16 <= width; cx += 8)
+		vst2_u8(uv + 2 * cx, ChromaOctNEON(rgba0 + 8 * cx, rgba1 + 8 * cx));
+
+	ChromaRowNV12Scalar(rgba0, rgba1, cx, width, uv);
+}
+
+static const KernelFunctions s_neonKernel = { LumaRowNEON, ChromaRowI420NEON, ChromaRowNV12NEON };
+
+#endif // COLOR_CONVERSION_NEON
+
+
+
+static const KernelFunctions& GetKernelFunctions(ColorConverter::Kernel kernel)
+{
+	switch (kernel)
+	{
+#if defined(COLOR_CONVERSION_X86)
+	case ColorConverter::KERNEL_SSE41:
+		return s_sse41Kernel;
+	case ColorConverter::KERNEL_AVX2:
+		return s_avx2Kernel;
+#endif
+#if defined(COLOR_CONVERSION_NEON)
+	case ColorConverter::KERNEL_NEON:
+		return s_neonKernel;
+#endif
+	default:
+		return s_scalarKernel;
+	}
+}
+
+
+
+/**
+ * @brief Constructor.
+ * @param threads Number of row bands converted in parallel (the calling thread converts one of them).
+ * @param kernel Kernel to use; KERNEL_AUTO or an unsupported one selects the best available.
+ */
+ColorConverter::ColorConverter(uint32_t threads, Kernel kernel):
+	m_kernel((kernel == KERNEL_AUTO || !IsKernelSupported(kernel)) ? GetBestKernel() : kernel)
+{
+	for (uint32_t i = 1; i < threads; ++i)
+		m_workers.emplace_back(&ColorConverter::WorkerLoop, this, i);
+}
+
+
+
+/**
+ * @brief Destructor.
+ */
+ColorConverter::~ColorConverter()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_quit = true;
+	}
+
+	m_startCondition.notify_all();
+
+	for (std::thread& worker : m_workers)
+		worker.join();
+}
+
+
+
+/**
+ * @brief Converts an RGBA image to planar I420 (YUV420P).
+ * @param rgba
+ * @param rgbaPitch
+ * @param width
+ * @param height
+ * @param y
+ * @param yPitch
+ * @param u
+ * @param uPitch
+ * @param v
+ * @param vPitch
+ */
+void ColorConverter::ConvertToI420(const uint8_t* rgba, uint32_t rgbaPitch, uint32_t width, uint32_t height,
+	uint8_t* y, uint32_t yPitch, uint8_t* u, uint32_t uPitch, uint8_t* v, uint32_t vPitch)
+{
+	const KernelFunctions& kernel = GetKernelFunctions(m_kernel);
+
+	RunBands(height, [&](uint32_t first, uint32_t last)
+	{
+		for (uint32_t row = first; row < last; row += 2)
+		{
+			const uint8_t* rgba0 = rgba + (size_t)row * rgbaPitch;
+			const uint8_t* rgba1 = (row + 1 < height) ? rgba0 + rgbaPitch : rgba0;
+
+			kernel.lumaRow(rgba0, y + (size_t)row * yPitch, width);
+			if (row + 1 < height)
+				kernel.lumaRow(rgba1, y + (size_t)(row + 1) * yPitch, width);
+
+			kernel.chromaRowI420(rgba0, rgba1, width, u + (size_t)(row / 2) * uPitch, v + (size_t)(row / 2) * vPitch);
+		}
+	});
+}
+
+
+
+/**
+ * @brief Converts an RGBA image to semi-planar NV12.
+ * @param rgba
+ * @param rgbaPitch
+ * @param width
+ * @param height
+ * @param y
+ * @param yPitch
+ * @param uv
+ * @param uvPitch
+ */
+void ColorConverter::ConvertToNV12(const uint8_t* rgba, uint32_t rgbaPitch, uint32_t width, uint32_t height,
+	uint8_t* y, uint32_t yPitch, uint8_t* uv, uint32_t uvPitch)
+{
+	const KernelFunctions& kernel = GetKernelFunctions(m_kernel);
+
+	RunBands(height, [&](uint32_t first, uint32_t last)
+	{
+		for (uint32_t row = first; row < last; row += 2)
+		{
+			const uint8_t* rgba0 = rgba + (size_t)row * rgbaPitch;
+			const uint8_t* rgba1 = (row + 1 < height) ? rgba0 + rgbaPitch : rgba0;
+
+			kernel.lumaRow(rgba0, y + (size_t)row * yPitch, width);
+			if (row + 1 < height)
+				kernel.lumaRow(rgba1, y + (size_t)(row + 1) * yPitch, width);
+
+			kernel.chromaRowNV12(rgba0, rgba1, width, uv + (size_t)(row / 2) * uvPitch);
+		}
+	});
+}
+
+
+
+/**
+ * @brief Picks the fastest kernel the running CPU supports.
+ * @return
+ */
+ColorConverter::Kernel ColorConverter::GetBestKernel()
+{
+	if (IsKernelSupported(KERNEL_AVX2))
+		return KERNEL_AVX2;
+	if (IsKernelSupported(KERNEL_SSE41))
+		return KERNEL_SSE41;
+	if (IsKernelSupported(KERNEL_NEON))
+		return KERNEL_NEON;
+	return KERNEL_SCALAR;
+}
+
+
+
+bool ColorConverter::IsKernelSupported(Kernel kernel)
+{
+	switch (kernel)
+	{
+	case KERNEL_SCALAR:
+		return true;
+#if defined(COLOR_CONVERSION_X86)
+	case KERNEL_SSE41:
+		return CpuHasSSE41();
+	case KERNEL_AVX2:
+		return CpuHasSSE41() && CpuHasAVX2();
+#endif
+#if defined(COLOR_CONVERSION_NEON)
+	case KERNEL_NEON:
+		return true;
+#endif
+	default:
+		return false;
+	}
+}
+
+
+
+const char* ColorConverter::GetKernelName(Kernel kernel)
+{
+	switch (kernel)
+	{
+	case KERNEL_AUTO: return "auto";
+	case KERNEL_SCALAR: return "scalar";
+	case KERNEL_SSE41: return "sse4.1";
+	case KERNEL_AVX2: return "avx2";
+	case KERNEL_NEON: return "neon";
+	}
+	return "unknown";
+}
+
+
+
+/**
+ * @brief Splits the image into bands of an even number of rows and converts them in parallel.
+ * @param height
+ * @param convertRows
+ */
+void ColorConverter::RunBands(uint32_t height, const std::function<void(uint32_t, uint32_t)>& convertRows)
+{
+	uint32_t bands = GetThreads();
+	uint32_t bandHeight = (((height + bands - 1) / bands) + 1) & ~1u;
+
+	// Not worth waking anyone up for a handful of rows
+	if (m_workers.empty() || bandHeight < 16)
+	{
+		convertRows(0, height);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_job = &convertRows;
+		m_jobHeight = height;
+		m_bandHeight = bandHeight;
+		m_remainingBands = static_cast<uint32_t>(m_workers.size());
+		++m_generation;
+	}
+
+	m_startCondition.notify_all();
+
+	convertRows(0, (std::min)(bandHeight, height));
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_doneCondition.wait(lock, [this]() { return m_remainingBands == 0; });
+	m_job = nullptr;
+}
+
+
+
+/**
+ * @brief Worker thread converting band number band of every job.
+ * @param band
+ */
+void ColorConverter::WorkerLoop(uint32_t band)
+{
+	uint64_t generation = 0;
+
+	for (;;)
+	{
+		const std::function<void(uint32_t, uint32_t)>* job;
+		uint32_t first;
+		uint32_t last;
+
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_startCondition.wait(lock, [&]() { return m_quit || m_generation != generation; });
+
+			if (m_quit)
+				return;
+
+			generation = m_generation;
+			job = m_job;
+			first = (std::min)(band * m_bandHeight, m_jobHeight);
+			last = (std::min)(first + m_bandHeight, m_jobHeight);
+		}
+
+		if (first < last)
+			(*job)(first, last);
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (--m_remainingBands == 0)
+				m_doneCondition.notify_one();
+		}
+	}
+}
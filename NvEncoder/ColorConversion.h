@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+
+/**
+ * @brief RGBA to YUV 4:2:0 conversion for the CPU encode path.
+ *
+ * Uses BT.709 coefficients with full-range output, i.e. the colour description Encoder::SetupEncoder
+ * writes into the VUI (videoFullRangeFlag = 1, colourMatrix = 1). Chroma is the rounded average of each
+ * 2x2 block. All kernels produce bit-identical output to the scalar reference; the fastest one the CPU
+ * supports is picked at runtime, and rows are split into bands that are converted in parallel.
+ */
+class ColorConverter
+{
+public:
+	enum Kernel
+	{
+		KERNEL_AUTO,
+		KERNEL_SCALAR,
+		KERNEL_SSE41,
+		KERNEL_AVX2,
+		KERNEL_NEON
+	};
+
+	ColorConverter(uint32_t threads = 1, Kernel kernel = KERNEL_AUTO);
+	~ColorConverter();
+
+	ColorConverter(const ColorConverter&) = delete;
+	ColorConverter& operator=(const ColorConverter&) = delete;
+
+	void ConvertToI420(const uint8_t* rgba, uint32_t rgbaPitch, uint32_t width, uint32_t height,
+		uint8_t* y, uint32_t yPitch, uint8_t* u, uint32_t uPitch, uint8_t* v, uint32_t vPitch);
+
+	void ConvertToNV12(const uint8_t* rgba, uint32_t rgbaPitch, uint32_t width, uint32_t height,
+		uint8_t* y, uint32_t yPitch, uint8_t* uv, uint32_t uvPitch);
+
+	Kernel GetKernel() const { return m_kernel; }
+	uint32_t GetThreads() const { return static_cast<uint32_t>(m_workers.size()) + 1; }
+
+	static Kernel GetBestKernel();
+	static bool IsKernelSupported(Kernel kernel);
+	static const char* GetKernelName(Kernel kernel);
+
+private:
+	void RunBands(uint32_t height, const std::function<void(uint32_t, uint32_t)>& convertRows);
+	void WorkerLoop(uint32_t band);
+
+private:
+	Kernel m_kernel;
+
+	std::vector<std::thread> m_workers;
+	std::mutex m_mutex;
+	std::condition_variable m_startCondition;
+	std::condition_variable m_doneCondition;
+	uint64_t m_generation = 0;
+	uint32_t m_remainingBands = 0;
+	bool m_quit = false;
+
+	// Current job: converts rows [first, last) of the image
+	const std::function<void(uint32_t, uint32_t)>* m_job = nullptr;
+	uint32_t m_jobHeight = 0;
+	uint32_t m_bandHeight = 0;
+};
@@ -1,11 +1,31 @@
 #include "DllInterface.h"
 #include <memory>
+#include <cstring>
+#include <atomic>
+#include <mutex>
 #include "EncoderCUDA.h"
 #include "EncoderOpenGL.h"
 #include "EncoderDX11.h"
+#include "EncoderPool.h"
 
-// A shared pointer to the base class.
-std::shared_ptr<Encoder>			frameEncoder;
+// Upper bound on simultaneously open encode sessions (i.e. streams)
+static const uint32_t maxEncodeSessions = 32;
+
+EncoderPool							encoderPool(maxEncodeSessions);
+
+// Stream used by the single-stream entry points (InitOpenGLEncoder/EncodeOpenGLFrame). Encodes only read it;
+// replacing and clearing it are serialized, so concurrent calls cannot leak or remove the wrong session
+std::atomic<EncoderPool::StreamHandle>	defaultStream(0);
+std::mutex							defaultStreamMutex;
+
+// What a frame handle handed across the DLL boundary points at; info must stay the first member.
+// The encoder reference keeps the session alive until the frame is released, even if the stream is destroyed.
+struct EncodedFrameHandle
+{
+	EncodedFrameInfo info;
+	std::shared_ptr<Encoder> encoder;
+	std::shared_ptr<EncodedFrame> frame;
+};
 
 HMODULE hEncodeDLL = nullptr;
 
@@ -30,23 +50,207 @@ __declspec(dllexport) bool InitNVENC()
 
 __declspec(dllexport) bool SetConcurrentEncodes(unsigned int encodes)
 {
-	return true;
+	return encoderPool.SetConcurrentEncodes(encodes);
 }
 
 __declspec(dllexport) bool InitOpenGLEncoder(void* device, unsigned int encodeWidth, unsigned int encodeHeight, unsigned int bitrate, bool hevc)
+{
+	std::lock_guard<std::mutex> lock(defaultStreamMutex);
+
+	EncoderPool::StreamHandle previous = defaultStream.exchange(0);
+	if (previous != 0)
+	{
+		encoderPool.RemoveSession(previous);
+	}
+
+	EncoderPool::StreamHandle stream = CreateOpenGLEncoder(device, encodeWidth, encodeHeight, bitrate, hevc);
+	defaultStream = stream;
+
+	return stream != 0;
+}
+
+__declspec(dllexport) unsigned int CreateOpenGLEncoder(void* device, unsigned int encodeWidth, unsigned int encodeHeight, unsigned int bitrate, bool hevc)
 {
 	if (hEncodeDLL == nullptr)
 	{
-		return false;
+		return 0;
 	}
 
 	//TODO: Fix horrible colorConversion.ptx load!
-	frameEncoder = std::make_shared<EncoderOpenGL>();
-	frameEncoder->Init(NV_ENC_DEVICE_TYPE_CUDA, nullptr, encodeWidth, encodeHeight, hevc, bitrate);
+	std::shared_ptr<Encoder> encoder;
+	try
+	{
+		encoder = std::make_shared<EncoderOpenGL>();
+		encoder->Init(NV_ENC_DEVICE_TYPE_CUDA, nullptr, encodeWidth, encodeHeight, hevc, bitrate);
+	}
+	catch (const std::exception&)
+	{
+		return 0;
+	}
+
+	return encoderPool.AddSession(encoder);
+}
+
+__declspec(dllexport) bool DestroyEncoder(unsigned int stream)
+{
+	{
+		std::lock_guard<std::mutex> lock(defaultStreamMutex);
+
+		EncoderPool::StreamHandle expected = stream;
+		defaultStream.compare_exchange_strong(expected, 0);
+	}
+
+	return encoderPool.RemoveSession(stream);
+}
+
+__declspec(dllexport) bool GetEncoderStats(unsigned int stream, EncoderSessionStats* stats)
+{
+	EncoderPool::SessionStats sessionStats;
+	if (stats == nullptr || !encoderPool.GetStats(stream, sessionStats))
+	{
+		return false;
+	}
+
+	stats->framesEncoded = sessionStats.framesEncoded;
+	stats->bytesEncoded = sessionStats.bytesEncoded;
+	stats->queuedSubmissions = sessionStats.queuedSubmissions;
+	stats->activeEncodes = sessionStats.activeEncodes;
+	stats->totalWaitTime = sessionStats.totalWaitTime;
+	stats->maxWaitTime = sessionStats.maxWaitTime;
+	stats->totalEncodeTime = sessionStats.totalEncodeTime;
+
+	return true;
+}
+
+__declspec(dllexport) bool GetEncoderLatencyStats(unsigned int stream, EncoderLatencyStats* stats, bool reset)
+{
+	static_assert(ENCODER_STAGE_COUNT == EncoderStats::STAGE_COUNT, "Stage lists are out of sync");
+
+	std::shared_ptr<Encoder> encoder = encoderPool.GetEncoder(stream);
+	if (stats == nullptr || !encoder)
+	{
+		return false;
+	}
+
+	EncoderStats::Snapshot snapshot;
+	encoder->GetStats().GetSnapshot(snapshot, reset);
+
+	for (uint32_t stage = 0; stage < ENCODER_STAGE_COUNT; ++stage)
+	{
+		const LatencyHistogram::Summary& summary = snapshot.stages[stage];
+		EncoderStageLatency& latency = stats->stages[stage];
+
+		latency.count = summary.count;
+		latency.min = summary.min;
+		latency.max = summary.max;
+		latency.mean = summary.mean;
+		latency.p50 = summary.p50;
+		latency.p90 = summary.p90;
+		latency.p99 = summary.p99;
+		latency.p999 = summary.p999;
+	}
+
+	stats->frames = snapshot.frames;
+	stats->idrFrames = snapshot.idrFrames;
+	stats->bytes = snapshot.bytes;
+	stats->resets = snapshot.resets;
+	stats->reconfigures = snapshot.reconfigures;
+	stats->invalidations = snapshot.invalidations;
+
+	return true;
+}
+
+__declspec(dllexport) bool SetEncoderLatencyStatsEnabled(unsigned int stream, bool enabled)
+{
+	std::shared_ptr<Encoder> encoder = encoderPool.GetEncoder(stream);
+	if (!encoder)
+	{
+		return false;
+	}
+
+	encoder->SetStatsEnabled(enabled);
+	return true;
+}
+
+__declspec(dllexport) bool EnableAdaptiveBitrate(unsigned int stream, bool enabled, unsigned int minBitrate, unsigned int maxBitrate)
+{
+	if (!enabled)
+	{
+		return encoderPool.DisableRateControl(stream);
+	}
+
+	RateController::Config config;
+	config.startBitrate = 0;
+	if (minBitrate != 0)
+	{
+		config.minBitrate = minBitrate;
+	}
+	if (maxBitrate != 0)
+	{
+		config.maxBitrate = maxBitrate;
+	}
+
+	try
+	{
+		return encoderPool.EnableRateControl(stream, config);
+	}
+	catch (const std::exception&)
+	{
+		return false;
+	}
+}
+
+__declspec(dllexport) bool ReportNetworkFeedback(unsigned int stream, unsigned int rtt, float loss, unsigned long long receivedBytes)
+{
+	return encoderPool.ReportNetworkFeedback(stream, rtt, loss, receivedBytes);
+}
+
+__declspec(dllexport) bool ReportSendQueue(unsigned int stream, unsigned int queuedBytes)
+{
+	return encoderPool.ReportSendQueue(stream, queuedBytes);
+}
+
+__declspec(dllexport) bool GetAdaptiveBitrateState(unsigned int stream, AdaptiveBitrateState* state)
+{
+	RateController::State controllerState;
+	if (state == nullptr || !encoderPool.GetRateControlState(stream, controllerState))
+	{
+		return false;
+	}
+
+	state->bitrate = controllerState.bitrate;
+	state->delayBasedBitrate = controllerState.delayBasedBitrate;
+	state->lossBasedBitrate = controllerState.lossBasedBitrate;
+	state->throughput = controllerState.throughput;
+	state->rtt = controllerState.rtt;
+	state->loss = controllerState.loss;
+	state->queueDelay = controllerState.queueDelay;
+	state->usage = controllerState.usage;
 
 	return true;
 }
 
+__declspec(dllexport) void EnableFrameTrace(unsigned int capacity)
+{
+	if (capacity == 0)
+	{
+		FrameTrace::Disable();
+		return;
+	}
+
+	FrameTrace::Enable(capacity);
+}
+
+__declspec(dllexport) bool WriteFrameTrace(const char* path)
+{
+	if (path == nullptr)
+	{
+		return false;
+	}
+
+	return FrameTrace::WriteToFile(path);
+}
+
 __declspec(dllexport) bool InitCUDAEncoder(void* device, unsigned int encodeWidth, unsigned int encodeHeight, unsigned int bitrate, bool hevc)
 {
 	if (hEncodeDLL == nullptr)
@@ -68,17 +272,82 @@ __declspec(dllexport) bool InitDX11Encoder(void* device, unsigned int encodeWidt
 }
 
 __declspec(dllexport) void* EncodeOpenGLFrame(unsigned int texture /*GLUint*/, unsigned int target /*GLEnum*/, unsigned int width, unsigned int height, bool iFrame, void* buffer, int bufferSize)
+{
+	return EncodeOpenGLStreamFrame(defaultStream, texture, target, width, height, iFrame, buffer, bufferSize);
+}
+
+__declspec(dllexport) void* EncodeOpenGLStreamFrame(unsigned int stream, unsigned int texture /*GLUint*/, unsigned int target /*GLEnum*/, unsigned int width, unsigned int height, bool iFrame, void* buffer, int bufferSize)
 {
 	if (hEncodeDLL == nullptr)
 	{
 		return nullptr;
 	}
-	// Dude!
 
-// 	oglEncoder->EncodeTexture(texture, target, width, height, iFrame, )
-// 	{
-// 	}
-// 	)
+	std::shared_ptr<Encoder> encoder = encoderPool.GetEncoder(stream);
+	if (!std::dynamic_pointer_cast<EncoderOpenGL>(encoder))
+	{
+		return nullptr;
+	}
+
+	std::shared_ptr<EncodedFrame> frame;
+	try
+	{
+		encoderPool.Run(stream, [&](Encoder& e)
+		{
+			frame = static_cast<EncoderOpenGL&>(e).EncodeFrame(texture, target, width, height, iFrame);
+			return frame ? frame->size : 0u;
+		});
+	}
+	catch (const std::exception&)
+	{
+		return nullptr;
+	}
+
+	if (!frame)
+	{
+		return nullptr;
+	}
+
+	// A frame that does not fit is not copied at all; the caller sees that from info.size and reads info.data instead
+	if (buffer && bufferSize >= 0 && frame->size <= (unsigned int)bufferSize)
+	{
+		memcpy(buffer, frame->data, frame->size);
+	}
+
+	EncodedFrameHandle* handle = new EncodedFrameHandle();
+	handle->info.data = frame->data;
+	handle->info.size = frame->size;
+	handle->info.pictureType = frame->pictureType;
+	handle->info.timestamp = frame->timestamp;
+	handle->encoder = std::move(encoder);
+	handle->frame = std::move(frame);
+
+	return handle;
+}
 
-	return nullptr;
+__declspec(dllexport) bool ReleaseEncodedFrame(void *frameHandle)
+{
+	if (frameHandle == nullptr)
+	{
+		return false;
+	}
+
+	// Dropping the last reference unlocks the bitstream buffer and returns it to the encoder
+	delete static_cast<EncodedFrameHandle*>(frameHandle);
+
+	return true;
+}
+
+__declspec(dllexport) bool InvalidateRefFrames(unsigned int stream, const unsigned long long* timestamps, unsigned int count)
+{
+	static_assert(sizeof(unsigned long long) == sizeof(uint64_t), "Timestamps are passed through as is");
+
+	std::shared_ptr<Encoder> encoder = encoderPool.GetEncoder(stream);
+	if (!encoder)
+	{
+		return false;
+	}
+
+	encoder->InvalidateRefFrames(reinterpret_cast<const uint64_t*>(timestamps), count);
+	return true;
 }
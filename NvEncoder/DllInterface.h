@@ -2,6 +2,14 @@
 
 extern "C" __declspec(dllexport) bool InitNVENC();
 
+//************************************
+// Method:    SetConcurrentEncodes
+// FullName:  SetConcurrentEncodes
+// Access:    public 
+// Returns:   bool - false if encodes is 0 or larger than the number of sessions the DLL can hold
+// Qualifier:
+// Parameter: unsigned int encodes - how many streams may run an encode on the GPU at the same time; further submissions queue in arrival order
+//************************************
 extern "C" __declspec(dllexport) bool SetConcurrentEncodes(unsigned int encodes);
 
 extern "C" __declspec(dllexport) bool InitOpenGLEncoder(void* device, unsigned int encodeWidth, unsigned int encodeHeight, unsigned int bitrate, bool hevc);
@@ -10,20 +18,230 @@ extern "C" __declspec(dllexport) bool InitCUDAEncoder(void* device, unsigned int
 
 extern "C" __declspec(dllexport) bool InitDX11Encoder(void* device, unsigned int encodeWidth, unsigned int encodeHeight, unsigned int bitrate, bool hevc);
 
+//************************************
+// Method:    CreateOpenGLEncoder
+// FullName:  CreateOpenGLEncoder
+// Access:    public 
+// Returns:   unsigned int - opaque stream handle, 0 if no session could be opened
+// Qualifier:
+// Parameter: same as InitOpenGLEncoder; every stream gets its own encode session
+//************************************
+extern "C" __declspec(dllexport) unsigned int CreateOpenGLEncoder(void* device, unsigned int encodeWidth, unsigned int encodeHeight, unsigned int bitrate, bool hevc);
+
+extern "C" __declspec(dllexport) bool DestroyEncoder(unsigned int stream);
+
+// Per-session counters returned by GetEncoderStats, all times in microseconds.
+struct EncoderSessionStats
+{
+	unsigned long long framesEncoded;
+	unsigned long long bytesEncoded;
+	unsigned int queuedSubmissions; // submissions waiting for the scheduler right now
+	unsigned int activeEncodes;
+	unsigned long long totalWaitTime;
+	unsigned long long maxWaitTime;
+	unsigned long long totalEncodeTime;
+};
+
+extern "C" __declspec(dllexport) bool GetEncoderStats(unsigned int stream, EncoderSessionStats* stats);
+
+// Encode steps timed by GetEncoderLatencyStats
+enum EncoderStage
+{
+	ENCODER_STAGE_PREPARE,              // size checks, reset on a size change, bitstream buffer growth
+	ENCODER_STAGE_REGISTER,             // input registration lookup, registering on a cache miss
+	ENCODER_STAGE_MAP,                  // nvEncMapInputResource
+	ENCODER_STAGE_ENCODE,               // nvEncEncodePicture
+	ENCODER_STAGE_LOCK,                 // waiting for the output and nvEncLockBitstream
+	ENCODER_STAGE_UNMAP,                // nvEncUnmapInputResource
+	ENCODER_STAGE_COPY,                 // copying the bitstream out; zero-copy frames skip it
+	ENCODER_STAGE_UNLOCK,               // nvEncUnlockBitstream
+	ENCODER_STAGE_LATENCY,              // submit until the output is locked, i.e. the frame's time on the GPU included
+	ENCODER_STAGE_COUNT
+};
+
+// Latency distribution of one stage, all times in nanoseconds. Percentiles are accurate to about 3%.
+struct EncoderStageLatency
+{
+	unsigned long long count;
+	unsigned long long min;
+	unsigned long long max;
+	unsigned long long mean;
+	unsigned long long p50;
+	unsigned long long p90;
+	unsigned long long p99;
+	unsigned long long p999;
+};
+
+struct EncoderLatencyStats
+{
+	EncoderStageLatency stages[ENCODER_STAGE_COUNT];
+	unsigned long long frames;
+	unsigned long long idrFrames;
+	unsigned long long bytes;
+	unsigned long long resets;          // reinitializations for a size change, each forcing an IDR
+	unsigned long long reconfigures;    // rate changes, applied without a reset
+	unsigned long long invalidations;   // losses recovered by InvalidateRefFrames without an IDR
+};
+
+//************************************
+// Method:    GetEncoderLatencyStats
+// FullName:  GetEncoderLatencyStats
+// Access:    public 
+// Returns:   bool - false if the stream does not exist
+// Qualifier:
+// Parameter: unsigned int stream
+// Parameter: EncoderLatencyStats * stats - everything since the session was created or last reset
+// Parameter: bool reset - starts a new interval, e.g. to report once per second
+//************************************
+extern "C" __declspec(dllexport) bool GetEncoderLatencyStats(unsigned int stream, EncoderLatencyStats* stats, bool reset);
+
+//************************************
+// Method:    SetEncoderLatencyStatsEnabled
+// FullName:  SetEncoderLatencyStatsEnabled
+// Access:    public 
+// Returns:   bool - false if the stream does not exist
+// Qualifier:
+// Parameter: unsigned int stream
+// Parameter: bool enabled - stage timing is on by default and costs a few clock reads per frame; counters are always kept
+//************************************
+extern "C" __declspec(dllexport) bool SetEncoderLatencyStatsEnabled(unsigned int stream, bool enabled);
+
+//************************************
+// Method:    EnableAdaptiveBitrate
+// FullName:  EnableAdaptiveBitrate
+// Access:    public 
+// Returns:   bool - false if the stream does not exist or the range is empty
+// Qualifier:
+// Parameter: unsigned int stream
+// Parameter: bool enabled - when on, the bitrate follows the available bandwidth, starting from the current one; when off, it stays where it is
+// Parameter: unsigned int minBitrate - 0 for the encoder's lowest rate (8 Mbit/s)
+// Parameter: unsigned int maxBitrate - 0 for the encoder's highest rate (256 Mbit/s)
+//************************************
+extern "C" __declspec(dllexport) bool EnableAdaptiveBitrate(unsigned int stream, bool enabled, unsigned int minBitrate, unsigned int maxBitrate);
+
+//************************************
+// Method:    ReportNetworkFeedback
+// FullName:  ReportNetworkFeedback
+// Access:    public 
+// Returns:   bool - false if the stream does not exist or has no adaptive bitrate
+// Qualifier:
+// Parameter: unsigned int stream
+// Parameter: unsigned int rtt - round-trip time in microseconds, 0 if the report has none
+// Parameter: float loss - fraction of packets lost since the previous report
+// Parameter: unsigned long long receivedBytes - bytes the client received since the previous report, 0 if unknown
+//************************************
+extern "C" __declspec(dllexport) bool ReportNetworkFeedback(unsigned int stream, unsigned int rtt, float loss, unsigned long long receivedBytes);
+
+//************************************
+// Method:    ReportSendQueue
+// FullName:  ReportSendQueue
+// Access:    public 
+// Returns:   bool - false if the stream does not exist or has no adaptive bitrate
+// Qualifier:
+// Parameter: unsigned int stream
+// Parameter: unsigned int queuedBytes - bytes of the stream waiting to be sent, e.g. after every send
+//************************************
+extern "C" __declspec(dllexport) bool ReportSendQueue(unsigned int stream, unsigned int queuedBytes);
+
+// What the adaptive bitrate controller of a stream currently estimates; rates in bits per second
+struct AdaptiveBitrateState
+{
+	unsigned int bitrate;               // applied to the encoder
+	unsigned int delayBasedBitrate;
+	unsigned int lossBasedBitrate;
+	unsigned int throughput;            // received, or encoded while the client reports no bytes
+	unsigned int rtt;                   // smoothed, microseconds
+	float loss;
+	unsigned int queueDelay;            // microseconds
+	unsigned int usage;                 // 0 normal, 1 underuse, 2 overuse (delay trend)
+};
+
+//************************************
+// Method:    GetAdaptiveBitrateState
+// FullName:  GetAdaptiveBitrateState
+// Access:    public 
+// Returns:   bool - false if the stream does not exist or has no adaptive bitrate
+// Qualifier:
+// Parameter: unsigned int stream
+// Parameter: AdaptiveBitrateState * state
+//************************************
+extern "C" __declspec(dllexport) bool GetAdaptiveBitrateState(unsigned int stream, AdaptiveBitrateState* state);
+
+//************************************
+// Method:    EnableFrameTrace
+// FullName:  EnableFrameTrace
+// Access:    public 
+// Returns:   void
+// Qualifier:
+// Parameter: unsigned int capacity - events kept (the most recent ones); 0 stops recording. Only the first call allocates, later ones keep its size and drop the events recorded so far
+//************************************
+extern "C" __declspec(dllexport) void EnableFrameTrace(unsigned int capacity);
+
+//************************************
+// Method:    WriteFrameTrace
+// FullName:  WriteFrameTrace
+// Access:    public 
+// Returns:   bool - false if the file could not be written
+// Qualifier:
+// Parameter: const char * path - receives the recorded events as Chrome trace JSON (chrome://tracing, ui.perfetto.dev); recording continues
+//************************************
+extern "C" __declspec(dllexport) bool WriteFrameTrace(const char* path);
+
+// Layout of the frame handle returned by EncodeOpenGLFrame. The handle can be cast to this struct;
+// data points straight into the encoder's bitstream buffer and stays valid until ReleaseEncodedFrame.
+struct EncodedFrameInfo
+{
+	const void* data;
+	unsigned int size;
+	unsigned int pictureType; // NV_ENC_PIC_TYPE
+	unsigned long long timestamp;
+};
+
 //************************************
 // Method:    EncodeOpenGLFrame
 // FullName:  EncodeOpenGLFrame
 // Access:    public 
-// Returns:   bool
+// Returns:   void* - frame handle (see EncodedFrameInfo), nullptr on failure. Must be passed to ReleaseEncodedFrame.
 // Qualifier:
 // Parameter: unsigned int texture - GLUint handle for the texture
 // Parameter: unsigned int target - GLEnum for target (GL_TEXTURE_2D for example)
 // Parameter: int width
 // Parameter: int height
 // Parameter: bool iFrame - if true, set encodePicFlags = NV_ENC_PIC_FLAG_FORCEIDR | NV_ENC_PIC_FLAG_OUTPUT_SPSPPS;
-// Parameter: void * buffer - output buffer
+// Parameter: void * buffer - optional output buffer the frame is also copied to (may be nullptr to skip the copy). If the frame is larger than bufferSize, nothing is copied and the buffer keeps its old contents; the frame is then only available through EncodedFrameInfo::data, so compare EncodedFrameInfo::size with bufferSize before using the buffer
 // Parameter: int bufferSize - size of output buffer
 //************************************
 extern "C" __declspec(dllexport) void* EncodeOpenGLFrame(unsigned int texture /*GLUint*/, unsigned int target /*GLEnum*/, unsigned int width, unsigned int height, bool iFrame, void* buffer, int bufferSize);
 
-extern "C" __declspec(dllexport) bool ReleaseEncodedFrame(void *frameHandle);
\ No newline at end of file
+//************************************
+// Method:    EncodeOpenGLStreamFrame
+// FullName:  EncodeOpenGLStreamFrame
+// Access:    public 
+// Returns:   void* - frame handle, see EncodeOpenGLFrame
+// Qualifier:
+// Parameter: unsigned int stream - handle from CreateOpenGLEncoder; different streams may be encoded from different threads
+// Parameter: remaining parameters as for EncodeOpenGLFrame
+//************************************
+extern "C" __declspec(dllexport) void* EncodeOpenGLStreamFrame(unsigned int stream, unsigned int texture /*GLUint*/, unsigned int target /*GLEnum*/, unsigned int width, unsigned int height, bool iFrame, void* buffer, int bufferSize);
+
+//************************************
+// Method:    ReleaseEncodedFrame
+// FullName:  ReleaseEncodedFrame
+// Access:    public 
+// Returns:   bool
+// Qualifier:
+// Parameter: void * frameHandle - handle returned by EncodeOpenGLFrame; hands the bitstream buffer back to the encoder
+//************************************
+extern "C" __declspec(dllexport) bool ReleaseEncodedFrame(void *frameHandle);
+
+//************************************
+// Method:    InvalidateRefFrames
+// FullName:  InvalidateRefFrames
+// Access:    public 
+// Returns:   bool - false if the stream does not exist
+// Qualifier:
+// Parameter: unsigned int stream
+// Parameter: const unsigned long long * timestamps - EncodedFrameInfo::timestamp of the frames the client lost; they and all frames encoded after them stop being used as references, so the next frame is a P-frame predicted from an older one. If no older frame is left to predict from (or the GPU cannot invalidate), the next frame is an IDR instead
+// Parameter: unsigned int count
+//************************************
+extern "C" __declspec(dllexport) bool InvalidateRefFrames(unsigned int stream, const unsigned long long* timestamps, unsigned int count);
@@ -103,7 +103,7 @@ EncoderCUDA::~EncoderCUDA()
 }
 
 
-std::shared_ptr<NV_ENC_LOCK_BITSTREAM>  EncoderCUDA::EncodeFrame(CUdeviceptr bufferRGBA, uint32_t width, uint32_t height, bool iFrame)
+std::shared_ptr<EncodedFrame>  EncoderCUDA::EncodeFrame(CUdeviceptr bufferRGBA, uint32_t width, uint32_t height, bool iFrame)
 {
 	return Encoder::EncodeFrame(NV_ENC_INPUT_RESOURCE_TYPE_CUDADEVICEPTR, (void*)bufferRGBA, NV_ENC_BUFFER_FORMAT_ABGR, width * 4, width, height, iFrame);
 }
@@ -146,6 +146,21 @@ void EncoderCUDA::Encode(CUdeviceptr bufferRGBA, uint32_t width, uint32_t height
 
 
 
+/**
+* @brief Queues the given linear RGBA buffer for encoding; fetch the output with Retrieve().
+* The buffer must stay valid and unmodified until then.
+* @param bufferRGBA
+* @param width
+* @param height
+* @param iFrame
+*/
+void EncoderCUDA::Submit(CUdeviceptr bufferRGBA, uint32_t width, uint32_t height, bool iFrame)
+{
+	Encoder::Submit(NV_ENC_INPUT_RESOURCE_TYPE_CUDADEVICEPTR, (void*)bufferRGBA, NV_ENC_BUFFER_FORMAT_ABGR, width * 4, width, height, iFrame);
+}
+
+
+
 /**
 * @brief Encodes the given RGBA array.
 * @param arrayRGBA
@@ -19,7 +19,9 @@ public:
 	void Encode(CUdeviceptr bufferRGBA, uint32_t width, uint32_t height, bool iFrame, std::vector<uint8_t>& buffer);
 	void EncodeArray(CUarray arrayRGBA, uint32_t width, uint32_t height, bool iFrame, std::vector<uint8_t>& buffer);
 
-	std::shared_ptr<NV_ENC_LOCK_BITSTREAM> EncodeFrame(CUdeviceptr bufferRGBA, uint32_t width, uint32_t height, bool iFrame);
+	void Submit(CUdeviceptr bufferRGBA, uint32_t width, uint32_t height, bool iFrame);
+
+	std::shared_ptr<EncodedFrame> EncodeFrame(CUdeviceptr bufferRGBA, uint32_t width, uint32_t height, bool iFrame);
 
 
 	virtual void Init(NV_ENC_DEVICE_TYPE deviceType, void* device, uint32_t width, uint32_t height, bool hevc, uint32_t bitrate) override;
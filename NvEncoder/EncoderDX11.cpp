@@ -39,7 +39,8 @@ void EncoderDX11::EncodeTexture(ID3D11Texture2D* texture, uint32_t width, uint32
 {
 	if (texture != m_texture)
 	{
-		m_texture->Release();
+		if (m_texture)
+			m_texture->Release();
 		texture->AddRef();
 		m_texture = texture;
 	}
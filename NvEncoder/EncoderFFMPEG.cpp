@@ -1,13 +1,16 @@
 #ifdef USE_CPU_ENCODER
 
 #include "EncoderFFMPEG.h"
+#include "FrameTrace.h"
+
+#include <algorithm>
+#include <stdexcept>
 
 extern "C"
 {
 #include <libavcodec/avcodec.h>
 #include <libavutil/log.h>
 #include <libavutil/opt.h>
-#include <libswscale/swscale.h>
 }
 
 /**
@@ -16,8 +19,18 @@ extern "C"
  * @param height
  * @param hevc
  * @param bitrate
+ * @param threads Encoder threads, 0 lets libavcodec decide.
+ * @param threadType
+ * @param queueDepth Number of converted frames that may wait for the encode thread.
  */
-EncoderFFmpeg::EncoderFFmpeg(uint32_t width, uint32_t height, bool hevc, uint32_t bitrate)
+EncoderFFmpeg::EncoderFFmpeg(uint32_t width, uint32_t height, bool hevc, uint32_t bitrate,
+    uint32_t threads, ThreadType threadType, uint32_t queueDepth):
+    hevc(hevc),
+    bitrate(bitrate),
+    threads(threads),
+    threadType(threadType),
+    traceSession(FrameTrace::CreateSession("EncoderFFmpeg")),
+    encodeTraceSession(FrameTrace::CreateSession("EncoderFFmpeg encode"))
 {
     av_log_set_level(AV_LOG_QUIET);
 
@@ -28,6 +41,231 @@ EncoderFFmpeg::EncoderFFmpeg(uint32_t width, uint32_t height, bool hevc, uint32_
     if (!this->codec)
         throw std::runtime_error("Failed to initialize codec in FFmpeg");
 
+    OpenCodec(width & ~1u, height & ~1u);
+
+    // Init conversion
+    uint32_t conversionThreads = (std::min)((std::max)(std::thread::hardware_concurrency(), 1u), 4u);
+    this->converter.reset(new ColorConverter(conversionThreads));
+
+    // One frame is being converted while the others wait in the queue
+    for (uint32_t i = 0; i < (std::max)(queueDepth, 1u) + 1; ++i)
+    {
+        AVFrame* frame = av_frame_alloc();
+        if (!frame)
+            throw std::runtime_error("Failed to allocate YUV420P frame in FFmpeg");
+
+        this->frames.push_back(frame);
+        this->freeFrames.push_back(frame);
+    }
+
+    // Buffers are allocated up front, so the first frames don't pay for it
+    ResizeFramePool(width & ~1u, height & ~1u);
+    for (AVFrame* frame : this->frames)
+        AttachFrameBuffers(frame);
+
+    this->encodeThread = std::thread(&EncoderFFmpeg::EncodeLoop, this);
+}
+
+
+/**
+ * @brief Destructor. Frames still in the queue are dropped.
+ */
+EncoderFFmpeg::~EncoderFFmpeg()
+{
+    if (this->encodeThread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->quit = true;
+        }
+
+        this->frameQueued.notify_all();
+        this->encodeThread.join();
+    }
+
+    CloseCodec();
+
+    for (AVFrame* frame : this->frames)
+        av_frame_free(&frame);
+
+    // Pools go away once the last buffer still referenced by a frame or the codec is returned
+    for (AVBufferPool*& pool : this->planePools)
+        av_buffer_pool_uninit(&pool);
+
+    for (AVPacket* packet : this->packets)
+        av_packet_free(&packet);
+}
+
+
+/**
+ * @brief Encode a single frame and wait until the encoder has consumed it.
+ * @param rgba
+ * @param width
+ * @param height
+ * @param iFrame
+ * @param buffer Receives the oldest packet. Encoders with a delay (frame threading) return packets of
+ *               earlier frames; the remainder is returned by later calls, Retrieve() or Flush().
+ * @return false if no packet was ready; buffer is left untouched then.
+ */
+bool EncoderFFmpeg::Encode(const uint8_t* rgba, uint32_t width, uint32_t height, bool iFrame, std::vector<uint8_t>& buffer)
+{
+    Submit(rgba, width, height, iFrame);
+    return Retrieve(buffer, true);
+}
+
+
+/**
+ * @brief Converts a frame and queues it for encoding. Blocks while the queue is full.
+ * @param rgba Tightly packed, i.e. with a pitch of 4 * width.
+ * @param width May differ from the previous frame's.
+ * @param height May differ from the previous frame's.
+ * @param iFrame
+ */
+void EncoderFFmpeg::Submit(const uint8_t* rgba, uint32_t width, uint32_t height, bool iFrame)
+{
+    const bool traced = FrameTrace::IsEnabled();
+    EncoderStats::Ticks submitTime = traced ? EncoderStats::Now() : 0;
+
+    AVFrame* frame;
+    {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->frameConsumed.wait(lock, [this]() { return !this->freeFrames.empty() || !this->error.empty(); });
+        ThrowIfFailed();
+
+        frame = this->freeFrames.back();
+        this->freeFrames.pop_back();
+    }
+
+    try
+    {
+        // 4:2:0 needs even dimensions; an odd last row or column is cropped
+        uint32_t encodeWidth = width & ~1u;
+        uint32_t encodeHeight = height & ~1u;
+        if (encodeWidth == 0 || encodeHeight == 0)
+            throw std::runtime_error("Invalid frame size for FFmpeg");
+
+        if (encodeWidth != this->width || encodeHeight != this->height)
+            ResizeFramePool(encodeWidth, encodeHeight);
+
+        // Buffers of another size, or still referenced by the codec, are swapped for pooled ones
+        if (frame->width != (int) this->width || frame->height != (int) this->height || !av_frame_is_writable(frame))
+            AttachFrameBuffers(frame);
+    }
+    catch (...)
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->freeFrames.push_back(frame);
+        throw;
+    }
+
+    // Convert input to YUV
+    EncoderStats::Ticks convertTime = traced ? EncoderStats::Now() : 0;
+    this->converter->ConvertToI420(rgba, 4 * width, this->width, this->height,
+        frame->data[0], frame->linesize[0],
+        frame->data[1], frame->linesize[1],
+        frame->data[2], frame->linesize[2]);
+
+    if (traced)
+        FrameTrace::Record(FrameTrace::EVENT_CONVERT, this->traceSession, this->frameNumber, convertTime, EncoderStats::Now());
+
+    if (iFrame)
+        frame->pict_type = AV_PICTURE_TYPE_I;
+    else
+        frame->pict_type = AV_PICTURE_TYPE_NONE;
+
+    // The encode thread owns the frame once it is queued
+    uint64_t frameNumber = this->frameNumber++;
+    frame->pts = frameNumber;
+
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->queuedFrames.push_back(frame);
+        ++this->pendingFrames;
+    }
+
+    this->frameQueued.notify_one();
+
+    if (traced)
+        FrameTrace::Record(FrameTrace::EVENT_SUBMIT, this->traceSession, frameNumber, submitTime, EncoderStats::Now());
+}
+
+
+/**
+ * @brief Returns the oldest encoded packet.
+ * @param buffer
+ * @param wait Wait until the encoder has consumed all submitted frames if no packet is ready yet.
+ * @return false if no packet is available.
+ */
+bool EncoderFFmpeg::Retrieve(std::vector<uint8_t>& buffer, bool wait)
+{
+    AVPacket* packet;
+    {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        if (wait)
+        {
+            this->frameConsumed.wait(lock, [this]()
+            {
+                return !this->packets.empty() || this->pendingFrames == 0 || !this->error.empty();
+            });
+        }
+
+        if (this->packets.empty())
+        {
+            ThrowIfFailed();
+            return false;
+        }
+
+        packet = this->packets.front();
+        this->packets.pop_front();
+    }
+
+    const bool traced = FrameTrace::IsEnabled();
+    EncoderStats::Ticks copyTime = traced ? EncoderStats::Now() : 0;
+
+    buffer.clear();
+    buffer.reserve(packet->size);
+    buffer.insert(buffer.end(), packet->data, packet->data + packet->size);
+
+    if (traced)
+        FrameTrace::Record(FrameTrace::EVENT_COPY, this->traceSession, packet->pts, copyTime, EncoderStats::Now());
+
+    av_packet_free(&packet);
+
+    return true;
+}
+
+
+/**
+ * @brief Drains the encoder. All frames submitted so far are available through Retrieve() afterwards;
+ * the next frame starts a new coded video sequence.
+ */
+void EncoderFFmpeg::Flush()
+{
+    std::unique_lock<std::mutex> lock(this->mutex);
+    ThrowIfFailed();
+
+    this->queuedFrames.push_back(nullptr);
+    ++this->pendingFrames;
+    this->frameQueued.notify_one();
+
+    this->frameConsumed.wait(lock, [this]() { return this->pendingFrames == 0 || !this->error.empty(); });
+    ThrowIfFailed();
+}
+
+
+/**
+ * @brief Number of submitted frames (and flush requests) the encode thread has not consumed yet.
+ * @return
+ */
+uint32_t EncoderFFmpeg::GetPendingFrames() const
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->pendingFrames;
+}
+
+
+void EncoderFFmpeg::OpenCodec(uint32_t width, uint32_t height)
+{
     this->context = avcodec_alloc_context3(this->codec);
     if (!this->context)
         throw std::runtime_error("Failed to allocate video codec context in FFmpeg");
@@ -35,7 +273,7 @@ EncoderFFmpeg::EncoderFFmpeg(uint32_t width, uint32_t height, bool hevc, uint32_
 
     this->context->width = width;
     this->context->height = height;
-    this->context->bit_rate = bitrate;
+    this->context->bit_rate = this->bitrate;
 	AVRational tb;
 	tb.num = 1;
 	tb.den = 90;
@@ -47,91 +285,229 @@ EncoderFFmpeg::EncoderFFmpeg(uint32_t width, uint32_t height, bool hevc, uint32_
     this->context->gop_size = 90;
     this->context->max_b_frames = 0;
     this->context->pix_fmt = AV_PIX_FMT_YUV420P;
+
+    // Matches what ColorConverter produces (and what the NVENC path signals in its VUI)
+    this->context->color_range = AVCOL_RANGE_JPEG;
+    this->context->colorspace = AVCOL_SPC_BT709;
+    this->context->color_primaries = AVCOL_PRI_BT709;
+    this->context->color_trc = AVCOL_TRC_BT709;
+
+    // libx264 derives sliced-threads from the thread type, so it is not forced in x264opts
+    this->context->thread_count = this->threads;
+    if (this->threadType == THREAD_FRAME)
+        this->context->thread_type = FF_THREAD_FRAME;
+    else if (this->threadType == THREAD_SLICE)
+        this->context->thread_type = FF_THREAD_SLICE;
+    else
+        this->context->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
     av_opt_set(this->context->priv_data, "preset", "ultrafast", 0);
     av_opt_set(this->context->priv_data, "tune", "zerolatency", 0);
-    av_opt_set(this->context->priv_data, "x264opts","no-mbtree:sliced-threads:sync-lookahead=0", 0);
+    av_opt_set(this->context->priv_data, "x264opts","no-mbtree:sync-lookahead=0", 0);
     av_opt_set(this->context->priv_data, "x265-params","log-level=error", 0);
 
     if (avcodec_open2(this->context, this->codec, NULL) < 0)
+    {
+        CloseCodec();
         throw std::runtime_error("Failed to open codec in FFmpeg");
+    }
+}
 
-    // Init conversion
-    // TODO move resize handling to encode function
-    this->conversionContext = sws_getContext(width, height, AV_PIX_FMT_RGBA, width, height, AV_PIX_FMT_YUV420P, 0, 0, 0, 0);
 
-    this->frame = av_frame_alloc();
-    this->frame->width = width;
-    this->frame->height = height;
-    this->frame->format = AV_PIX_FMT_YUV420P;
+void EncoderFFmpeg::CloseCodec()
+{
+    if (this->context)
+        avcodec_free_context(&this->context);
+}
+
+
+/**
+ * @brief Switches the frame pool to a new size. Frames are moved over as they are reused.
+ * @param width
+ * @param height
+ */
+void EncoderFFmpeg::ResizeFramePool(uint32_t width, uint32_t height)
+{
+    // Same alignment av_frame_get_buffer() uses
+    this->planePitches[0] = (int) ((width + 31) & ~31u);
+    this->planePitches[1] = (int) (((width + 1) / 2 + 31) & ~31u);
+    this->planePitches[2] = this->planePitches[1];
+
+    int planeSizes[3] =
+    {
+        this->planePitches[0] * (int) height,
+        this->planePitches[1] * (int) ((height + 1) / 2),
+        this->planePitches[2] * (int) ((height + 1) / 2)
+    };
+
+    for (int i = 0; i < 3; ++i)
+    {
+        av_buffer_pool_uninit(&this->planePools[i]);
 
-    if (av_frame_get_buffer(this->frame, 32) < 0)
-        throw std::runtime_error("Failed to allocate YUV420P frame data in FFmpeg");
+        // Padding for SIMD reads past the end of the last row
+        this->planePools[i] = av_buffer_pool_init(planeSizes[i] + 64, NULL);
+        if (!this->planePools[i])
+            throw std::runtime_error("Failed to allocate YUV420P frame pool in FFmpeg");
+    }
 
-    av_frame_make_writable(this->frame);
+    this->width = width;
+    this->height = height;
 }
 
 
 /**
- * @brief Destructor.
+ * @brief Gives a frame fresh buffers of the current size from the pool.
+ * @param frame
  */
-EncoderFFmpeg::~EncoderFFmpeg()
+void EncoderFFmpeg::AttachFrameBuffers(AVFrame* frame)
 {
-    if (this->context)
-        avcodec_free_context(&this->context);
+    av_frame_unref(frame);
+
+    frame->width = this->width;
+    frame->height = this->height;
+    frame->format = AV_PIX_FMT_YUV420P;
 
-    if (this->conversionContext)
-        sws_freeContext(this->conversionContext);
+    for (int i = 0; i < 3; ++i)
+    {
+        frame->buf[i] = av_buffer_pool_get(this->planePools[i]);
+        if (!frame->buf[i])
+        {
+            av_frame_unref(frame);
+            throw std::runtime_error("Failed to allocate YUV420P frame data in FFmpeg");
+        }
 
-    if (this->frame)
-        av_frame_free(&this->frame);
+        frame->data[i] = frame->buf[i]->data;
+        frame->linesize[i] = this->planePitches[i];
+    }
 }
 
 
 /**
- * @brief Encode a single frame.
- * @param rgba
- * @param width
- * @param height
- * @param iFrame
- * @param buffer
+ * @brief Encode thread: feeds queued frames to the codec and collects its packets.
  */
-void EncoderFFmpeg::Encode(const uint8_t* rgba, uint32_t width, uint32_t height, bool iFrame, std::vector<uint8_t>& buffer)
+void EncoderFFmpeg::EncodeLoop()
 {
-    // Convert input to YUV
-    const uint8_t* inData[1] = { rgba };
-    int inLinesize[1] = { 4 * (int) width };
+    for (;;)
+    {
+        AVFrame* frame;
+        bool failed;
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->frameQueued.wait(lock, [this]() { return this->quit || !this->queuedFrames.empty(); });
 
-    uint8_t* outData[3] = { this->frame->data[0], this->frame->data[1], this->frame->data[2] };
-    int outLinesize[3] = { this->frame->linesize[0], this->frame->linesize[1], this->frame->linesize[2] };
+            if (this->quit)
+                return;
 
-    if (sws_scale(this->conversionContext, inData, inLinesize, 0, height, outData, outLinesize) < 0)
-        throw std::runtime_error("Faild to convert RGBA to YUV in FFmpeg");
+            frame = this->queuedFrames.front();
+            this->queuedFrames.pop_front();
+            failed = !this->error.empty();
+        }
 
+        // The frame is only read before it is handed back, so its number is taken now
+        const bool traced = FrameTrace::IsEnabled();
+        EncoderStats::Ticks encodeTime = traced ? EncoderStats::Now() : 0;
+        uint64_t frameNumber = frame ? frame->pts : 0;
 
-    // Encode
-    if (iFrame)
-        this->frame->pict_type = AV_PICTURE_TYPE_I;
-    else
-        this->frame->pict_type = AV_PICTURE_TYPE_NONE;
+        // After a failure frames are only returned to the pool
+        std::string failure;
+        try
+        {
+            if (!failed)
+            {
+                // A frame of a new size drains the codec, which closes it, and reopens it at that size
+                if (frame && this->context && (this->context->width != frame->width || this->context->height != frame->height))
+                {
+                    if (avcodec_send_frame(this->context, nullptr) < 0)
+                        throw std::runtime_error("Failed to drain codec in FFmpeg");
+
+                    ReceivePackets();
+
+                    if (traced)
+                        FrameTrace::Mark(FrameTrace::EVENT_RESET, this->encodeTraceSession, frameNumber, (uint64_t) frame->width << 16 | frame->height);
+                }
+
+                if (frame && !this->context)
+                    OpenCodec(frame->width, frame->height);
+
+                // A null frame enters draining mode
+                if (this->context && avcodec_send_frame(this->context, frame) < 0)
+                    throw std::runtime_error("Failed to encode video frame in FFmpeg");
 
-    frame->pts = this->frameNumber++;
+                if (this->context)
+                    ReceivePackets();
+            }
+        }
+        catch (const std::exception& e)
+        {
+            failure = e.what();
+        }
 
-    AVPacket pkt;
-    av_init_packet(&pkt);
-    pkt.data = NULL;    // packet data will be allocated by the encoder
-    pkt.size = 0;
+        if (traced && frame)
+            FrameTrace::Record(FrameTrace::EVENT_ENCODE, this->encodeTraceSession, frameNumber, encodeTime, EncoderStats::Now());
 
-    int got_output;
-    if (avcodec_encode_video2(this->context, &pkt, this->frame, &got_output) < 0)
-        throw std::runtime_error("Faild to encode video frame in FFmpeg");
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
 
-    if (got_output)
+            if (frame)
+                this->freeFrames.push_back(frame);
+            --this->pendingFrames;
+
+            if (!failure.empty() && this->error.empty())
+                this->error = failure;
+        }
+
+        this->frameConsumed.notify_all();
+    }
+}
+
+
+/**
+ * @brief Moves every packet the codec has ready to the output queue. Closes the codec once a drain
+ * has completed; the next frame reopens it.
+ */
+void EncoderFFmpeg::ReceivePackets()
+{
+    for (;;)
     {
-        buffer.clear();
-        buffer.reserve(pkt.size);
-        buffer.insert(buffer.end(), pkt.data, pkt.data + pkt.size);
-        av_packet_unref(&pkt);
+        AVPacket* packet = av_packet_alloc();
+        if (!packet)
+            throw std::runtime_error("Failed to allocate packet in FFmpeg");
+
+        int result = avcodec_receive_packet(this->context, packet);
+        if (result < 0)
+        {
+            av_packet_free(&packet);
+
+            if (result == AVERROR(EAGAIN))
+                return;
+
+            if (result == AVERROR_EOF)
+            {
+                // A drained encoder cannot take new frames
+                CloseCodec();
+                return;
+            }
+
+            throw std::runtime_error("Failed to receive encoded packet in FFmpeg");
+        }
+
+        if ((packet->flags & AV_PKT_FLAG_KEY) && FrameTrace::IsEnabled())
+            FrameTrace::Mark(FrameTrace::EVENT_IDR, this->encodeTraceSession, packet->pts, packet->size);
+
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->packets.push_back(packet);
+        }
+
+        this->frameConsumed.notify_all();
     }
 }
 
+
+void EncoderFFmpeg::ThrowIfFailed()
+{
+    if (!this->error.empty())
+        throw std::runtime_error(this->error);
+}
+
 #endif
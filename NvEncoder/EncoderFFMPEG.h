@@ -2,30 +2,97 @@
 
 #include <stdint.h>
 #include <vector>
+#include <deque>
+#include <memory>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "ColorConversion.h"
 
 struct AVCodec;
 struct AVCodecContext;
-struct SwsContext;
 struct AVFrame;
+struct AVPacket;
+struct AVBufferPool;
 
 
+/**
+ * @brief CPU fallback encoder (libx264/libx265 through libavcodec).
+ *
+ * Frames are converted on the calling thread and handed to an encode thread through a small queue,
+ * so the conversion of frame N+1 overlaps the encode of frame N. Packets come out in decode order
+ * through Retrieve(); Encode() is the synchronous shorthand that returns the oldest packet, if any.
+ *
+ * The input size may change from call to call. The codec is reopened (after draining the frames of the
+ * old size) only when the encoded size changes, which is the input size rounded down to even.
+ */
 class EncoderFFmpeg
 {
 public:
-    EncoderFFmpeg(uint32_t width, uint32_t height, bool hevc, uint32_t bitrate);
+    enum ThreadType
+    {
+        THREAD_FRAME,   // Higher throughput, adds one frame of latency per thread
+        THREAD_SLICE,   // No added latency, each frame is split into one slice per thread
+        THREAD_AUTO     // Let libavcodec pick
+    };
+
+    EncoderFFmpeg(uint32_t width, uint32_t height, bool hevc, uint32_t bitrate,
+        uint32_t threads = 0, ThreadType threadType = THREAD_SLICE, uint32_t queueDepth = 2);
     virtual ~EncoderFFmpeg();
 
-    void Encode(const uint8_t* rgba, uint32_t width, uint32_t height, bool iFrame, std::vector<uint8_t>& buffer);
+    bool Encode(const uint8_t* rgba, uint32_t width, uint32_t height, bool iFrame, std::vector<uint8_t>& buffer);
+
+    void Submit(const uint8_t* rgba, uint32_t width, uint32_t height, bool iFrame);
+    bool Retrieve(std::vector<uint8_t>& buffer, bool wait = true);
+    void Flush();
+
+    uint32_t GetPendingFrames() const;
 
 private:
+    void OpenCodec(uint32_t width, uint32_t height);
+    void CloseCodec();
+    void ResizeFramePool(uint32_t width, uint32_t height);
+    void AttachFrameBuffers(AVFrame* frame);
+    void EncodeLoop();
+    void ReceivePackets();
+    void ThrowIfFailed();
+
+private:
+    bool hevc;
+    uint32_t bitrate;
+    uint32_t threads;
+    ThreadType threadType;
+
     AVCodec* codec = nullptr;
     AVCodecContext* context = nullptr;
-    SwsContext* conversionContext = nullptr;
-    AVFrame* frame = nullptr;
+    std::unique_ptr<ColorConverter> converter;
     uint64_t frameNumber = 0;
-};
 
+    // Encode thread; the codec context is only touched from there once the constructor returns
+    std::thread encodeThread;
+    mutable std::mutex mutex;
+    std::condition_variable frameQueued;
+    std::condition_variable frameConsumed;
+    bool quit = false;
+    std::string error;
 
+    // Size of the frames handed out by the pool; the codec follows once it reaches a frame of a new size
+    uint32_t width = 0;
+    uint32_t height = 0;
+    AVBufferPool* planePools[3] = {};
+    int planePitches[3] = {};
 
+    // Frames ready to be converted into, and frames waiting to be encoded (nullptr requests a drain)
+    std::vector<AVFrame*> frames;
+    std::vector<AVFrame*> freeFrames;
+    std::deque<AVFrame*> queuedFrames;
+    uint32_t pendingFrames = 0;
 
+    std::deque<AVPacket*> packets;
 
+    // Trace tracks of the calling thread and of the encode thread
+    uint32_t traceSession;
+    uint32_t encodeTraceSession;
+};
@@ -97,7 +97,7 @@ EncoderOpenGL::~EncoderOpenGL()
 // }
 
 
-std::shared_ptr<NV_ENC_LOCK_BITSTREAM> EncoderOpenGL::EncodeFrame(unsigned int texture, unsigned int target, uint32_t width, uint32_t height, bool iFrame)
+std::shared_ptr<EncodedFrame> EncoderOpenGL::EncodeFrame(unsigned int texture, unsigned int target, uint32_t width, uint32_t height, bool iFrame)
 {
 	// Check if texture needs to be (re)registered
 	RegisteredTexture& reg = m_registeredTextures[texture];
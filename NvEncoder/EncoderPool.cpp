@@ -0,0 +1,395 @@
+#include "EncoderPool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <string>
+
+
+/**
+ * @brief Constructor.
+ * @param maxSessions Number of encode sessions the pool will ever hold at once.
+ */
+EncoderPool::EncoderPool(uint32_t maxSessions):
+	m_maxSessions((std::max)(maxSessions, 1u)),
+	m_concurrentEncodes(m_maxSessions)
+{
+
+}
+
+
+
+/**
+ * @brief Destructor. Sessions are torn down once their last user lets go of them.
+ */
+EncoderPool::~EncoderPool()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_sessions.clear();
+}
+
+
+
+/**
+ * @brief Sets how many sessions may encode at the same time.
+ * @param encodes Between 1 and the pool's session capacity.
+ * @return false if out of range.
+ */
+bool EncoderPool::SetConcurrentEncodes(uint32_t encodes)
+{
+	if (encodes == 0 || encodes > m_maxSessions)
+		return false;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_concurrentEncodes = encodes;
+	}
+
+	m_slotAvailable.notify_all();
+	return true;
+}
+
+
+
+uint32_t EncoderPool::GetConcurrentEncodes() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_concurrentEncodes;
+}
+
+
+
+/**
+ * @brief Takes ownership of an initialized encoder and assigns it a stream handle.
+ * @param encoder
+ * @return The stream handle, or 0 if all sessions are taken.
+ */
+EncoderPool::StreamHandle EncoderPool::AddSession(const std::shared_ptr<Encoder>& encoder)
+{
+	if (!encoder)
+		return 0;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (m_sessions.size() >= m_maxSessions)
+		return 0;
+
+	StreamHandle stream = m_nextHandle++;
+	if (m_nextHandle == 0)
+		m_nextHandle = 1;
+
+	auto session = std::make_shared<Session>();
+	session->encoder = encoder;
+	m_sessions[stream] = session;
+
+	return stream;
+}
+
+
+
+/**
+ * @brief Releases a stream's session. Encodes already running on it finish first.
+ * @param stream
+ * @return false if the handle is unknown.
+ */
+bool EncoderPool::RemoveSession(StreamHandle stream)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_sessions.erase(stream) > 0;
+}
+
+
+
+std::shared_ptr<Encoder> EncoderPool::GetEncoder(StreamHandle stream) const
+{
+	std::shared_ptr<Session> session = FindSession(stream);
+	return session ? session->encoder : nullptr;
+}
+
+
+
+/**
+ * @brief Copies the current counters of a stream's session.
+ * @param stream
+ * @param stats
+ * @return false if the handle is unknown.
+ */
+bool EncoderPool::GetStats(StreamHandle stream, SessionStats& stats) const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	auto it = m_sessions.find(stream);
+	if (it == m_sessions.end())
+		return false;
+
+	stats = it->second->stats;
+	return true;
+}
+
+
+
+/**
+ * @brief Runs an encode on the stream's session once the scheduler admits it.
+ * @param stream
+ * @param encode Does the actual work and returns the number of bytes produced.
+ * @return The value returned by encode. Throws if the handle is unknown.
+ */
+uint32_t EncoderPool::Run(StreamHandle stream, const std::function<uint32_t(Encoder&)>& encode)
+{
+	std::shared_ptr<Session> session = FindSession(stream);
+	if (!session)
+		throw std::runtime_error("Unknown encoder stream handle " + std::to_string(stream));
+
+	// One encode per session at a time; the encoder itself is not thread-safe
+	std::lock_guard<std::mutex> sessionLock(session->encodeMutex);
+
+	auto queued = std::chrono::steady_clock::now();
+	AcquireSlot(*session);
+	auto started = std::chrono::steady_clock::now();
+
+	uint32_t bytes = 0;
+	try
+	{
+		bytes = encode(*session->encoder);
+	}
+	catch (...)
+	{
+		ReleaseSlot(*session, 0, std::chrono::duration_cast<std::chrono::microseconds>(started - queued).count(), 0);
+		throw;
+	}
+
+	auto finished = std::chrono::steady_clock::now();
+	ReleaseSlot(*session, bytes,
+		std::chrono::duration_cast<std::chrono::microseconds>(started - queued).count(),
+		std::chrono::duration_cast<std::chrono::microseconds>(finished - started).count());
+
+	// Rate changes apply between frames, while this thread still owns the encoder
+	{
+		std::lock_guard<std::mutex> rateLock(session->rateMutex);
+
+		if (session->rateController)
+		{
+			uint64_t time = GetTime();
+			if (bytes > 0)
+				session->rateController->OnFrameEncoded(time, bytes);
+
+			uint32_t bitrate = 0;
+			if (session->rateController->Update(time, bitrate))
+				session->pendingBitrate = bitrate;
+		}
+		else
+			session->pendingBitrate = 0;
+	}
+
+	// The frame is encoded already and must reach the caller, so a rejected rate is only counted and tried again
+	if (session->pendingBitrate != 0)
+	{
+		try
+		{
+			session->encoder->SetRate(session->pendingBitrate);
+			session->pendingBitrate = 0;
+		}
+		catch (const std::exception&)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			++session->stats.rateChangeFailures;
+		}
+	}
+
+	return bytes;
+}
+
+
+
+/**
+ * @brief Hands a stream's bitrate to a RateController, which adjusts it after every encode from the
+ * frame sizes and the reports passed to ReportNetworkFeedback/ReportSendQueue. Replaces a controller
+ * that is already running.
+ * @param stream
+ * @param config Rates are limited to what Encoder::SetRate accepts; a start rate of 0 starts at the
+ *               stream's current rate.
+ * @return false if the handle is unknown. Throws if the rate range is empty.
+ */
+bool EncoderPool::EnableRateControl(StreamHandle stream, const RateController::Config& config)
+{
+	std::shared_ptr<Session> session = FindSession(stream);
+	if (!session)
+		return false;
+
+	std::lock_guard<std::mutex> sessionLock(session->encodeMutex);
+
+	RateController::Config limited = config;
+	limited.minBitrate = (std::max)(limited.minBitrate, Encoder::s_minRate);
+	limited.maxBitrate = (std::min)(limited.maxBitrate, Encoder::s_maxRate);
+	if (limited.startBitrate == 0)
+		limited.startBitrate = session->encoder->GetRate();
+
+	std::unique_ptr<RateController> rateController(new RateController(limited));
+
+	std::lock_guard<std::mutex> rateLock(session->rateMutex);
+	session->rateController = std::move(rateController);
+	return true;
+}
+
+
+
+/**
+ * @brief Stops adapting a stream's bitrate; it stays where the controller left it.
+ * @param stream
+ * @return false if the handle is unknown.
+ */
+bool EncoderPool::DisableRateControl(StreamHandle stream)
+{
+	std::shared_ptr<Session> session = FindSession(stream);
+	if (!session)
+		return false;
+
+	std::lock_guard<std::mutex> rateLock(session->rateMutex);
+	session->rateController.reset();
+	return true;
+}
+
+
+
+/**
+ * @brief Passes a client's receiver report to the stream's rate controller.
+ * @param stream
+ * @param rtt Microseconds, 0 if unknown
+ * @param loss Fraction of packets lost since the previous report
+ * @param receivedBytes Since the previous report, 0 if unknown
+ * @return false if the handle is unknown or the stream has no rate controller.
+ */
+bool EncoderPool::ReportNetworkFeedback(StreamHandle stream, uint32_t rtt, float loss, uint64_t receivedBytes)
+{
+	std::shared_ptr<Session> session = FindSession(stream);
+	if (!session)
+		return false;
+
+	std::lock_guard<std::mutex> rateLock(session->rateMutex);
+	if (!session->rateController)
+		return false;
+
+	session->rateController->OnFeedback(GetTime(), rtt, loss, receivedBytes);
+	return true;
+}
+
+
+
+/**
+ * @brief Passes the number of bytes waiting to be sent to the stream's rate controller.
+ * @param stream
+ * @param queuedBytes
+ * @return false if the handle is unknown or the stream has no rate controller.
+ */
+bool EncoderPool::ReportSendQueue(StreamHandle stream, uint32_t queuedBytes)
+{
+	std::shared_ptr<Session> session = FindSession(stream);
+	if (!session)
+		return false;
+
+	std::lock_guard<std::mutex> rateLock(session->rateMutex);
+	if (!session->rateController)
+		return false;
+
+	session->rateController->OnSendQueue(GetTime(), queuedBytes);
+	return true;
+}
+
+
+
+/**
+ * @brief Copies what the stream's rate controller currently estimates.
+ * @param stream
+ * @param state
+ * @return false if the handle is unknown or the stream has no rate controller.
+ */
+bool EncoderPool::GetRateControlState(StreamHandle stream, RateController::State& state) const
+{
+	std::shared_ptr<Session> session = FindSession(stream);
+	if (!session)
+		return false;
+
+	std::lock_guard<std::mutex> rateLock(session->rateMutex);
+	if (!session->rateController)
+		return false;
+
+	state = session->rateController->GetState();
+	return true;
+}
+
+
+
+std::shared_ptr<EncoderPool::Session> EncoderPool::FindSession(StreamHandle stream) const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	auto it = m_sessions.find(stream);
+	return (it != m_sessions.end()) ? it->second : nullptr;
+}
+
+
+
+/**
+ * @brief Blocks until it is this submission's turn and an encode slot is free.
+ * @param session
+ */
+void EncoderPool::AcquireSlot(Session& session)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	uint64_t ticket = m_nextTicket++;
+	++session.stats.queuedSubmissions;
+
+	m_slotAvailable.wait(lock, [&]()
+	{
+		return ticket == m_admitTicket && m_activeEncodes < m_concurrentEncodes;
+	});
+
+	++m_admitTicket;
+	++m_activeEncodes;
+	--session.stats.queuedSubmissions;
+	++session.stats.activeEncodes;
+
+	// The next ticket may be admissible right away if more slots are free
+	lock.unlock();
+	m_slotAvailable.notify_all();
+}
+
+
+
+/**
+ * @brief Returns an encode slot and books the submission into the session's counters.
+ * @param session
+ * @param bytes
+ * @param waitTime
+ * @param encodeTime
+ */
+void EncoderPool::ReleaseSlot(Session& session, uint32_t bytes, uint64_t waitTime, uint64_t encodeTime)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		--m_activeEncodes;
+		--session.stats.activeEncodes;
+
+		if (bytes > 0)
+			++session.stats.framesEncoded;
+		session.stats.bytesEncoded += bytes;
+		session.stats.totalWaitTime += waitTime;
+		session.stats.maxWaitTime = (std::max)(session.stats.maxWaitTime, waitTime);
+		session.stats.totalEncodeTime += encodeTime;
+	}
+
+	m_slotAvailable.notify_all();
+}
+
+
+
+/**
+ * @brief Clock of the rate controllers.
+ * @return Microseconds
+ */
+uint64_t EncoderPool::GetTime()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <unordered_map>
+
+#include "encoder.h"
+#include "RateController.h"
+
+
+/**
+ * @brief Fixed-capacity set of encode sessions, one per stream, with a FIFO scheduler that caps
+ * how many of them may run an encode on the GPU at the same time.
+ *
+ * Streams are addressed by opaque non-zero handles. Calls for different streams may come from
+ * different threads; calls for the same stream are serialized.
+ */
+class EncoderPool
+{
+public:
+	EncoderPool(uint32_t maxSessions);
+	~EncoderPool();
+
+	typedef uint32_t StreamHandle;
+
+	/**
+	 * @brief Per-session counters, all times in microseconds.
+	 */
+	struct SessionStats
+	{
+		uint64_t framesEncoded = 0;
+		uint64_t bytesEncoded = 0;
+		uint32_t queuedSubmissions = 0;
+		uint32_t activeEncodes = 0;
+		uint64_t totalWaitTime = 0;
+		uint64_t maxWaitTime = 0;
+		uint64_t totalEncodeTime = 0;
+		uint64_t rateChangeFailures = 0;    // adaptive bitrate changes the encoder rejected; retried after the next frame
+	};
+
+	bool SetConcurrentEncodes(uint32_t encodes);
+	uint32_t GetConcurrentEncodes() const;
+	uint32_t GetMaxSessions() const { return m_maxSessions; }
+
+	StreamHandle AddSession(const std::shared_ptr<Encoder>& encoder);
+	bool RemoveSession(StreamHandle stream);
+
+	std::shared_ptr<Encoder> GetEncoder(StreamHandle stream) const;
+	bool GetStats(StreamHandle stream, SessionStats& stats) const;
+
+	uint32_t Run(StreamHandle stream, const std::function<uint32_t(Encoder&)>& encode);
+
+	bool EnableRateControl(StreamHandle stream, const RateController::Config& config);
+	bool DisableRateControl(StreamHandle stream);
+	bool ReportNetworkFeedback(StreamHandle stream, uint32_t rtt, float loss, uint64_t receivedBytes);
+	bool ReportSendQueue(StreamHandle stream, uint32_t queuedBytes);
+	bool GetRateControlState(StreamHandle stream, RateController::State& state) const;
+
+private:
+	struct Session
+	{
+		std::shared_ptr<Encoder> encoder;
+		std::mutex encodeMutex;
+		SessionStats stats;
+
+		// Adaptive bitrate, null while the caller sets the rate; reports arrive from other threads than encodes
+		std::unique_ptr<RateController> rateController;
+		std::mutex rateMutex;
+		uint32_t pendingBitrate = 0;        // Chosen by the controller, not applied yet; guarded by encodeMutex
+	};
+
+	std::shared_ptr<Session> FindSession(StreamHandle stream) const;
+	void AcquireSlot(Session& session);
+	void ReleaseSlot(Session& session, uint32_t bytes, uint64_t waitTime, uint64_t encodeTime);
+	static uint64_t GetTime();
+
+private:
+	const uint32_t m_maxSessions;
+
+	mutable std::mutex m_mutex;
+	std::condition_variable m_slotAvailable;
+	std::unordered_map<StreamHandle, std::shared_ptr<Session>> m_sessions;
+	StreamHandle m_nextHandle = 1;
+
+	uint32_t m_concurrentEncodes;
+	uint32_t m_activeEncodes = 0;
+
+	// Ticket scheduler: submissions are admitted strictly in arrival order
+	uint64_t m_nextTicket = 0;
+	uint64_t m_admitTicket = 0;
+};
@@ -0,0 +1,221 @@
+#include "EncoderStats.h"
+
+#include <algorithm>
+
+
+static inline uint32_t CountLeadingZeros64(uint64_t value)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+#if defined(_M_X64) || defined(_M_ARM64)
+	_BitScanReverse64(&index, value);
+	return 63 - index;
+#else
+	if (value >> 32)
+	{
+		_BitScanReverse(&index, static_cast<unsigned long>(value >> 32));
+		return 31 - index;
+	}
+	_BitScanReverse(&index, static_cast<unsigned long>(value));
+	return 63 - index;
+#endif
+#else
+	return __builtin_clzll(value);
+#endif
+}
+
+
+
+// Where the TSC calibration starts
+static const std::chrono::steady_clock::time_point s_calibrationTime = std::chrono::steady_clock::now();
+static const EncoderStats::Ticks s_calibrationTicks = EncoderStats::Now();
+
+
+
+LatencyHistogram::LatencyHistogram():
+	m_total(0),
+	m_min(UINT64_MAX),
+	m_max(0)
+{
+	for (std::atomic<uint64_t>& bucket : m_buckets)
+		bucket.store(0, std::memory_order_relaxed);
+}
+
+
+
+/**
+ * @brief Bucket of a value: the first 64 hold one value each, after that every power of two is split
+ * into 32 buckets.
+ * @param value At most s_maxValue
+ * @return
+ */
+uint32_t LatencyHistogram::GetBucket(uint64_t value)
+{
+	const uint64_t subBuckets = 1ull << s_subBucketBits;
+	if (value < 2 * subBuckets)
+		return static_cast<uint32_t>(value);
+
+	uint32_t shift = 63 - CountLeadingZeros64(value) - s_subBucketBits;
+	return static_cast<uint32_t>(2 * subBuckets + (shift - 1) * subBuckets + ((value >> shift) - subBuckets));
+}
+
+
+
+/**
+ * @brief Largest value that falls into a bucket, which is what percentiles report.
+ * @param bucket
+ * @return
+ */
+uint64_t LatencyHistogram::GetBucketValue(uint32_t bucket)
+{
+	const uint64_t subBuckets = 1ull << s_subBucketBits;
+	if (bucket < 2 * subBuckets)
+		return bucket;
+
+	uint32_t shift = static_cast<uint32_t>((bucket - 2 * subBuckets) / subBuckets) + 1;
+	uint64_t subBucket = (bucket - 2 * subBuckets) % subBuckets + subBuckets;
+	return ((subBucket + 1) << shift) - 1;
+}
+
+
+
+/**
+ * @brief Adds one sample.
+ * @param ticks
+ */
+void LatencyHistogram::Record(uint64_t ticks)
+{
+	uint64_t value = ticks < s_maxValue ? ticks : s_maxValue;
+
+	m_buckets[GetBucket(value)].fetch_add(1, std::memory_order_relaxed);
+	m_total.fetch_add(value, std::memory_order_relaxed);
+
+	// New extremes are rare once a session has run for a while, so these loops almost never spin
+	uint64_t min = m_min.load(std::memory_order_relaxed);
+	while (value < min && !m_min.compare_exchange_weak(min, value, std::memory_order_relaxed));
+
+	uint64_t max = m_max.load(std::memory_order_relaxed);
+	while (value > max && !m_max.compare_exchange_weak(max, value, std::memory_order_relaxed));
+}
+
+
+
+/**
+ * @brief Computes count, extremes, mean and percentiles.
+ * @param summary
+ * @param tickPeriod Nanoseconds per tick
+ * @param reset Starts a new interval, so the next summary only covers samples recorded after this one.
+ */
+void LatencyHistogram::GetSummary(Summary& summary, double tickPeriod, bool reset)
+{
+	// Copied first, so the percentiles agree with the count even while samples come in
+	static_assert(s_bucketCount == 2 * (1u << s_subBucketBits) + (36 - s_subBucketBits - 1) * (1u << s_subBucketBits),
+		"Bucket count does not match the value range");
+
+	uint64_t counts[s_bucketCount];
+	uint64_t count = 0;
+	for (uint32_t i = 0; i < s_bucketCount; ++i)
+	{
+		counts[i] = reset ? m_buckets[i].exchange(0, std::memory_order_relaxed) : m_buckets[i].load(std::memory_order_relaxed);
+		count += counts[i];
+	}
+
+	uint64_t total = reset ? m_total.exchange(0, std::memory_order_relaxed) : m_total.load(std::memory_order_relaxed);
+	uint64_t min = reset ? m_min.exchange(UINT64_MAX, std::memory_order_relaxed) : m_min.load(std::memory_order_relaxed);
+	uint64_t max = reset ? m_max.exchange(0, std::memory_order_relaxed) : m_max.load(std::memory_order_relaxed);
+
+	summary = Summary();
+	if (count == 0)
+		return;
+
+	auto toNanoseconds = [tickPeriod](uint64_t ticks)
+	{
+		return static_cast<uint64_t>(ticks * tickPeriod + 0.5);
+	};
+
+	summary.count = count;
+	summary.min = toNanoseconds((std::min)(min, max));
+	summary.max = toNanoseconds(max);
+	summary.mean = toNanoseconds(total / count);
+
+	const double percentiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	uint64_t* results[] = { &summary.p50, &summary.p90, &summary.p99, &summary.p999 };
+
+	uint64_t seen = 0;
+	uint32_t bucket = 0;
+	for (uint32_t i = 0; i < 4; ++i)
+	{
+		// Rank of the sample the percentile lands on, counting from 1
+		uint64_t rank = (std::max)(static_cast<uint64_t>(percentiles[i] * count + 0.5), static_cast<uint64_t>(1));
+		while (bucket < s_bucketCount && seen + counts[bucket] < rank)
+			seen += counts[bucket++];
+
+		*results[i] = toNanoseconds((std::min)(GetBucketValue((std::min)(bucket, s_bucketCount - 1)), max));
+	}
+}
+
+
+
+/**
+ * @brief Length of a tick in nanoseconds. The TSC is measured against steady_clock since the library was
+ * loaded, so the estimate gets better the longer the process runs; the first call waits a millisecond
+ * if it comes too early to tell.
+ * @return
+ */
+double EncoderStats::GetTickPeriod()
+{
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+	std::chrono::steady_clock::time_point now;
+	Ticks ticks;
+	do
+	{
+		now = std::chrono::steady_clock::now();
+		ticks = Now();
+	} while (now - s_calibrationTime < std::chrono::milliseconds(1) || ticks <= s_calibrationTicks);
+
+	return std::chrono::duration<double, std::nano>(now - s_calibrationTime).count() / (ticks - s_calibrationTicks);
+#else
+	return 1.0;
+#endif
+}
+
+
+
+/**
+ * @brief Counts a finished frame.
+ * @param bytes
+ * @param idr
+ */
+void EncoderStats::AddFrame(uint32_t bytes, bool idr)
+{
+	m_frames.fetch_add(1, std::memory_order_relaxed);
+	m_bytes.fetch_add(bytes, std::memory_order_relaxed);
+	if (idr)
+		m_idrFrames.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+
+/**
+ * @brief Reads all stages and counters.
+ * @param snapshot
+ * @param reset Clears the histograms and counters, so the next snapshot covers a new interval.
+ */
+void EncoderStats::GetSnapshot(Snapshot& snapshot, bool reset)
+{
+	double tickPeriod = GetTickPeriod();
+	for (uint32_t stage = 0; stage < STAGE_COUNT; ++stage)
+		m_stages[stage].GetSummary(snapshot.stages[stage], tickPeriod, reset);
+
+	auto read = [reset](std::atomic<uint64_t>& counter)
+	{
+		return reset ? counter.exchange(0, std::memory_order_relaxed) : counter.load(std::memory_order_relaxed);
+	};
+
+	snapshot.frames = read(m_frames);
+	snapshot.idrFrames = read(m_idrFrames);
+	snapshot.bytes = read(m_bytes);
+	snapshot.resets = read(m_resets);
+	snapshot.reconfigures = read(m_reconfigures);
+	snapshot.invalidations = read(m_invalidations);
+}
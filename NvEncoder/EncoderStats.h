@@ -0,0 +1,156 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+
+/**
+ * @brief Latency distribution in clock ticks, HDR histogram style: exact below 64 ticks, then 32 buckets
+ * per power of two, so any percentile is within about 3% of the true value. Values of 2^36 ticks and more
+ * (about 20 s on the TSC) are counted as 2^36 - 1.
+ *
+ * Recording is lock-free and wait-free and may happen from any thread; readers take a Summary at any
+ * time, which is consistent per bucket but not across buckets while frames are being recorded.
+ */
+class LatencyHistogram
+{
+public:
+	/**
+	 * @brief What a histogram held when it was read, converted to nanoseconds.
+	 */
+	struct Summary
+	{
+		uint64_t count = 0;
+		uint64_t min = 0;
+		uint64_t max = 0;
+		uint64_t mean = 0;
+		uint64_t p50 = 0;
+		uint64_t p90 = 0;
+		uint64_t p99 = 0;
+		uint64_t p999 = 0;
+	};
+
+	LatencyHistogram();
+
+	LatencyHistogram(const LatencyHistogram&) = delete;
+	LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+	void Record(uint64_t ticks);
+	void GetSummary(Summary& summary, double tickPeriod, bool reset = false);
+
+	static const uint32_t s_subBucketBits = 5;
+	static const uint32_t s_bucketCount = 1024;
+	static const uint64_t s_maxValue = (1ull << 36) - 1;
+
+private:
+	static uint32_t GetBucket(uint64_t value);
+	static uint64_t GetBucketValue(uint32_t bucket);
+
+private:
+	std::atomic<uint64_t> m_buckets[s_bucketCount];
+	std::atomic<uint64_t> m_total;
+	std::atomic<uint64_t> m_min;
+	std::atomic<uint64_t> m_max;
+};
+
+
+
+/**
+ * @brief Per-session encode instrumentation: how long each step of an encode takes, and how often
+ * the expensive events happen. Owned by the Encoder, which records into it; any thread may read it.
+ */
+class EncoderStats
+{
+public:
+	// Timestamps are raw TSC ticks on x86, a few nanoseconds per read where steady_clock takes tens;
+	// elsewhere they are steady_clock nanoseconds. 0 means "not timed".
+	typedef uint64_t Ticks;
+
+	static Ticks Now()
+	{
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+		return __rdtsc();
+#else
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+	}
+
+	static double GetTickPeriod();
+
+	enum Stage
+	{
+		STAGE_PREPARE,                      // PrepareEncode: size checks and, on a change, the reset
+		STAGE_REGISTER,                     // Registration cache lookup, registering on a miss
+		STAGE_MAP,                          // nvEncMapInputResource
+		STAGE_ENCODE,                       // nvEncEncodePicture
+		STAGE_LOCK,                         // Waiting for the frame and nvEncLockBitstream
+		STAGE_UNMAP,                        // nvEncUnmapInputResource
+		STAGE_COPY,                         // Copying the bitstream out (Retrieve only)
+		STAGE_UNLOCK,                       // nvEncUnlockBitstream
+		STAGE_LATENCY,                      // From Submit until the frame's bitstream is locked
+		STAGE_COUNT
+	};
+
+	/**
+	 * @brief Everything at once, for reporting.
+	 */
+	struct Snapshot
+	{
+		LatencyHistogram::Summary stages[STAGE_COUNT];
+		uint64_t frames = 0;
+		uint64_t idrFrames = 0;
+		uint64_t bytes = 0;
+		uint64_t resets = 0;                // Reconfigurations with a reset, i.e. size changes
+		uint64_t reconfigures = 0;          // Rate changes applied in place
+		uint64_t invalidations = 0;         // Losses recovered by reference invalidation instead of an IDR
+	};
+
+	EncoderStats() {}
+
+	EncoderStats(const EncoderStats&) = delete;
+	EncoderStats& operator=(const EncoderStats&) = delete;
+
+	void SetEnabled(bool enabled) { m_enabled.store(enabled, std::memory_order_relaxed); }
+	bool IsEnabled() const { return m_enabled.load(std::memory_order_relaxed); }
+
+	/**
+	 * @brief Records the time since start for a stage and returns the current time, so consecutive
+	 * stages can be timed with one clock read each.
+	 */
+	Ticks Record(Stage stage, Ticks start)
+	{
+		Ticks now = Now();
+		Record(stage, start, now);
+		return now;
+	}
+
+	void Record(Stage stage, Ticks start, Ticks end)
+	{
+		// The TSC of another core can be a little behind; such a sample counts as 0
+		m_stages[stage].Record(end > start ? end - start : 0);
+	}
+
+	void AddFrame(uint32_t bytes, bool idr);
+	void AddReset() { m_resets.fetch_add(1, std::memory_order_relaxed); }
+	void AddReconfigure() { m_reconfigures.fetch_add(1, std::memory_order_relaxed); }
+	void AddInvalidation() { m_invalidations.fetch_add(1, std::memory_order_relaxed); }
+
+	void GetSnapshot(Snapshot& snapshot, bool reset = false);
+
+private:
+	std::atomic<bool> m_enabled{ true };
+	LatencyHistogram m_stages[STAGE_COUNT];
+	std::atomic<uint64_t> m_frames{ 0 };
+	std::atomic<uint64_t> m_idrFrames{ 0 };
+	std::atomic<uint64_t> m_bytes{ 0 };
+	std::atomic<uint64_t> m_resets{ 0 };
+	std::atomic<uint64_t> m_reconfigures{ 0 };
+	std::atomic<uint64_t> m_invalidations{ 0 };
+};
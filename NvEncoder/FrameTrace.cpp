@@ -0,0 +1,270 @@
+#include "FrameTrace.h"
+
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <fstream>
+
+
+/**
+ * @brief One recorded event. Fields are atomics so Write() can read them while writers lap it; the
+ * sequence number tells whether the fields belong together.
+ */
+struct TraceEntry
+{
+	std::atomic<uint64_t> sequence;             // Index + 1 once written, 0 while a writer is at it
+	std::atomic<uint64_t> start;
+	std::atomic<uint64_t> end;
+	std::atomic<uint64_t> frame;
+	std::atomic<uint64_t> value;
+	std::atomic<uint32_t> session;
+	std::atomic<uint32_t> event;
+};
+
+struct TraceEvent
+{
+	uint64_t start;
+	uint64_t end;
+	uint64_t frame;
+	uint64_t value;
+	uint32_t session;
+	uint32_t event;
+};
+
+static const char* s_eventNames[FrameTrace::EVENT_COUNT] =
+{
+	"submit", "prepare", "register", "map", "encode", "lock", "unmap", "copy", "release", "convert", "mux",
+	"IDR", "reset", "reconfigure", "invalidate"
+};
+
+// What an event's value means, or nullptr if it has none
+static const char* s_valueNames[FrameTrace::EVENT_COUNT] =
+{
+	nullptr, nullptr, nullptr, nullptr, nullptr, "bytes", nullptr, nullptr, nullptr, nullptr, "bytes",
+	"bytes", "size", "bitrate", "from"          // The reset's size is written as width and height
+};
+
+std::atomic<bool> FrameTrace::s_enabled(false);
+
+// Allocated by the first Enable() and never freed, so a writer that saw the trace enabled just before
+// it was disabled can never write into freed memory
+static std::atomic<TraceEntry*> s_entries(nullptr);
+static uint64_t s_capacity = 0;
+
+// Next index to write, and the first one after the last Enable()
+static std::atomic<uint64_t> s_head(0);
+static uint64_t s_tail = 0;
+
+// Guards enabling, sessions and reading
+static std::mutex s_mutex;
+static uint32_t s_nextSession = 1;
+static std::vector<std::pair<uint32_t, const char*>> s_sessions;
+
+
+
+/**
+ * @brief Starts recording, dropping whatever an earlier recording left in the buffer.
+ * @param capacity Events kept, rounded up to a power of two; only the first call allocates, later ones
+ *                 keep that size.
+ */
+void FrameTrace::Enable(uint32_t capacity)
+{
+	std::lock_guard<std::mutex> lock(s_mutex);
+
+	if (!s_entries.load(std::memory_order_relaxed))
+	{
+		s_capacity = 1024;
+		while (s_capacity < capacity)
+			s_capacity <<= 1;
+
+		TraceEntry* entries = new TraceEntry[s_capacity];
+		for (uint64_t i = 0; i < s_capacity; ++i)
+			entries[i].sequence.store(0, std::memory_order_relaxed);
+
+		s_entries.store(entries, std::memory_order_release);
+	}
+
+	s_tail = s_head.load(std::memory_order_relaxed);
+	s_enabled.store(true, std::memory_order_relaxed);
+}
+
+
+
+/**
+ * @brief Stops recording. The events recorded so far can still be written.
+ */
+void FrameTrace::Disable()
+{
+	std::lock_guard<std::mutex> lock(s_mutex);
+	s_enabled.store(false, std::memory_order_relaxed);
+}
+
+
+
+/**
+ * @brief Allocates the track for an encoder or muxer instance.
+ * @param kind Shown with the session number as the track name; must be a string literal.
+ * @return Session number, unique for the process
+ */
+uint32_t FrameTrace::CreateSession(const char* kind)
+{
+	std::lock_guard<std::mutex> lock(s_mutex);
+
+	uint32_t session = s_nextSession++;
+	s_sessions.push_back(std::make_pair(session, kind));
+	return session;
+}
+
+
+
+/**
+ * @brief Appends an event, overwriting the oldest one once the buffer is full. Callers check
+ * IsEnabled() first, so timestamps are only taken while tracing.
+ * @param event
+ * @param session
+ * @param frame
+ * @param start
+ * @param end Equal to start for instant events
+ * @param value See Event
+ */
+void FrameTrace::Record(Event event, uint32_t session, uint64_t frame, EncoderStats::Ticks start, EncoderStats::Ticks end, uint64_t value)
+{
+	TraceEntry* entries = s_entries.load(std::memory_order_acquire);
+	if (!entries)
+		return;
+
+	uint64_t index = s_head.fetch_add(1, std::memory_order_relaxed);
+	TraceEntry& entry = entries[index & (s_capacity - 1)];
+
+	entry.sequence.store(0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	entry.start.store(start, std::memory_order_relaxed);
+	entry.end.store(end, std::memory_order_relaxed);
+	entry.frame.store(frame, std::memory_order_relaxed);
+	entry.value.store(value, std::memory_order_relaxed);
+	entry.session.store(session, std::memory_order_relaxed);
+	entry.event.store(event, std::memory_order_relaxed);
+
+	entry.sequence.store(index + 1, std::memory_order_release);
+}
+
+
+
+/**
+ * @brief Writes the buffered events as a Chrome trace. Recording may continue meanwhile; events that
+ * are overwritten while being read are left out.
+ * @param json Replaced with the trace
+ */
+void FrameTrace::Write(std::string& json)
+{
+	std::lock_guard<std::mutex> lock(s_mutex);
+
+	std::vector<TraceEvent> events;
+	TraceEntry* entries = s_entries.load(std::memory_order_acquire);
+	if (entries)
+	{
+		uint64_t head = s_head.load(std::memory_order_relaxed);
+		uint64_t first = (std::max)(s_tail, head > s_capacity ? head - s_capacity : 0);
+		events.reserve(static_cast<size_t>(head - first));
+
+		for (uint64_t index = first; index < head; ++index)
+		{
+			TraceEntry& entry = entries[index & (s_capacity - 1)];
+			if (entry.sequence.load(std::memory_order_acquire) != index + 1)
+				continue;
+
+			TraceEvent event;
+			event.start = entry.start.load(std::memory_order_relaxed);
+			event.end = entry.end.load(std::memory_order_relaxed);
+			event.frame = entry.frame.load(std::memory_order_relaxed);
+			event.value = entry.value.load(std::memory_order_relaxed);
+			event.session = entry.session.load(std::memory_order_relaxed);
+			event.event = entry.event.load(std::memory_order_relaxed);
+
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (entry.sequence.load(std::memory_order_relaxed) != index + 1 || event.event >= EVENT_COUNT)
+				continue;
+
+			events.push_back(event);
+		}
+	}
+
+	// Enclosing spans first, so viewers nest the steps of a frame under its submit
+	std::sort(events.begin(), events.end(), [](const TraceEvent& a, const TraceEvent& b)
+	{
+		return a.start < b.start || (a.start == b.start && a.end > b.end);
+	});
+
+	double tickPeriod = EncoderStats::GetTickPeriod();
+	uint64_t origin = events.empty() ? 0 : events.front().start;
+	char line[256];
+
+	json = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+	json += "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"NvEncoder\"}}";
+
+	// Track names, only for sessions that have events
+	std::vector<uint32_t> sessions;
+	for (const TraceEvent& event : events)
+		sessions.push_back(event.session);
+	std::sort(sessions.begin(), sessions.end());
+	sessions.erase(std::unique(sessions.begin(), sessions.end()), sessions.end());
+
+	for (const std::pair<uint32_t, const char*>& session : s_sessions)
+	{
+		if (!std::binary_search(sessions.begin(), sessions.end(), session.first))
+			continue;
+
+		snprintf(line, sizeof(line), ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s %u\"}}",
+			session.first, session.second, session.first);
+		json += line;
+	}
+
+	for (const TraceEvent& event : events)
+	{
+		double timestamp = (event.start - origin) * tickPeriod / 1000.0;
+		const char* valueName = s_valueNames[event.event];
+
+		int length;
+		if (event.event >= EVENT_IDR)
+		{
+			length = snprintf(line, sizeof(line), ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"args\":{\"frame\":%llu",
+				s_eventNames[event.event], event.session, timestamp, (unsigned long long)event.frame);
+		}
+		else
+		{
+			double duration = (event.end > event.start ? event.end - event.start : 0) * tickPeriod / 1000.0;
+			length = snprintf(line, sizeof(line), ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%llu",
+				s_eventNames[event.event], event.session, timestamp, duration, (unsigned long long)event.frame);
+		}
+
+		if (valueName && event.event == EVENT_RESET)
+			length += snprintf(line + length, sizeof(line) - length, ",\"width\":%u,\"height\":%u",
+				(uint32_t)(event.value >> 16), (uint32_t)(event.value & 0xFFFF));
+		else if (valueName)
+			length += snprintf(line + length, sizeof(line) - length, ",\"%s\":%llu", valueName, (unsigned long long)event.value);
+
+		snprintf(line + length, sizeof(line) - length, "}}");
+		json += line;
+	}
+
+	json += "\n]}\n";
+}
+
+
+
+/**
+ * @brief Writes the buffered events to a file, see Write().
+ * @param path
+ * @return false if the file could not be written
+ */
+bool FrameTrace::WriteToFile(const std::string& path)
+{
+	std::string json;
+	Write(json);
+
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	file.write(json.data(), json.size());
+	return file.good();
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <string>
+
+#include "EncoderStats.h"
+
+
+/**
+ * @brief Process-wide ring buffer of per-frame trace events, exported as Chrome trace JSON
+ * (chrome://tracing, ui.perfetto.dev).
+ *
+ * Each encoder or muxer is a session and gets its own track; events are spans (what a frame spent in a
+ * step) or instants (IDRs, resets, rate changes), tagged with the frame number. Recording is lock-free
+ * from any thread and keeps the most recent events; while disabled, a call site costs one relaxed load.
+ */
+class FrameTrace
+{
+public:
+	enum Event
+	{
+		EVENT_SUBMIT,                       // Whole Submit() call
+		EVENT_PREPARE,
+		EVENT_REGISTER,
+		EVENT_MAP,
+		EVENT_ENCODE,
+		EVENT_LOCK,
+		EVENT_UNMAP,
+		EVENT_COPY,
+		EVENT_RELEASE,                      // Unlocking the bitstream
+		EVENT_CONVERT,                      // RGBA to YUV conversion (CPU encoder)
+		EVENT_MUX,
+		EVENT_IDR,                          // Instant; value is the frame size in bytes
+		EVENT_RESET,                        // Instant; value is width << 16 | height
+		EVENT_RECONFIGURE,                  // Instant; value is the new bitrate
+		EVENT_INVALIDATE,                   // Instant; value is the first frame invalidated as a reference
+		EVENT_COUNT
+	};
+
+	static void Enable(uint32_t capacity = 65536);
+	static void Disable();
+	static bool IsEnabled() { return s_enabled.load(std::memory_order_relaxed); }
+
+	static uint32_t CreateSession(const char* kind);
+
+	static void Record(Event event, uint32_t session, uint64_t frame, EncoderStats::Ticks start, EncoderStats::Ticks end, uint64_t value = 0);
+
+	/**
+	 * @brief Records an instant event now.
+	 */
+	static void Mark(Event event, uint32_t session, uint64_t frame, uint64_t value = 0)
+	{
+		EncoderStats::Ticks now = EncoderStats::Now();
+		Record(event, session, frame, now, now, value);
+	}
+
+	static void Write(std::string& json);
+	static bool WriteToFile(const std::string& path);
+
+private:
+	static std::atomic<bool> s_enabled;
+};
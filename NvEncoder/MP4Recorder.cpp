@@ -0,0 +1,609 @@
+#include "MP4Recorder.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <climits>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <malloc.h>
+#else
+#include <unistd.h>
+#endif
+
+
+/**
+ * @brief Write-behind buffer; aligned so it can be handed to the kernel with O_DIRECT.
+ */
+struct MP4Recorder::Buffer
+{
+	Buffer(size_t capacity, size_t alignment):
+		capacity(capacity)
+	{
+#ifdef _WIN32
+		data = static_cast<uint8_t*>(_aligned_malloc(capacity, alignment));
+#else
+		void* memory = nullptr;
+		data = (posix_memalign(&memory, (std::max)(alignment, sizeof(void*)), capacity) == 0) ? static_cast<uint8_t*>(memory) : nullptr;
+#endif
+		if (!data)
+			throw std::bad_alloc();
+	}
+
+	~Buffer()
+	{
+#ifdef _WIN32
+		_aligned_free(data);
+#else
+		free(data);
+#endif
+	}
+
+	uint8_t* data;
+	size_t size = 0;
+	size_t capacity;
+};
+
+// O_DIRECT transfers have to be aligned to the logical block size; 4 KiB covers every current device
+static const size_t s_directIOAlignment = 4096;
+
+
+
+MP4Recorder::MP4Recorder(const std::string& path):
+	MP4Recorder(path, Options())
+{
+
+}
+
+
+
+/**
+ * @brief Constructor. The first segment is created with the first frame.
+ * @param path File to record to; with a segment limit, the segment number is inserted before the extension.
+ * @param options
+ */
+MP4Recorder::MP4Recorder(const std::string& path, const Options& options):
+	m_path(path),
+	m_options(options)
+{
+	m_options.bufferCount = (std::max)(m_options.bufferCount, 2u);
+
+	if (m_options.directIO)
+		m_alignment = s_directIOAlignment;
+
+	m_options.bufferSize = (std::max)(m_options.bufferSize, m_alignment);
+	m_options.bufferSize = (m_options.bufferSize + m_alignment - 1) / m_alignment * m_alignment;
+
+	m_flushThread = std::thread(&MP4Recorder::FlushLoop, this);
+}
+
+
+
+/**
+ * @brief Destructor. Finishes the recording; errors that have not been reported yet are lost.
+ */
+MP4Recorder::~MP4Recorder()
+{
+	try
+	{
+		Close();
+	}
+	catch (const std::exception&)
+	{
+	}
+
+	if (m_flushThread.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_quit = true;
+		}
+		m_jobQueued.notify_all();
+		m_flushThread.join();
+	}
+
+	// Left open if the flush thread stopped on an error
+	try
+	{
+		CloseFile();
+	}
+	catch (const std::exception&)
+	{
+	}
+}
+
+
+
+/**
+ * @brief Muxes a frame into the current segment, first starting a new segment if the current one is
+ * over its limits and the frame is a sync sample. The frame is timed by the muxer's frame rate.
+ * @param frame Access unit in Annex-B format.
+ * @param size
+ * @param width
+ * @param height
+ */
+void MP4Recorder::Write(const uint8_t* frame, size_t size, uint32_t width, uint32_t height)
+{
+	WriteSample(frame, size, width, height, false, 0);
+}
+
+
+
+/**
+ * @brief Muxes a frame with its presentation timestamp, see MP4::Wrap().
+ * @param frame Access unit in Annex-B format.
+ * @param size
+ * @param width
+ * @param height
+ * @param timestamp In the muxer's time base.
+ */
+void MP4Recorder::Write(const uint8_t* frame, size_t size, uint32_t width, uint32_t height, uint64_t timestamp)
+{
+	WriteSample(frame, size, width, height, true, timestamp);
+}
+
+
+
+void MP4Recorder::Write(const std::vector<uint8_t>& frame, uint32_t width, uint32_t height)
+{
+	Write(frame.data(), frame.size(), width, height);
+}
+
+
+
+void MP4Recorder::WriteSample(const uint8_t* frame, size_t size, uint32_t width, uint32_t height, bool hasTimestamp, uint64_t timestamp)
+{
+	ThrowIfFailed();
+
+	if (m_closed)
+		throw std::runtime_error("MP4 recorder is already closed");
+
+	if (!m_mp4)
+		StartSegment();
+	else
+	{
+		bool full = (m_options.maxSegmentSize > 0 && m_segmentSize >= m_options.maxSegmentSize) ||
+		            (m_options.maxSegmentDuration > 0 &&
+		             std::chrono::steady_clock::now() - m_segmentStart >= std::chrono::milliseconds(m_options.maxSegmentDuration));
+
+		if (full && MP4::IsSyncSample(frame, size, m_mp4->GetCodec()))
+		{
+			FinishSegment();
+			StartSegment();
+		}
+	}
+
+	uint64_t fragments = m_mp4->GetFragmentCount();
+	if (hasTimestamp)
+		m_mp4->WrapChunks(frame, size, width, height, timestamp, m_chunks);
+	else
+		m_mp4->WrapChunks(frame, size, width, height, m_chunks);
+	Append(m_chunks);
+	m_currentFragments += m_mp4->GetFragmentCount() - fragments;
+}
+
+
+
+/**
+ * @brief Hands everything muxed so far to the flush thread and waits until it has been written.
+ * A fragment the muxer still has open is not included. With direct I/O, a tail smaller than the
+ * alignment stays buffered.
+ */
+void MP4Recorder::Flush()
+{
+	ThrowIfFailed();
+
+	SubmitBuffer(false);
+
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_bufferFreed.wait(lock, [this]() { return (m_jobs.empty() && !m_busy) || !m_error.empty(); });
+	}
+
+	ThrowIfFailed();
+}
+
+
+
+/**
+ * @brief Finishes the current segment and waits until all of it is on disk. Further writes fail.
+ */
+void MP4Recorder::Close()
+{
+	if (m_closed)
+		return;
+
+	m_closed = true;
+
+	ThrowIfFailed();
+
+	if (m_mp4)
+		FinishSegment();
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_quit = true;
+	}
+	m_jobQueued.notify_all();
+
+	if (m_flushThread.joinable())
+		m_flushThread.join();
+
+	ThrowIfFailed();
+}
+
+
+
+/**
+ * @brief Gets the file name of a segment.
+ * @param segment Zero-based segment number.
+ * @return
+ */
+std::string MP4Recorder::GetSegmentPath(uint32_t segment) const
+{
+	if (m_options.maxSegmentSize == 0 && m_options.maxSegmentDuration == 0)
+		return m_path;
+
+	size_t separator = m_path.find_last_of("/\\");
+	size_t extension = m_path.find_last_of('.');
+	if (extension == std::string::npos || (separator != std::string::npos && extension < separator))
+		extension = m_path.size();
+
+	char number[16];
+	snprintf(number, sizeof(number), "_%04u", segment);
+
+	return m_path.substr(0, extension) + number + m_path.substr(extension);
+}
+
+
+
+/**
+ * @brief Creates the muxer for a new segment and has the flush thread open its file.
+ */
+void MP4Recorder::StartSegment()
+{
+	m_mp4.reset(new MP4());
+	m_mp4->SetRandomAccessIndex(m_options.randomAccessIndex);
+	m_mp4->SetSegmentIndex(m_options.segmentIndex);
+	if (m_options.setupMuxer)
+		m_options.setupMuxer(*m_mp4);
+
+	Job job;
+	job.openPath = GetSegmentPath(m_segment++);
+	Submit(std::move(job));
+
+	m_segmentSize = 0;
+	m_segmentStart = std::chrono::steady_clock::now();
+}
+
+
+
+/**
+ * @brief Writes out the fragment the muxer still has open and the index, and has the flush thread close the file.
+ */
+void MP4Recorder::FinishSegment()
+{
+	uint64_t fragments = m_mp4->GetFragmentCount();
+	m_mp4->CloseChunks(m_chunks);
+	Append(m_chunks);
+	m_currentFragments += m_mp4->GetFragmentCount() - fragments;
+
+	SubmitBuffer(true);
+
+	Job job;
+	job.close = true;
+	Submit(std::move(job));
+
+	m_mp4.reset();
+}
+
+
+
+/**
+ * @brief Copies a fragment into the write-behind buffers, submitting each one as it fills up.
+ * @param chunks
+ */
+void MP4Recorder::Append(const std::vector<MP4Chunk>& chunks)
+{
+	for (const MP4Chunk& chunk : chunks)
+	{
+		const uint8_t* data = chunk.data;
+		size_t size = chunk.size;
+		m_segmentSize += size;
+
+		while (size > 0)
+		{
+			if (!m_current)
+				m_current = AcquireBuffer();
+
+			size_t count = (std::min)(size, m_current->capacity - m_current->size);
+			memcpy(m_current->data + m_current->size, data, count);
+			m_current->size += count;
+			data += count;
+			size -= count;
+
+			if (m_current->size == m_current->capacity)
+				SubmitBuffer(false);
+		}
+	}
+}
+
+
+
+/**
+ * @brief Hands the current buffer to the flush thread.
+ * @param final The buffer ends the file. Otherwise, with direct I/O, an unaligned tail is moved to a new buffer.
+ */
+void MP4Recorder::SubmitBuffer(bool final)
+{
+	if (!m_current || m_current->size == 0)
+		return;
+
+	size_t tail = final ? 0 : m_current->size % m_alignment;
+	if (tail == m_current->size)
+		return;
+
+	Job job;
+	job.buffer = m_current;
+	m_current = nullptr;
+
+	if (tail > 0)
+	{
+		// The fragments completed in here end in the tail, so they are counted with it
+		m_current = AcquireBuffer();
+		memcpy(m_current->data, job.buffer->data + job.buffer->size - tail, tail);
+		m_current->size = tail;
+		job.buffer->size -= tail;
+	}
+	else
+	{
+		job.fragments = m_currentFragments;
+		m_currentFragments = 0;
+	}
+
+	Submit(std::move(job));
+}
+
+
+
+void MP4Recorder::Submit(Job&& job)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_jobs.push_back(std::move(job));
+	}
+	m_jobQueued.notify_one();
+}
+
+
+
+/**
+ * @brief Gets an empty buffer, allocating up to the configured number and then waiting for the flush thread.
+ * @return
+ */
+MP4Recorder::Buffer* MP4Recorder::AcquireBuffer()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	if (m_freeBuffers.empty() && m_buffers.size() < m_options.bufferCount)
+	{
+		// The flush thread must not wait for the allocation; only this thread adds buffers, so the count holds
+		lock.unlock();
+		std::unique_ptr<Buffer> buffer(new Buffer(m_options.bufferSize, (std::max)(m_alignment, (size_t) 64)));
+		lock.lock();
+
+		m_buffers.push_back(std::move(buffer));
+		return m_buffers.back().get();
+	}
+
+	m_bufferFreed.wait(lock, [this]() { return !m_freeBuffers.empty() || !m_error.empty(); });
+
+	if (!m_error.empty())
+		throw std::runtime_error(m_error);
+
+	Buffer* buffer = m_freeBuffers.back();
+	m_freeBuffers.pop_back();
+	return buffer;
+}
+
+
+
+/**
+ * @brief Flush thread: performs the file operations in submission order.
+ */
+void MP4Recorder::FlushLoop()
+{
+	for (;;)
+	{
+		Job job;
+		bool failed;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_jobQueued.wait(lock, [this]() { return m_quit || !m_jobs.empty(); });
+
+			if (m_jobs.empty())
+				return;
+
+			job = std::move(m_jobs.front());
+			m_jobs.pop_front();
+			m_busy = true;
+			failed = !m_error.empty();
+		}
+
+		// After a failure buffers are only returned to the pool
+		std::string failure;
+		try
+		{
+			if (!failed)
+			{
+				if (!job.openPath.empty())
+				{
+					CloseFile();
+					OpenFile(job.openPath);
+				}
+
+				if (job.buffer)
+				{
+					WriteBuffer(*job.buffer);
+
+					m_unsyncedFragments += job.fragments;
+					if (m_options.syncInterval > 0 && m_unsyncedFragments >= m_options.syncInterval)
+						SyncFile();
+				}
+
+				if (job.close)
+					CloseFile();
+			}
+		}
+		catch (const std::exception& e)
+		{
+			failure = e.what();
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+
+			if (job.buffer)
+			{
+				job.buffer->size = 0;
+				m_freeBuffers.push_back(job.buffer);
+			}
+			m_busy = false;
+
+			if (!failure.empty() && m_error.empty())
+				m_error = failure;
+		}
+
+		m_bufferFreed.notify_all();
+	}
+}
+
+
+
+void MP4Recorder::WriteBuffer(const Buffer& buffer)
+{
+	if (m_fd < 0)
+		throw std::runtime_error("MP4 recorder has no file open");
+
+#if defined(O_DIRECT)
+	// Only the end of a file may be unaligned, and only written through the page cache
+	if (m_fdDirect && buffer.size % m_alignment != 0)
+	{
+		int flags = fcntl(m_fd, F_GETFL);
+		if (flags < 0 || fcntl(m_fd, F_SETFL, flags & ~O_DIRECT) < 0)
+			throw std::runtime_error("Failed to disable direct I/O for the MP4 recording");
+		m_fdDirect = false;
+	}
+#endif
+
+	size_t written = 0;
+	while (written < buffer.size)
+	{
+#ifdef _WIN32
+		int result = _write(m_fd, buffer.data + written, static_cast<unsigned int>((std::min)(buffer.size - written, (size_t) INT_MAX)));
+#else
+		ssize_t result = write(m_fd, buffer.data + written, buffer.size - written);
+		if (result < 0 && errno == EINTR)
+			continue;
+#endif
+		if (result <= 0)
+			throw std::runtime_error("Failed to write the MP4 recording: " + std::string(strerror(errno)));
+
+		written += static_cast<size_t>(result);
+	}
+}
+
+
+
+void MP4Recorder::OpenFile(const std::string& path)
+{
+#ifdef _WIN32
+	m_fd = _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+	int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+
+	m_fdDirect = false;
+#if defined(O_DIRECT)
+	if (m_options.directIO)
+	{
+		m_fd = open(path.c_str(), flags | O_DIRECT, 0644);
+
+		// Not every file system supports it (tmpfs, for one); fall back to buffered writes
+		m_fdDirect = (m_fd >= 0);
+	}
+#endif
+	if (m_fd < 0)
+		m_fd = open(path.c_str(), flags, 0644);
+#endif
+
+	if (m_fd < 0)
+		throw std::runtime_error("Failed to open " + path + " for recording: " + std::string(strerror(errno)));
+
+	m_unsyncedFragments = 0;
+}
+
+
+
+void MP4Recorder::CloseFile()
+{
+	if (m_fd < 0)
+		return;
+
+	bool synced = true;
+	if (m_options.syncInterval > 0)
+	{
+		try
+		{
+			SyncFile();
+		}
+		catch (const std::exception&)
+		{
+			synced = false;
+		}
+	}
+
+#ifdef _WIN32
+	bool closed = (_close(m_fd) == 0);
+#else
+	bool closed = (close(m_fd) == 0);
+#endif
+	m_fd = -1;
+	m_fdDirect = false;
+
+	if (!synced || !closed)
+		throw std::runtime_error("Failed to finish the MP4 recording");
+}
+
+
+
+void MP4Recorder::SyncFile()
+{
+#if defined(_WIN32)
+	bool synced = (_commit(m_fd) == 0);
+#elif defined(__APPLE__)
+	bool synced = (fsync(m_fd) == 0);
+#else
+	bool synced = (fdatasync(m_fd) == 0);
+#endif
+
+	if (!synced)
+		throw std::runtime_error("Failed to sync the MP4 recording: " + std::string(strerror(errno)));
+
+	m_unsyncedFragments = 0;
+}
+
+
+
+void MP4Recorder::ThrowIfFailed()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (!m_error.empty())
+		throw std::runtime_error(m_error);
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+
+#include "mp4.h"
+
+
+/**
+ * @brief Records a stream of encoded frames to fragmented MP4 files on local disk.
+ *
+ * The file stays open for the whole segment. Fragments are copied into a large write-behind buffer
+ * on the calling thread; full buffers are written, optionally synced, by a background thread, so the
+ * encode thread never makes a system call. Recordings can be split into segments by size or duration;
+ * a new segment only starts at a sync sample, with its own moov.
+ */
+class MP4Recorder
+{
+public:
+	struct Options
+	{
+		size_t bufferSize = 4 << 20;        // Size of one write-behind buffer
+		uint32_t bufferCount = 4;           // Buffers in flight before Write() blocks
+		bool directIO = false;              // Bypass the page cache (O_DIRECT, Linux only)
+		uint32_t syncInterval = 0;          // fdatasync after every N fragments, 0 leaves it to the OS
+		uint64_t maxSegmentSize = 0;        // Bytes per segment, 0 for no limit
+		uint32_t maxSegmentDuration = 0;    // Milliseconds per segment, 0 for no limit
+		bool randomAccessIndex = true;      // End every segment with mfra
+		bool segmentIndex = false;          // Put a sidx in front of every fragment
+
+		// Called for the muxer of every segment before its first frame (codec, parameter sets, fragmenting)
+		std::function<void(MP4&)> setupMuxer;
+	};
+
+	MP4Recorder(const std::string& path);
+	MP4Recorder(const std::string& path, const Options& options);
+	~MP4Recorder();
+
+	MP4Recorder(const MP4Recorder&) = delete;
+	MP4Recorder& operator=(const MP4Recorder&) = delete;
+
+	void Write(const uint8_t* frame, size_t size, uint32_t width, uint32_t height);
+	void Write(const uint8_t* frame, size_t size, uint32_t width, uint32_t height, uint64_t timestamp);
+	void Write(const std::vector<uint8_t>& frame, uint32_t width, uint32_t height);
+	void Flush();
+	void Close();
+
+	uint32_t GetSegmentCount() const { return m_segment; }
+	std::string GetSegmentPath(uint32_t segment) const;
+
+private:
+	struct Buffer;
+
+	/**
+	 * @brief Unit of work for the flush thread, handled in submission order.
+	 */
+	struct Job
+	{
+		Buffer* buffer = nullptr;           // Data to append to the current file
+		uint64_t fragments = 0;             // Fragments completed by this data
+		std::string openPath;               // Close the current file and start this one
+		bool close = false;                 // Close the current file
+	};
+
+	void WriteSample(const uint8_t* frame, size_t size, uint32_t width, uint32_t height, bool hasTimestamp, uint64_t timestamp);
+	void StartSegment();
+	void FinishSegment();
+	void Append(const std::vector<MP4Chunk>& chunks);
+	void SubmitBuffer(bool final);
+	void Submit(Job&& job);
+	Buffer* AcquireBuffer();
+	void FlushLoop();
+	void WriteBuffer(const Buffer& buffer);
+	void OpenFile(const std::string& path);
+	void CloseFile();
+	void SyncFile();
+	void ThrowIfFailed();
+
+private:
+	std::string m_path;
+	Options m_options;
+	size_t m_alignment = 1;
+
+	// Caller side: the current segment and the buffer fragments are copied into
+	std::unique_ptr<MP4> m_mp4;
+	std::vector<MP4Chunk> m_chunks;
+	Buffer* m_current = nullptr;
+	uint64_t m_currentFragments = 0;
+	uint32_t m_segment = 0;
+	uint64_t m_segmentSize = 0;
+	std::chrono::steady_clock::time_point m_segmentStart;
+	bool m_closed = false;
+
+	// Flush thread
+	std::thread m_flushThread;
+	mutable std::mutex m_mutex;
+	std::condition_variable m_jobQueued;
+	std::condition_variable m_bufferFreed;
+	std::deque<Job> m_jobs;
+	std::vector<std::unique_ptr<Buffer>> m_buffers;
+	std::vector<Buffer*> m_freeBuffers;
+	bool m_busy = false;
+	bool m_quit = false;
+	std::string m_error;
+
+	// Only touched by the flush thread
+	int m_fd = -1;
+	bool m_fdDirect = false;
+	uint64_t m_unsyncedFragments = 0;
+};
@@ -0,0 +1,527 @@
+#include "RateController.h"
+
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+
+
+// Trendline overuse detector (GCC): samples in the regression, gain, and how long a trend must
+// stay above the threshold, in milliseconds
+static const size_t s_trendlineWindow = 20;
+static const double s_trendlineGain = 4.0;
+static const double s_overuseTime = 10.0;
+
+// AIMD: back-off factor against the measured throughput, and multiplicative growth per second
+static const double s_beta = 0.85;
+static const double s_increaseFactor = 1.08;
+static const double s_packetBits = 1200 * 8;
+
+// Loss-based estimate: loss below which it grows, above which it backs off
+static const float s_lowLoss = 0.02f;
+static const float s_highLoss = 0.10f;
+
+// Throughput is averaged over this long; reports older than this stop steering the estimates
+static const uint64_t s_window = 1000000;
+static const uint64_t s_feedbackTimeout = 1000000;
+
+// At a back-off, the link's capacity is what got through over this long: with a queue in front of it,
+// the link was busy all that time. The estimate is dropped once the client received this much more
+static const uint64_t s_capacityWindow = 250000;
+static const double s_capacityMargin = 0.1;
+
+// The lowest RTT of this long is taken as the path's RTT without queueing, as BBR does
+static const uint64_t s_minRttWindow = 10000000;
+
+
+
+/**
+ * @brief Constructor.
+ * @param config
+ */
+RateController::RateController(const Config& config):
+	m_config(config)
+{
+	if (m_config.minBitrate == 0 || m_config.minBitrate > m_config.maxBitrate)
+		throw std::runtime_error("Invalid rate controller bitrate range");
+
+	m_state.bitrate = Clamp(m_config.startBitrate);
+	m_state.delayBasedBitrate = m_state.bitrate;
+	m_state.lossBasedBitrate = m_state.bitrate;
+	m_delayBasedBitrate = m_state.bitrate;
+	m_lossBasedBitrate = m_state.bitrate;
+}
+
+
+
+/**
+ * @brief Books an encoded frame; its size is what the stream sends, and the throughput estimate
+ * while the client reports no received bytes.
+ * @param time Microseconds, same clock as all other calls
+ * @param bytes
+ */
+void RateController::OnFrameEncoded(uint64_t time, uint32_t bytes)
+{
+	if (m_firstEncoded == UINT64_MAX)
+		m_firstEncoded = time;
+
+	m_encoded.push_back({ time, bytes });
+	m_encodedBytes += bytes;
+}
+
+
+
+/**
+ * @brief Takes a receiver report.
+ * @param time When the report arrived
+ * @param rtt Round-trip time in microseconds, 0 if the report has none
+ * @param loss Fraction of packets lost since the previous report
+ * @param receivedBytes Bytes received since the previous report, 0 if unknown
+ */
+void RateController::OnFeedback(uint64_t time, uint32_t rtt, float loss, uint64_t receivedBytes)
+{
+	m_state.loss = (std::min)((std::max)(loss, 0.0f), 1.0f);
+
+	if (receivedBytes > 0)
+	{
+		if (m_firstReceived == UINT64_MAX)
+			m_firstReceived = time;
+
+		m_received.push_back({ time, receivedBytes });
+		m_receivedBytes += receivedBytes;
+	}
+
+	if (rtt > 0)
+	{
+		m_state.rtt = m_state.rtt ? (7 * m_state.rtt + rtt) / 8 : rtt;
+
+		if (m_minRtt == 0 || rtt <= m_minRtt || time - m_minRttTime > s_minRttWindow)
+		{
+			m_minRtt = rtt;
+			m_minRttTime = time;
+		}
+
+		DetectOveruse(time, rtt);
+	}
+
+	m_lastFeedbackTime = time;
+	m_hasFeedback = true;
+}
+
+
+
+/**
+ * @brief Takes the number of bytes waiting in the sender's queue, e.g. after every send.
+ * @param time
+ * @param queuedBytes
+ */
+void RateController::OnSendQueue(uint64_t time, uint32_t queuedBytes)
+{
+	(void)time;
+	m_queuedBytes = queuedBytes;
+}
+
+
+
+/**
+ * @brief Runs the estimators and decides whether the encoder's rate should change, which is the case
+ * on the first call, on decreases and, at most every minIncreaseInterval, on increases, each only
+ * when the change is larger than the hysteresis or, once the link capacity is known, on any increase.
+ * @param time
+ * @param bitrate Receives the rate to apply
+ * @return true if the rate changed and has to be applied
+ */
+bool RateController::Update(uint64_t time, uint32_t& bitrate)
+{
+	if (!m_started)
+	{
+		m_started = true;
+		m_lastDelayUpdate = time;
+		m_lastLossUpdate = time;
+		bitrate = m_state.bitrate;
+		return true;
+	}
+
+	m_state.throughput = GetThroughput(time);
+	m_state.queueDelay = static_cast<uint32_t>((std::min)(m_queuedBytes * 8 * 1000000 / m_state.bitrate, static_cast<uint64_t>(UINT32_MAX)));
+
+	UpdateDelayBasedRate(time);
+	UpdateLossBasedRate(time);
+
+	m_state.delayBasedBitrate = Clamp(m_delayBasedBitrate);
+	m_state.lossBasedBitrate = Clamp(m_lossBasedBitrate);
+	uint32_t target = (std::min)(m_state.delayBasedBitrate, m_state.lossBasedBitrate);
+
+	double current = m_state.bitrate;
+	bool changed = false;
+
+	if (target < current * (1.0 - m_config.hysteresis))
+	{
+		m_state.bitrate = target;
+		changed = true;
+	}
+	// Near a known link capacity the additive increase is followed as it goes: stepping past the capacity by
+	// the hysteresis builds up a queue the detector sees only late
+	else if ((target > current * (1.0 + m_config.hysteresis) || (m_linkCapacity >= 0.0 && target > current)) &&
+		time - m_lastIncrease >= m_config.minIncreaseInterval)
+	{
+		m_state.bitrate = Clamp((std::min)(static_cast<double>(target), current * (1.0 + m_config.maxIncreaseStep)));
+		m_lastIncrease = time;
+		changed = m_state.bitrate != static_cast<uint32_t>(current);
+	}
+
+	bitrate = m_state.bitrate;
+	return changed;
+}
+
+
+
+/**
+ * @brief Trendline filter on the smoothed RTT: a rising delay means a queue is building up somewhere
+ * on the path, well before packets are lost.
+ * @param time
+ * @param rtt
+ */
+void RateController::DetectOveruse(uint64_t time, uint32_t rtt)
+{
+	double delay = rtt / 1000.0;
+
+	if (m_delays.empty() && m_feedbackCount == 0)
+	{
+		m_firstFeedbackTime = time;
+		m_smoothedDelay = delay;
+	}
+	else
+		m_smoothedDelay = 0.9 * m_smoothedDelay + 0.1 * delay;
+
+	double deltaTime = m_feedbackCount ? (time - m_lastFeedbackTime) / 1000.0 : 0.0;
+	++m_feedbackCount;
+
+	m_delays.push_back(std::make_pair((time - m_firstFeedbackTime) / 1000.0, m_smoothedDelay));
+	if (m_delays.size() > s_trendlineWindow)
+		m_delays.pop_front();
+
+	if (m_delays.size() < s_trendlineWindow)
+		return;
+
+	// Least-squares slope of delay over time
+	double meanTime = 0.0;
+	double meanDelay = 0.0;
+	for (const std::pair<double, double>& sample : m_delays)
+	{
+		meanTime += sample.first;
+		meanDelay += sample.second;
+	}
+	meanTime /= m_delays.size();
+	meanDelay /= m_delays.size();
+
+	double numerator = 0.0;
+	double denominator = 0.0;
+	for (const std::pair<double, double>& sample : m_delays)
+	{
+		numerator += (sample.first - meanTime) * (sample.second - meanDelay);
+		denominator += (sample.first - meanTime) * (sample.first - meanTime);
+	}
+
+	double slope = denominator > 0.0 ? numerator / denominator : 0.0;
+	double trend = (std::min)(m_feedbackCount, 60u) * slope * s_trendlineGain;
+
+	if (trend > m_threshold)
+	{
+		m_overuseTime = (m_overuseTime < 0.0) ? deltaTime / 2 : m_overuseTime + deltaTime;
+		++m_overuseCount;
+
+		// Overuse only once the trend has stayed up for a while and is not already turning
+		if (m_overuseTime > s_overuseTime && m_overuseCount > 1 && trend >= m_previousTrend)
+		{
+			m_overuseTime = 0.0;
+			m_overuseCount = 0;
+			m_state.usage = USAGE_OVERUSE;
+		}
+	}
+	else if (trend < -m_threshold)
+	{
+		m_overuseTime = -1.0;
+		m_overuseCount = 0;
+		m_state.usage = USAGE_UNDERUSE;
+	}
+	else
+	{
+		m_overuseTime = -1.0;
+		m_overuseCount = 0;
+		m_state.usage = USAGE_NORMAL;
+	}
+
+	m_previousTrend = trend;
+	UpdateThreshold(trend, time);
+}
+
+
+
+/**
+ * @brief Adapts the overuse threshold to the trend, so the detector neither starves against
+ * loss-based competing flows nor reacts to the jitter of every path.
+ * @param trend
+ * @param time
+ */
+void RateController::UpdateThreshold(double trend, uint64_t time)
+{
+	if (m_lastThresholdUpdate == 0)
+		m_lastThresholdUpdate = time;
+
+	// Spikes far above the threshold are outliers, not a new normal
+	double absTrend = std::fabs(trend);
+	if (absTrend > m_threshold + 15.0)
+	{
+		m_lastThresholdUpdate = time;
+		return;
+	}
+
+	double k = (absTrend < m_threshold) ? 0.039 : 0.0087;
+	double deltaTime = (std::min)((time - m_lastThresholdUpdate) / 1000.0, 100.0);
+
+	m_threshold += k * (absTrend - m_threshold) * deltaTime;
+	m_threshold = (std::min)((std::max)(m_threshold, 6.0), 600.0);
+	m_lastThresholdUpdate = time;
+}
+
+
+
+/**
+ * @brief AIMD on the detector's output: grow while the path is fine (multiplicatively until congestion
+ * was seen, additively once the link capacity is known), back off to below the measured throughput on
+ * overuse or a standing queue in the sender or on the path, hold on underuse and while the queue drains.
+ * @param time
+ */
+void RateController::UpdateDelayBasedRate(uint64_t time)
+{
+	double deltaTime = (std::min)(time - m_lastDelayUpdate, s_window) / 1e6;
+	m_lastDelayUpdate = time;
+
+	bool feedbackFresh = m_hasFeedback && time - m_lastFeedbackTime <= s_feedbackTimeout;
+	// A standing queue on the path keeps the RTT up without a trend the detector would see
+	bool pathQueueFull = feedbackFresh && m_state.rtt > m_minRtt + m_config.maxQueueDelay;
+	bool queueFull = pathQueueFull || m_state.queueDelay > m_config.maxQueueDelay;
+	bool queueBuilding = m_state.queueDelay > m_config.maxQueueDelay / 2;
+
+	if (queueFull || (feedbackFresh && m_state.usage == USAGE_OVERUSE))
+		m_rateControlState = RATE_DECREASE;
+	else if (!feedbackFresh || queueBuilding || m_state.usage == USAGE_UNDERUSE)
+		m_rateControlState = RATE_HOLD;
+	else if (m_rateControlState == RATE_HOLD)
+		m_rateControlState = RATE_INCREASE;
+
+	double throughput = m_state.throughput;
+
+	// More got through than the link was thought to carry, the path has changed. What was only sent says
+	// nothing here: it may still be queued
+	if (m_linkCapacity >= 0.0 && GetRecentRate(m_received, time) > m_linkCapacity * 1000.0 * (1.0 + s_capacityMargin))
+		m_linkCapacity = -1.0;
+
+	switch (m_rateControlState)
+	{
+	case RATE_HOLD:
+		break;
+
+	case RATE_INCREASE:
+	{
+		double bitrate = m_delayBasedBitrate;
+		if (m_linkCapacity >= 0.0)
+		{
+			// Congestion set in around here last time: creep up by a fraction of the rate per response time
+			double responseTime = (m_state.rtt + 100000) / 1e6;
+			bitrate += (std::max)(bitrate * 0.002, s_packetBits) * deltaTime / responseTime;
+		}
+		else
+			bitrate *= std::pow(s_increaseFactor, deltaTime);
+
+		// Not far beyond what actually gets through, and not far beyond what is applied
+		if (throughput > 0.0 && bitrate > 1.5 * throughput + 10000.0)
+			bitrate = (std::max)(m_delayBasedBitrate, 1.5 * throughput + 10000.0);
+		bitrate = (std::min)(bitrate, m_state.bitrate * (1.0 + 2 * m_config.maxIncreaseStep));
+
+		m_delayBasedBitrate = (std::max)(bitrate, m_delayBasedBitrate);
+		break;
+	}
+
+	case RATE_DECREASE:
+	{
+		// Once per round trip, so the previous back-off can take effect first
+		uint64_t interval = (std::max)(m_state.rtt, 100000u);
+		if (m_lastDecrease == 0 || time - m_lastDecrease >= interval)
+		{
+			// What the link delivers right now, not the second-long average that still lags behind an increase
+			double capacity = GetRecentThroughput(time);
+			if (capacity <= 0.0)
+				capacity = throughput;
+
+			double bitrate = s_beta * (capacity > 0.0 ? capacity : m_delayBasedBitrate);
+			m_delayBasedBitrate = (std::min)(bitrate, m_delayBasedBitrate);
+
+			if (capacity > 0.0)
+			{
+				// Well below the old capacity estimate, the path has changed
+				double capacityKbps = capacity / 1000.0;
+				double stddev = std::sqrt(m_linkCapacityVariance * (std::max)(m_linkCapacity, 1.0));
+				if (m_linkCapacity >= 0.0 && capacityKbps < m_linkCapacity - 3 * stddev)
+					m_linkCapacity = -1.0;
+
+				UpdateLinkCapacity(capacityKbps);
+			}
+
+			m_lastDecrease = time;
+		}
+
+		m_rateControlState = RATE_HOLD;
+		break;
+	}
+	}
+
+	m_delayBasedBitrate = Clamp(m_delayBasedBitrate);
+}
+
+
+
+/**
+ * @brief Loss-based estimate: grows 8% per second under 2% loss, backs off by half the loss above 10%.
+ * @param time
+ */
+void RateController::UpdateLossBasedRate(uint64_t time)
+{
+	double deltaTime = (std::min)(time - m_lastLossUpdate, s_window) / 1e6;
+	m_lastLossUpdate = time;
+
+	if (!m_hasFeedback || time - m_lastFeedbackTime > s_feedbackTimeout)
+		return;
+
+	if (m_state.loss < s_lowLoss)
+	{
+		// Grows from what is applied, so it does not run ahead while the delay-based estimate limits
+		double base = (std::min)(m_lossBasedBitrate, m_state.bitrate * (1.0 + m_config.maxIncreaseStep));
+		m_lossBasedBitrate = base * std::pow(s_increaseFactor, deltaTime);
+	}
+	else if (m_state.loss > s_highLoss)
+	{
+		uint64_t interval = 300000 + m_state.rtt;
+		if (m_lastLossDecrease == 0 || time - m_lastLossDecrease >= interval)
+		{
+			m_lossBasedBitrate = m_state.bitrate * (1.0 - 0.5 * m_state.loss);
+			m_lastLossDecrease = time;
+		}
+	}
+
+	m_lossBasedBitrate = Clamp(m_lossBasedBitrate);
+}
+
+
+
+/**
+ * @brief Tracks the throughput at which congestion sets in, and how much it varies.
+ * @param throughput kbps
+ */
+void RateController::UpdateLinkCapacity(double throughput)
+{
+	const double alpha = 0.05;
+
+	if (m_linkCapacity < 0.0)
+		m_linkCapacity = throughput;
+	else
+		m_linkCapacity = (1.0 - alpha) * m_linkCapacity + alpha * throughput;
+
+	double error = m_linkCapacity - throughput;
+	m_linkCapacityVariance = (1.0 - alpha) * m_linkCapacityVariance + alpha * error * error / (std::max)(m_linkCapacity, 1.0);
+	m_linkCapacityVariance = (std::min)((std::max)(m_linkCapacityVariance, 0.4), 2.5);
+}
+
+
+
+/**
+ * @brief Bits per second the client receives, or the encoder produces while the client does not say.
+ * @param time
+ * @return 0 until there is enough history
+ */
+uint32_t RateController::GetThroughput(uint64_t time)
+{
+	uint32_t received = GetRate(m_received, m_receivedBytes, m_firstReceived, time);
+	uint32_t encoded = GetRate(m_encoded, m_encodedBytes, m_firstEncoded, time);
+	return (!m_received.empty() && received > 0) ? received : encoded;
+}
+
+
+
+/**
+ * @brief Bits per second the client received over the last s_capacityWindow, or the encoder produced
+ * while the client does not say.
+ * @param time
+ * @return 0 without at least two samples in the window
+ */
+uint32_t RateController::GetRecentThroughput(uint64_t time) const
+{
+	uint32_t received = GetRecentRate(m_received, time);
+	return (received > 0) ? received : GetRecentRate(m_encoded, time);
+}
+
+
+
+/**
+ * @brief Rate of the most recent samples. Each sample counts what arrived since the one before it, so the
+ * oldest one in the window only marks where the span starts.
+ * @param samples
+ * @param time
+ * @return Bits per second, 0 without at least two samples in the window
+ */
+uint32_t RateController::GetRecentRate(const std::deque<Sample>& samples, uint64_t time)
+{
+	uint64_t total = 0;
+	auto oldest = samples.rend();
+
+	for (auto it = samples.rbegin(); it != samples.rend() && it->time + s_capacityWindow > time; ++it)
+	{
+		if (oldest != samples.rend())
+			total += oldest->value;
+		oldest = it;
+	}
+
+	if (oldest == samples.rend() || samples.back().time <= oldest->time)
+		return 0;
+
+	uint64_t start = oldest->time;
+
+	return static_cast<uint32_t>((std::min)(total * 8 * 1000000 / (samples.back().time - start), static_cast<uint64_t>(UINT32_MAX)));
+}
+
+
+
+/**
+ * @brief Rate of the samples in the window that ends at time.
+ * @param samples Older samples are dropped
+ * @param total Sum of the samples' values
+ * @param first Time of the first sample ever
+ * @param time
+ * @return Bits per second, 0 with less than 100 ms of history
+ */
+uint32_t RateController::GetRate(std::deque<Sample>& samples, uint64_t& total, uint64_t first, uint64_t time)
+{
+	while (!samples.empty() && samples.front().time + s_window <= time)
+	{
+		total -= samples.front().value;
+		samples.pop_front();
+	}
+
+	if (first == UINT64_MAX || time < first + 100000)
+		return 0;
+
+	uint64_t span = (std::min)(time - first, s_window);
+	return static_cast<uint32_t>((std::min)(total * 8 * 1000000 / span, static_cast<uint64_t>(UINT32_MAX)));
+}
+
+
+
+/**
+ * @brief Limits a rate to the configured range.
+ * @param bitrate
+ * @return
+ */
+uint32_t RateController::Clamp(double bitrate) const
+{
+	return static_cast<uint32_t>((std::min)((std::max)(bitrate, static_cast<double>(m_config.minBitrate)), static_cast<double>(m_config.maxBitrate)));
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <utility>
+
+
+/**
+ * @brief Closed-loop bitrate controller for one stream, after Google Congestion Control: a delay-based
+ * estimate (trendline of the client's round-trip times, AIMD on top of it), a loss-based estimate, and
+ * caps from the sender's queue and, in the spirit of BBR, the RTT above its recent minimum, which drain
+ * queues before rate is added again.
+ *
+ * The controller never reads a clock: every input and Update() carry the caller's time in microseconds,
+ * so a recorded or simulated network trace replays to exactly the same rates. It is not thread-safe.
+ */
+class RateController
+{
+public:
+	struct Config
+	{
+		uint32_t minBitrate = 8 * 1024 * 1024;
+		uint32_t maxBitrate = 256 * 1024 * 1024;
+		uint32_t startBitrate = 20 * 1024 * 1024;
+
+		uint32_t maxQueueDelay = 100000;        // Send queue, in microseconds at the target rate, above which it is drained
+		float hysteresis = 0.05f;               // Smallest relative change that is applied
+		uint32_t minIncreaseInterval = 500000;  // Microseconds between two increases; decreases apply right away
+		float maxIncreaseStep = 0.25f;          // Largest relative increase applied at once
+	};
+
+	// Delay trend, as GCC's overuse detector classifies it
+	enum Usage
+	{
+		USAGE_NORMAL,
+		USAGE_UNDERUSE,
+		USAGE_OVERUSE
+	};
+
+	struct State
+	{
+		uint32_t bitrate = 0;                   // Applied, i.e. last returned by Update()
+		uint32_t delayBasedBitrate = 0;
+		uint32_t lossBasedBitrate = 0;
+		uint32_t throughput = 0;                // Received (or, without reports, encoded) bits per second
+		uint32_t rtt = 0;                       // Smoothed, microseconds
+		float loss = 0.0f;
+		uint32_t queueDelay = 0;                // Microseconds
+		Usage usage = USAGE_NORMAL;
+	};
+
+	RateController(const Config& config);
+
+	void OnFrameEncoded(uint64_t time, uint32_t bytes);
+	void OnFeedback(uint64_t time, uint32_t rtt, float loss, uint64_t receivedBytes);
+	void OnSendQueue(uint64_t time, uint32_t queuedBytes);
+
+	bool Update(uint64_t time, uint32_t& bitrate);
+
+	const State& GetState() const { return m_state; }
+	const Config& GetConfig() const { return m_config; }
+
+private:
+	enum RateControlState
+	{
+		RATE_HOLD,
+		RATE_INCREASE,
+		RATE_DECREASE
+	};
+
+	struct Sample
+	{
+		uint64_t time;
+		uint64_t value;
+	};
+
+	void DetectOveruse(uint64_t time, uint32_t rtt);
+	void UpdateThreshold(double trend, uint64_t time);
+	void UpdateDelayBasedRate(uint64_t time);
+	void UpdateLossBasedRate(uint64_t time);
+	void UpdateLinkCapacity(double throughput);
+	uint32_t GetThroughput(uint64_t time);
+	uint32_t GetRecentThroughput(uint64_t time) const;
+	static uint32_t GetRate(std::deque<Sample>& samples, uint64_t& total, uint64_t first, uint64_t time);
+	static uint32_t GetRecentRate(const std::deque<Sample>& samples, uint64_t time);
+	uint32_t Clamp(double bitrate) const;
+
+private:
+	Config m_config;
+	State m_state;
+
+	// Throughput over the last second: bytes the client reported, and bytes the encoder produced
+	std::deque<Sample> m_received;
+	std::deque<Sample> m_encoded;
+	uint64_t m_receivedBytes = 0;
+	uint64_t m_encodedBytes = 0;
+	uint64_t m_firstReceived = UINT64_MAX;      // Time of the first sample, so rates are not underestimated at the start
+	uint64_t m_firstEncoded = UINT64_MAX;
+
+	// Trendline of the smoothed RTT (time in ms, delay in ms)
+	std::deque<std::pair<double, double>> m_delays;
+	double m_smoothedDelay = 0.0;
+	uint64_t m_firstFeedbackTime = 0;
+	uint64_t m_lastFeedbackTime = 0;
+	uint32_t m_feedbackCount = 0;
+	bool m_hasFeedback = false;
+	double m_threshold = 12.5;
+	uint64_t m_lastThresholdUpdate = 0;
+	double m_previousTrend = 0.0;
+	double m_overuseTime = -1.0;                // ms above the threshold, < 0 while below it
+	uint32_t m_overuseCount = 0;
+	uint32_t m_minRtt = 0;
+	uint64_t m_minRttTime = 0;
+
+	// AIMD state of the delay-based estimate
+	RateControlState m_rateControlState = RATE_HOLD;
+	double m_delayBasedBitrate;
+	uint64_t m_lastDelayUpdate = 0;
+	uint64_t m_lastDecrease = 0;
+	double m_linkCapacity = -1.0;               // kbps, EWMA of the recent throughput at decreases; < 0 while unknown
+	double m_linkCapacityVariance = 0.4;
+
+	double m_lossBasedBitrate;
+	uint64_t m_lastLossUpdate = 0;
+	uint64_t m_lastLossDecrease = 0;
+
+	uint64_t m_queuedBytes = 0;
+	uint64_t m_lastIncrease = 0;
+	bool m_started = false;
+};
@@ -59,15 +59,21 @@ inline void NVENC_THROW(NVENCSTATUS code, const std::string& errorMessage)
 	}
 }
 
+const uint32_t Encoder::s_minRate;
+const uint32_t Encoder::s_maxRate;
+const uint32_t Encoder::s_refFrames;
+
 Encoder::Encoder():
 	m_nvencHandle(nullptr),
 	m_nvencFuncs(),
 	m_nvencConfig(),
 	m_nvencEncoder(nullptr),
 	m_forceReinit(true),
-	m_hevc(true)
+	m_hevc(true),
+	m_traceSession(FrameTrace::CreateSession("Encoder")),
+	m_leaseOwner(std::make_shared<LeaseOwner>())
 {
-
+	m_leaseOwner->encoder = this;
 }
 
 /**
@@ -130,12 +136,93 @@ void Encoder::Init(NV_ENC_DEVICE_TYPE deviceType, void* device, uint32_t width,
 	m_nvencParams.encodeConfig = &m_nvencConfig;
 	m_nvencParams.enablePTD = 1;
 
+	// Loss recovery by reference invalidation needs older frames in the DPB to fall back to
+	NV_ENC_CAPS_PARAM invalidationCaps = { NV_ENC_CAPS_PARAM_VER };
+	invalidationCaps.capsToQuery = NV_ENC_CAPS_SUPPORT_REF_PIC_INVALIDATION;
+
+	int invalidationSupport = 0;
+	if (m_nvencFuncs.nvEncGetEncodeCaps(m_nvencEncoder, m_nvencParams.encodeGUID, &invalidationCaps, &invalidationSupport) == NV_ENC_SUCCESS && invalidationSupport)
+		m_refFrames = s_refFrames;
+
 	SetupEncoder(bitrate);
 
+#if defined(_WIN32)
+	// Completion events are only available on Windows; on Linux the ring is drained with blocking/polling locks instead
+	if (m_pipelineDepth > 1)
+	{
+		NV_ENC_CAPS_PARAM capsParam = { NV_ENC_CAPS_PARAM_VER };
+		capsParam.capsToQuery = NV_ENC_CAPS_ASYNC_ENCODE_SUPPORT;
+
+		int asyncSupport = 0;
+		if (m_nvencFuncs.nvEncGetEncodeCaps(m_nvencEncoder, m_nvencParams.encodeGUID, &capsParam, &asyncSupport) == NV_ENC_SUCCESS)
+			m_asyncEncode = (asyncSupport != 0);
+	}
+#endif
+	m_nvencParams.enableEncodeAsync = m_asyncEncode ? 1 : 0;
+
 	NVENC_THROW(m_nvencFuncs.nvEncInitializeEncoder(m_nvencEncoder, &m_nvencParams),
 		"Failed to initialize encoder");
 
-	CreateBitstream(width * height); // TODO: currently just a guess, GFN uses a fixed 1MB.
+	CreateSlots();
+
+	// Freshly initialized with exactly these parameters, nothing to reconfigure on the first frame
+	m_forceReinit = false;
+}
+
+
+
+/**
+ * @brief Sets the number of frames that may be in flight at once (must be called before Init).
+ * @param depth
+ */
+void Encoder::SetPipelineDepth(uint32_t depth)
+{
+	assert(!m_nvencEncoder);
+	m_pipelineDepth = (std::max)(depth, 1u);
+}
+
+
+
+/**
+ * @brief Sets whether SPS/PPS (and VPS) are repeated in front of every IDR (must be called before Init).
+ * Containers that carry them out of band, see GetSequenceParams(), can turn this off.
+ * @param repeat
+ */
+void Encoder::SetRepeatParameterSets(bool repeat)
+{
+	assert(!m_nvencEncoder);
+	m_repeatParameterSets = repeat;
+}
+
+
+
+/**
+ * @brief Gets the current parameter sets (VPS for HEVC, SPS, PPS) in Annex-B format. They change on
+ * resolution changes, so fetch them again after one.
+ * @param buffer
+ * @return false if there is no encode session.
+ */
+bool Encoder::GetSequenceParams(std::vector<uint8_t>& buffer)
+{
+	if (!m_nvencEncoder)
+		return false;
+
+	// Parameter sets are a few dozen bytes; this leaves plenty of room for long VUI and scaling lists
+	uint32_t payloadSize = 0;
+	buffer.resize(1024);
+
+	NV_ENC_SEQUENCE_PARAM_PAYLOAD payload;
+	memset(&payload, 0, sizeof(payload));
+	payload.version = NV_ENC_SEQUENCE_PARAM_PAYLOAD_VER;
+	payload.inBufferSize = static_cast<uint32_t>(buffer.size());
+	payload.spsppsBuffer = buffer.data();
+	payload.outSPSPPSPayloadSize = &payloadSize;
+
+	NVENC_THROW(m_nvencFuncs.nvEncGetSequenceParams(m_nvencEncoder, &payload),
+		"Failed to get sequence parameters");
+
+	buffer.resize(payloadSize);
+	return true;
 }
 
 
@@ -145,13 +232,42 @@ void Encoder::Init(NV_ENC_DEVICE_TYPE deviceType, void* device, uint32_t width,
  */
 Encoder::~Encoder()
 {
+	// EncodedFrames released from now on leave the session alone
+	{
+		std::lock_guard<std::mutex> lock(m_leaseOwner->mutex);
+		m_leaseOwner->encoder = nullptr;
+	}
+
 	if (!m_nvencEncoder)
 		return;
 
-	if (m_registeredResource)
-		m_nvencFuncs.nvEncUnregisterResource(m_nvencEncoder, m_registeredResource);
+	// Frames still handed out lose their buffers, which are destroyed below
+	for (EncodeSlot& slot : m_slots)
+	{
+		if (!slot.leased)
+			continue;
+
+		m_nvencFuncs.nvEncUnlockBitstream(m_nvencEncoder, slot.bitstreamBuffer);
+		slot.leased = false;
+	}
+	m_leasedFrames = 0;
+
+	// Drain whatever is still in flight so the driver releases the mapped inputs
+	while (m_pendingFrames > 0)
+	{
+		EncodeSlot& slot = m_slots[(m_submitSlot + m_slots.size() - m_pendingFrames) % m_slots.size()];
+
+		NV_ENC_LOCK_BITSTREAM lockBitstreamData = { NV_ENC_LOCK_BITSTREAM_VER };
+		lockBitstreamData.outputBitstream = slot.bitstreamBuffer;
+		if (m_nvencFuncs.nvEncLockBitstream(m_nvencEncoder, &lockBitstreamData) == NV_ENC_SUCCESS)
+			m_nvencFuncs.nvEncUnlockBitstream(m_nvencEncoder, slot.bitstreamBuffer);
 
-	m_nvencFuncs.nvEncDestroyBitstreamBuffer(m_nvencEncoder, m_bitstreamBuffer);
+		UnmapSlotInput(slot);
+		--m_pendingFrames;
+	}
+
+	DestroySlots();
+	EvictRegistrations(0);
 	m_nvencFuncs.nvEncDestroyEncoder(m_nvencEncoder);
 }
 
@@ -161,6 +277,7 @@ Encoder::~Encoder()
 
 /**
  * @brief Base encode method which is called by the different specialized subclasses.
+ * Submits the frame and blocks until its bitstream has been copied out, i.e. a pipeline of depth one.
  * @param resourceType
  * @param resource
  * @param format
@@ -172,26 +289,101 @@ Encoder::~Encoder()
  */
 void Encoder::Encode(NV_ENC_INPUT_RESOURCE_TYPE resourceType, void* resource, NV_ENC_BUFFER_FORMAT format, uint32_t pitch, uint32_t width, uint32_t height, bool iFrame, std::vector<uint8_t>& buffer)
 {
+	// Mixing the blocking path with queued Submit() calls would hand back someone else's frame
+	assert(m_pendingFrames == 0);
+
+	Submit(resourceType, resource, format, pitch, width, height, iFrame);
+	Retrieve(buffer, true);
+}
+
+
+
+/**
+ * @brief Queues a frame for encoding without waiting for its output.
+ * The input stays mapped until the matching Retrieve() call. Throws if all slots are in flight.
+ * @param resourceType
+ * @param resource
+ * @param format
+ * @param pitch
+ * @param width
+ * @param height
+ * @param iFrame
+ */
+void Encoder::Submit(NV_ENC_INPUT_RESOURCE_TYPE resourceType, void* resource, NV_ENC_BUFFER_FORMAT format, uint32_t pitch, uint32_t width, uint32_t height, bool iFrame)
+{
+	if (IsPipelineFull())
+		throw std::runtime_error("Encode pipeline is full, retrieve or release pending frames first");
+
+	// One clock read per stage boundary, none at all while stats and tracing are disabled
+	const bool timed = IsTimed();
+	EncoderStats::Ticks time = 0;
+	if (timed)
+		time = EncoderStats::Now();
+
+	EncodeSlot& slot = m_slots[m_submitSlot];
+	slot.submitTime = time;
+
 	// Preprocess input and resize (if necessary)
-	PrepareEncode(resourceType, resource, format, pitch, width, height);
+	PrepareEncode(width, height);
+
+	// Buffers are only reallocated when a resize or rate change made them too small, never shrunk
+	uint32_t requiredSize = GetRequiredBitstreamSize();
+	if (slot.bitstreamSize < requiredSize)
+	{
+		NVENC_THROW(m_nvencFuncs.nvEncDestroyBitstreamBuffer(m_nvencEncoder, slot.bitstreamBuffer),
+			"Failed to destroy bitstream buffer");
+
+		slot.bitstreamBuffer = nullptr;
+		slot.bitstreamSize = 0;
+
+		slot.bitstreamBuffer = CreateBitstream(requiredSize);
+		slot.bitstreamSize = requiredSize;
+	}
+
+	// Frames the client lost are dropped from the references, or, if that is not enough, this frame becomes an IDR.
+	// Done before the input is mapped, so nothing has to be undone if it fails
+	uint64_t lostFrame = UINT64_MAX;
+	if (ApplyInvalidation(m_frameNumber, lostFrame))
+		iFrame = true;
+
+	if (timed)
+		time = RecordStage(EncoderStats::STAGE_PREPARE, time, m_frameNumber);
+
+	Registration& registration = AcquireRegistration(resourceType, resource, format, pitch, width, height);
+
+	if (timed)
+		time = RecordStage(EncoderStats::STAGE_REGISTER, time, m_frameNumber);
 
 	NV_ENC_MAP_INPUT_RESOURCE mapInputResource = { NV_ENC_MAP_INPUT_RESOURCE_VER };
-	mapInputResource.registeredResource = m_registeredResource;
+	mapInputResource.registeredResource = registration.registeredResource;
 
 	NVENC_THROW(m_nvencFuncs.nvEncMapInputResource(m_nvencEncoder, &mapInputResource),
 		"Failed to map input resource");
 
+	slot.registration = &registration;
+	slot.mappedResource = mapInputResource.mappedResource;
+	++registration.mapCount;
+	slot.frameNumber = m_frameNumber++;
+
+	if (timed)
+		time = RecordStage(EncoderStats::STAGE_MAP, time, slot.frameNumber);
+
+	if (iFrame)
+		m_lastIdrFrame = slot.frameNumber;
+
 	// Do the encode
 	NV_ENC_PIC_PARAMS picParams = {};
 	picParams.version = NV_ENC_PIC_PARAMS_VER;
 	picParams.pictureStruct = NV_ENC_PIC_STRUCT_FRAME;
-	picParams.inputBuffer = mapInputResource.mappedResource;
+	picParams.inputBuffer = slot.mappedResource;
 	picParams.bufferFmt = format;
 	//picParams.pictureType = NV_ENC_PIC_TYPE_P;
 	picParams.inputWidth = width;
 	picParams.inputHeight = height;
-	picParams.outputBitstream = m_bitstreamBuffer;
-	picParams.completionEvent = NULL;
+	picParams.frameIdx = static_cast<uint32_t>(slot.frameNumber);
+	picParams.inputTimeStamp = slot.frameNumber;
+	picParams.outputBitstream = slot.bitstreamBuffer;
+	picParams.completionEvent = m_asyncEncode ? slot.completionEvent : NULL;
 	if (iFrame)
 		picParams.encodePicFlags = NV_ENC_PIC_FLAG_FORCEIDR | NV_ENC_PIC_FLAG_OUTPUT_SPSPPS;
 
@@ -203,153 +395,493 @@ void Encoder::Encode(NV_ENC_INPUT_RESOURCE_TYPE resourceType, void* resource, NV
 		hevcpicParams.sliceModeData = 0;
 	}
 
-	NVENC_THROW(m_nvencFuncs.nvEncEncodePicture(m_nvencEncoder, &picParams),
-		"Failed to encode picture");
+	NVENCSTATUS status = m_nvencFuncs.nvEncEncodePicture(m_nvencEncoder, &picParams);
+	if (timed)
+	{
+		time = RecordStage(EncoderStats::STAGE_ENCODE, time, slot.frameNumber);
+		if (FrameTrace::IsEnabled())
+			FrameTrace::Record(FrameTrace::EVENT_SUBMIT, m_traceSession, slot.frameNumber, slot.submitTime, time);
+	}
 
-	NV_ENC_LOCK_BITSTREAM lockBitstreamData = { NV_ENC_LOCK_BITSTREAM_VER };
+	if (status != NV_ENC_SUCCESS)
+	{
+		UnmapSlotInput(slot);
+		NVENC_THROW(status, "Failed to encode picture");
+	}
+
+	// The loss report is only consumed once a frame that handles it is in the encoder, so a failed submit retries it
+	if (lostFrame != UINT64_MAX)
+	{
+		std::lock_guard<std::mutex> lock(m_invalidationMutex);
+		if (m_invalidFrame >= lostFrame)
+			m_invalidFrame = UINT64_MAX;
+	}
+
+	m_submitSlot = (m_submitSlot + 1) % m_slots.size();
+	++m_pendingFrames;
+}
+
+
+
+/**
+ * @brief Whether Submit() would have to wait for a Retrieve() or an EncodedFrame release first.
+ * @return
+ */
+bool Encoder::IsPipelineFull() const
+{
+	if (m_pendingFrames >= m_slots.size())
+		return true;
+
+	std::lock_guard<std::mutex> lock(m_leaseMutex);
+	return m_slots[m_submitSlot].leased;
+}
 
-	lockBitstreamData.outputBitstream = m_bitstreamBuffer;
-	lockBitstreamData.doNotWait = false;
 
-	NVENC_THROW(m_nvencFuncs.nvEncLockBitstream(m_nvencEncoder, &lockBitstreamData),
-		"Failed to lock bitstream");
+
+/**
+ * @brief Copies out the oldest frame in flight and returns its slot to the ring.
+ * @param buffer
+ * @param wait If false, returns immediately when the oldest frame is still being encoded.
+ * @return true if a frame was written to buffer.
+ */
+bool Encoder::Retrieve(std::vector<uint8_t>& buffer, bool wait)
+{
+	NV_ENC_LOCK_BITSTREAM lockBitstreamData = { NV_ENC_LOCK_BITSTREAM_VER };
+	EncodeSlot* slot = PopSlot(wait, lockBitstreamData);
+	if (!slot)
+		return false;
 
 	uint8_t *pData = (uint8_t*)lockBitstreamData.bitstreamBufferPtr;
 
 	buffer.clear();
 	buffer.insert(buffer.begin(), &pData[0], &pData[lockBitstreamData.bitstreamSizeInBytes]);
 
-	NVENC_THROW(m_nvencFuncs.nvEncUnlockBitstream(m_nvencEncoder, lockBitstreamData.outputBitstream),
+	const bool timed = IsTimed() && slot->stageTime != 0;
+	EncoderStats::Ticks time = 0;
+	if (timed)
+		time = RecordStage(EncoderStats::STAGE_COPY, slot->stageTime, slot->frameNumber);
+
+	NVENC_THROW(m_nvencFuncs.nvEncUnlockBitstream(m_nvencEncoder, slot->bitstreamBuffer),
 		"Failed to unlock bitstream");
 
-	NVENC_THROW(m_nvencFuncs.nvEncUnmapInputResource(m_nvencEncoder, mapInputResource.mappedResource),
-		"Failed to unmap input resource");
+	if (timed)
+		RecordStage(EncoderStats::STAGE_UNLOCK, time, slot->frameNumber);
+
+	return true;
 }
 
 
 
-std::shared_ptr<NV_ENC_LOCK_BITSTREAM> Encoder::EncodeFrame(NV_ENC_INPUT_RESOURCE_TYPE resourceType, void* resource, NV_ENC_BUFFER_FORMAT format, uint32_t pitch, uint32_t width, uint32_t height, bool iFrame)
+/**
+ * @brief Hands out the oldest frame in flight without copying it.
+ * Its bitstream buffer stays locked (and its slot unavailable to Submit) until the returned frame is released.
+ * @param wait If false, returns nullptr when the oldest frame is still being encoded.
+ * @return
+ */
+std::shared_ptr<EncodedFrame> Encoder::RetrieveFrame(bool wait)
 {
-	// Preprocess input and resize (if necessary)
-	PrepareEncode(resourceType, resource, format, pitch, width, height);
+	NV_ENC_LOCK_BITSTREAM lockBitstreamData = { NV_ENC_LOCK_BITSTREAM_VER };
+	EncodeSlot* slot = PopSlot(wait, lockBitstreamData);
+	if (!slot)
+		return nullptr;
 
-	NV_ENC_MAP_INPUT_RESOURCE mapInputResource = { NV_ENC_MAP_INPUT_RESOURCE_VER };
-	mapInputResource.registeredResource = m_registeredResource;
+	{
+		std::lock_guard<std::mutex> lock(m_leaseMutex);
+		slot->leased = true;
+		++m_leasedFrames;
+	}
 
-	NVENC_THROW(m_nvencFuncs.nvEncMapInputResource(m_nvencEncoder, &mapInputResource),
-		"Failed to map input resource");
+	EncodedFrame* frame = new EncodedFrame();
+	frame->data = (const uint8_t*)lockBitstreamData.bitstreamBufferPtr;
+	frame->size = lockBitstreamData.bitstreamSizeInBytes;
+	frame->pictureType = lockBitstreamData.pictureType;
+	frame->timestamp = lockBitstreamData.outputTimeStamp;
 
-	// Do the encode
-	NV_ENC_PIC_PARAMS picParams = {};
-	picParams.version = NV_ENC_PIC_PARAMS_VER;
-	picParams.pictureStruct = NV_ENC_PIC_STRUCT_FRAME;
-	picParams.inputBuffer = mapInputResource.mappedResource;
-	picParams.bufferFmt = format;
-	//picParams.pictureType = NV_ENC_PIC_TYPE_P;
-	picParams.inputWidth = width;
-	picParams.inputHeight = height;
-	picParams.outputBitstream = m_bitstreamBuffer;
-	picParams.completionEvent = NULL;
-	if (iFrame)
-		picParams.encodePicFlags = NV_ENC_PIC_FLAG_FORCEIDR | NV_ENC_PIC_FLAG_OUTPUT_SPSPPS;
+	std::shared_ptr<LeaseOwner> owner = m_leaseOwner;
+	return std::shared_ptr<EncodedFrame>(frame, [owner, slot](EncodedFrame* f)
+	{
+		{
+			std::lock_guard<std::mutex> lock(owner->mutex);
+			if (owner->encoder)
+				owner->encoder->ReleaseFrame(slot);
+		}
 
-	if (m_hevc)
+		delete f;
+	});
+}
+
+
+
+/**
+ * @brief Encodes a single frame and hands its output out without copying it.
+ * @param resourceType
+ * @param resource
+ * @param format
+ * @param pitch
+ * @param width
+ * @param height
+ * @param iFrame
+ * @return
+ */
+std::shared_ptr<EncodedFrame> Encoder::EncodeFrame(NV_ENC_INPUT_RESOURCE_TYPE resourceType, void* resource, NV_ENC_BUFFER_FORMAT format, uint32_t pitch, uint32_t width, uint32_t height, bool iFrame)
+{
+	assert(m_pendingFrames == 0);
+
+	Submit(resourceType, resource, format, pitch, width, height, iFrame);
+	return RetrieveFrame(true);
+}
+
+
+
+/**
+ * @brief Waits for (or polls) the given slot's output and locks its bitstream.
+ * @param slot
+ * @param wait
+ * @param lockBitstreamData
+ * @return false if the frame is not finished yet and wait is false.
+ */
+bool Encoder::LockSlot(EncodeSlot& slot, bool wait, NV_ENC_LOCK_BITSTREAM& lockBitstreamData)
+{
+#if defined(_WIN32)
+	if (m_asyncEncode)
 	{
-		NV_ENC_PIC_PARAMS_HEVC& hevcpicParams = picParams.codecPicParams.hevcPicParams;
-		hevcpicParams.constrainedFrame = 1;
-		hevcpicParams.sliceMode = 0;
-		hevcpicParams.sliceModeData = 0;
+		DWORD result = WaitForSingleObject(slot.completionEvent, wait ? INFINITE : 0);
+		if (result == WAIT_TIMEOUT)
+			return false;
+		if (result != WAIT_OBJECT_0)
+			throw std::runtime_error("Failed to wait for encode completion event");
 	}
+#endif
+
+	lockBitstreamData.outputBitstream = slot.bitstreamBuffer;
+	lockBitstreamData.doNotWait = !wait && !m_asyncEncode;
+
+	NVENCSTATUS status = m_nvencFuncs.nvEncLockBitstream(m_nvencEncoder, &lockBitstreamData);
+	if (status == NV_ENC_ERR_LOCK_BUSY && lockBitstreamData.doNotWait)
+		return false;
+
+	NVENC_THROW(status, "Failed to lock bitstream");
+	return true;
+}
+
+
+
+/**
+ * @brief Locks the oldest frame in flight and unmaps its input, which the encoder no longer needs.
+ * @param wait
+ * @param lockBitstreamData
+ * @return The popped slot with its bitstream still locked, or nullptr if nothing is ready.
+ */
+Encoder::EncodeSlot* Encoder::PopSlot(bool wait, NV_ENC_LOCK_BITSTREAM& lockBitstreamData)
+{
+	if (m_pendingFrames == 0)
+		return nullptr;
 
-	NVENC_THROW(m_nvencFuncs.nvEncEncodePicture(m_nvencEncoder, &picParams),
-		"Failed to encode picture");
+	EncodeSlot& slot = m_slots[(m_submitSlot + m_slots.size() - m_pendingFrames) % m_slots.size()];
 
-	auto lockBitstreamData = std::make_shared<NV_ENC_LOCK_BITSTREAM>(NV_ENC_LOCK_BITSTREAM{ NV_ENC_LOCK_BITSTREAM_VER });
-//	NV_ENC_LOCK_BITSTREAM lockBitstreamData = { NV_ENC_LOCK_BITSTREAM_VER };
+	// A slot submitted while stats and tracing were disabled has no submit time to measure from
+	const bool timed = IsTimed() && slot.submitTime != 0;
+	EncoderStats::Ticks time = 0;
+	if (timed)
+		time = EncoderStats::Now();
 
-	lockBitstreamData->outputBitstream = m_bitstreamBuffer;
-	lockBitstreamData->doNotWait = false;
+	if (!LockSlot(slot, wait, lockBitstreamData))
+		return nullptr;
+
+	--m_pendingFrames;
+
+	bool idr = lockBitstreamData.pictureType == NV_ENC_PIC_TYPE_IDR;
+	if (timed)
+	{
+		time = RecordStage(EncoderStats::STAGE_LOCK, time, slot.frameNumber, lockBitstreamData.bitstreamSizeInBytes);
+		if (m_stats.IsEnabled())
+			m_stats.Record(EncoderStats::STAGE_LATENCY, slot.submitTime, time);
+	}
+	m_stats.AddFrame(lockBitstreamData.bitstreamSizeInBytes, idr);
 
-	NVENC_THROW(m_nvencFuncs.nvEncLockBitstream(m_nvencEncoder, lockBitstreamData.get()),
-		"Failed to lock bitstream");
+	if (idr && FrameTrace::IsEnabled())
+		FrameTrace::Mark(FrameTrace::EVENT_IDR, m_traceSession, slot.frameNumber, lockBitstreamData.bitstreamSizeInBytes);
 
-	// Now just return the struct, we don't unlock it.
+	NVENC_THROW(UnmapSlotInput(slot),
+		"Failed to unmap input resource");
 
-	return lockBitstreamData;
+	if (timed)
+		time = RecordStage(EncoderStats::STAGE_UNMAP, time, slot.frameNumber);
+	slot.stageTime = time;
 
-// 	uint8_t *pData = (uint8_t*)lockBitstreamData.bitstreamBufferPtr;
-// 
-// 	buffer.clear();
-// 	buffer.insert(buffer.begin(), &pData[0], &pData[lockBitstreamData.bitstreamSizeInBytes]);
-// 
-// 	NVENC_THROW(m_nvencFuncs.nvEncUnlockBitstream(m_nvencEncoder, lockBitstreamData.outputBitstream),
-// 		"Failed to unlock bitstream");
-// 
-// 	NVENC_THROW(m_nvencFuncs.nvEncUnmapInputResource(m_nvencEncoder, mapInputResource.mappedResource),
-// 		"Failed to unmap input resource");
+	return &slot;
 }
 
+
+
 /**
- * @brief Pre-encode operations such as resize and color conversion.
- * @param resourceType
- * @param resource
- * @param format
- * @param pitch
+ * @brief Unmaps the slot's input and unpins its registration.
+ * @param slot
+ * @return
+ */
+NVENCSTATUS Encoder::UnmapSlotInput(EncodeSlot& slot)
+{
+	NVENCSTATUS status = m_nvencFuncs.nvEncUnmapInputResource(m_nvencEncoder, slot.mappedResource);
+
+	slot.mappedResource = nullptr;
+	if (slot.registration)
+	{
+		--slot.registration->mapCount;
+		slot.registration = nullptr;
+	}
+
+	return status;
+}
+
+
+
+/**
+ * @brief Unlocks a leased slot's bitstream so Submit() can reuse it. May be called from any thread.
+ * @param slot
+ */
+void Encoder::ReleaseFrame(EncodeSlot* slot)
+{
+	const bool timed = IsTimed();
+	EncoderStats::Ticks time = 0;
+	if (timed)
+		time = EncoderStats::Now();
+
+	// Called from a shared_ptr deleter, so failures can only be ignored here
+	m_nvencFuncs.nvEncUnlockBitstream(m_nvencEncoder, slot->bitstreamBuffer);
+
+	if (timed)
+		RecordStage(EncoderStats::STAGE_UNLOCK, time, slot->frameNumber);
+
+	std::lock_guard<std::mutex> lock(m_leaseMutex);
+	slot->leased = false;
+	--m_leasedFrames;
+}
+
+
+
+/**
+ * @brief Pre-encode operations: resets the encoder when the input size changed.
  * @param width
  * @param height
- * @return
  */
-void Encoder::PrepareEncode(NV_ENC_INPUT_RESOURCE_TYPE resourceType, void* resource, NV_ENC_BUFFER_FORMAT format, uint32_t pitch, uint32_t width, uint32_t height)
+void Encoder::PrepareEncode(uint32_t width, uint32_t height)
 {
 	if (m_forceReinit || (width != m_nvencParams.encodeWidth) || (height != m_nvencParams.encodeHeight))
 	{
-		// Reconfigure encoder and register resource
+		// A reset drops the encoder's state, so frames still in flight would be lost
+		if (m_pendingFrames > 0)
+			throw std::runtime_error("Cannot change encode size while frames are in flight");
+
 		m_nvencParams.encodeWidth = width;
 		m_nvencParams.encodeHeight = height;
 		m_nvencParams.darWidth = width;
 		m_nvencParams.darHeight = height;
 
-		NV_ENC_RECONFIGURE_PARAMS reInitEncodeParams;
-		reInitEncodeParams.version = NV_ENC_RECONFIGURE_PARAMS_VER;
-		reInitEncodeParams.forceIDR = true;
-		reInitEncodeParams.resetEncoder = true;
-		reInitEncodeParams.reInitEncodeParams = m_nvencParams;
+		// Registrations are keyed by size and bitstream buffers grow on demand in Submit(), so both survive the reset
+		Reconfigure(true);
+
+		m_forceReinit = false;
+	}
+}
 
-		NVENC_THROW(m_nvencFuncs.nvEncReconfigureEncoder(m_nvencEncoder, &reInitEncodeParams),
-			"Failed to reconfigure encoder");
 
-		m_nvencFuncs.nvEncDestroyBitstreamBuffer(m_nvencEncoder, m_bitstreamBuffer);
-		CreateBitstream(width * height);
 
-		if (m_registeredResource)
+/**
+ * @brief Looks up the registration for the given input, registering it on a miss.
+ * Swapchains that rotate through a few resources hit the cache every frame after the first round.
+ * @param resourceType
+ * @param resource
+ * @param format
+ * @param pitch
+ * @param width
+ * @param height
+ * @return The registration, now the most recently used entry.
+ */
+Encoder::Registration& Encoder::AcquireRegistration(NV_ENC_INPUT_RESOURCE_TYPE resourceType, void* resource, NV_ENC_BUFFER_FORMAT format, uint32_t pitch, uint32_t width, uint32_t height)
+{
+	for (auto it = m_registrations.begin(); it != m_registrations.end(); ++it)
+	{
+		if (it->resource == resource && it->resourceType == resourceType && it->format == format &&
+			it->pitch == pitch && it->width == width && it->height == height)
 		{
-			NVENC_THROW(m_nvencFuncs.nvEncUnregisterResource(m_nvencEncoder, m_registeredResource),
-				"Failed to unregister resource");
+			m_registrations.splice(m_registrations.begin(), m_registrations, it);
+			return m_registrations.front();
+		}
+	}
+
+	// Make room for the new entry first
+	EvictRegistrations(m_registrationCacheSize - 1);
+
+	NV_ENC_REGISTER_RESOURCE registerResource = { NV_ENC_REGISTER_RESOURCE_VER };
+	registerResource.width = width;
+	registerResource.height = height;
+	registerResource.resourceType = resourceType;
+	registerResource.resourceToRegister = resource;
+	registerResource.bufferFormat = format;
+	registerResource.pitch = pitch;
+
+	NVENC_THROW(m_nvencFuncs.nvEncRegisterResource(m_nvencEncoder, &registerResource),
+		"Failed to register resource");
+
+	Registration registration;
+	registration.resource = resource;
+	registration.resourceType = resourceType;
+	registration.format = format;
+	registration.pitch = pitch;
+	registration.width = width;
+	registration.height = height;
+	registration.registeredResource = registerResource.registeredResource;
+
+	m_registrations.push_front(registration);
+	return m_registrations.front();
+}
+
+
 
-			m_registeredResource = nullptr;
+/**
+ * @brief Unregisters least recently used entries until at most keep remain.
+ * Entries used by frames in flight are skipped, so the cache may temporarily stay above keep.
+ * @param keep
+ */
+void Encoder::EvictRegistrations(size_t keep)
+{
+	auto it = m_registrations.end();
+	while (m_registrations.size() > keep && it != m_registrations.begin())
+	{
+		--it;
+		if (it->mapCount == 0)
+		{
+			m_nvencFuncs.nvEncUnregisterResource(m_nvencEncoder, it->registeredResource);
+			it = m_registrations.erase(it);
 		}
+	}
+}
+
+
 
-		NV_ENC_REGISTER_RESOURCE registerResource = { NV_ENC_REGISTER_RESOURCE_VER };
-		registerResource.width = width;
-		registerResource.height = height;
-		registerResource.resourceType = resourceType;
-		registerResource.resourceToRegister = resource;
-		registerResource.bufferFormat = format;
-		registerResource.pitch = pitch;
+/**
+ * @brief Sets how many input registrations are kept around (at least one).
+ * @param size
+ */
+void Encoder::SetRegistrationCacheSize(uint32_t size)
+{
+	m_registrationCacheSize = (std::max)(size, 1u);
+	EvictRegistrations(m_registrationCacheSize);
+}
 
-		NVENC_THROW(m_nvencFuncs.nvEncRegisterResource(m_nvencEncoder, &registerResource),
-			"Failed to register resource");
 
-		m_registeredResource = registerResource.registeredResource;
 
-		m_forceReinit = false;
+/**
+ * @brief Drops all registrations of the given resource, e.g. before the caller frees it.
+ * @param resource
+ * @return false if the resource is still used by a frame in flight (those registrations are kept).
+ */
+bool Encoder::UnregisterResource(void* resource)
+{
+	bool unregistered = true;
+
+	for (auto it = m_registrations.begin(); it != m_registrations.end();)
+	{
+		if (it->resource != resource)
+		{
+			++it;
+		}
+		else if (it->mapCount > 0)
+		{
+			unregistered = false;
+			++it;
+		}
+		else
+		{
+			m_nvencFuncs.nvEncUnregisterResource(m_nvencEncoder, it->registeredResource);
+			it = m_registrations.erase(it);
+		}
 	}
+
+	return unregistered;
+}
+
+
+
+/**
+ * @brief Drops all registrations that are not used by frames in flight.
+ */
+void Encoder::ClearRegistrations()
+{
+	EvictRegistrations(0);
+}
+
+
+
+/**
+ * @brief Reports frames the client could not decode, e.g. because packets were lost. Before the next frame
+ * is encoded, they and every frame encoded after them are invalidated as references, so the encoder predicts
+ * from an older frame the client still has instead of sending an IDR. Where no such frame is left in the DPB,
+ * or the driver does not support invalidation, the next frame is an IDR. May be called from any thread.
+ * @param timestamps EncodedFrame::timestamp of the lost frames
+ * @param count
+ */
+void Encoder::InvalidateRefFrames(const uint64_t* timestamps, size_t count)
+{
+	if (!timestamps || count == 0)
+		return;
+
+	std::lock_guard<std::mutex> lock(m_invalidationMutex);
+
+	for (size_t i = 0; i < count; ++i)
+		m_invalidFrame = (std::min)(m_invalidFrame, timestamps[i]);
 }
 
 
 
 /**
- * @brief Reconfigures the encoder for the given bitrate.
+ * @brief Applies the frames reported by InvalidateRefFrames before a frame is encoded. The report stays pending
+ * until the caller has submitted the frame, see Submit().
+ * @param frameNumber Of the frame about to be encoded
+ * @param lostFrame Set to the first lost frame if there was one to handle
+ * @return true if that frame has to be an IDR
+ */
+bool Encoder::ApplyInvalidation(uint64_t frameNumber, uint64_t& lostFrame)
+{
+	uint64_t first;
+	{
+		std::lock_guard<std::mutex> lock(m_invalidationMutex);
+		first = m_invalidFrame;
+
+		// Frames that were never encoded cannot be lost
+		if (first >= frameNumber)
+		{
+			m_invalidFrame = UINT64_MAX;
+			return false;
+		}
+	}
+
+	lostFrame = first;
+
+	// Frames after a lost one referenced it, so the client has none of them; the frame before it has to be a
+	// reference that is still in the DPB and not from before the last IDR
+	uint64_t invalidFrames = frameNumber - first;
+	if (m_refFrames == 0 || first <= m_lastIdrFrame || invalidFrames >= m_refFrames)
+		return true;
+
+	// Whatever was invalidated before a failure stays so; the IDR makes it irrelevant
+	for (uint64_t frame = first; frame < frameNumber; ++frame)
+	{
+		if (m_nvencFuncs.nvEncInvalidateRefFrames(m_nvencEncoder, frame) != NV_ENC_SUCCESS)
+			return true;
+	}
+
+	m_stats.AddInvalidation();
+	if (FrameTrace::IsEnabled())
+		FrameTrace::Mark(FrameTrace::EVENT_INVALIDATE, m_traceSession, frameNumber, first);
+
+	return false;
+}
+
+
+
+/**
+ * @brief Builds the full encoder configuration from the preset for the given bitrate.
  * @param bps
  */
 void Encoder::SetupEncoder(uint32_t bps)
@@ -359,11 +891,7 @@ void Encoder::SetupEncoder(uint32_t bps)
 	m_nvencConfig = presetConfig.presetCfg;
 	m_nvencConfig.frameIntervalP = 1;
 	m_nvencConfig.gopLength = 1;
-	m_nvencConfig.rcParams.rateControlMode = NV_ENC_PARAMS_RC_CBR_LOWDELAY_HQ;
-	m_nvencConfig.rcParams.maxBitRate = bps;
-	m_nvencConfig.rcParams.averageBitRate = m_nvencConfig.rcParams.maxBitRate;
-	m_nvencConfig.rcParams.vbvBufferSize = (uint32_t)(1.05f * bps * m_nvencParams.frameRateDen / m_nvencParams.frameRateNum);
-	m_nvencConfig.rcParams.vbvInitialDelay = m_nvencConfig.rcParams.vbvBufferSize;
+	SetupRateControl(bps);
 	m_nvencConfig.gopLength = NVENC_INFINITE_GOPLENGTH;
 	m_nvencConfig.frameIntervalP = 1;
 
@@ -380,29 +908,131 @@ void Encoder::SetupEncoder(uint32_t bps)
 		vui.transferCharacteristics = 1;
 	};
 
+	// 0 leaves the DPB size to the driver
 	if (m_hevc)
 	{
 		NV_ENC_CONFIG_HEVC& hc = m_nvencConfig.encodeCodecConfig.hevcConfig;
-		hc.repeatSPSPPS = 1;
+		hc.repeatSPSPPS = m_repeatParameterSets ? 1 : 0;
 		hc.chromaFormatIDC = 1;
+		hc.maxNumRefFramesInDPB = m_refFrames;
 		setVUIParameters(hc.hevcVUIParameters);
 	}
 	else
 	{
 		NV_ENC_CONFIG_H264& hc = m_nvencConfig.encodeCodecConfig.h264Config;
-		hc.repeatSPSPPS = 1;
+		hc.repeatSPSPPS = m_repeatParameterSets ? 1 : 0;
 		hc.chromaFormatIDC = 1;
+		hc.maxNumRefFrames = m_refFrames;
 		setVUIParameters(hc.h264VUIParameters);
 	}
 }
 
 
 
+/**
+ * @brief Updates only the rate control parameters of the current configuration.
+ * @param bps
+ */
+void Encoder::SetupRateControl(uint32_t bps)
+{
+	m_nvencConfig.rcParams.rateControlMode = NV_ENC_PARAMS_RC_CBR_LOWDELAY_HQ;
+	m_nvencConfig.rcParams.maxBitRate = bps;
+	m_nvencConfig.rcParams.averageBitRate = m_nvencConfig.rcParams.maxBitRate;
+	m_nvencConfig.rcParams.vbvBufferSize = (uint32_t)(1.05f * bps * m_nvencParams.frameRateDen / m_nvencParams.frameRateNum);
+	m_nvencConfig.rcParams.vbvInitialDelay = m_nvencConfig.rcParams.vbvBufferSize;
+}
+
+
+
+/**
+ * @brief Applies the current parameters to the running encoder.
+ * @param reset Resets the encoder state and forces an IDR; only needed for geometry changes.
+ */
+void Encoder::Reconfigure(bool reset)
+{
+	NV_ENC_RECONFIGURE_PARAMS reInitEncodeParams;
+	memset(&reInitEncodeParams, 0, sizeof(reInitEncodeParams));
+	reInitEncodeParams.version = NV_ENC_RECONFIGURE_PARAMS_VER;
+	reInitEncodeParams.forceIDR = reset;
+	reInitEncodeParams.resetEncoder = reset;
+	reInitEncodeParams.reInitEncodeParams = m_nvencParams;
+
+	NVENC_THROW(m_nvencFuncs.nvEncReconfigureEncoder(m_nvencEncoder, &reInitEncodeParams),
+		"Failed to reconfigure encoder");
+
+	if (reset)
+	{
+		m_lastIdrFrame = m_frameNumber;
+		m_stats.AddReset();
+	}
+	else
+		m_stats.AddReconfigure();
+
+	if (FrameTrace::IsEnabled())
+	{
+		if (reset)
+			FrameTrace::Mark(FrameTrace::EVENT_RESET, m_traceSession, m_frameNumber, m_nvencParams.encodeWidth << 16 | m_nvencParams.encodeHeight);
+		else
+			FrameTrace::Mark(FrameTrace::EVENT_RECONFIGURE, m_traceSession, m_frameNumber, m_nvencConfig.rcParams.maxBitRate);
+	}
+}
+
+
+
+/**
+ * @brief Ends a timed stage: records it into the stats and the trace, whichever are enabled.
+ * @param stage
+ * @param start When the stage began
+ * @param frame
+ * @param value Passed to the trace event
+ * @return The current time, where the next stage begins
+ */
+EncoderStats::Ticks Encoder::RecordStage(EncoderStats::Stage stage, EncoderStats::Ticks start, uint64_t frame, uint64_t value)
+{
+	static const FrameTrace::Event events[EncoderStats::STAGE_COUNT] =
+	{
+		FrameTrace::EVENT_PREPARE,
+		FrameTrace::EVENT_REGISTER,
+		FrameTrace::EVENT_MAP,
+		FrameTrace::EVENT_ENCODE,
+		FrameTrace::EVENT_LOCK,
+		FrameTrace::EVENT_UNMAP,
+		FrameTrace::EVENT_COPY,
+		FrameTrace::EVENT_RELEASE,
+		FrameTrace::EVENT_COUNT         // Spans frames in flight, not a step of its own
+	};
+
+	EncoderStats::Ticks now = EncoderStats::Now();
+
+	if (m_stats.IsEnabled())
+		m_stats.Record(stage, start, now);
+
+	if (FrameTrace::IsEnabled() && events[stage] != FrameTrace::EVENT_COUNT)
+		FrameTrace::Record(events[stage], m_traceSession, frame, start, now, value);
+
+	return now;
+}
+
+
+
+/**
+ * @brief Bitstream buffer size needed for the current size and rate.
+ * @return
+ */
+uint32_t Encoder::GetRequiredBitstreamSize() const
+{
+	// TODO: currently just a guess, GFN uses a fixed 1MB.
+	return (std::max)(m_nvencParams.encodeWidth * m_nvencParams.encodeHeight, m_nvencConfig.rcParams.vbvBufferSize);
+}
+
+
+
 /**
  * @brief Allocates an internal bitstream buffer of given size.
  * @param size
+ * @return
  */
-void Encoder::CreateBitstream(uint32_t size)
+NV_ENC_OUTPUT_PTR Encoder::CreateBitstream(uint32_t size)
 {
 	NV_ENC_CREATE_BITSTREAM_BUFFER createBitstreamBuffer = { NV_ENC_CREATE_BITSTREAM_BUFFER_VER };
 	createBitstreamBuffer.size = (std::max)(size, m_nvencConfig.rcParams.vbvBufferSize);
@@ -411,7 +1041,64 @@ void Encoder::CreateBitstream(uint32_t size)
 	NVENC_THROW(m_nvencFuncs.nvEncCreateBitstreamBuffer(m_nvencEncoder, &createBitstreamBuffer),
 		"Failed to create bitstream buffer");
 
-	m_bitstreamBuffer = createBitstreamBuffer.bitstreamBuffer;
+	return createBitstreamBuffer.bitstreamBuffer;
+}
+
+
+
+/**
+ * @brief Allocates the ring of bitstream buffers (and completion events in async mode) for the current size.
+ */
+void Encoder::CreateSlots()
+{
+	m_slots.resize(m_pipelineDepth);
+	m_submitSlot = 0;
+
+	for (EncodeSlot& slot : m_slots)
+	{
+		slot.bitstreamSize = GetRequiredBitstreamSize();
+		slot.bitstreamBuffer = CreateBitstream(slot.bitstreamSize);
+
+#if defined(_WIN32)
+		if (m_asyncEncode)
+		{
+			slot.completionEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+			NV_ENC_EVENT_PARAMS eventParams = { NV_ENC_EVENT_PARAMS_VER };
+			eventParams.completionEvent = slot.completionEvent;
+
+			NVENC_THROW(m_nvencFuncs.nvEncRegisterAsyncEvent(m_nvencEncoder, &eventParams),
+				"Failed to register completion event");
+		}
+#endif
+	}
+}
+
+
+
+/**
+ * @brief Releases all slot resources. Slots must not be in flight.
+ */
+void Encoder::DestroySlots()
+{
+	for (EncodeSlot& slot : m_slots)
+	{
+		if (slot.bitstreamBuffer)
+			m_nvencFuncs.nvEncDestroyBitstreamBuffer(m_nvencEncoder, slot.bitstreamBuffer);
+
+#if defined(_WIN32)
+		if (slot.completionEvent)
+		{
+			NV_ENC_EVENT_PARAMS eventParams = { NV_ENC_EVENT_PARAMS_VER };
+			eventParams.completionEvent = slot.completionEvent;
+			m_nvencFuncs.nvEncUnregisterAsyncEvent(m_nvencEncoder, &eventParams);
+
+			CloseHandle(slot.completionEvent);
+		}
+#endif
+	}
+
+	m_slots.clear();
 }
 
 
@@ -422,14 +1109,12 @@ void Encoder::CreateBitstream(uint32_t size)
  */
 void Encoder::SwitchRate(CompressionBandwidth bw)
 {
-	const uint32_t minRate = 8 * 1024 * 1024;
-
 	uint32_t rate = 0;
 
 	if (bw != COMPRESSION_BANDWIDTH_LOW)
 	{
 		rate = m_nvencConfig.rcParams.maxBitRate;
-		uint32_t step = (std::min)(minRate, rate >> 1);
+		uint32_t step = (std::min)(s_minRate, rate >> 1);
 
 		if (bw == COMPRESSION_BANDWIDTH_INCREASE)
 			rate += step;
@@ -448,15 +1133,27 @@ void Encoder::SwitchRate(CompressionBandwidth bw)
  */
 void Encoder::SetRate(uint32_t bps)
 {
-	const uint32_t minRate = 8 * 1024 * 1024;
-	const uint32_t maxRate = 256 * 1024 * 1024;
-
-	uint32_t rate = (std::min)((std::max)(bps, minRate), maxRate);
+	uint32_t rate = (std::min)((std::max)(bps, s_minRate), s_maxRate);
 
 	if (rate != m_nvencConfig.rcParams.maxBitRate)
 	{
-		SetupEncoder(rate);
-		m_forceReinit = true;
+		NV_ENC_RC_PARAMS previous = m_nvencConfig.rcParams;
+		SetupRateControl(rate);
+
+		// Rate-only change: no reset, no IDR, buffers and registrations stay as they are
+		if (m_nvencEncoder)
+		{
+			// If the encoder rejects it, it keeps running at the old rate, and the next call has to try again
+			try
+			{
+				Reconfigure(false);
+			}
+			catch (...)
+			{
+				m_nvencConfig.rcParams = previous;
+				throw;
+			}
+		}
 	}
 }
 
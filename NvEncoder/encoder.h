@@ -6,7 +6,11 @@
 #include <unordered_map>
 
 #include "nvEncodeAPI.h"
+#include "EncoderStats.h"
+#include "FrameTrace.h"
 #include <memory>
+#include <mutex>
+#include <list>
 
 
 // RGBA input is only available in SDK 6+ (otherwise we use manual CUDA conversion kernels)
@@ -25,6 +29,21 @@
 
 
 
+/**
+ * @brief Encoded picture that still lives in the encoder's locked bitstream buffer.
+ * The buffer is unlocked and handed back to the encoder when the last reference is dropped. If the encoder
+ * is destroyed first, it unlocks the buffer itself: data is invalid from then on and the release does nothing.
+ */
+struct EncodedFrame
+{
+	const uint8_t* data = nullptr;
+	uint32_t size = 0;
+	NV_ENC_PIC_TYPE pictureType = NV_ENC_PIC_TYPE_UNKNOWN;
+	uint64_t timestamp = 0;
+};
+
+
+
 /**
  * @brief Shared base class for different encoder specializations.
  */
@@ -46,31 +65,151 @@ public:
 
 	void SwitchRate(CompressionBandwidth bw);
 	void SetRate(uint32_t bps);
+	uint32_t GetRate() const { return m_nvencConfig.rcParams.maxBitRate; }
+
+	// Range SetRate() clamps to
+	static const uint32_t s_minRate = 8 * 1024 * 1024;
+	static const uint32_t s_maxRate = 256 * 1024 * 1024;
+
+	void SetPipelineDepth(uint32_t depth);
+	uint32_t GetPipelineDepth() const { return m_pipelineDepth; }
+	uint32_t GetPendingFrames() const { return m_pendingFrames; }
+	bool IsPipelineFull() const;
+
+	bool Retrieve(std::vector<uint8_t>& buffer, bool wait = true);
+	std::shared_ptr<EncodedFrame> RetrieveFrame(bool wait = true);
+
+	void SetRepeatParameterSets(bool repeat);
+	bool GetSequenceParams(std::vector<uint8_t>& buffer);
+	bool IsHEVC() const { return m_hevc; }
+
+	void SetRegistrationCacheSize(uint32_t size);
+	bool UnregisterResource(void* resource);
+	void ClearRegistrations();
+
+	void InvalidateRefFrames(const uint64_t* timestamps, size_t count);
+
+	// DPB size while the driver supports reference invalidation, i.e. how many frames back a loss can be recovered
+	static const uint32_t s_refFrames = 4;
+
+	void SetStatsEnabled(bool enabled) { m_stats.SetEnabled(enabled); }
+	EncoderStats& GetStats() { return m_stats; }
+	uint32_t GetTraceSession() const { return m_traceSession; }
 
 	virtual void Init(NV_ENC_DEVICE_TYPE deviceType, void* device, uint32_t width, uint32_t height, bool hevc, uint32_t bitrate);
 protected:
+	void Submit(NV_ENC_INPUT_RESOURCE_TYPE resourceType, void* resource, NV_ENC_BUFFER_FORMAT format, uint32_t pitch, uint32_t width, uint32_t height, bool iFrame);
+
 	void Encode(NV_ENC_INPUT_RESOURCE_TYPE resourceType, void* resource, NV_ENC_BUFFER_FORMAT format, uint32_t pitch, uint32_t width, uint32_t height, bool iFrame, std::vector<uint8_t>& buffer);
 
-	std::shared_ptr<NV_ENC_LOCK_BITSTREAM> EncodeFrame(NV_ENC_INPUT_RESOURCE_TYPE resourceType, void* resource, NV_ENC_BUFFER_FORMAT format, uint32_t pitch, uint32_t width, uint32_t height, bool iFrame);
+	std::shared_ptr<EncodedFrame> EncodeFrame(NV_ENC_INPUT_RESOURCE_TYPE resourceType, void* resource, NV_ENC_BUFFER_FORMAT format, uint32_t pitch, uint32_t width, uint32_t height, bool iFrame);
 
 private:
-	void PrepareEncode(NV_ENC_INPUT_RESOURCE_TYPE resourceType, void* resource, NV_ENC_BUFFER_FORMAT format, uint32_t pitch, uint32_t width, uint32_t height);
+	void PrepareEncode(uint32_t width, uint32_t height);
 	void SetupEncoder(uint32_t bps);
-	void CreateBitstream(uint32_t size);
+	void SetupRateControl(uint32_t bps);
+	void Reconfigure(bool reset);
+	uint32_t GetRequiredBitstreamSize() const;
+	NV_ENC_OUTPUT_PTR CreateBitstream(uint32_t size);
+
+	struct EncodeSlot;
+	void CreateSlots();
+	void DestroySlots();
+	struct Registration;
+	Registration& AcquireRegistration(NV_ENC_INPUT_RESOURCE_TYPE resourceType, void* resource, NV_ENC_BUFFER_FORMAT format, uint32_t pitch, uint32_t width, uint32_t height);
+	void EvictRegistrations(size_t keep);
+	NVENCSTATUS UnmapSlotInput(EncodeSlot& slot);
+	bool LockSlot(EncodeSlot& slot, bool wait, NV_ENC_LOCK_BITSTREAM& lockBitstreamData);
+	EncodeSlot* PopSlot(bool wait, NV_ENC_LOCK_BITSTREAM& lockBitstreamData);
+	void ReleaseFrame(EncodeSlot* slot);
+	bool ApplyInvalidation(uint64_t frameNumber, uint64_t& lostFrame);
+	bool IsTimed() const { return m_stats.IsEnabled() || FrameTrace::IsEnabled(); }
+	EncoderStats::Ticks RecordStage(EncoderStats::Stage stage, EncoderStats::Ticks start, uint64_t frame, uint64_t value = 0);
 
 private:
+	/**
+	 * @brief One entry of the in-flight ring: an input registration plus the bitstream buffer the frame encodes into.
+	 */
+	struct EncodeSlot
+	{
+		NV_ENC_OUTPUT_PTR bitstreamBuffer = nullptr;
+		uint32_t bitstreamSize = 0;
+		void* completionEvent = nullptr;
+
+		Registration* registration = nullptr;
+		NV_ENC_INPUT_PTR mappedResource = nullptr;
+
+		uint64_t frameNumber = 0;
+		bool leased = false;
+
+		// Stage timing: when Submit() started, and the end of the last stage timed for this frame
+		EncoderStats::Ticks submitTime = 0;
+		EncoderStats::Ticks stageTime = 0;
+	};
+
+	/**
+	 * @brief A cached input registration, identified by everything NvEncRegisterResource was given.
+	 */
+	struct Registration
+	{
+		void* resource = nullptr;
+		NV_ENC_INPUT_RESOURCE_TYPE resourceType = NV_ENC_INPUT_RESOURCE_TYPE_DIRECTX;
+		NV_ENC_BUFFER_FORMAT format = NV_ENC_BUFFER_FORMAT_UNDEFINED;
+		uint32_t pitch = 0;
+		uint32_t width = 0;
+		uint32_t height = 0;
+
+		NV_ENC_REGISTERED_PTR registeredResource = nullptr;
+		uint32_t mapCount = 0; // frames in flight that use this registration; pinned while non-zero
+	};
+
 	void* m_nvencHandle;
 	NV_ENCODE_API_FUNCTION_LIST m_nvencFuncs;
 	NV_ENC_INITIALIZE_PARAMS m_nvencParams;
 	NV_ENC_CONFIG m_nvencConfig;
 	void* m_nvencEncoder;
 
-	//TODO: Replace me!
-	NV_ENC_OUTPUT_PTR m_bitstreamBuffer;
-	NV_ENC_REGISTERED_PTR m_registeredResource;
+	std::vector<EncodeSlot> m_slots;
+
+	// Most recently used first; small enough that a linear scan beats hashing
+	std::list<Registration> m_registrations;
+	uint32_t m_registrationCacheSize = 8;
+	uint32_t m_pipelineDepth = 1;
+	uint32_t m_submitSlot = 0;
+	uint32_t m_pendingFrames = 0;
+	uint64_t m_frameNumber = 0;
+	bool m_asyncEncode = false;
+
+	// Guards the leased flags, which are cleared from whichever thread drops the last EncodedFrame reference
+	mutable std::mutex m_leaseMutex;
+	uint32_t m_leasedFrames = 0;
 
+	// Forces a reset and IDR on the next frame; rate changes never need it, they are applied in place
 	bool m_forceReinit = true;
 	bool m_hevc;
+	bool m_repeatParameterSets = true;
+
+	// Loss recovery: earliest frame reported lost since the last encode (UINT64_MAX for none), and the last
+	// IDR, before which nothing can be referenced
+	std::mutex m_invalidationMutex;
+	uint64_t m_invalidFrame = UINT64_MAX;
+	uint64_t m_lastIdrFrame = 0;
+	uint32_t m_refFrames = 0;
+
+	EncoderStats m_stats;
+	uint32_t m_traceSession;
+
+	/**
+	 * @brief Shared with the EncodedFrame deleters, which may outlive the encoder; encoder is cleared by the
+	 * destructor, under mutex, so a release after that does not touch the destroyed session.
+	 */
+	struct LeaseOwner
+	{
+		std::mutex mutex;
+		Encoder* encoder = nullptr;
+	};
+
+	std::shared_ptr<LeaseOwner> m_leaseOwner;
 };
 
 
@@ -1,102 +1,197 @@
 // Copyright 2017 NVIDIA Corporation. All Rights Reserved.
 
 #include "mp4.h"
+#include "Bitstream.h"
 
 #include <cstddef>
+#include <cstring>
+#include <climits>
+#include <cerrno>
+#include <algorithm>
 #include <string>
 #include <fstream>
+#include <initializer_list>
+#include <stdexcept>
 
+#ifdef _WIN32
+#include <io.h>
+#include <stdlib.h>
+#else
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
 
-template<typename T>
-inline void write(std::vector<uint8_t>& buffer, T v)
+
+inline uint8_t byteswap(uint8_t v)
+{
+    return v;
+}
+
+inline uint16_t byteswap(uint16_t v)
+{
+#ifdef _MSC_VER
+    return _byteswap_ushort(v);
+#else
+    return __builtin_bswap16(v);
+#endif
+}
+
+inline uint32_t byteswap(uint32_t v)
 {
-    uint8_t* p = (uint8_t*) &v;
-    for (int i = sizeof(T) - 1; i >= 0; --i)
-        buffer.push_back(p[i]);
+#ifdef _MSC_VER
+    return _byteswap_ulong(v);
+#else
+    return __builtin_bswap32(v);
+#endif
 }
 
-inline void writeString(std::vector<uint8_t>& buffer, const std::string& s)
+inline uint64_t byteswap(uint64_t v)
 {
-    for (size_t i = 0; i < s.size(); ++i)
-        buffer.push_back((uint8_t) s[i]);
-    buffer.push_back(0);
+#ifdef _MSC_VER
+    return _byteswap_uint64(v);
+#else
+    return __builtin_bswap64(v);
+#endif
 }
 
 
 
+/// Stores a field big-endian
+template<typename T>
+inline void store(uint8_t* p, T v)
+{
+    v = byteswap(v);
+    memcpy(p, &v, sizeof(T));
+}
+
+
+
+/**
+ * @brief Cursor into an output buffer that has already been sized for the boxes written through it.
+ * All multi-byte fields are stored big-endian (the hosts we build for are little-endian).
+ */
+class Mp4_writer
+{
+public:
+    explicit Mp4_writer(uint8_t* data)
+        : m_data(data)
+    {
+    }
+
+    template<typename T>
+    inline void write(T v)
+    {
+        store(m_data, v);
+        m_data += sizeof(T);
+    }
+
+    inline void write_zeros(size_t count)
+    {
+        memset(m_data, 0, count);
+        m_data += count;
+    }
+
+    inline void write_bytes(const uint8_t* data, size_t count)
+    {
+        memcpy(m_data, data, count);
+        m_data += count;
+    }
+
+    inline void write_string(const std::string& s)
+    {
+        write_bytes((const uint8_t*) s.c_str(), s.size() + 1);
+    }
+
+    inline void write_string(const char* s)
+    {
+        write_bytes((const uint8_t*) s, strlen(s) + 1);
+    }
+
+    inline uint8_t* get_position() const
+    {
+        return m_data;
+    }
+
+private:
+    uint8_t* m_data;
+};
+
+
+
 /**
  * @brief General definition of a box (also called atom).
+ *
+ * Boxes are not polymorphic: each class records its kind, and serialize_body() dispatches on it.
+ * Children are linked in place, so a tree can live in an MP4Arena; sizes are laid out in one pass
+ * by update_size() once the tree, or a sample table in it, has changed.
  */
 class Mp4_box
 {
 public:
 
+    /// Box classes with a body of their own
+    enum Kind : uint8_t
+    {
+        KIND_CONTAINER,
+        KIND_FTYP,
+        KIND_MVHD,
+        KIND_MEHD,
+        KIND_TREX,
+        KIND_TKHD,
+        KIND_MDHD,
+        KIND_HDLR,
+        KIND_DATA_ENTRY_URL,
+        KIND_DATA_ENTRY_URN,
+        KIND_DREF,
+        KIND_VMHD,
+        KIND_AVC_DECODER_CONFIGURATION,
+        KIND_HEVC_DECODER_CONFIGURATION,
+        KIND_VISUAL_SAMPLE_ENTRY,
+        KIND_STSD,
+        KIND_STSZ,
+        KIND_STSC,
+        KIND_STTS,
+        KIND_STCO,
+        KIND_MFHD,
+        KIND_TFHD,
+        KIND_TFDT,
+        KIND_TRUN,
+        KIND_MDAT,
+        KIND_SIDX,
+        KIND_TFRA,
+        KIND_MFRO
+    };
+
     /// Constructor for box (32-bit size)
     ///
     /// \param type The box's type
-    /// \param size The box's size
+    /// \param size The box's size without children
     Mp4_box(uint32_t type, uint32_t size = s_mp4_box_header_size)
         : m_type(type)
         , m_size(size)
         , m_size_64(0)
+        , m_own_size(size)
         , m_is_full(false)
+        , m_kind(KIND_CONTAINER)
         , m_bits(0)
-        , m_parent(nullptr)
     {
     }
 
     /// Constructor for full box (32-bit size)
     ///
     /// \param type The box's type
-    /// \param size The box's size
+    /// \param size The box's size without children
     /// \param version The box's version
     /// \param flags The box's flags
     Mp4_box(uint32_t type, uint32_t size, uint8_t version, uint32_t flags)
         : m_type(type)
         , m_size(size)
         , m_size_64(0)
+        , m_own_size(size)
         , m_is_full(true)
+        , m_kind(KIND_CONTAINER)
         , m_bits((static_cast<uint32_t>(version) << 24) | (flags & 0x00ffffff))
-        , m_parent(nullptr)
-    {
-    }
-
-    /// Constructor for box (32-bit size)
-    ///
-    /// \param type The box's type
-    /// \param size The box's size
-    Mp4_box(uint32_t type, uint64_t size)
-        : m_type(type)
-        , m_size(1)
-        , m_size_64(size)
-        , m_is_full(false)
-        , m_bits(0)
-        , m_parent(nullptr)
-    {
-    }
-
-    /// Constructor for full box (64-bit size)
-    ///
-    /// \param type The box's type
-    /// \param size The box's size
-    /// \param version The box's version
-    /// \param flags The box's flags
-    Mp4_box(uint32_t type, uint64_t size, uint8_t version, uint32_t flags)
-        : m_type(type)
-        , m_size(1)
-        , m_size_64(size)
-        , m_is_full(true)
-        , m_bits((static_cast<uint32_t>(version) << 24) | (flags & 0x00ffffff))
-        , m_parent(nullptr)
-    {
-    }
-
-
-    /// Destructor
-    virtual ~Mp4_box()
     {
-        for (size_t i = 0; i < m_boxes.size(); ++i)
-            delete m_boxes[i];
     }
 
     /// Get the box's header size
@@ -109,63 +204,91 @@ public:
             return m_is_full ? s_mp4_full_box_header_size :  s_mp4_box_header_size;
     }
 
-    /// Get the box's size
+    /// Get the box's size, as of the last update_size() if it has children
     /// \return the box's size
     inline uint64_t get_size() const
     {
         return (m_size == 1) ? m_size_64 : m_size;
     }
 
-    /// Set the box's size
-    /// \param size The box's size
+    /// Set the size of the box without its children
+    /// \param size The box's own size
     inline void set_size(uint64_t size)
     {
-        if (size >= ((uint64_t) 1) << 32)
-        {
-            m_size = 1;
-            m_size_64 = size;
-        }
-        else
-            m_size = static_cast<uint32_t>(size);
+        m_own_size = size;
+        set_total_size(size);
     }
 
-    /// Serialize the box
+    /// Lay out the tree: sum up the sizes of all boxes below this one
+    /// \return the box's size
+    uint64_t update_size()
+    {
+        uint64_t size = m_own_size;
+        for (Mp4_box* child = m_first_child; child; child = child->m_next_sibling)
+            size += child->update_size();
+
+        set_total_size(size);
+        return size;
+    }
+
+    /// Serialize the box, appending it to a buffer
+    ///
+    /// \param outputBuffer Grown once by the box's total size
     void serialize(std::vector<uint8_t>& outputBuffer) const
     {
-        write(outputBuffer, m_size);
-        write(outputBuffer, m_type);
+        size_t offset = outputBuffer.size();
+        outputBuffer.resize(offset + static_cast<size_t>(get_size()));
+
+        Mp4_writer writer(outputBuffer.data() + offset);
+        serialize(writer);
+    }
+
+    /// Serialize the box
+    void serialize(Mp4_writer& writer) const
+    {
+        writer.write(m_size);
+        writer.write(m_type);
 
         if (m_size == 1)
-            write(outputBuffer, m_size_64);
+            writer.write(m_size_64);
 
         if (m_is_full)
-            write(outputBuffer, m_bits);
+            writer.write(m_bits);
 
-        serialize_body(outputBuffer);
+        serialize_body(writer);
     }
 
-    /// Serialize the box's body
-    virtual void serialize_body(std::vector<uint8_t>& outputBuffer) const
+    /// Serialize the box's body with the class's serialize_body()
+    void serialize_body(Mp4_writer& writer) const;
+
+    /// Get the box's position within its serialized root box. Only valid below boxes whose body
+    /// consists of nothing but their children.
+    /// \return the box's offset
+    uint64_t get_offset() const
     {
-        for (size_t i = 0; i < m_boxes.size(); ++i)
-            m_boxes[i]->serialize(outputBuffer);
+        if (!m_parent)
+            return 0;
+
+        uint64_t offset = m_parent->get_offset() + m_parent->get_header_size();
+        for (const Mp4_box* sibling = m_parent->m_first_child; sibling && sibling != this; sibling = sibling->m_next_sibling)
+            offset += sibling->get_size();
+
+        return offset;
     }
 
     /// add a child box
-    /// \param child A child box
+    /// \param child A child box, which has to live as long as this one
     void add_box(Mp4_box* child)
     {
         child->m_parent = this;
-        m_boxes.push_back(child);
 
-        // Adjust the size of all the boxes recursively until we reach the root
-        Mp4_box* p = this;
-        uint64_t add_size = child->get_size();
-        while (p)
-        {
-            p->set_size(p->get_size() + add_size);
-            p = p->m_parent;
-        }
+        if (m_last_child)
+            m_last_child->m_next_sibling = child;
+        else
+            m_first_child = child;
+        m_last_child = child;
+
+        m_child_count++;
     }
 
     static const uint32_t s_mp4_box_header_size         = 8;
@@ -182,6 +305,7 @@ public:
     static const uint32_t s_mp4_box_type_hdlr;
     static const uint32_t s_mp4_box_type_mdhd;
     static const uint32_t s_mp4_box_type_mdia;
+    static const uint32_t s_mp4_box_type_mfra;
     static const uint32_t s_mp4_box_type_minf;
     static const uint32_t s_mp4_box_type_moov;
     static const uint32_t s_mp4_box_type_moof;
@@ -192,20 +316,46 @@ public:
     static const uint32_t s_mp4_box_type_trak;
 
 protected:
+
+    /// Serialize the children
+    void serialize_children(Mp4_writer& writer) const
+    {
+        for (const Mp4_box* child = m_first_child; child; child = child->m_next_sibling)
+            child->serialize(writer);
+    }
+
+    /// Set the serialized size, switching to a 64-bit size if necessary
+    inline void set_total_size(uint64_t size)
+    {
+        if (size >= ((uint64_t) 1) << 32)
+        {
+            m_size = 1;
+            m_size_64 = size;
+        }
+        else
+            m_size = static_cast<uint32_t>(size);
+    }
+
     uint32_t m_type;
     uint32_t m_size;
     uint64_t m_size_64;
+    uint64_t m_own_size;
     bool m_is_full;
+    Kind m_kind;
     uint32_t m_bits;
-    Mp4_box* m_parent;
 
-    std::vector<Mp4_box*> m_boxes;
+    Mp4_box* m_parent = nullptr;
+    Mp4_box* m_first_child = nullptr;
+    Mp4_box* m_last_child = nullptr;
+    Mp4_box* m_next_sibling = nullptr;
+    uint32_t m_child_count = 0;
 };
 
 const uint32_t Mp4_box::s_mp4_box_type_dinf(Mp4_box::chars_to_type('d','i','n','f'));
 const uint32_t Mp4_box::s_mp4_box_type_hdlr(Mp4_box::chars_to_type('h','d','l','r'));
 const uint32_t Mp4_box::s_mp4_box_type_mdhd(Mp4_box::chars_to_type('m','d','h','d'));
 const uint32_t Mp4_box::s_mp4_box_type_mdia(Mp4_box::chars_to_type('m','d','i','a'));
+const uint32_t Mp4_box::s_mp4_box_type_mfra(Mp4_box::chars_to_type('m','f','r','a'));
 const uint32_t Mp4_box::s_mp4_box_type_minf(Mp4_box::chars_to_type('m','i','n','f'));
 const uint32_t Mp4_box::s_mp4_box_type_moof(Mp4_box::chars_to_type('m','o','o','f'));
 const uint32_t Mp4_box::s_mp4_box_type_moov(Mp4_box::chars_to_type('m','o','o','v'));
@@ -218,6 +368,60 @@ const uint32_t Mp4_box::s_mp4_box_type_trak(Mp4_box::chars_to_type('t','r','a','
 
 
 
+/**
+ * @brief ftyp (file type box), or styp (segment type box), which has the same layout.
+ */
+class Mp4_ftyp : public Mp4_box
+{
+public:
+
+    /// Constructor
+    /// \param type ftyp or styp
+    /// \param major_brand The major brand
+    /// \param minor_version The minor version
+    /// \param compatible_brands The compatible brands
+    Mp4_ftyp(uint32_t type, uint32_t major_brand, uint32_t minor_version, std::initializer_list<uint32_t> compatible_brands)
+        : Mp4_box(type, static_cast<uint32_t>(s_mp4_box_header_size + s_mp4_ftyp_body_size + 4 * (compatible_brands.size() < s_mp4_ftyp_max_brands ? compatible_brands.size() : s_mp4_ftyp_max_brands))),
+          m_major_brand(major_brand), m_minor_version(minor_version), m_brand_count(0)
+    {
+        m_kind = KIND_FTYP;
+
+        for (uint32_t brand : compatible_brands)
+        {
+            if (m_brand_count < s_mp4_ftyp_max_brands)
+                m_compatible_brands[m_brand_count++] = brand;
+        }
+    }
+
+    /// Serialize ftyp's body
+    void serialize_body(Mp4_writer& writer) const
+    {
+        writer.write(m_major_brand);
+        writer.write(m_minor_version);
+
+        for (size_t i = 0; i < m_brand_count; ++i)
+            writer.write(m_compatible_brands[i]);
+    }
+
+    static const uint32_t s_mp4_box_type_ftyp;
+    static const uint32_t s_mp4_box_type_styp;
+
+private:
+
+    static const uint32_t s_mp4_ftyp_body_size = 8;
+    static const size_t s_mp4_ftyp_max_brands = 4;
+
+    uint32_t m_major_brand;
+    uint32_t m_minor_version;
+    uint32_t m_compatible_brands[s_mp4_ftyp_max_brands];
+    size_t m_brand_count;
+};
+
+const uint32_t Mp4_ftyp::s_mp4_box_type_ftyp(Mp4_box::chars_to_type('f','t','y','p'));
+const uint32_t Mp4_ftyp::s_mp4_box_type_styp(Mp4_box::chars_to_type('s','t','y','p'));
+
+
+
 /**
  * @brief mvhd (movie header box).
  */
@@ -238,49 +442,45 @@ public:
         , m_time_scale(time_scale)
         , m_duration(duration)
     {
-
+        m_kind = KIND_MVHD;
     }
 
     /// Serialize mvhd's body
-    void serialize_body(std::vector<uint8_t>& outputBuffer) const
+    void serialize_body(Mp4_writer& writer) const
     {
-        write(outputBuffer, m_creation_time);
+        writer.write(m_creation_time);
 
-        write(outputBuffer, m_mod_time);
+        writer.write(m_mod_time);
 
-        write(outputBuffer, m_time_scale);
+        writer.write(m_time_scale);
 
-        write(outputBuffer, m_duration);
+        writer.write(m_duration);
 
         // rate
-        write<uint32_t>(outputBuffer, 0x00010000);
+        writer.write<uint32_t>(0x00010000);
 
         // volume and reserved bits
-        write<uint32_t>(outputBuffer, 0x01000000);
+        writer.write<uint32_t>(0x01000000);
 
         // reserved bits
-        for (int i = 0; i < 2; ++i)
-            write<uint32_t>(outputBuffer, 0);
+        writer.write_zeros(8);
 
         // unity matrix
-        write<uint32_t>(outputBuffer, 0x00010000);
+        writer.write<uint32_t>(0x00010000);
 
-        for (int i = 0; i < 3; ++i)
-            write<uint32_t>(outputBuffer, 0);
+        writer.write_zeros(12);
 
-        write<uint32_t>(outputBuffer, 0x00010000);
+        writer.write<uint32_t>(0x00010000);
 
-        for (int i = 0; i < 3; ++i)
-            write<uint32_t>(outputBuffer, 0);
+        writer.write_zeros(12);
 
-        write<uint32_t>(outputBuffer, 0x40000000);
+        writer.write<uint32_t>(0x40000000);
 
         // predefined
-        for (int i = 0; i < 6; ++i)
-            write<uint32_t>(outputBuffer, 0);
+        writer.write_zeros(24);
 
         // next track ID (0xffffffff means that an unused track ID will be taken)
-        write<uint32_t>(outputBuffer, 0xffffffff);
+        writer.write<uint32_t>(0xffffffff);
     }
 
 private:
@@ -312,12 +512,13 @@ public:
                   s_mp4_full_box_header_size + s_mp4_mehd_body_size, 0, 0)
         , m_fragment_duration(fragment_duration)
     {
+        m_kind = KIND_MEHD;
     }
 
     /// Serialize mehd's body
-    void serialize_body(std::vector<uint8_t>& outputBuffer) const
+    void serialize_body(Mp4_writer& writer) const
     {
-        write(outputBuffer, m_fragment_duration);
+        writer.write(m_fragment_duration);
     }
 
 private:
@@ -354,21 +555,21 @@ public:
         , m_default_sample_size(sample_size)
         , m_default_sample_flags(sample_flags)
     {
-
+        m_kind = KIND_TREX;
     }
 
     /// Serialize trex's body
-    void serialize_body(std::vector<uint8_t>& outputBuffer) const
+    void serialize_body(Mp4_writer& writer) const
     {
-        write(outputBuffer, m_track_id);
+        writer.write(m_track_id);
 
-        write(outputBuffer, m_default_sample_description_index);
+        writer.write(m_default_sample_description_index);
 
-        write(outputBuffer, m_default_sample_duration);
+        writer.write(m_default_sample_duration);
 
-        write(outputBuffer, m_default_sample_size);
+        writer.write(m_default_sample_size);
 
-        write(outputBuffer, m_default_sample_flags);
+        writer.write(m_default_sample_flags);
     }
 
 private:
@@ -405,54 +606,50 @@ public:
         , m_width(width)
         , m_height(height)
     {
-
+        m_kind = KIND_TKHD;
     }
 
     /// Serialize tkhd's body
-    void serialize_body(std::vector<uint8_t>& outputBuffer) const
+    void serialize_body(Mp4_writer& writer) const
     {
         // creation time
-        write<uint64_t>(outputBuffer, 0);
+        writer.write<uint64_t>(0);
 
         // modification time
-        write<uint64_t>(outputBuffer, 0);
+        writer.write<uint64_t>(0);
 
-        write(outputBuffer, m_track_id);
+        writer.write(m_track_id);
 
         // reserved
-        write<uint32_t>(outputBuffer, 0);
+        writer.write<uint32_t>(0);
 
         // duration
-        write<uint64_t>(outputBuffer, 0);
+        writer.write<uint64_t>(0);
 
         // int(32)[2] reserved
-        for (int i = 0; i < 2; ++i)
-            write<uint32_t>(outputBuffer, 0);
+        writer.write_zeros(8);
 
         // int(16) layer
         // int(16) alternate_group
         // int(16) volume
         // int(16) reserved
-        for (size_t i = 0; i < 4; ++i)
-            write<uint16_t>(outputBuffer, 0);
+        writer.write_zeros(8);
 
         // unity matrix
-        write<uint32_t>(outputBuffer, 0x00010000);
+        writer.write<uint32_t>(0x00010000);
 
-        for (int i = 0; i < 3; ++i)
-            write<uint32_t>(outputBuffer, 0);
+        writer.write_zeros(12);
 
-        write<uint32_t>(outputBuffer, 0x00010000);
+        writer.write<uint32_t>(0x00010000);
 
-        for (int i = 0; i < 3; ++i)
-            write<uint32_t>(outputBuffer, 0);
+        writer.write_zeros(12);
 
-        write<uint32_t>(outputBuffer, 0x40000000);
+        writer.write<uint32_t>(0x40000000);
 
         // shift the bytes to get fixed point values (encoded as 16 bits for
         // decimal and fractional parts)
-        write<uint32_t>(outputBuffer, m_width << 16);
-        write<uint32_t>(outputBuffer, m_height << 16);
+        writer.write<uint32_t>(m_width << 16);
+        writer.write<uint32_t>(m_height << 16);
     }
 
 private:
@@ -484,6 +681,7 @@ public:
                   s_mp4_full_box_header_size + s_mp4_mdhd_body_size, 1, 0)
         , m_time_scale(time_scale)
     {
+        m_kind = KIND_MDHD;
         size_t lsize = language.size();
         for (size_t i = 0; i < 3; ++i)
         {
@@ -495,18 +693,18 @@ public:
     }
 
     /// Serialize mdhd's body
-    void serialize_body(std::vector<uint8_t>& outputBuffer) const
+    void serialize_body(Mp4_writer& writer) const
     {
         // creation time (8 bytes)
-        write<uint64_t>(outputBuffer, 0);
+        writer.write<uint64_t>(0);
 
         // modification time (8 bytes)
-        write<uint64_t>(outputBuffer, 0);
+        writer.write<uint64_t>(0);
 
-        write(outputBuffer, m_time_scale);
+        writer.write(m_time_scale);
 
         // duration (8 bytes)
-        write<uint64_t>(outputBuffer, 0xffffffffffffffff);
+        writer.write<uint64_t>(0xffffffffffffffff);
 
         // bit(1) pad = 0
         // unsigned int(5)[3] language;
@@ -517,7 +715,7 @@ public:
             temp = (temp << 5) | (m_language[i] - 0x60);
         }
         temp <<= 16;
-        write(outputBuffer, temp);
+        writer.write(temp);
     }
 
 private:
@@ -541,29 +739,29 @@ public:
 
     /// Constructor
     /// \param handler_type The handler type (video, audio, or hint)
-    /// \param handler_name The handler name (for debugging and inspection)
-    Mp4_hdlr(const uint32_t handler_type, const std::string& handler_name)
+    /// \param handler_name The handler name (for debugging and inspection), kept by reference
+    Mp4_hdlr(const uint32_t handler_type, const char* handler_name)
         : Mp4_box(s_mp4_box_type_hdlr,
                   static_cast<uint32_t>(s_mp4_full_box_header_size + s_mp4_hdlr_body_size +
-                                        handler_name.size() + 1), 0, 0), m_handler_type(handler_type),
+                                        strlen(handler_name) + 1), 0, 0), m_handler_type(handler_type),
           m_handler_name(handler_name)
     {
+        m_kind = KIND_HDLR;
     }
 
     /// Serialize hdlr's body
-    void serialize_body(std::vector<uint8_t>& outputBuffer) const
+    void serialize_body(Mp4_writer& writer) const
     {
         // pre-defined
-        write<uint32_t>(outputBuffer, 0);
+        writer.write<uint32_t>(0);
 
         // handler type
-        write(outputBuffer, m_handler_type);
+        writer.write(m_handler_type);
 
         // reserved
-        for (int i = 0; i < 3; ++i)
-            write<uint32_t>(outputBuffer, 0);
+        writer.write_zeros(12);
 
-        writeString(outputBuffer, m_handler_name);
+        writer.write_string(m_handler_name);
     }
 
     static const uint32_t s_mp4_hdlr_video_handler;
@@ -574,7 +772,7 @@ private:
     static const uint32_t s_mp4_hdlr_body_size = 20;
 
     uint32_t m_handler_type;
-    std::string m_handler_name;
+    const char* m_handler_name;
 };
 
 const uint32_t Mp4_hdlr::s_mp4_box_type_hdlr(Mp4_box::chars_to_type('h','d','l','r'));
@@ -602,31 +800,22 @@ public:
 class Mp4_data_entry_url : public Mp4_data_entry
 {
 public:
-    Mp4_data_entry_url(const std::string& location)
-        : Mp4_data_entry(Mp4_data_entry_url::s_mp4_box_type_data_entry_url, static_cast<uint32_t>(location.size()), 0, 1), m_location(location)
-    {
-    }
-
-    uint64_t get_size() const
+    Mp4_data_entry_url(const char* location)
+        : Mp4_data_entry(Mp4_data_entry_url::s_mp4_box_type_data_entry_url, *location ? static_cast<uint32_t>(strlen(location) + 1) : 0, 0, 1), m_location(location)
     {
-        size_t location_length = m_location.size();
-        if (((m_bits & 0x01) == 0) || location_length)
-            return s_mp4_full_box_header_size + location_length + 1;
-        else
-            return s_mp4_full_box_header_size;
+        m_kind = KIND_DATA_ENTRY_URL;
     }
 
-    void serialize_body(std::vector<uint8_t>& outputBuffer) const
+    void serialize_body(Mp4_writer& writer) const
     {
-        size_t location_length = m_location.size();
-        if (((m_bits & 0x01) == 0) || location_length)
-            writeString(outputBuffer, m_location);
+        if (((m_bits & 0x01) == 0) || *m_location)
+            writer.write_string(m_location);
     }
 
 private:
     static const uint32_t s_mp4_box_type_data_entry_url;
 
-    std::string m_location;
+    const char* m_location;
 };
 
 const uint32_t Mp4_data_entry_url::s_mp4_box_type_data_entry_url(Mp4_box::chars_to_type('u','r','l',' '));
@@ -639,28 +828,24 @@ const uint32_t Mp4_data_entry_url::s_mp4_box_type_data_entry_url(Mp4_box::chars_
 class Mp4_data_entry_urn : public Mp4_data_entry
 {
 public:
-    Mp4_data_entry_urn(const std::string& name, const std::string& location)
-        : Mp4_data_entry(Mp4_data_entry_urn::s_mp4_box_type_data_entry_urn, static_cast<uint32_t>(name.size() + location.size()), 0, 0), m_name(name), m_location(location)
-    {
-    }
-
-    uint64_t get_size() const
+    Mp4_data_entry_urn(const char* name, const char* location)
+        : Mp4_data_entry(Mp4_data_entry_urn::s_mp4_box_type_data_entry_urn, static_cast<uint32_t>(strlen(name) + strlen(location) + 2), 0, 0), m_name(name), m_location(location)
     {
-        return s_mp4_full_box_header_size + m_name.size() + m_location.size() + 2;
+        m_kind = KIND_DATA_ENTRY_URN;
     }
 
-    void serialize_body(std::vector<uint8_t>& outputBuffer) const
+    void serialize_body(Mp4_writer& writer) const
     {
-        writeString(outputBuffer, m_name);
+        writer.write_string(m_name);
 
-        writeString(outputBuffer, m_location);
+        writer.write_string(m_location);
     }
 
 private:
     static const uint32_t s_mp4_box_type_data_entry_urn;
 
-    std::string m_name;
-    std::string m_location;
+    const char* m_name;
+    const char* m_location;
 };
 
 const uint32_t Mp4_data_entry_urn::s_mp4_box_type_data_entry_urn(Mp4_box::chars_to_type('u','r','n',' '));
@@ -680,18 +865,16 @@ public:
         : Mp4_box(s_mp4_box_type_dref,
                   s_mp4_full_box_header_size + s_mp4_dref_body_size, 0, 0)
     {
-
+        m_kind = KIND_DREF;
     }
 
     /// Serialize dref's body
-    void serialize_body(std::vector<uint8_t>& outputBuffer) const
+    void serialize_body(Mp4_writer& writer) const
     {
         // entry count
-        size_t nr_children = m_boxes.size();
-        write<uint32_t>(outputBuffer, nr_children);
+        writer.write(m_child_count);
 
-        for (size_t i = 0; i < nr_children; ++i)
-            m_boxes[i]->serialize(outputBuffer);
+        serialize_children(writer);
     }
 
 
@@ -718,17 +901,17 @@ public:
     Mp4_vmhd(uint32_t flags)
         : Mp4_box(s_mp4_box_type_vmhd, s_mp4_full_box_header_size + s_mp4_vmhd_body_size, 0, flags)
     {
+        m_kind = KIND_VMHD;
     }
 
     /// Serialize vmhd's body
-    void serialize_body(std::vector<uint8_t>& outputBuffer) const
+    void serialize_body(Mp4_writer& writer) const
     {
         // graphicsmode = 0 (2 bytes)
-        write<uint16_t>(outputBuffer, 0);
+        writer.write<uint16_t>(0);
 
         // opcolor = {0, 0, 0} (3x2 bytes)
-        for (int i = 0; i < 3; ++i)
-            write<uint16_t>(outputBuffer, 0);
+        writer.write_zeros(6);
     }
 
 private:
@@ -743,6 +926,117 @@ const uint32_t Mp4_vmhd::s_mp4_box_type_vmhd(Mp4_box::chars_to_type('v','m','h',
 
 
 
+/// Location of a NAL unit (without start code) within a buffer
+typedef MP4Chunk Mp4_nal_unit;
+
+typedef std::vector<Mp4_nal_unit> Mp4_nal_units;
+
+static const uint8_t s_h264_nal_sps = 7;
+static const uint8_t s_h264_nal_pps = 8;
+static const uint8_t s_hevc_nal_vps = 32;
+static const uint8_t s_hevc_nal_sps = 33;
+static const uint8_t s_hevc_nal_pps = 34;
+
+inline uint8_t get_nal_type(const Mp4_nal_unit& nal, bool hevc)
+{
+    return hevc ? ((nal.data[0] >> 1) & 0x3f) : (nal.data[0] & 0x1f);
+}
+
+/// Find the next three byte start code with the fastest version the CPU supports
+/// \param p Where to start looking
+/// \param end The end of the byte stream
+/// \return the start code's position, or end
+inline const uint8_t* find_start_code(const uint8_t* p, const uint8_t* end)
+{
+    return BitstreamParser::FindStartCode(p, end);
+}
+
+/// Split an Annex-B byte stream into its NAL units
+/// \param data The byte stream
+/// \param size The byte stream's size
+/// \param nals Receives the NAL units
+static void split_annexb(const uint8_t* data, size_t size, Mp4_nal_units& nals)
+{
+    nals.clear();
+
+    const uint8_t* end = data + size;
+    const uint8_t* nal = nullptr;
+
+    for (const uint8_t* p = find_start_code(data, end); ; p = find_start_code(p + 3, end))
+    {
+        if (nal)
+        {
+            // The zero_byte of a four byte start code belongs to the next one, trailing zeros to none
+            const uint8_t* nal_end = p;
+            while (nal_end > nal && nal_end[-1] == 0)
+                --nal_end;
+
+            if (nal_end > nal)
+                nals.push_back({ nal, static_cast<size_t>(nal_end - nal) });
+        }
+
+        if (p == end)
+            break;
+
+        nal = p + 3;
+    }
+}
+
+/// Check whether an access unit starts with a random access picture (IDR, or IRAP for HEVC)
+/// \param data The access unit in Annex-B format
+/// \param size The access unit's size
+/// \param hevc Interpret the NAL headers as HEVC
+/// \return true if decoding can start at this access unit
+static bool is_sync_sample(const uint8_t* data, size_t size, bool hevc)
+{
+    const uint8_t* end = data + size;
+
+    // Only the NAL units in front of the first slice need to be looked at
+    for (const uint8_t* p = find_start_code(data, end); p != end; p = find_start_code(p + 3, end))
+    {
+        if (p + 3 == end)
+            break;
+
+        uint8_t type = hevc ? ((p[3] >> 1) & 0x3f) : (p[3] & 0x1f);
+        if (hevc && type < 32)
+            return type >= 16 && type <= 21;
+        if (!hevc && type >= 1 && type <= 5)
+            return type == 5;
+    }
+
+    return false;
+}
+
+/// Check whether a NAL unit is a parameter set, i.e. belongs into the sample description
+/// \param nal The NAL unit
+/// \param hevc Interpret the NAL header as HEVC
+/// \return true for VPS, SPS and PPS
+inline bool is_parameter_set(const Mp4_nal_unit& nal, bool hevc)
+{
+    uint8_t type = get_nal_type(nal, hevc);
+    if (hevc)
+        return type == s_hevc_nal_vps || type == s_hevc_nal_sps || type == s_hevc_nal_pps;
+    return type == s_h264_nal_sps || type == s_h264_nal_pps;
+}
+
+/// Collect the NAL units of one type
+/// \param nals All NAL units
+/// \param type The wanted type
+/// \param hevc Interpret the NAL headers as HEVC
+/// \return the NAL units of that type
+static std::vector<std::vector<uint8_t>> filter_nal_units(const Mp4_nal_units& nals, uint8_t type, bool hevc)
+{
+    std::vector<std::vector<uint8_t>> result;
+    for (const Mp4_nal_unit& nal : nals)
+    {
+        if (get_nal_type(nal, hevc) == type)
+            result.emplace_back(nal.data, nal.data + nal.size);
+    }
+    return result;
+}
+
+
+
 /**
  * @brief AVC decoder configuration.
  */
@@ -750,40 +1044,130 @@ class Mp4_avc_decoder_configuration : public Mp4_box
 {
 public:
 
-    Mp4_avc_decoder_configuration()
-        : Mp4_box(s_mp4_avc_decoder_configuration_type, s_mp4_box_header_size + s_mp4_avc_decoder_configuration_body_size)
+    /// Constructor
+    /// \param sps Sequence parameter sets (NAL units without start code), kept by reference
+    /// \param pps Picture parameter sets (NAL units without start code), kept by reference
+    Mp4_avc_decoder_configuration(const std::vector<std::vector<uint8_t>>& sps, const std::vector<std::vector<uint8_t>>& pps)
+        : Mp4_box(s_mp4_avc_decoder_configuration_type, s_mp4_box_header_size + s_mp4_avc_decoder_configuration_body_size), m_sps(sps), m_pps(pps)
+    {
+        m_kind = KIND_AVC_DECODER_CONFIGURATION;
+
+        uint64_t size = get_size();
+        for (const std::vector<uint8_t>& nal : m_sps)
+            size += 2 + nal.size();
+        for (const std::vector<uint8_t>& nal : m_pps)
+            size += 2 + nal.size();
+
+        if (!m_sps.empty())
+            parse_sps(m_sps[0]);
+        if (has_high_profile_fields())
+            size += 4;
+        set_size(size);
+    }
+
+    /// Get the RFC 6381 codecs parameter, e.g. avc1.64001f
+    /// \return the codec string
+    std::string get_codec_string() const
     {
+        const uint8_t* sps = (!m_sps.empty() && m_sps[0].size() >= 4) ? m_sps[0].data() : nullptr;
+
+        char codec[16];
+        snprintf(codec, sizeof(codec), "avc1.%02x%02x%02x", sps ? sps[1] : 0, sps ? sps[2] : 0, sps ? sps[3] : 0);
+        return codec;
     }
 
-    void serialize_body(std::vector<uint8_t>& outputBuffer) const
+    void serialize_body(Mp4_writer& writer) const
     {
+        // Profile, compatibility and level are copied from the first SPS
+        const uint8_t* sps = (!m_sps.empty() && m_sps[0].size() >= 4) ? m_sps[0].data() : nullptr;
+
         // config version (1 byte)
-        write<uint8_t>(outputBuffer, 1);
+        writer.write<uint8_t>(1);
 
         // profile indication (1 byte)
-        write<uint8_t>(outputBuffer, 0);
+        writer.write<uint8_t>(sps ? sps[1] : 0);
 
         // profile compatibility (1 byte)
-        write<uint8_t>(outputBuffer, 0);
+        writer.write<uint8_t>(sps ? sps[2] : 0);
 
         // AVC level indication (1 byte)
-        write<uint8_t>(outputBuffer, 0);
+        writer.write<uint8_t>(sps ? sps[3] : 0);
 
         // reserved (6 bit)
         // lengthSizeMinusOne (2 bit)
-        write<uint8_t>(outputBuffer, 0xff);
+        writer.write<uint8_t>(0xff);
 
         // reserved (3 bit)
         // numberOfSequenceParameterSets (5 bit)
-        write<uint8_t>(outputBuffer, 0xe0);
+        writer.write<uint8_t>(0xe0 | static_cast<uint8_t>(m_sps.size() & 0x1f));
+
+        for (const std::vector<uint8_t>& nal : m_sps)
+        {
+            writer.write<uint16_t>(static_cast<uint16_t>(nal.size()));
+            writer.write_bytes(nal.data(), nal.size());
+        }
+
+        // numberOfPictureParameterSets (8 bit)
+        writer.write<uint8_t>(static_cast<uint8_t>(m_pps.size()));
+
+        for (const std::vector<uint8_t>& nal : m_pps)
+        {
+            writer.write<uint16_t>(static_cast<uint16_t>(nal.size()));
+            writer.write_bytes(nal.data(), nal.size());
+        }
+
+        if (!has_high_profile_fields())
+            return;
+
+        // reserved (6 bit)
+        // chroma_format (2 bit)
+        writer.write<uint8_t>(0xfc | m_chroma_format);
 
-        // numberOfPictureParameterSets (5 bit)
-        write<uint8_t>(outputBuffer, 0);
+        // reserved (5 bit)
+        // bit_depth_luma_minus8 (3 bit)
+        writer.write<uint8_t>(0xf8 | m_bit_depth_luma_minus8);
+
+        // reserved (5 bit)
+        // bit_depth_chroma_minus8 (3 bit)
+        writer.write<uint8_t>(0xf8 | m_bit_depth_chroma_minus8);
+
+        // numOfSequenceParameterSetExt (8 bit)
+        writer.write<uint8_t>(0);
     }
 
 private:
+
+    /// ISO/IEC 14496-15 adds chroma format and bit depths to the record for these profiles
+    /// \return whether the first SPS has one of them
+    bool has_high_profile_fields() const
+    {
+        uint8_t profile = (!m_sps.empty() && m_sps[0].size() >= 4) ? m_sps[0][1] : 0;
+        return profile == 100 || profile == 110 || profile == 122 || profile == 144;
+    }
+
+    /// Read the fields avcC repeats from the SPS
+    /// \param sps The SPS NAL unit
+    void parse_sps(const std::vector<uint8_t>& sps)
+    {
+        H264SPS parsed;
+        if (!BitstreamParser::ParseH264SPS(sps.data(), sps.size(), parsed))
+            return;
+
+        m_chroma_format = static_cast<uint8_t>(parsed.chromaFormat & 3);
+        m_bit_depth_luma_minus8 = static_cast<uint8_t>((parsed.bitDepthLuma - 8) & 7);
+        m_bit_depth_chroma_minus8 = static_cast<uint8_t>((parsed.bitDepthChroma - 8) & 7);
+    }
+
     static const uint32_t s_mp4_avc_decoder_configuration_type;
     static const uint32_t s_mp4_avc_decoder_configuration_body_size = 7;
+
+    const std::vector<std::vector<uint8_t>>& m_sps;
+    const std::vector<std::vector<uint8_t>>& m_pps;
+
+    // Used if the SPS cannot be parsed: 4:2:0, 8 bit
+    uint8_t m_chroma_format = 1;
+    uint8_t m_bit_depth_luma_minus8 = 0;
+    uint8_t m_bit_depth_chroma_minus8 = 0;
 };
 
 const uint32_t Mp4_avc_decoder_configuration::s_mp4_avc_decoder_configuration_type(Mp4_box::chars_to_type('a','v','c','C'));
@@ -791,103 +1175,260 @@ const uint32_t Mp4_avc_decoder_configuration::s_mp4_avc_decoder_configuration_ty
 
 
 /**
- * @brief Visual sample entry.
+ * @brief HEVC decoder configuration.
  */
-class Mp4_visual_sample_entry : public Mp4_box
+class Mp4_hevc_decoder_configuration : public Mp4_box
 {
 public:
 
-    Mp4_visual_sample_entry(uint16_t width, uint16_t height)
-        : Mp4_box(s_mp4_visual_sample_entry_avc1, s_mp4_box_header_size + s_mp4_visual_sample_entry_body_size), m_width(width), m_height(height)
-    {
-        Mp4_avc_decoder_configuration* decoder_config = new Mp4_avc_decoder_configuration();
-        add_box(decoder_config);
+    /// Constructor
+    /// \param vps Video parameter sets (NAL units without start code), kept by reference
+    /// \param sps Sequence parameter sets (NAL units without start code), kept by reference
+    /// \param pps Picture parameter sets (NAL units without start code), kept by reference
+    Mp4_hevc_decoder_configuration(const std::vector<std::vector<uint8_t>>& vps, const std::vector<std::vector<uint8_t>>& sps, const std::vector<std::vector<uint8_t>>& pps)
+        : Mp4_box(s_mp4_hevc_decoder_configuration_type, s_mp4_box_header_size + s_mp4_hevc_decoder_configuration_body_size)
+    {
+        m_kind = KIND_HEVC_DECODER_CONFIGURATION;
+        m_arrays[0] = { s_hevc_nal_vps, &vps };
+        m_arrays[1] = { s_hevc_nal_sps, &sps };
+        m_arrays[2] = { s_hevc_nal_pps, &pps };
+
+        uint64_t size = get_size();
+        for (const Array& array : m_arrays)
+        {
+            if (array.nals->empty())
+                continue;
+
+            size += 3;
+            for (const std::vector<uint8_t>& nal : *array.nals)
+                size += 2 + nal.size();
+        }
+        set_size(size);
+
+        if (!sps.empty())
+            parse_sps(sps[0]);
     }
 
-    void serialize_body(std::vector<uint8_t>& outputBuffer) const
+    /// Get the codecs parameter as ISO/IEC 14496-15 Annex E defines it, e.g. hvc1.1.6.L93.B0
+    /// \return the codec string
+    std::string get_codec_string() const
     {
-        // reserved (6 bytes)
-        for (int i = 0; i < 6; ++i)
-            write<uint8_t>(outputBuffer, 0);
+        const uint8_t* ptl = m_profile_tier_level;
 
-        // data_reference_index
-        write<uint16_t>(outputBuffer, 1);
+        static const char* const s_profile_spaces[] = { "", "A", "B", "C" };
 
-        // pre-defined (2 bytes)
-        // resreved (2 bytes)
-        // pre-defined (3 x 4 bytes)
-        for (int i = 0; i < 16; ++i)
-            write<uint8_t>(outputBuffer, 0);
+        // The compatibility flags are written in reverse bit order
+        uint32_t compatibility = (static_cast<uint32_t>(ptl[1]) << 24) | (static_cast<uint32_t>(ptl[2]) << 16) | (static_cast<uint32_t>(ptl[3]) << 8) | ptl[4];
+        uint32_t reversed = 0;
+        for (int i = 0; i < 32; ++i)
+            reversed |= ((compatibility >> i) & 1) << (31 - i);
 
-        // width
-        write(outputBuffer, m_width);
+        char codec[64];
+        int length = snprintf(codec, sizeof(codec), "hvc1.%s%u.%x.%c%u", s_profile_spaces[ptl[0] >> 6], ptl[0] & 0x1f, reversed,
+                              (ptl[0] & 0x20) ? 'H' : 'L', ptl[11]);
 
-        // height
-        write(outputBuffer, m_height);
+        // Constraint bytes up to the last non-zero one
+        int constraints = 6;
+        while (constraints > 0 && ptl[4 + constraints] == 0)
+            --constraints;
+        for (int i = 0; i < constraints && length < (int) sizeof(codec) - 4; ++i)
+            length += snprintf(codec + length, sizeof(codec) - length, ".%02X", ptl[5 + i]);
 
-        // horizresolution (4 bytes): 72 dpi
-        // vertresolution (4 bytes): 72 dpi
-        for (int i = 0; i < 2; ++i)
-            write<uint32_t>(outputBuffer, 0x00480000);
+        return codec;
+    }
 
-        // reserved (4 bytes)
-        for (int i = 0; i < 4; ++i)
-            write<uint8_t>(outputBuffer, 0);
+    void serialize_body(Mp4_writer& writer) const
+    {
+        // configurationVersion
+        writer.write<uint8_t>(1);
 
-        // frame_count (2 bytes)
-        write<uint16_t>(outputBuffer, 1);
+        // general_profile_space, general_tier_flag, general_profile_idc,
+        // general_profile_compatibility_flags, general_constraint_indicator_flags, general_level_idc
+        // (same layout as in the SPS)
+        writer.write_bytes(m_profile_tier_level, sizeof(m_profile_tier_level));
 
-        // compressorname (32 bytes)
-        for (int i = 0; i < 32; ++i)
-            write<uint8_t>(outputBuffer, 0);
+        // reserved (4 bit), min_spatial_segmentation_idc (12 bit)
+        writer.write<uint16_t>(0xf000);
 
-        // depth (2 bytes)
-        write<uint16_t>(outputBuffer, 0x003c);
+        // reserved (6 bit), parallelismType (2 bit)
+        writer.write<uint8_t>(0xfc);
 
-        // pre-defined = -1 (2 bytes)
-        write<uint16_t>(outputBuffer, 0xffff);
+        // reserved (6 bit), chromaFormat (2 bit)
+        writer.write<uint8_t>(0xfc | (m_chroma_format & 0x03));
 
-        size_t nr_children = m_boxes.size();
-        for (size_t i = 0; i < nr_children; ++i)
-            m_boxes[i]->serialize(outputBuffer);
-    }
+        // reserved (5 bit), bitDepthLumaMinus8 (3 bit)
+        writer.write<uint8_t>(0xf8 | (m_bit_depth_luma_minus8 & 0x07));
 
-private:
-    static const uint32_t s_mp4_visual_sample_entry_avc1;
-    static const uint32_t s_mp4_visual_sample_entry_body_size = 78;
-    uint16_t m_width;
-    uint16_t m_height;
-};
+        // reserved (5 bit), bitDepthChromaMinus8 (3 bit)
+        writer.write<uint8_t>(0xf8 | (m_bit_depth_chroma_minus8 & 0x07));
 
-const uint32_t Mp4_visual_sample_entry::s_mp4_visual_sample_entry_avc1(Mp4_box::chars_to_type('a','v','c','1'));
+        // avgFrameRate
+        writer.write<uint16_t>(0);
 
+        // constantFrameRate (2 bit), numTemporalLayers (3 bit), temporalIdNested (1 bit), lengthSizeMinusOne (2 bit)
+        writer.write<uint8_t>(((m_num_temporal_layers & 0x07) << 3) | ((m_temporal_id_nested & 0x01) << 2) | 0x03);
 
+        uint8_t num_arrays = 0;
+        for (const Array& array : m_arrays)
+            num_arrays += array.nals->empty() ? 0 : 1;
+        writer.write<uint8_t>(num_arrays);
 
-/**
- * @brief stsd (sample description box).
- */
-class Mp4_stsd : public Mp4_box
+        for (const Array& array : m_arrays)
+        {
+            if (array.nals->empty())
+                continue;
+
+            // array_completeness = 1, reserved = 0, NAL_unit_type (6 bit)
+            writer.write<uint8_t>(0x80 | array.type);
+            writer.write<uint16_t>(static_cast<uint16_t>(array.nals->size()));
+
+            for (const std::vector<uint8_t>& nal : *array.nals)
+            {
+                writer.write<uint16_t>(static_cast<uint16_t>(nal.size()));
+                writer.write_bytes(nal.data(), nal.size());
+            }
+        }
+    }
+
+private:
+
+    /// Read the fields hvcC repeats from the SPS
+    /// \param sps The SPS NAL unit
+    void parse_sps(const std::vector<uint8_t>& sps)
+    {
+        HEVCSPS parsed;
+        if (!BitstreamParser::ParseHEVCSPS(sps.data(), sps.size(), parsed))
+            return;
+
+        memcpy(m_profile_tier_level, parsed.profileTierLevel.bytes, sizeof(m_profile_tier_level));
+        m_chroma_format = static_cast<uint8_t>(parsed.chromaFormat);
+        m_bit_depth_luma_minus8 = static_cast<uint8_t>(parsed.bitDepthLuma - 8);
+        m_bit_depth_chroma_minus8 = static_cast<uint8_t>(parsed.bitDepthChroma - 8);
+        m_num_temporal_layers = static_cast<uint8_t>(parsed.maxSubLayers);
+        m_temporal_id_nested = parsed.temporalIdNesting ? 1 : 0;
+    }
+
+    struct Array
+    {
+        uint8_t type;
+        const std::vector<std::vector<uint8_t>>* nals;
+    };
+
+    static const uint32_t s_mp4_hevc_decoder_configuration_type;
+    static const uint32_t s_mp4_hevc_decoder_configuration_body_size = 23;
+
+    Array m_arrays[3];
+
+    // Used if the SPS cannot be parsed; matches what NVENC produces: Main profile level 4, 4:2:0, 8 bit
+    uint8_t m_profile_tier_level[12] = { 0x01, 0x60, 0, 0, 0, 0x90, 0, 0, 0, 0, 0, 0x78 };
+    uint8_t m_chroma_format = 1;
+    uint8_t m_bit_depth_luma_minus8 = 0;
+    uint8_t m_bit_depth_chroma_minus8 = 0;
+    uint8_t m_num_temporal_layers = 1;
+    uint8_t m_temporal_id_nested = 1;
+};
+
+const uint32_t Mp4_hevc_decoder_configuration::s_mp4_hevc_decoder_configuration_type(Mp4_box::chars_to_type('h','v','c','C'));
+
+
+
+/**
+ * @brief Visual sample entry.
+ */
+class Mp4_visual_sample_entry : public Mp4_box
 {
 public:
 
     /// Constructor
+    /// \param type The sample entry's type (avc1 or hvc1)
     /// \param width video's width
     /// \param height video's height
-    Mp4_stsd(uint16_t width, uint16_t height)
+    /// \param decoder_config The decoder configuration box matching the type
+    Mp4_visual_sample_entry(uint32_t type, uint16_t width, uint16_t height, Mp4_box* decoder_config)
+        : Mp4_box(type, s_mp4_box_header_size + s_mp4_visual_sample_entry_body_size), m_width(width), m_height(height)
+    {
+        m_kind = KIND_VISUAL_SAMPLE_ENTRY;
+        add_box(decoder_config);
+    }
+
+    void serialize_body(Mp4_writer& writer) const
+    {
+        // reserved (6 bytes)
+        writer.write_zeros(6);
+
+        // data_reference_index
+        writer.write<uint16_t>(1);
+
+        // pre-defined (2 bytes)
+        // resreved (2 bytes)
+        // pre-defined (3 x 4 bytes)
+        writer.write_zeros(16);
+
+        // width
+        writer.write(m_width);
+
+        // height
+        writer.write(m_height);
+
+        // horizresolution (4 bytes): 72 dpi
+        // vertresolution (4 bytes): 72 dpi
+        for (int i = 0; i < 2; ++i)
+            writer.write<uint32_t>(0x00480000);
+
+        // reserved (4 bytes)
+        writer.write_zeros(4);
+
+        // frame_count (2 bytes)
+        writer.write<uint16_t>(1);
+
+        // compressorname (32 bytes)
+        writer.write_zeros(32);
+
+        // depth (2 bytes)
+        writer.write<uint16_t>(0x003c);
+
+        // pre-defined = -1 (2 bytes)
+        writer.write<uint16_t>(0xffff);
+
+        serialize_children(writer);
+    }
+
+    static const uint32_t s_mp4_visual_sample_entry_avc1;
+    static const uint32_t s_mp4_visual_sample_entry_hvc1;
+
+private:
+    static const uint32_t s_mp4_visual_sample_entry_body_size = 78;
+    uint16_t m_width;
+    uint16_t m_height;
+};
+
+const uint32_t Mp4_visual_sample_entry::s_mp4_visual_sample_entry_avc1(Mp4_box::chars_to_type('a','v','c','1'));
+const uint32_t Mp4_visual_sample_entry::s_mp4_visual_sample_entry_hvc1(Mp4_box::chars_to_type('h','v','c','1'));
+
+
+
+/**
+ * @brief stsd (sample description box).
+ */
+class Mp4_stsd : public Mp4_box
+{
+public:
+
+    /// Constructor
+    /// \param sample_entry The track's only sample entry
+    Mp4_stsd(Mp4_box* sample_entry)
         : Mp4_box(s_mp4_box_type_stsd, s_mp4_full_box_header_size + s_mp4_stsd_body_size, 0, 0)
     {
-        Mp4_visual_sample_entry* sample_entry = new Mp4_visual_sample_entry(width, height);
+        m_kind = KIND_STSD;
         add_box(sample_entry);
     }
 
     /// Serialize stsd's body
-    void serialize_body(std::vector<uint8_t>& outputBuffer) const
+    void serialize_body(Mp4_writer& writer) const
     {
-        size_t nr_children = m_boxes.size();
-        write<uint32_t>(outputBuffer, nr_children);
+        writer.write(m_child_count);
 
-        for (size_t i = 0; i < nr_children; ++i)
-            m_boxes[i]->serialize(outputBuffer);
+        serialize_children(writer);
     }
 
 private:
@@ -913,14 +1454,15 @@ public:
     Mp4_stsz(uint32_t sample_size, uint32_t sample_count)
         : Mp4_box(s_mp4_box_type_stsz, s_mp4_full_box_header_size + s_mp4_stsz_body_size, 0, 0), m_sample_size(sample_size), m_sample_count(sample_count)
     {
+        m_kind = KIND_STSZ;
     }
 
     /// Serialize stsz's body
-    void serialize_body(std::vector<uint8_t>& outputBuffer) const
+    void serialize_body(Mp4_writer& writer) const
     {
-        write(outputBuffer, m_sample_size);
+        writer.write(m_sample_size);
 
-        write(outputBuffer, m_sample_count);
+        writer.write(m_sample_count);
     }
 
 private:
@@ -948,12 +1490,13 @@ public:
     Mp4_stsc(uint32_t entry_count)
         : Mp4_box(s_mp4_box_type_stsc, s_mp4_full_box_header_size + s_mp4_stsc_body_size, 0, 0), m_entry_count(entry_count)
     {
+        m_kind = KIND_STSC;
     }
 
     /// Serialize stsc's body
-    void serialize_body(std::vector<uint8_t>& outputBuffer) const
+    void serialize_body(Mp4_writer& writer) const
     {
-        write(outputBuffer, m_entry_count);
+        writer.write(m_entry_count);
     }
 
 private:
@@ -980,12 +1523,13 @@ public:
     Mp4_stts(uint32_t entry_count)
         : Mp4_box(s_mp4_box_type_stts, s_mp4_full_box_header_size + s_mp4_stts_body_size, 0, 0), m_entry_count(entry_count)
     {
+        m_kind = KIND_STTS;
     }
 
     /// Serialize stts's body
-    void serialize_body(std::vector<uint8_t>& outputBuffer) const
+    void serialize_body(Mp4_writer& writer) const
     {
-        write(outputBuffer, m_entry_count);
+        writer.write(m_entry_count);
     }
 
 
@@ -1014,13 +1558,14 @@ public:
     Mp4_stco(uint32_t entry_count)
         : Mp4_box(s_mp4_box_type_stco, s_mp4_full_box_header_size + s_mp4_stco_body_size, 0, 0), m_entry_count(entry_count)
     {
+        m_kind = KIND_STCO;
     }
 
     /// Serialize stco's body
     /// \param data_pointer points to the serialized buffer for stco's body
-    void serialize_body(std::vector<uint8_t>& outputBuffer) const
+    void serialize_body(Mp4_writer& writer) const
     {
-        write(outputBuffer, m_entry_count);
+        writer.write(m_entry_count);
     }
 
 private:
@@ -1047,12 +1592,27 @@ public:
     Mp4_mfhd(uint32_t sequence_number)
         : Mp4_box(s_mp4_box_type_mfhd, s_mp4_full_box_header_size + s_mp4_mfhd_body_size, 0, 0), m_sequence_number(sequence_number)
     {
+        m_kind = KIND_MFHD;
     }
 
     /// Serialize mfhd's body
-    void serialize_body(std::vector<uint8_t>& outputBuffer) const
+    void serialize_body(Mp4_writer& writer) const
+    {
+        writer.write(m_sequence_number);
+    }
+
+    /// Set the sequence number
+    /// \param sequence_number The sequence number of this fragment
+    void set_sequence_number(uint32_t sequence_number)
     {
-        write(outputBuffer, m_sequence_number);
+        m_sequence_number = sequence_number;
+    }
+
+    /// Get the position of the sequence number within the box
+    /// \return the field's offset
+    uint32_t get_sequence_number_offset() const
+    {
+        return get_header_size();
     }
 
 private:
@@ -1091,6 +1651,14 @@ public:
           m_default_sample_size(default_sample_size),
           m_default_sample_flags(default_sample_flags)
     {
+        m_kind = KIND_TFHD;
+    }
+
+    /// Set the default sample duration
+    /// \param default_sample_duration sample duration
+    void set_default_sample_duration(uint32_t default_sample_duration)
+    {
+        m_default_sample_duration = default_sample_duration;
     }
 
     /// Set the default sample size
@@ -1107,25 +1675,44 @@ public:
         m_default_sample_flags = default_sample_flags;
     }
 
+    /// Get the position of the default sample duration within the box
+    /// \return the field's offset
+    uint32_t get_default_sample_duration_offset() const
+    {
+        return get_header_size() + 4 +
+               ((m_bits & s_mp4_tfhd_flag_base_data_offset_present) ? 8 : 0) +
+               ((m_bits & s_mp4_tfhd_flag_sample_description_index_present) ? 4 : 0);
+    }
+
+    /// Get the position of the default sample size within the box
+    /// \return the field's offset
+    uint32_t get_default_sample_size_offset() const
+    {
+        return get_header_size() + 4 +
+               ((m_bits & s_mp4_tfhd_flag_base_data_offset_present) ? 8 : 0) +
+               ((m_bits & s_mp4_tfhd_flag_sample_description_index_present) ? 4 : 0) +
+               ((m_bits & s_mp4_tfhd_flag_default_sample_duration_present) ? 4 : 0);
+    }
+
     /// Serialize tfhd's body
-    void serialize_body(std::vector<uint8_t>& outputBuffer) const
+    void serialize_body(Mp4_writer& writer) const
     {
-        write(outputBuffer, m_track_id);
+        writer.write(m_track_id);
 
         if (m_bits & s_mp4_tfhd_flag_base_data_offset_present)
-            write(outputBuffer, m_base_data_offset);
+            writer.write(m_base_data_offset);
 
         if (m_bits & s_mp4_tfhd_flag_sample_description_index_present)
-            write(outputBuffer, m_sample_description_index);
+            writer.write(m_sample_description_index);
 
         if (m_bits & s_mp4_tfhd_flag_default_sample_duration_present)
-            write(outputBuffer, m_default_sample_duration);
+            writer.write(m_default_sample_duration);
 
         if (m_bits & s_mp4_tfhd_flag_default_sample_size_present)
-            write(outputBuffer, m_default_sample_size);
+            writer.write(m_default_sample_size);
 
         if (m_bits & s_mp4_tfhd_flag_default_sample_flags_present)
-            write(outputBuffer, m_default_sample_flags);
+            writer.write(m_default_sample_flags);
     }
 
     /// Get the optional size
@@ -1181,12 +1768,13 @@ public:
     Mp4_tfdt(uint64_t base_media_decode_time)
         : Mp4_box(s_mp4_box_type_tfdt, s_mp4_full_box_header_size + s_mp4_tfdt_body_size, 1, 0), m_base_media_decode_time(base_media_decode_time)
     {
+        m_kind = KIND_TFDT;
     }
 
     /// Serialize tfdt's body
-    void serialize_body(std::vector<uint8_t>& outputBuffer) const
+    void serialize_body(Mp4_writer& writer) const
     {
-        write(outputBuffer, m_base_media_decode_time);
+        writer.write(m_base_media_decode_time);
     }
 
     /// Set the base media decode time
@@ -1196,6 +1784,13 @@ public:
         m_base_media_decode_time = media_decode_time;
     }
 
+    /// Get the position of the base media decode time within the box
+    /// \return the field's offset
+    uint32_t get_media_decode_time_offset() const
+    {
+        return get_header_size();
+    }
+
 private:
 
     static const uint32_t s_mp4_box_type_tfdt;
@@ -1208,6 +1803,22 @@ const uint32_t Mp4_tfdt::s_mp4_box_type_tfdt(Mp4_box::chars_to_type('t','f','d',
 
 
 
+/**
+ * @brief One entry of trun's sample table.
+ */
+struct Mp4_trun_sample
+{
+    uint32_t duration;
+    uint32_t size;
+    uint32_t flags;
+    uint32_t composition_time_offset;
+};
+
+static const uint32_t s_mp4_sample_flags_sync     = 0x02000000; // depends on no other sample
+static const uint32_t s_mp4_sample_flags_non_sync = 0x01010000; // depends on others, is a non-sync sample
+
+
+
 /**
  * @brief trun (track fragment run box).
  */
@@ -1221,39 +1832,45 @@ public:
     /// \param data_offset The data offset
     /// \param first_sample_flags The first sample flags
     Mp4_trun(uint32_t flags, uint32_t sample_count, uint32_t data_offset, uint32_t first_sample_flags)
-        : Mp4_box(s_mp4_box_type_trun, s_mp4_full_box_header_size + s_mp4_trun_body_size, 0, flags), m_sample_count(sample_count), m_data_offset(data_offset), m_first_sample_flags(first_sample_flags)
+        : Mp4_box(s_mp4_box_type_trun, s_mp4_full_box_header_size + s_mp4_trun_body_size, 0, flags), m_sample_count(sample_count), m_data_offset(data_offset), m_first_sample_flags(first_sample_flags),
+          m_sample_duration(0), m_sample_size(0), m_sample_flags(0), m_sample_composition_time_offset(0)
     {
-        m_size +=
-                ((m_bits & s_mp4_trun_data_offset_present) ? 4 : 0) +
-                ((m_bits & s_mp4_trun_first_sample_flags_present) ? 4: 0) +
-                ((m_bits & s_mp4_trun_sample_duration_present) ? 4 : 0) +
-                ((m_bits & s_mp4_trun_sample_size_present) ? 4 : 0) +
-                ((m_bits & s_mp4_trun_sample_flags_present) ? 4 : 0) +
-                ((m_bits & s_mp4_trun_sample_composition_time_offsets_present) ? 4 : 0);
+        m_kind = KIND_TRUN;
+        set_size(get_size() +
+                 ((m_bits & s_mp4_trun_data_offset_present) ? 4 : 0) +
+                 ((m_bits & s_mp4_trun_first_sample_flags_present) ? 4: 0) +
+                 get_sample_entry_size());
     }
 
     /// Serialize trun's body
-    void serialize_body(std::vector<uint8_t>& outputBuffer) const
+    void serialize_body(Mp4_writer& writer) const
     {
-        write(outputBuffer, m_sample_count);
+        writer.write(m_samples.empty() ? m_sample_count : static_cast<uint32_t>(m_samples.size()));
 
         if (m_bits & s_mp4_trun_data_offset_present)
-            write(outputBuffer, m_data_offset);
+            writer.write(m_data_offset);
 
         if (m_bits & s_mp4_trun_first_sample_flags_present)
-            write(outputBuffer, m_first_sample_flags);
+            writer.write(m_first_sample_flags);
+
+        if (!m_samples.empty())
+        {
+            for (const Mp4_trun_sample& sample : m_samples)
+                serialize_sample(writer, sample);
+            return;
+        }
 
         if (m_bits & s_mp4_trun_sample_duration_present)
-            write(outputBuffer, m_sample_duration);
+            writer.write(m_sample_duration);
 
         if (m_bits & s_mp4_trun_sample_size_present)
-            write(outputBuffer, m_sample_size);
+            writer.write(m_sample_size);
 
         if (m_bits & s_mp4_trun_sample_flags_present)
-            write(outputBuffer, m_sample_flags);
+            writer.write(m_sample_flags);
 
         if (m_bits & s_mp4_trun_sample_composition_time_offsets_present)
-            write(outputBuffer, m_sample_composition_time_offset);
+            writer.write(m_sample_composition_time_offset);
     }
 
     /// Set data offset
@@ -1263,6 +1880,63 @@ public:
         m_data_offset = data_offset;
     }
 
+    /// Get the position of the data offset within the box
+    /// \return the field's offset
+    uint32_t get_data_offset_offset() const
+    {
+        return get_header_size() + 4;
+    }
+
+    /// Get the position of the first sample flags within the box
+    /// \return the field's offset
+    uint32_t get_first_sample_flags_offset() const
+    {
+        return get_header_size() + 4 +
+               ((m_bits & s_mp4_trun_data_offset_present) ? 4 : 0);
+    }
+
+    /// Get the position of the sample size within the box
+    /// \return the field's offset
+    uint32_t get_sample_size_offset() const
+    {
+        return get_header_size() + 4 +
+               ((m_bits & s_mp4_trun_data_offset_present) ? 4 : 0) +
+               ((m_bits & s_mp4_trun_first_sample_flags_present) ? 4 : 0) +
+               ((m_bits & s_mp4_trun_sample_duration_present) ? 4 : 0);
+    }
+
+    /// Append an entry to the sample table. Once the table has entries, they replace the single
+    /// sample the individual setters describe. The enclosing boxes need update_size() afterwards.
+    /// \param sample The sample's fields; those not flagged as present are ignored
+    void add_sample(const Mp4_trun_sample& sample)
+    {
+        m_samples.push_back(sample);
+        set_size(get_size() + (m_samples.size() > 1 ? get_sample_entry_size() : 0));
+    }
+
+    /// Set the duration of the sample table's last entry
+    /// \param duration The sample's duration
+    void set_last_sample_duration(uint32_t duration)
+    {
+        if (!m_samples.empty())
+            m_samples.back().duration = duration;
+    }
+
+    /// Empty the sample table
+    void clear_samples()
+    {
+        if (m_samples.size() > 1)
+            set_size(get_size() - (m_samples.size() - 1) * get_sample_entry_size());
+        m_samples.clear();
+    }
+
+    /// Get the number of entries in the sample table
+    /// \return the number of entries
+    uint32_t get_sample_table_size() const
+    {
+        return static_cast<uint32_t>(m_samples.size());
+    }
+
     /// Set first sample flags
     /// \param first_sample_flags The first sample flags
     void set_first_sample_flags(uint32_t first_sample_flags)
@@ -1307,10 +1981,37 @@ public:
 
 private:
 
+    /// Get the size of one sample's fields
+    /// \return the size of a sample table entry
+    uint32_t get_sample_entry_size() const
+    {
+        return ((m_bits & s_mp4_trun_sample_duration_present) ? 4 : 0) +
+               ((m_bits & s_mp4_trun_sample_size_present) ? 4 : 0) +
+               ((m_bits & s_mp4_trun_sample_flags_present) ? 4 : 0) +
+               ((m_bits & s_mp4_trun_sample_composition_time_offsets_present) ? 4 : 0);
+    }
+
+    /// Serialize one entry of the sample table
+    void serialize_sample(Mp4_writer& writer, const Mp4_trun_sample& sample) const
+    {
+        if (m_bits & s_mp4_trun_sample_duration_present)
+            writer.write(sample.duration);
+
+        if (m_bits & s_mp4_trun_sample_size_present)
+            writer.write(sample.size);
+
+        if (m_bits & s_mp4_trun_sample_flags_present)
+            writer.write(sample.flags);
+
+        if (m_bits & s_mp4_trun_sample_composition_time_offsets_present)
+            writer.write(sample.composition_time_offset);
+    }
+
     static const uint32_t s_mp4_box_type_trun;
     static const uint32_t s_mp4_trun_body_size = 4;
 
     uint32_t m_sample_count;
+    std::vector<Mp4_trun_sample> m_samples;
 
     // Optional fields
     uint32_t m_data_offset;
@@ -1327,181 +2028,1292 @@ const uint32_t Mp4_trun::s_mp4_box_type_trun(Mp4_box::chars_to_type('t','r','u',
 
 
 /**
- * @brief mdat (media data box).
+ * @brief mdat (media data box) holding one access unit. The Annex-B start codes are replaced with
+ * four byte NAL unit lengths, as avcC/hvcC announce.
  */
 class Mp4_mdat : public Mp4_box
 {
 public:
 
     /// Constructor
-    /// \param data Pointer to the data buffer
-    /// \param data_size The data buffer's size
-    Mp4_mdat(uint8_t* data, uint32_t data_size)
-        : Mp4_box(s_mp4_box_type_mdat, s_mp4_box_header_size + data_size), m_data(data)
+    /// \param data Pointer to the access unit in Annex-B format
+    /// \param data_size The access unit's size
+    /// \param nals Receives the access unit's NAL units; kept by the caller so it can be reused
+    /// \param hevc Interpret the NAL headers as HEVC
+    /// \param strip_parameter_sets Leave out VPS, SPS and PPS
+    Mp4_mdat(const uint8_t* data, size_t data_size, Mp4_nal_units& nals, bool hevc, bool strip_parameter_sets)
+        : Mp4_box(s_mp4_box_type_mdat), m_nals(nals)
     {
+        m_kind = KIND_MDAT;
+        split_annexb(data, data_size, m_nals);
+
+        if (strip_parameter_sets)
+            m_nals.erase(std::remove_if(m_nals.begin(), m_nals.end(),
+                                        [hevc](const Mp4_nal_unit& nal) { return is_parameter_set(nal, hevc); }),
+                         m_nals.end());
+
+        uint64_t size = s_mp4_box_header_size;
+        for (const Mp4_nal_unit& nal : m_nals)
+            size += s_mp4_nal_length_size + nal.size;
+        set_size(size);
     }
 
     /// Serialize mdat's body
-    void serialize_body(std::vector<uint8_t>& outputBuffer) const
+    void serialize_body(Mp4_writer& writer) const
     {
-        // Hint from Stefan Schoenefeld: Skip the first four bytes to work with Chrome
-        int offset = 4;
-        int data_size = static_cast<int>(get_size()) - s_mp4_box_header_size;
-
-        if (m_data && data_size >= offset)
+        for (const Mp4_nal_unit& nal : m_nals)
         {
-            uint32_t s = data_size - offset;
-            write<uint32_t>(outputBuffer, s);
+            writer.write<uint32_t>(static_cast<uint32_t>(nal.size));
+            writer.write_bytes(nal.data, nal.size);
+        }
+    }
+
+    /// Serialize everything but the NAL units, which can then be written straight from the data buffer:
+    /// the box header followed by the length of every NAL unit
+    /// \param outputBuffer The header is appended
+    void serialize_header(std::vector<uint8_t>& outputBuffer) const
+    {
+        size_t offset = outputBuffer.size();
+        outputBuffer.resize(offset + s_mp4_box_header_size + m_nals.size() * s_mp4_nal_length_size);
+
+        Mp4_writer writer(outputBuffer.data() + offset);
+        writer.write(m_size);
+        writer.write(m_type);
+
+        for (const Mp4_nal_unit& nal : m_nals)
+            writer.write<uint32_t>(static_cast<uint32_t>(nal.size));
+    }
+
+    /// Serialize the header of an mdat whose data is already in the output format
+    /// \param outputBuffer The header is appended
+    /// \param data_size The size of the data following the header
+    static void serialize_header(std::vector<uint8_t>& outputBuffer, uint32_t data_size)
+    {
+        size_t offset = outputBuffer.size();
+        outputBuffer.resize(offset + s_mp4_box_header_size);
+
+        Mp4_writer writer(outputBuffer.data() + offset);
+        writer.write<uint32_t>(s_mp4_box_header_size + data_size);
+        writer.write(s_mp4_box_type_mdat);
+    }
+
+    /// Lay out the box for a gather write, interleaving the lengths with the NAL units
+    /// \param header The output of serialize_header(), which must no longer move
+    /// \param chunks The pieces are appended
+    void get_chunks(const uint8_t* header, std::vector<MP4Chunk>& chunks) const
+    {
+        add_chunk(chunks, header, s_mp4_box_header_size);
+        header += s_mp4_box_header_size;
 
-            for (uint32_t i = 0; i < s; ++i)
-                write<uint8_t>(outputBuffer, m_data[offset + i]);
+        for (const Mp4_nal_unit& nal : m_nals)
+        {
+            add_chunk(chunks, header, s_mp4_nal_length_size);
+            add_chunk(chunks, nal.data, nal.size);
+            header += s_mp4_nal_length_size;
         }
     }
 
+    /// Get the size of the access unit in the box
+    /// \return the sample's size
+    uint32_t get_data_size() const
+    {
+        return static_cast<uint32_t>(get_size()) - s_mp4_box_header_size;
+    }
+
+    /// Append a piece to a gather list, merging it with the previous one if they are adjacent
+    static void add_chunk(std::vector<MP4Chunk>& chunks, const uint8_t* data, size_t size)
+    {
+        if (!chunks.empty() && chunks.back().data + chunks.back().size == data)
+            chunks.back().size += size;
+        else
+            chunks.push_back({ data, size });
+    }
+
 private:
 
     static const uint32_t s_mp4_box_type_mdat;
+    static const uint32_t s_mp4_nal_length_size = 4;
 
-    uint8_t* m_data;
+    Mp4_nal_units& m_nals;
 };
 
 const uint32_t Mp4_mdat::s_mp4_box_type_mdat(Mp4_box::chars_to_type('m','d','a','t'));
 
 
 
-
 /**
- * @brief Destructor.
+ * @brief sidx (segment index box) for a segment of one subsegment, placed right in front of it.
  */
-MP4::~MP4()
+class Mp4_sidx : public Mp4_box
 {
-    if (m_moof)
-        delete m_moof;
-}
+public:
 
+    /// Constructor
+    /// \param reference_id The track's ID
+    /// \param timescale The track's timescale
+    /// \param earliest_presentation_time Presentation time of the subsegment's first sample
+    /// \param referenced_size The subsegment's size (moof and mdat)
+    /// \param subsegment_duration The subsegment's duration
+    /// \param starts_with_sap The subsegment starts with a sync sample
+    Mp4_sidx(uint32_t reference_id, uint32_t timescale, uint64_t earliest_presentation_time, uint32_t referenced_size, uint32_t subsegment_duration, bool starts_with_sap)
+        : Mp4_box(s_mp4_box_type_sidx, s_mp4_full_box_header_size + s_mp4_sidx_body_size, 1, 0), m_reference_id(reference_id), m_timescale(timescale),
+          m_earliest_presentation_time(earliest_presentation_time), m_referenced_size(referenced_size), m_subsegment_duration(subsegment_duration), m_starts_with_sap(starts_with_sap)
+    {
+        m_kind = KIND_SIDX;
+    }
 
-/**
- * @brief Wraps a single frame.
- * @param inputFrameH264
- * @param width
- * @param height
- * @param outputBuffer
- */
-void MP4::Wrap(const std::vector<uint8_t>& inputFrameH264, uint32_t width, uint32_t height, std::vector<uint8_t>& outputBuffer)
-{
-    /*
-     * First frame initialization
-     */
-    if (!initialized)
+    /// Serialize sidx's body
+    void serialize_body(Mp4_writer& writer) const
     {
-        Mp4_box moov(Mp4_box::s_mp4_box_type_moov);
+        writer.write(m_reference_id);
+        writer.write(m_timescale);
+        writer.write(m_earliest_presentation_time);
+        writer.write<uint64_t>(0);                                      // first_offset: the subsegment follows
+        writer.write<uint16_t>(0);                                      // reserved
+        writer.write<uint16_t>(1);                                      // reference_count
+        writer.write<uint32_t>(m_referenced_size & 0x7fffffff);         // reference_type 0: media
+        writer.write(m_subsegment_duration);
+        writer.write<uint32_t>(m_starts_with_sap ? 0x90000000 : 0);     // starts_with_SAP, SAP_type 1
+    }
+
+private:
 
-        moov.add_box(new Mp4_mvhd(0, 0, 1000, 0));
+    static const uint32_t s_mp4_box_type_sidx;
+    static const uint32_t s_mp4_sidx_body_size = 40;
 
-        Mp4_box* mvex = new Mp4_box(Mp4_box::s_mp4_box_type_mvex);
-        mvex->add_box(new Mp4_mehd(0));
-        mvex->add_box(new Mp4_trex(m_track_id, 1, 0, 0, 0)); // sample description id: 1
-        moov.add_box(mvex);
+    uint32_t m_reference_id;
+    uint32_t m_timescale;
+    uint64_t m_earliest_presentation_time;
+    uint32_t m_referenced_size;
+    uint32_t m_subsegment_duration;
+    bool m_starts_with_sap;
+};
+
+const uint32_t Mp4_sidx::s_mp4_box_type_sidx(Mp4_box::chars_to_type('s','i','d','x'));
 
-        Mp4_box* trak = new Mp4_box(Mp4_box::s_mp4_box_type_trak);
-        trak->add_box(new Mp4_tkhd(m_track_id, width, height));
 
-        Mp4_box* mdia = new Mp4_box(Mp4_box::s_mp4_box_type_mdia);
-        mdia->add_box(new Mp4_mdhd(120, "eng"));
-        mdia->add_box(new Mp4_hdlr(Mp4_hdlr::s_mp4_hdlr_video_handler, "NVIDIA MPEG4 container"));
 
-        Mp4_dref* dref = new Mp4_dref();
-        dref->add_box(new Mp4_data_entry_url(""));
+/**
+ * @brief tfra (track fragment random access box).
+ */
+class Mp4_tfra : public Mp4_box
+{
+public:
+
+    /// Constructor
+    /// \param track_id The track's ID
+    /// \param entries The track's sync samples
+    Mp4_tfra(uint32_t track_id, const std::vector<MP4RandomAccessPoint>& entries)
+        : Mp4_box(s_mp4_box_type_tfra, static_cast<uint32_t>(s_mp4_full_box_header_size + s_mp4_tfra_body_size + entries.size() * s_mp4_tfra_entry_size), 1, 0),
+          m_track_id(track_id), m_entries(entries)
+    {
+        m_kind = KIND_TFRA;
+    }
 
-        Mp4_box* dinf = new Mp4_box(Mp4_box::s_mp4_box_type_dinf);
-        dinf->add_box(dref);
+    /// Serialize tfra's body
+    void serialize_body(Mp4_writer& writer) const
+    {
+        writer.write(m_track_id);
+        writer.write<uint32_t>(s_mp4_tfra_length_sizes);
+        writer.write(static_cast<uint32_t>(m_entries.size()));
 
-        Mp4_box* minf = new Mp4_box(Mp4_box::s_mp4_box_type_minf);
-        minf->add_box(new Mp4_vmhd(0x000001));
-        minf->add_box(dinf);
+        for (const MP4RandomAccessPoint& entry : m_entries)
+        {
+            writer.write(entry.time);
+            writer.write(entry.moofOffset);
+            writer.write<uint8_t>(1);                                   // traf_number
+            writer.write<uint8_t>(1);                                   // trun_number
+            writer.write(entry.sampleNumber);
+        }
+    }
 
-        Mp4_box* stbl = new Mp4_box(Mp4_box::s_mp4_box_type_stbl);
-        stbl->add_box(new Mp4_stsd(width, height));
-        stbl->add_box(new Mp4_stsz(0, 0));
-        stbl->add_box(new Mp4_stsc(0));
-        stbl->add_box(new Mp4_stts(0));
-        stbl->add_box(new Mp4_stco(0));
+private:
 
-        minf->add_box(stbl);
-        mdia->add_box(minf);
+    static const uint32_t s_mp4_box_type_tfra;
+    static const uint32_t s_mp4_tfra_body_size = 12;
+    static const uint32_t s_mp4_tfra_entry_size = 22;
 
-        trak->add_box(mdia);
-        moov.add_box(trak);
+    // One byte for the traf and trun numbers, four for the sample number
+    static const uint32_t s_mp4_tfra_length_sizes = 0x03;
 
-        m_moof = new Mp4_box(Mp4_box::s_mp4_box_type_moof);
-        Mp4_mfhd* mfhd = new Mp4_mfhd(m_seqno);
-        m_moof->add_box(mfhd);
+    uint32_t m_track_id;
+    const std::vector<MP4RandomAccessPoint>& m_entries;
+};
 
-        Mp4_box* traf = new Mp4_box(Mp4_box::s_mp4_box_type_traf);
+const uint32_t Mp4_tfra::s_mp4_box_type_tfra(Mp4_box::chars_to_type('t','f','r','a'));
 
-        uint32_t flags = Mp4_tfhd::s_mp4_tfhd_flag_default_base_is_moof |
-                         Mp4_tfhd::s_mp4_tfhd_flag_default_sample_flags_present |
-                         Mp4_tfhd::s_mp4_tfhd_flag_default_sample_size_present |
-                         Mp4_tfhd::s_mp4_tfhd_flag_default_sample_duration_present;
-        m_tfhd = new Mp4_tfhd(flags, m_track_id, 0, 1, 1, 0, 0x01010000);
-        traf->add_box(m_tfhd);
 
-        m_tfdt = new Mp4_tfdt(m_seqno);
-        traf->add_box(m_tfdt);
 
-        flags = Mp4_trun::s_mp4_trun_data_offset_present |
-                Mp4_trun::s_mp4_trun_sample_size_present |
-                Mp4_trun::s_mp4_trun_first_sample_flags_present;
-        m_trun = new Mp4_trun(flags, 1, 0x0000008, 0x2000000);
-        traf->add_box(m_trun);
-        m_moof->add_box(traf);
+/**
+ * @brief mfro (movie fragment random access offset box), lets readers find mfra from the end of the file.
+ */
+class Mp4_mfro : public Mp4_box
+{
+public:
 
-        moov.serialize(outputBuffer);
-        this->initialized = true;
+    /// Constructor
+    Mp4_mfro()
+        : Mp4_box(s_mp4_box_type_mfro, s_mp4_full_box_header_size + s_mp4_mfro_body_size, 0, 0), m_mfra_size(0)
+    {
+        m_kind = KIND_MFRO;
     }
 
+    /// Serialize mfro's body
+    void serialize_body(Mp4_writer& writer) const
+    {
+        writer.write(m_mfra_size);
+    }
 
+    /// Set the size of the enclosing mfra
+    /// \param mfra_size mfra's size
+    void set_mfra_size(uint32_t mfra_size)
+    {
+        m_mfra_size = mfra_size;
+    }
 
-    /*
-     * Encode frame
-     */
-    uint64_t moof_size = m_moof->get_size();
-    uint64_t data_size = inputFrameH264.size();
+private:
 
-    Mp4_mdat* mdat = new Mp4_mdat((uint8_t*) inputFrameH264.data(), static_cast<uint32_t>(data_size));
+    static const uint32_t s_mp4_box_type_mfro;
+    static const uint32_t s_mp4_mfro_body_size = 4;
 
-    m_tfdt->set_media_decode_time(m_seqno++);
-    m_trun->set_data_offset(static_cast<uint32_t>(moof_size + 8));
-    m_trun->set_sample_size(static_cast<uint32_t>(data_size));
+    uint32_t m_mfra_size;
+};
 
-    m_tfhd->set_default_sample_size(static_cast<uint32_t>(inputFrameH264.size()));
-    m_tfhd->set_default_sample_flags(0x01010000);
+const uint32_t Mp4_mfro::s_mp4_box_type_mfro(Mp4_box::chars_to_type('m','f','r','o'));
 
-    outputBuffer.reserve(moof_size + data_size); // TODO enough?
 
-    m_moof->serialize(outputBuffer);
-    mdat->serialize(outputBuffer); // TODO this copies the raw H.264 data into the wrapped buffer... in a real application we should avoid unnecessary copying
 
-    delete mdat;
+/// Dispatch to the serialize_body() of the box's class
+/// \param writer The body is written here
+void Mp4_box::serialize_body(Mp4_writer& writer) const
+{
+    switch (m_kind)
+    {
+    case KIND_CONTAINER:                    serialize_children(writer); break;
+    case KIND_FTYP:                         static_cast<const Mp4_ftyp*>(this)->serialize_body(writer); break;
+    case KIND_MVHD:                         static_cast<const Mp4_mvhd*>(this)->serialize_body(writer); break;
+    case KIND_MEHD:                         static_cast<const Mp4_mehd*>(this)->serialize_body(writer); break;
+    case KIND_TREX:                         static_cast<const Mp4_trex*>(this)->serialize_body(writer); break;
+    case KIND_TKHD:                         static_cast<const Mp4_tkhd*>(this)->serialize_body(writer); break;
+    case KIND_MDHD:                         static_cast<const Mp4_mdhd*>(this)->serialize_body(writer); break;
+    case KIND_HDLR:                         static_cast<const Mp4_hdlr*>(this)->serialize_body(writer); break;
+    case KIND_DATA_ENTRY_URL:               static_cast<const Mp4_data_entry_url*>(this)->serialize_body(writer); break;
+    case KIND_DATA_ENTRY_URN:               static_cast<const Mp4_data_entry_urn*>(this)->serialize_body(writer); break;
+    case KIND_DREF:                         static_cast<const Mp4_dref*>(this)->serialize_body(writer); break;
+    case KIND_VMHD:                         static_cast<const Mp4_vmhd*>(this)->serialize_body(writer); break;
+    case KIND_AVC_DECODER_CONFIGURATION:    static_cast<const Mp4_avc_decoder_configuration*>(this)->serialize_body(writer); break;
+    case KIND_HEVC_DECODER_CONFIGURATION:   static_cast<const Mp4_hevc_decoder_configuration*>(this)->serialize_body(writer); break;
+    case KIND_VISUAL_SAMPLE_ENTRY:          static_cast<const Mp4_visual_sample_entry*>(this)->serialize_body(writer); break;
+    case KIND_STSD:                         static_cast<const Mp4_stsd*>(this)->serialize_body(writer); break;
+    case KIND_STSZ:                         static_cast<const Mp4_stsz*>(this)->serialize_body(writer); break;
+    case KIND_STSC:                         static_cast<const Mp4_stsc*>(this)->serialize_body(writer); break;
+    case KIND_STTS:                         static_cast<const Mp4_stts*>(this)->serialize_body(writer); break;
+    case KIND_STCO:                         static_cast<const Mp4_stco*>(this)->serialize_body(writer); break;
+    case KIND_MFHD:                         static_cast<const Mp4_mfhd*>(this)->serialize_body(writer); break;
+    case KIND_TFHD:                         static_cast<const Mp4_tfhd*>(this)->serialize_body(writer); break;
+    case KIND_TFDT:                         static_cast<const Mp4_tfdt*>(this)->serialize_body(writer); break;
+    case KIND_TRUN:                         static_cast<const Mp4_trun*>(this)->serialize_body(writer); break;
+    case KIND_MDAT:                         static_cast<const Mp4_mdat*>(this)->serialize_body(writer); break;
+    case KIND_SIDX:                         static_cast<const Mp4_sidx*>(this)->serialize_body(writer); break;
+    case KIND_TFRA:                         static_cast<const Mp4_tfra*>(this)->serialize_body(writer); break;
+    case KIND_MFRO:                         static_cast<const Mp4_mfro*>(this)->serialize_body(writer); break;
+    }
 }
 
 
 
+/**
+ * @brief Destructor: destroys the objects that need it and frees the heap blocks.
+ */
+MP4Arena::~MP4Arena()
+{
+    Rewind({ 0, 0, nullptr });
+}
+
+
 
 /**
- * @brief Encode and append output to file.
- * @param inputFrameH264
- * @param width
- * @param height
- * @param path
+ * @brief Destroys everything created since the mark was taken; the memory is reused.
+ * @param mark
  */
-void MP4::WrapToFile(const std::vector<uint8_t>& inputFrameH264, uint32_t width, uint32_t height, const std::string& path)
+void MP4Arena::Rewind(const Mark& mark)
+{
+    while (m_destructors != mark.destructors)
+    {
+        m_destructors->destroy(m_destructors->object);
+        m_destructors = m_destructors->next;
+    }
+
+    m_block = mark.block;
+    m_used = mark.used;
+}
+
+
+
+void* MP4Arena::Allocate(size_t size, size_t alignment)
 {
-    std::vector<uint8_t> buffer;
-    this->Wrap(inputFrameH264, width, height, buffer);
+    size_t offset = (m_used + alignment - 1) & ~(alignment - 1);
 
-    std::ofstream out(path, std::ios::out | std::ios::binary | std::ios::app);
-    out.write((char*) buffer.data(), buffer.size());
-    out.close();
+    while (offset + size > GetBlockSize(m_block))
+    {
+        // Move on to the next block, adding one that is large enough if there is none
+        if (m_block == m_blocks.size())
+        {
+            size_t block_size = (size + alignment > s_block_size) ? size + alignment : s_block_size;
+            m_blocks.push_back({ std::unique_ptr<uint8_t[]>(new uint8_t[block_size]), block_size });
+        }
+
+        m_block++;
+        uint8_t* data = GetBlockData(m_block);
+        offset = static_cast<size_t>(((reinterpret_cast<uintptr_t>(data) + alignment - 1) & ~(uintptr_t) (alignment - 1)) - reinterpret_cast<uintptr_t>(data));
+    }
+
+    m_used = offset + size;
+    return GetBlockData(m_block) + offset;
 }
 
+
+
+void MP4Arena::AddDestructor(void* object, void (*destroy)(void*))
+{
+    Destructor* destructor = new (Allocate(sizeof(Destructor), alignof(Destructor))) Destructor{ destroy, object, m_destructors };
+    m_destructors = destructor;
+}
+
+
+
+uint8_t* MP4Arena::GetBlockData(size_t block) const
+{
+    return (block == 0) ? const_cast<uint8_t*>(m_inline) : m_blocks[block - 1].data.get();
+}
+
+
+
+size_t MP4Arena::GetBlockSize(size_t block) const
+{
+    return (block == 0) ? s_inline_size : m_blocks[block - 1].size;
+}
+
+
+
+
+/// Compute value * numerator / denominator, rounded down, without overflowing in between
+/// \param value
+/// \param numerator
+/// \param denominator
+/// \return the rescaled value
+static uint64_t rescale(uint64_t value, uint64_t numerator, uint64_t denominator)
+{
+#if defined(__SIZEOF_INT128__)
+    return static_cast<uint64_t>(static_cast<unsigned __int128>(value) * numerator / denominator);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    uint64_t high;
+    uint64_t low = _umul128(value, numerator, &high);
+    uint64_t remainder;
+    return _udiv128(high, low, denominator, &remainder);
+#else
+    return (value / denominator) * numerator + (value % denominator) * numerator / denominator;
+#endif
+}
+
+/// Copy a wrapped fragment into a buffer
+/// \param chunks The fragment
+/// \param outputBuffer The fragment is appended
+static void append_chunks(const std::vector<MP4Chunk>& chunks, std::vector<uint8_t>& outputBuffer)
+{
+    size_t size = 0;
+    for (const MP4Chunk& chunk : chunks)
+        size += chunk.size;
+
+    outputBuffer.reserve(outputBuffer.size() + size);
+
+    for (const MP4Chunk& chunk : chunks)
+        outputBuffer.insert(outputBuffer.end(), chunk.data, chunk.data + chunk.size);
+}
+
+/// Append a wrapped fragment to a file
+/// \param chunks The fragment
+/// \param path The file
+static void append_chunks(const std::vector<MP4Chunk>& chunks, const std::string& path)
+{
+    std::ofstream out(path, std::ios::out | std::ios::binary | std::ios::app);
+    for (const MP4Chunk& chunk : chunks)
+        out.write((const char*) chunk.data, chunk.size);
+    out.close();
+}
+
+
+
+/**
+ * @brief Destructor.
+ */
+MP4::~MP4()
+{
+}
+
+
+/**
+ * @brief Wraps a single frame, timed by the frame rate.
+ * @param inputFrameH264
+ * @param width
+ * @param height
+ * @param outputBuffer The fragment is appended.
+ */
+void MP4::Wrap(const std::vector<uint8_t>& inputFrameH264, uint32_t width, uint32_t height, std::vector<uint8_t>& outputBuffer)
+{
+    WrapSample(inputFrameH264.data(), inputFrameH264.size(), width, height, false, 0, m_chunks);
+    append_chunks(m_chunks, outputBuffer);
+}
+
+
+
+/**
+ * @brief Wraps a single frame with its presentation timestamp.
+ * @param inputFrameH264
+ * @param width
+ * @param height
+ * @param timestamp In the time base set with SetTimeBase(); decode times count from the first frame's.
+ * @param outputBuffer The fragment is appended.
+ */
+void MP4::Wrap(const std::vector<uint8_t>& inputFrameH264, uint32_t width, uint32_t height, uint64_t timestamp, std::vector<uint8_t>& outputBuffer)
+{
+    WrapSample(inputFrameH264.data(), inputFrameH264.size(), width, height, true, timestamp, m_chunks);
+    append_chunks(m_chunks, outputBuffer);
+}
+
+
+
+/**
+ * @brief Wraps a single frame without copying its data, timed by the frame rate.
+ * @param inputFrameH264 Must stay valid until the chunks have been written.
+ * @param inputSize
+ * @param width
+ * @param height
+ * @param chunks Receives the fragment: header bytes owned by this object, valid until the next call,
+ *               interleaved with references to the NAL units in inputFrameH264.
+ */
+void MP4::WrapChunks(const uint8_t* inputFrameH264, size_t inputSize, uint32_t width, uint32_t height, std::vector<MP4Chunk>& chunks)
+{
+    WrapSample(inputFrameH264, inputSize, width, height, false, 0, chunks);
+}
+
+
+
+/**
+ * @brief Wraps a single frame with its presentation timestamp without copying its data, see WrapChunks().
+ * @param inputFrameH264
+ * @param inputSize
+ * @param width
+ * @param height
+ * @param timestamp In the time base set with SetTimeBase(); decode times count from the first frame's.
+ * @param chunks
+ */
+void MP4::WrapChunks(const uint8_t* inputFrameH264, size_t inputSize, uint32_t width, uint32_t height, uint64_t timestamp, std::vector<MP4Chunk>& chunks)
+{
+    WrapSample(inputFrameH264, inputSize, width, height, true, timestamp, chunks);
+}
+
+
+
+/**
+ * @brief Wraps a frame into a fragment of its own, or adds it to the open one.
+ * @param inputFrameH264
+ * @param inputSize
+ * @param width
+ * @param height
+ * @param hasTimestamp
+ * @param timestamp
+ * @param chunks
+ */
+void MP4::WrapSample(const uint8_t* inputFrameH264, size_t inputSize, uint32_t width, uint32_t height, bool hasTimestamp, uint64_t timestamp, std::vector<MP4Chunk>& chunks)
+{
+    const bool traced = FrameTrace::IsEnabled();
+    EncoderStats::Ticks trace_start = traced ? EncoderStats::Now() : 0;
+    uint64_t frame_index = m_frame_index;
+
+    m_header.clear();
+    chunks.clear();
+    m_emitted_fragments.clear();
+
+    if (!initialized)
+    {
+        // Without out-of-band parameter sets, take them from the first frame (an IDR carries them in-band)
+        if (m_sps.empty())
+            SetParameterSets(inputFrameH264, inputSize);
+
+        Initialize(width, height);
+    }
+
+    if (IsMultiSample())
+    {
+        // moov, if this is the first frame
+        if (!m_header.empty())
+            chunks.push_back({ nullptr, m_header.size() });
+
+        AddSample(inputFrameH264, inputSize, AdvanceDecodeTime(hasTimestamp, timestamp), chunks);
+        FinishChunks(chunks);
+
+        if (traced)
+            FrameTrace::Record(FrameTrace::EVENT_MUX, m_trace_session, frame_index, trace_start, EncoderStats::Now(), inputSize);
+        return;
+    }
+
+
+    /*
+     * Encode frame
+     */
+    uint64_t moof_size = m_moof->get_size();
+
+    Mp4_mdat mdat(inputFrameH264, inputSize, m_nals, m_codec == CODEC_HEVC, IsStrippingParameterSets());
+    uint32_t data_size = mdat.get_data_size();
+    uint32_t sample_flags = is_sync_sample(inputFrameH264, inputSize, m_codec == CODEC_HEVC) ? s_mp4_sample_flags_sync : s_mp4_sample_flags_non_sync;
+
+    // The frame's duration is not known before the next one arrives; the next tfdt corrects for it
+    uint64_t time = AdvanceDecodeTime(hasTimestamp, timestamp);
+
+    // Fragments are numbered from 1 in the order they are emitted
+    uint32_t sequence_number = static_cast<uint32_t>(m_fragment_count + 1);
+
+    m_mfhd->set_sequence_number(sequence_number);
+    m_tfdt->set_media_decode_time(time);
+    m_trun->set_data_offset(static_cast<uint32_t>(moof_size + 8));
+    m_trun->set_sample_size(data_size);
+    m_trun->set_first_sample_flags(sample_flags);
+
+    m_tfhd->set_default_sample_duration(m_frame_duration);
+    m_tfhd->set_default_sample_size(data_size);
+    m_tfhd->set_default_sample_flags(s_mp4_sample_flags_non_sync);
+
+    size_t header_size = m_header.size();
+    if (m_segment_index)
+        AddSegmentIndex(time, moof_size + mdat.get_size(), m_frame_duration, sample_flags == s_mp4_sample_flags_sync);
+
+    if (sample_flags == s_mp4_sample_flags_sync && m_random_access_index)
+        m_random_access_points.push_back({ time, m_position, 1 });
+
+    m_emitted_fragments.push_back({ time, m_frame_duration, static_cast<uint32_t>(m_header.size() - header_size + moof_size + mdat.get_size()),
+                                    sample_flags == s_mp4_sample_flags_sync });
+    m_position += moof_size + mdat.get_size();
+
+    if (m_header_template)
+    {
+        // Only the per-frame fields differ from the template
+        size_t offset = m_header.size();
+        m_header.insert(m_header.end(), m_moof_template.begin(), m_moof_template.end());
+
+        uint8_t* moof = m_header.data() + offset;
+        store<uint32_t>(moof + m_mfhd_sequence_number_offset, sequence_number);
+        store<uint64_t>(moof + m_tfdt_time_offset, time);
+        store<uint32_t>(moof + m_trun_data_offset_offset, static_cast<uint32_t>(moof_size + 8));
+        store<uint32_t>(moof + m_trun_sample_size_offset, data_size);
+        store<uint32_t>(moof + m_trun_first_sample_flags_offset, sample_flags);
+        store<uint32_t>(moof + m_tfhd_sample_size_offset, data_size);
+        store<uint32_t>(moof + m_tfhd_sample_duration_offset, m_frame_duration);
+    }
+    else
+        m_moof->serialize(m_header);
+
+    size_t mdat_offset = m_header.size();
+    mdat.serialize_header(m_header);
+    m_fragment_count++;
+
+    chunks.push_back({ m_header.data(), mdat_offset });
+    mdat.get_chunks(m_header.data() + mdat_offset, chunks);
+
+    if (traced)
+        FrameTrace::Record(FrameTrace::EVENT_MUX, m_trace_session, frame_index, trace_start, EncoderStats::Now(), inputSize);
+}
+
+
+
+
+/**
+ * @brief Selects the video codec (must be called before the first frame).
+ * @param codec
+ */
+void MP4::SetCodec(Codec codec)
+{
+    m_codec = codec;
+}
+
+
+
+/**
+ * @brief Sets the parameter sets the sample description carries, e.g. from Encoder::GetSequenceParams()
+ * (must be called before the first frame to have an effect).
+ * @param annexB VPS (HEVC only), SPS and PPS NAL units with start codes; other NAL units are ignored.
+ * @param size
+ */
+void MP4::SetParameterSets(const uint8_t* annexB, size_t size)
+{
+    bool hevc = (m_codec == CODEC_HEVC);
+
+    Mp4_nal_units nals;
+    split_annexb(annexB, size, nals);
+
+    m_vps = hevc ? filter_nal_units(nals, s_hevc_nal_vps, true) : std::vector<std::vector<uint8_t>>();
+    m_sps = filter_nal_units(nals, hevc ? s_hevc_nal_sps : s_h264_nal_sps, hevc);
+    m_pps = filter_nal_units(nals, hevc ? s_hevc_nal_pps : s_h264_nal_pps, hevc);
+}
+
+
+
+/**
+ * @brief Selects how fragment headers are produced. With the template (the default), moof is
+ * serialized once and each frame only patches decode time, data offset and sample size; without it,
+ * the box tree is serialized for every frame.
+ * @param enabled
+ */
+void MP4::SetHeaderTemplate(bool enabled)
+{
+    m_header_template = enabled;
+}
+
+
+
+
+/**
+ * @brief Checks whether decoding can start at an access unit (IDR for H.264, IRAP for HEVC).
+ * @param annexB
+ * @param size
+ * @param codec
+ * @return
+ */
+bool MP4::IsSyncSample(const uint8_t* annexB, size_t size, Codec codec)
+{
+    return is_sync_sample(annexB, size, codec == CODEC_HEVC);
+}
+
+
+
+/**
+ * @brief Leaves VPS, SPS and PPS out of the samples when the sample description already carries them.
+ * Only safe as long as the encoder does not change its parameter sets mid-stream.
+ * @param strip
+ */
+void MP4::SetStripParameterSets(bool strip)
+{
+    m_strip_parameter_sets = strip;
+}
+
+
+
+/**
+ * @brief Sets how many frames go into one fragment (must be called before the first frame). A fragment
+ * is closed as soon as either limit is reached; a limit of 0 disables it. With more than one frame per
+ * fragment, frames are copied until their fragment is complete, and the last one has to be pushed out
+ * with Flush().
+ * @param frames Frames per fragment (1, the default, emits every frame on its own).
+ * @param milliseconds Maximum fragment duration.
+ */
+void MP4::SetFragmentSize(uint32_t frames, uint32_t milliseconds)
+{
+    m_fragment_frames = frames;
+    m_fragment_duration = milliseconds;
+}
+
+
+
+/**
+ * @brief Closes the current fragment before each sync sample, so every fragment starts with one and
+ * can be decoded on its own. Only applies to fragments of more than one frame.
+ * @param aligned
+ */
+void MP4::SetKeyframeAlignedFragments(bool aligned)
+{
+    m_keyframe_aligned = aligned;
+}
+
+
+
+/**
+ * @brief Sets the track's timescale in ticks per second (must be called before the first frame). The
+ * default of 90000 represents the common frame rates exactly.
+ * @param timescale
+ */
+void MP4::SetTimescale(uint32_t timescale)
+{
+    if (timescale == 0)
+        throw std::runtime_error("MP4 timescale must not be zero");
+
+    m_timescale = timescale;
+}
+
+
+
+/**
+ * @brief Sets the nominal frame rate, which spaces frames wrapped without a timestamp and gives the
+ * duration assumed for the first frame. Defaults to the encoder's 90 fps.
+ * @param numerator
+ * @param denominator
+ */
+void MP4::SetFrameRate(uint32_t numerator, uint32_t denominator)
+{
+    if (numerator == 0 || denominator == 0)
+        throw std::runtime_error("MP4 frame rate must not be zero");
+
+    m_frame_rate_num = numerator;
+    m_frame_rate_den = denominator;
+}
+
+
+
+/**
+ * @brief Sets the unit of the timestamps passed to Wrap() as a fraction of a second, e.g. 1/1000000
+ * (the default) for microseconds, or the inverse frame rate for frame numbers.
+ * @param numerator
+ * @param denominator
+ */
+void MP4::SetTimeBase(uint32_t numerator, uint32_t denominator)
+{
+    if (numerator == 0 || denominator == 0)
+        throw std::runtime_error("MP4 time base must not be zero");
+
+    m_time_base_num = numerator;
+    m_time_base_den = denominator;
+}
+
+
+
+/**
+ * @brief Emits the frames of the fragment that is still open.
+ * @param outputBuffer The fragment, if any, is appended.
+ */
+void MP4::Flush(std::vector<uint8_t>& outputBuffer)
+{
+    FlushChunks(m_chunks);
+    append_chunks(m_chunks, outputBuffer);
+}
+
+
+
+/**
+ * @brief Emits the frames of the fragment that is still open, without copying them.
+ * @param chunks Receives the fragment (empty if there was none), valid until the next call.
+ */
+void MP4::FlushChunks(std::vector<MP4Chunk>& chunks)
+{
+    m_header.clear();
+    chunks.clear();
+    m_emitted_fragments.clear();
+
+    if (initialized && IsMultiSample())
+        EmitFragment(chunks);
+
+    FinishChunks(chunks);
+}
+
+
+
+/**
+ * @brief Emits the fragment that is still open and appends it to a file.
+ * @param path
+ */
+void MP4::FlushToFile(const std::string& path)
+{
+    FlushChunks(m_chunks);
+    append_chunks(m_chunks, path);
+}
+
+
+
+/**
+ * @brief Ends the stream: emits the fragment that is still open, followed by the random access index
+ * if it is enabled.
+ * @param outputBuffer The rest of the stream is appended.
+ */
+void MP4::Close(std::vector<uint8_t>& outputBuffer)
+{
+    CloseChunks(m_chunks);
+    append_chunks(m_chunks, outputBuffer);
+}
+
+
+
+/**
+ * @brief Ends the stream without copying the frame data, see Close().
+ * @param chunks Receives the rest of the stream, valid until the next call.
+ */
+void MP4::CloseChunks(std::vector<MP4Chunk>& chunks)
+{
+    m_header.clear();
+    chunks.clear();
+    m_emitted_fragments.clear();
+
+    if (initialized && IsMultiSample())
+        EmitFragment(chunks);
+
+    if (initialized && m_random_access_index)
+    {
+        size_t offset = m_header.size();
+        MP4Arena::Mark mark = m_arena.GetMark();
+
+        Mp4_box* mfra = m_arena.Create<Mp4_box>(Mp4_box::s_mp4_box_type_mfra);
+        mfra->add_box(m_arena.Create<Mp4_tfra>(m_track_id, m_random_access_points));
+
+        Mp4_mfro* mfro = m_arena.Create<Mp4_mfro>();
+        mfra->add_box(mfro);
+        mfro->set_mfra_size(static_cast<uint32_t>(mfra->update_size()));
+
+        mfra->serialize(m_header);
+        m_position += mfra->get_size();
+        m_arena.Rewind(mark);
+
+        chunks.push_back({ nullptr, m_header.size() - offset });
+    }
+
+    FinishChunks(chunks);
+}
+
+
+
+/**
+ * @brief Ends the stream and appends the rest of it to a file, see Close().
+ * @param path
+ */
+void MP4::CloseToFile(const std::string& path)
+{
+    CloseChunks(m_chunks);
+    append_chunks(m_chunks, path);
+}
+
+
+
+/**
+ * @brief Writes ftyp (iso6, CMAF compatible) in front of moov (must be called before the first frame).
+ * @param enabled
+ */
+void MP4::SetFileType(bool enabled)
+{
+    m_file_type = enabled;
+}
+
+
+
+/**
+ * @brief Appends a styp box, which starts a media segment.
+ * @param outputBuffer
+ */
+void MP4::WriteSegmentType(std::vector<uint8_t>& outputBuffer)
+{
+    Mp4_ftyp styp(Mp4_ftyp::s_mp4_box_type_styp, Mp4_box::chars_to_type('m','s','d','h'), 0,
+                  { Mp4_box::chars_to_type('m','s','d','h'), Mp4_box::chars_to_type('m','s','i','x'), Mp4_box::chars_to_type('c','m','f','s') });
+    styp.serialize(outputBuffer);
+}
+
+
+
+/**
+ * @brief Keeps track of where the sync samples are and writes mfra (with tfra and mfro) when the stream
+ * is closed, so players can seek without reading every moof (must be called before the first frame).
+ * @param enabled
+ */
+void MP4::SetRandomAccessIndex(bool enabled)
+{
+    m_random_access_index = enabled;
+}
+
+
+
+/**
+ * @brief Puts a sidx in front of every fragment, which then forms a segment of its own.
+ * @param enabled
+ */
+void MP4::SetSegmentIndex(bool enabled)
+{
+    m_segment_index = enabled;
+}
+
+
+
+/**
+ * @brief Appends a sidx for the fragment that follows to the header buffer.
+ * @param time Decode time of the fragment's first sample.
+ * @param size Size of the fragment (moof and mdat).
+ * @param duration
+ * @param sync The fragment starts with a sync sample.
+ */
+void MP4::AddSegmentIndex(uint64_t time, uint64_t size, uint32_t duration, bool sync)
+{
+    Mp4_sidx sidx(m_track_id, m_timescale, time, static_cast<uint32_t>(size), duration, sync);
+    sidx.serialize(m_header);
+    m_position += sidx.get_size();
+}
+
+
+
+/**
+ * @brief Adds a frame to the open fragment and closes the fragment when it is complete.
+ * @param inputFrameH264
+ * @param inputSize
+ * @param time The frame's decode time, from AdvanceDecodeTime().
+ * @param chunks Receives the fragments that were closed.
+ */
+void MP4::AddSample(const uint8_t* inputFrameH264, size_t inputSize, uint64_t time, std::vector<MP4Chunk>& chunks)
+{
+    bool sync = is_sync_sample(inputFrameH264, inputSize, m_codec == CODEC_HEVC);
+
+    // With this frame's time known, so is the duration of the one before
+    if (m_trun->get_sample_table_size() > 0)
+    {
+        m_trun->set_last_sample_duration(m_frame_duration);
+        m_fragment_ticks = time - m_fragment_start;
+    }
+
+    if (sync && m_keyframe_aligned)
+        EmitFragment(chunks);
+
+    // A fragment never grows past its duration limit (the LL-HLS part target), unless one frame alone does
+    if (m_fragment_duration > 0 && m_trun->get_sample_table_size() > 0 &&
+        (time + m_frame_duration - m_fragment_start) * 1000 > static_cast<uint64_t>(m_fragment_duration) * m_timescale)
+        EmitFragment(chunks);
+
+    if (m_trun->get_sample_table_size() == 0)
+    {
+        m_fragment_start = time;
+        m_fragment_sync = sync;
+    }
+
+    // The moof offset is filled in once the fragment is closed
+    if (sync && m_random_access_index)
+        m_random_access_points.push_back({ time, 0, m_trun->get_sample_table_size() + 1 });
+
+    Mp4_mdat mdat(inputFrameH264, inputSize, m_nals, m_codec == CODEC_HEVC, IsStrippingParameterSets());
+    uint32_t sample_size = mdat.get_data_size();
+
+    size_t offset = m_fragment_data.size();
+    m_fragment_data.resize(offset + sample_size);
+
+    Mp4_writer writer(m_fragment_data.data() + offset);
+    mdat.serialize_body(writer);
+
+    // Until the next frame arrives, this one is assumed to last as long as the one before
+    m_trun->add_sample({ m_frame_duration, sample_size, sync ? s_mp4_sample_flags_sync : s_mp4_sample_flags_non_sync, 0 });
+    m_fragment_ticks = time + m_frame_duration - m_fragment_start;
+
+    bool full = (m_fragment_frames > 0 && m_trun->get_sample_table_size() >= m_fragment_frames) ||
+                (m_fragment_duration > 0 && m_fragment_ticks * 1000 >= static_cast<uint64_t>(m_fragment_duration) * m_timescale);
+    if (full)
+        EmitFragment(chunks);
+}
+
+
+
+/**
+ * @brief Works out the decode time of the next frame, and the duration of the frame before it.
+ * Timestamps are converted from the caller's time base relative to the first frame; frames without one
+ * follow the last timestamped frame (or the first frame) at the nominal frame rate. Either way, decode
+ * times are computed from absolute values, so rounding does not accumulate, and kept increasing.
+ * @param hasTimestamp
+ * @param timestamp
+ * @return the frame's decode time in the track's timescale.
+ */
+uint64_t MP4::AdvanceDecodeTime(bool hasTimestamp, uint64_t timestamp)
+{
+    uint64_t time;
+    if (hasTimestamp)
+    {
+        if (m_frame_index == 0)
+            m_first_timestamp = timestamp;
+
+        time = (timestamp > m_first_timestamp) ? rescale(timestamp - m_first_timestamp, static_cast<uint64_t>(m_timescale) * m_time_base_num, m_time_base_den) : 0;
+
+        m_origin_time = time;
+        m_origin_frame = m_frame_index;
+    }
+    else
+        time = m_origin_time + rescale(m_frame_index - m_origin_frame, static_cast<uint64_t>(m_timescale) * m_frame_rate_den, m_frame_rate_num);
+
+    if (m_frame_index > 0)
+    {
+        if (time <= m_decode_time)
+            time = m_decode_time + 1;
+
+        m_frame_duration = static_cast<uint32_t>((std::min)(time - m_decode_time, (uint64_t) UINT32_MAX));
+    }
+    else
+    {
+        uint64_t nominal = rescale(1, static_cast<uint64_t>(m_timescale) * m_frame_rate_den, m_frame_rate_num);
+        m_frame_duration = static_cast<uint32_t>((std::max)((std::min)(nominal, (uint64_t) UINT32_MAX), (uint64_t) 1));
+    }
+
+    m_decode_time = time;
+    m_frame_index++;
+    return time;
+}
+
+
+
+/**
+ * @brief Closes the open fragment, if it has any frames: serializes moof and the mdat header into the
+ * header buffer and hands the frame data over to a buffer that stays valid until the next call.
+ * @param chunks Receives the fragment; header chunks are resolved by FinishChunks().
+ */
+void MP4::EmitFragment(std::vector<MP4Chunk>& chunks)
+{
+    if (m_trun->get_sample_table_size() == 0)
+        return;
+
+    uint64_t moof_size = m_moof->update_size();
+    uint64_t mdat_size = Mp4_box::s_mp4_box_header_size + m_fragment_data.size();
+
+    m_mfhd->set_sequence_number(static_cast<uint32_t>(m_fragment_count + 1));
+    m_tfdt->set_media_decode_time(m_fragment_start);
+    m_trun->set_data_offset(static_cast<uint32_t>(moof_size + Mp4_box::s_mp4_box_header_size));
+
+    size_t offset = m_header.size();
+    if (m_segment_index)
+        AddSegmentIndex(m_fragment_start, moof_size + mdat_size, static_cast<uint32_t>(m_fragment_ticks), m_fragment_sync);
+
+    for (size_t i = m_random_access_points.size(); i > 0 && m_random_access_points[i - 1].time >= m_fragment_start; --i)
+        m_random_access_points[i - 1].moofOffset = m_position;
+
+    m_emitted_fragments.push_back({ m_fragment_start, static_cast<uint32_t>(m_fragment_ticks),
+                                    static_cast<uint32_t>(m_header.size() - offset + moof_size + mdat_size), m_fragment_sync });
+    m_position += moof_size + mdat_size;
+
+    m_moof->serialize(m_header);
+    Mp4_mdat::serialize_header(m_header, static_cast<uint32_t>(m_fragment_data.size()));
+
+    // Closing a fragment right before the next one is opened can happen twice per call
+    if (m_emitted_count == m_emitted_data.size())
+        m_emitted_data.emplace_back();
+
+    std::vector<uint8_t>& data = m_emitted_data[m_emitted_count++];
+    data.swap(m_fragment_data);
+    m_fragment_data.clear();
+
+    chunks.push_back({ nullptr, m_header.size() - offset });
+    if (!data.empty())
+        chunks.push_back({ data.data(), data.size() });
+
+    m_trun->clear_samples();
+    m_fragment_ticks = 0;
+    m_fragment_count++;
+}
+
+
+
+/**
+ * @brief Points the header chunks at the header buffer, which no longer moves; they cover it in order.
+ * @param chunks
+ */
+void MP4::FinishChunks(std::vector<MP4Chunk>& chunks)
+{
+    size_t offset = 0;
+    for (MP4Chunk& chunk : chunks)
+    {
+        if (!chunk.data)
+        {
+            chunk.data = m_header.data() + offset;
+            offset += chunk.size;
+        }
+    }
+
+    m_emitted_count = 0;
+}
+
+
+
+
+/**
+ * @brief Encode and append output to file. Opens and closes the file on every call; MP4Recorder keeps
+ * it open and writes from a background thread.
+ * @param inputFrameH264
+ * @param width
+ * @param height
+ * @param path
+ */
+void MP4::WrapToFile(const std::vector<uint8_t>& inputFrameH264, uint32_t width, uint32_t height, const std::string& path)
+{
+    WrapSample(inputFrameH264.data(), inputFrameH264.size(), width, height, false, 0, m_chunks);
+    append_chunks(m_chunks, path);
+}
+
+
+
+/**
+ * @brief Writes a wrapped fragment to a file or socket descriptor with a single gather write where
+ * the platform has one.
+ * @param fd
+ * @param chunks
+ * @return false if the write failed.
+ */
+bool MP4::WriteChunks(int fd, const std::vector<MP4Chunk>& chunks)
+{
+#ifdef _WIN32
+    for (const MP4Chunk& chunk : chunks)
+    {
+        size_t written = 0;
+        while (written < chunk.size)
+        {
+            int result = _write(fd, chunk.data + written, static_cast<unsigned int>((std::min)(chunk.size - written, (size_t) INT_MAX)));
+            if (result <= 0)
+                return false;
+
+            written += result;
+        }
+    }
+
+    return true;
+#else
+    std::vector<iovec> iov(chunks.size());
+    for (size_t i = 0; i < chunks.size(); ++i)
+    {
+        iov[i].iov_base = const_cast<uint8_t*>(chunks[i].data);
+        iov[i].iov_len = chunks[i].size;
+    }
+
+    // Resume after short writes and interruptions
+    size_t first = 0;
+    while (first < iov.size())
+    {
+        int count = static_cast<int>((std::min)(iov.size() - first, (size_t) IOV_MAX));
+        ssize_t result = writev(fd, &iov[first], count);
+        if (result < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return false;
+        }
+
+        size_t written = static_cast<size_t>(result);
+        while (first < iov.size() && written >= iov[first].iov_len)
+            written -= iov[first++].iov_len;
+
+        if (written > 0)
+        {
+            iov[first].iov_base = static_cast<uint8_t*>(iov[first].iov_base) + written;
+            iov[first].iov_len -= written;
+        }
+    }
+
+    return true;
+#endif
+}
+
+
+
+/**
+ * @brief First frame initialization: builds the fragment template and serializes moov into the header.
+ * @param width
+ * @param height
+ */
+void MP4::Initialize(uint32_t width, uint32_t height)
+{
+    // moof stays for the muxer's lifetime
+    m_moof = m_arena.Create<Mp4_box>(Mp4_box::s_mp4_box_type_moof);
+    m_mfhd = m_arena.Create<Mp4_mfhd>(1);
+    m_moof->add_box(m_mfhd);
+
+    Mp4_box* traf = m_arena.Create<Mp4_box>(Mp4_box::s_mp4_box_type_traf);
+
+    uint32_t flags = Mp4_tfhd::s_mp4_tfhd_flag_default_base_is_moof |
+                     Mp4_tfhd::s_mp4_tfhd_flag_default_sample_flags_present |
+                     Mp4_tfhd::s_mp4_tfhd_flag_default_sample_size_present |
+                     Mp4_tfhd::s_mp4_tfhd_flag_default_sample_duration_present;
+    m_tfhd = m_arena.Create<Mp4_tfhd>(flags, m_track_id, 0, 1, 1, 0, s_mp4_sample_flags_non_sync);
+    traf->add_box(m_tfhd);
+
+    m_tfdt = m_arena.Create<Mp4_tfdt>(0);
+    traf->add_box(m_tfdt);
+
+    // A fragment of several frames describes each one in the sample table; a single frame is always a sync sample
+    if (IsMultiSample())
+        flags = Mp4_trun::s_mp4_trun_data_offset_present |
+                Mp4_trun::s_mp4_trun_sample_duration_present |
+                Mp4_trun::s_mp4_trun_sample_size_present |
+                Mp4_trun::s_mp4_trun_sample_flags_present;
+    else
+        flags = Mp4_trun::s_mp4_trun_data_offset_present |
+                Mp4_trun::s_mp4_trun_sample_size_present |
+                Mp4_trun::s_mp4_trun_first_sample_flags_present;
+    m_trun = m_arena.Create<Mp4_trun>(flags, 1, 0x0000008, s_mp4_sample_flags_sync);
+    traf->add_box(m_trun);
+    m_moof->add_box(traf);
+
+    // The tree's layout is fixed from here on, so the field positions are as well
+    m_moof->update_size();
+    m_moof_template.clear();
+    m_moof->serialize(m_moof_template);
+
+    m_mfhd_sequence_number_offset = static_cast<uint32_t>(m_mfhd->get_offset()) + m_mfhd->get_sequence_number_offset();
+    m_tfdt_time_offset = static_cast<uint32_t>(m_tfdt->get_offset()) + m_tfdt->get_media_decode_time_offset();
+    m_trun_data_offset_offset = static_cast<uint32_t>(m_trun->get_offset()) + m_trun->get_data_offset_offset();
+    m_trun_sample_size_offset = static_cast<uint32_t>(m_trun->get_offset()) + m_trun->get_sample_size_offset();
+    m_trun_first_sample_flags_offset = static_cast<uint32_t>(m_trun->get_offset()) + m_trun->get_first_sample_flags_offset();
+    m_tfhd_sample_size_offset = static_cast<uint32_t>(m_tfhd->get_offset()) + m_tfhd->get_default_sample_size_offset();
+    m_tfhd_sample_duration_offset = static_cast<uint32_t>(m_tfhd->get_offset()) + m_tfhd->get_default_sample_duration_offset();
+
+    if (m_file_type)
+    {
+        uint32_t brand = (m_codec == CODEC_HEVC) ? Mp4_box::chars_to_type('h','v','c','1') : Mp4_box::chars_to_type('a','v','c','1');
+        Mp4_ftyp ftyp(Mp4_ftyp::s_mp4_box_type_ftyp, Mp4_box::chars_to_type('i','s','o','6'), 0,
+                      { Mp4_box::chars_to_type('i','s','o','6'), Mp4_box::chars_to_type('c','m','f','c'), Mp4_box::chars_to_type('m','p','4','1'), brand });
+        ftyp.serialize(m_header);
+    }
+
+    // moov is only needed until it has been serialized
+    MP4Arena::Mark mark = m_arena.GetMark();
+
+    Mp4_box* moov = m_arena.Create<Mp4_box>(Mp4_box::s_mp4_box_type_moov);
+    moov->add_box(m_arena.Create<Mp4_mvhd>(0, 0, 1000, 0));
+
+    Mp4_box* mvex = m_arena.Create<Mp4_box>(Mp4_box::s_mp4_box_type_mvex);
+    mvex->add_box(m_arena.Create<Mp4_mehd>(0));
+    mvex->add_box(m_arena.Create<Mp4_trex>(m_track_id, 1, 0, 0, 0)); // sample description id: 1
+    moov->add_box(mvex);
+
+    Mp4_box* trak = m_arena.Create<Mp4_box>(Mp4_box::s_mp4_box_type_trak);
+    trak->add_box(m_arena.Create<Mp4_tkhd>(m_track_id, width, height));
+
+    Mp4_box* mdia = m_arena.Create<Mp4_box>(Mp4_box::s_mp4_box_type_mdia);
+    mdia->add_box(m_arena.Create<Mp4_mdhd>(m_timescale, "eng"));
+    mdia->add_box(m_arena.Create<Mp4_hdlr>(Mp4_hdlr::s_mp4_hdlr_video_handler, "NVIDIA MPEG4 container"));
+
+    Mp4_dref* dref = m_arena.Create<Mp4_dref>();
+    dref->add_box(m_arena.Create<Mp4_data_entry_url>(""));
+
+    Mp4_box* dinf = m_arena.Create<Mp4_box>(Mp4_box::s_mp4_box_type_dinf);
+    dinf->add_box(dref);
+
+    Mp4_box* minf = m_arena.Create<Mp4_box>(Mp4_box::s_mp4_box_type_minf);
+    minf->add_box(m_arena.Create<Mp4_vmhd>(0x000001));
+    minf->add_box(dinf);
+
+    Mp4_box* sample_entry;
+    if (m_codec == CODEC_HEVC)
+    {
+        Mp4_hevc_decoder_configuration* config = m_arena.Create<Mp4_hevc_decoder_configuration>(m_vps, m_sps, m_pps);
+        m_codec_string = config->get_codec_string();
+        sample_entry = m_arena.Create<Mp4_visual_sample_entry>(Mp4_visual_sample_entry::s_mp4_visual_sample_entry_hvc1, width, height, config);
+    }
+    else
+    {
+        Mp4_avc_decoder_configuration* config = m_arena.Create<Mp4_avc_decoder_configuration>(m_sps, m_pps);
+        m_codec_string = config->get_codec_string();
+        sample_entry = m_arena.Create<Mp4_visual_sample_entry>(Mp4_visual_sample_entry::s_mp4_visual_sample_entry_avc1, width, height, config);
+    }
+
+    Mp4_box* stbl = m_arena.Create<Mp4_box>(Mp4_box::s_mp4_box_type_stbl);
+    stbl->add_box(m_arena.Create<Mp4_stsd>(sample_entry));
+    stbl->add_box(m_arena.Create<Mp4_stsz>(0, 0));
+    stbl->add_box(m_arena.Create<Mp4_stsc>(0));
+    stbl->add_box(m_arena.Create<Mp4_stts>(0));
+    stbl->add_box(m_arena.Create<Mp4_stco>(0));
+
+    minf->add_box(stbl);
+    mdia->add_box(minf);
+
+    trak->add_box(mdia);
+    moov->add_box(trak);
+
+    moov->update_size();
+    moov->serialize(m_header);
+    m_arena.Rewind(mark);
+
+    m_init_segment.assign(m_header.begin(), m_header.end());
+    m_position = m_header.size();
+    this->initialized = true;
+}
@@ -3,37 +3,274 @@
 
 #include <vector>
 #include <cstdint>
+#include <cstddef>
 #include <string>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "FrameTrace.h"
 
 
 class Mp4_box;
+class Mp4_mfhd;
 class Mp4_tfhd;
 class Mp4_tfdt;
 class Mp4_trun;
 
 
 /**
- * @brief MP4 container for H.264 streaming.
+ * @brief Piece of a wrapped fragment, laid out for writev()-style output.
+ */
+struct MP4Chunk
+{
+	const uint8_t* data;
+	size_t size;
+};
+
+
+
+/**
+ * @brief Sync sample as listed in the random access index (mfra).
+ */
+struct MP4RandomAccessPoint
+{
+	uint64_t time;          // Decode time in the track's timescale
+	uint64_t moofOffset;    // Position of the fragment's moof in the stream
+	uint32_t sampleNumber;  // One-based position of the sample within the fragment
+};
+
+
+
+/**
+ * @brief Fragment emitted by the last call, in output order.
+ */
+struct MP4FragmentInfo
+{
+	uint64_t decodeTime;    // Decode time of the first sample in the track's timescale
+	uint32_t duration;
+	uint32_t size;          // Bytes, including a leading sidx
+	bool sync;              // Starts with a sync sample
+};
+
+
+
+/**
+ * @brief Bump allocator for the muxer's box trees. Its first block is part of the muxer, so a muxer
+ * builds its boxes without touching the heap; objects are only released by rewinding the arena.
+ */
+class MP4Arena
+{
+public:
+	MP4Arena() = default;
+	~MP4Arena();
+
+	MP4Arena(const MP4Arena&) = delete;
+	MP4Arena& operator=(const MP4Arena&) = delete;
+
+	/**
+	 * @brief Allocation state to rewind to.
+	 */
+	struct Mark
+	{
+		size_t block;
+		size_t used;
+		const void* destructors;
+	};
+
+	template<typename T, typename... Args>
+	T* Create(Args&&... args)
+	{
+		T* object = new (Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+		if (!std::is_trivially_destructible<T>::value)
+			AddDestructor(object, [](void* p) { static_cast<T*>(p)->~T(); });
+		return object;
+	}
+
+	Mark GetMark() const { return { m_block, m_used, m_destructors }; }
+	void Rewind(const Mark& mark);
+
+private:
+	struct Destructor
+	{
+		void (*destroy)(void*);
+		void* object;
+		Destructor* next;
+	};
+
+	struct Block
+	{
+		std::unique_ptr<uint8_t[]> data;
+		size_t size;
+	};
+
+	void* Allocate(size_t size, size_t alignment);
+	void AddDestructor(void* object, void (*destroy)(void*));
+	uint8_t* GetBlockData(size_t block) const;
+	size_t GetBlockSize(size_t block) const;
+
+private:
+	static const size_t s_inline_size = 4096;
+	static const size_t s_block_size = 4096;
+
+	// Block 0 is the inline one, the others come from the heap and are kept for reuse
+	alignas(16) uint8_t m_inline[s_inline_size];
+	std::vector<Block> m_blocks;
+	size_t m_block = 0;
+	size_t m_used = 0;
+	Destructor* m_destructors = nullptr;
+};
+
+
+
+/**
+ * @brief MP4 container for H.264 and HEVC streaming.
  */
 class MP4
 {
 public:
 	virtual ~MP4();
 
+	enum Codec
+	{
+		CODEC_H264,
+		CODEC_HEVC
+	};
+
+	void SetCodec(Codec codec);
+	Codec GetCodec() const { return m_codec; }
+	void SetParameterSets(const uint8_t* annexB, size_t size);
+
 	void Wrap(const std::vector<uint8_t>& inputFrameH264, uint32_t width, uint32_t height, std::vector<uint8_t>& outputBuffer);
+	void Wrap(const std::vector<uint8_t>& inputFrameH264, uint32_t width, uint32_t height, uint64_t timestamp, std::vector<uint8_t>& outputBuffer);
+
+	void WrapChunks(const uint8_t* inputFrameH264, size_t inputSize, uint32_t width, uint32_t height, std::vector<MP4Chunk>& chunks);
+	void WrapChunks(const uint8_t* inputFrameH264, size_t inputSize, uint32_t width, uint32_t height, uint64_t timestamp, std::vector<MP4Chunk>& chunks);
 
 	void WrapToFile(const std::vector<uint8_t>& inputFrameH264, uint32_t width, uint32_t height, const std::string& path);
 
+	static bool WriteChunks(int fd, const std::vector<MP4Chunk>& chunks);
+	static bool IsSyncSample(const uint8_t* annexB, size_t size, Codec codec);
+
+	uint64_t GetFragmentCount() const { return m_fragment_count; }
+
+	void SetHeaderTemplate(bool enabled);
+	void SetStripParameterSets(bool strip);
+
+	void SetFragmentSize(uint32_t frames, uint32_t milliseconds = 0);
+	void SetKeyframeAlignedFragments(bool aligned);
+
+	void Flush(std::vector<uint8_t>& outputBuffer);
+	void FlushChunks(std::vector<MP4Chunk>& chunks);
+	void FlushToFile(const std::string& path);
+
+	void SetRandomAccessIndex(bool enabled);
+	void SetSegmentIndex(bool enabled);
+
+	void Close(std::vector<uint8_t>& outputBuffer);
+	void CloseChunks(std::vector<MP4Chunk>& chunks);
+	void CloseToFile(const std::string& path);
+
+	const std::vector<MP4RandomAccessPoint>& GetRandomAccessPoints() const { return m_random_access_points; }
+
+	void SetFileType(bool enabled);
+	static void WriteSegmentType(std::vector<uint8_t>& outputBuffer);
+
+	const std::vector<uint8_t>& GetInitSegment() const { return m_init_segment; }
+	const std::vector<MP4FragmentInfo>& GetEmittedFragments() const { return m_emitted_fragments; }
+	const std::string& GetCodecString() const { return m_codec_string; }
+
+	void SetTimescale(uint32_t timescale);
+	void SetFrameRate(uint32_t numerator, uint32_t denominator);
+	void SetTimeBase(uint32_t numerator, uint32_t denominator);
+	uint32_t GetTimescale() const { return m_timescale; }
+	uint64_t GetDecodeEndTime() const { return m_decode_time + m_frame_duration; }
+
+private:
+	void Initialize(uint32_t width, uint32_t height);
+	void WrapSample(const uint8_t* inputFrameH264, size_t inputSize, uint32_t width, uint32_t height, bool hasTimestamp, uint64_t timestamp, std::vector<MP4Chunk>& chunks);
+	uint64_t AdvanceDecodeTime(bool hasTimestamp, uint64_t timestamp);
+	bool IsMultiSample() const { return m_fragment_frames != 1; }
+	bool IsStrippingParameterSets() const { return m_strip_parameter_sets && !m_sps.empty(); }
+	void AddSample(const uint8_t* inputFrameH264, size_t inputSize, uint64_t time, std::vector<MP4Chunk>& chunks);
+	void EmitFragment(std::vector<MP4Chunk>& chunks);
+	void FinishChunks(std::vector<MP4Chunk>& chunks);
+	void AddSegmentIndex(uint64_t time, uint64_t size, uint32_t duration, bool sync);
+
 private:
 	bool initialized = false;
 
+	// Holds moof for the muxer's lifetime; moov and mfra only while they are serialized
+	MP4Arena m_arena;
 	Mp4_box* m_moof = nullptr;
+	Mp4_mfhd* m_mfhd = nullptr;
 	Mp4_tfhd* m_tfhd = nullptr;
 	Mp4_tfdt* m_tfdt = nullptr;
 	Mp4_trun* m_trun = nullptr;
 
+	Codec m_codec = CODEC_H264;
+	std::vector<std::vector<uint8_t>> m_vps;
+	std::vector<std::vector<uint8_t>> m_sps;
+	std::vector<std::vector<uint8_t>> m_pps;
+
+	bool m_strip_parameter_sets = false;
+	bool m_file_type = false;
+	std::string m_codec_string;
+	std::vector<uint8_t> m_init_segment;
+
 	uint32_t m_track_id = 1;
-	uint32_t m_seqno = 0;
-};
+	uint64_t m_fragment_count = 0;
+
+	// Timing: frames without a timestamp are spaced by the nominal frame rate, starting from the last
+	// frame that had one; decode times are computed from those origins, so rounding does not accumulate
+	uint32_t m_timescale = 90000;
+	uint32_t m_frame_rate_num = 90;
+	uint32_t m_frame_rate_den = 1;
+	uint32_t m_time_base_num = 1;
+	uint32_t m_time_base_den = 1000000;
+	uint64_t m_frame_index = 0;
+	uint64_t m_first_timestamp = 0;
+	uint64_t m_origin_time = 0;
+	uint64_t m_origin_frame = 0;
+	uint64_t m_decode_time = 0;
+	uint32_t m_frame_duration = 0;              // Of the latest frame: measured, or assumed until the next one arrives
+
+	// Serialized moof and the positions of the fields that change per frame
+	bool m_header_template = true;
+	std::vector<uint8_t> m_moof_template;
+	uint32_t m_mfhd_sequence_number_offset = 0;
+	uint32_t m_tfdt_time_offset = 0;
+	uint32_t m_trun_data_offset_offset = 0;
+	uint32_t m_trun_sample_size_offset = 0;
+	uint32_t m_trun_first_sample_flags_offset = 0;
+	uint32_t m_tfhd_sample_size_offset = 0;
+	uint32_t m_tfhd_sample_duration_offset = 0;
 
+	// Fragments of several frames: limits, and the frames of the open fragment in mdat format
+	uint32_t m_fragment_frames = 1;
+	uint32_t m_fragment_duration = 0;
+	bool m_keyframe_aligned = false;
+	uint64_t m_fragment_start = 0;
+	uint64_t m_fragment_ticks = 0;
+	bool m_fragment_sync = false;
+	std::vector<uint8_t> m_fragment_data;
 
+	// Indexes; the position counts every byte handed out so far
+	bool m_random_access_index = false;
+	bool m_segment_index = false;
+	std::vector<MP4RandomAccessPoint> m_random_access_points;
+	uint64_t m_position = 0;
+	std::vector<MP4FragmentInfo> m_emitted_fragments;
+
+	// Frame data of the fragments closed by the current call
+	std::vector<std::vector<uint8_t>> m_emitted_data;
+	size_t m_emitted_count = 0;
+
+	// Everything the muxer writes itself for the current fragment (moov on the first one, moof, mdat header)
+	std::vector<uint8_t> m_header;
+	std::vector<MP4Chunk> m_chunks;
+	std::vector<MP4Chunk> m_nals;
+
+	uint32_t m_trace_session = FrameTrace::CreateSession("MP4");
+};
@@ -0,0 +1,1239 @@
+// Measures the CPU time the encoder wrapper spends per frame around the driver calls (registration
+// lookup, map/unmap, bitstream lock/copy/unlock, reconfiguration), against the NvEncodeStub library
+// instead of a GPU. Every scenario is also run as the bare sequence of driver calls it needs, so the
+// reported overhead is the wrapper's alone. It also times MP4 fragment serialization for several streams at
+// 90 fps, and checks that:
+// - the scalar colour conversion gives BT.709 full range for fixed colours, and every SIMD kernel the CPU
+//   supports is bit-exact with it,
+// - the stub's output parses back to the session's settings,
+// - lost frames are recovered from by reference invalidation or an IDR as they should,
+// - the rate controller settles at the capacity of a simulated bottleneck.
+// Exits with 1 if anything failed, one of these checks did not hold or the wrapper leaked driver objects, so
+// it can run in CI on machines without an NVIDIA GPU.
+//
+// Usage: NvEncoderBenchmark [--library <stub>] [--frames <n>] [--width <w>] [--height <h>] [--bitrate <bps>]
+//                           [--hevc] [--latency <us>] [--frame-size <bytes>] [--streams <n>] [--trace]
+//                           [--frame-trace <json>]
+//
+// Outside Visual Studio, with the same definitions the DLL needs on Linux:
+//   DEFS='-D__declspec(x)=__attribute__((visibility("default"))) -DHMODULE=void*'
+//   g++ -O2 -shared -fPIC -fvisibility=hidden $DEFS -INvEncoder/VideoCodecSDK NvEncodeStub/NvEncodeStub.cpp -o libNvEncodeStub.so
+//   g++ -O2 $DEFS -INvEncoder -INvEncoder/VideoCodecSDK -INvEncodeStub NvEncoderBenchmark/Benchmark.cpp NvEncoder/encoder.cpp NvEncoder/EncoderStats.cpp NvEncoder/FrameTrace.cpp NvEncoder/ColorConversion.cpp NvEncoder/mp4.cpp NvEncoder/Bitstream.cpp NvEncoder/RateController.cpp -ldl -lpthread
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+
+#include "encoder.h"
+#include "ColorConversion.h"
+#include "mp4.h"
+#include "Bitstream.h"
+#include "RateController.h"
+#include "shared.h"
+#include "NvEncodeStub.h"
+
+#if !defined(_WIN32)
+#include <dlfcn.h>
+#endif
+
+
+// The driver library the encoder resolves its entry points from; InitNVENC sets it in the DLL
+HMODULE hEncodeDLL = nullptr;
+
+typedef std::chrono::steady_clock Clock;
+
+static NvEncStubGetDefaultConfig_Type s_getDefaultConfig = nullptr;
+static NvEncStubSetConfig_Type s_setConfig = nullptr;
+static NvEncStubGetStats_Type s_getStats = nullptr;
+static NvEncStubResetStats_Type s_resetStats = nullptr;
+static NvEncStubGetCallName_Type s_getCallName = nullptr;
+
+
+
+/**
+ * @brief Encoder on fake device pointers; the stub registers any non-null resource without touching it.
+ */
+class BenchmarkEncoder : public Encoder
+{
+public:
+	BenchmarkEncoder(uint32_t width, uint32_t height, bool hevc, uint32_t bitrate, uint32_t pipelineDepth)
+	{
+		SetPipelineDepth(pipelineDepth);
+		Init(NV_ENC_DEVICE_TYPE_CUDA, nullptr, width, height, hevc, bitrate);
+	}
+
+	void Submit(void* resource, uint32_t width, uint32_t height, bool iFrame)
+	{
+		Encoder::Submit(NV_ENC_INPUT_RESOURCE_TYPE_CUDADEVICEPTR, resource, NV_ENC_BUFFER_FORMAT_ABGR, width * 4, width, height, iFrame);
+	}
+
+	void Encode(void* resource, uint32_t width, uint32_t height, bool iFrame, std::vector<uint8_t>& buffer)
+	{
+		Encoder::Encode(NV_ENC_INPUT_RESOURCE_TYPE_CUDADEVICEPTR, resource, NV_ENC_BUFFER_FORMAT_ABGR, width * 4, width, height, iFrame, buffer);
+	}
+
+	std::shared_ptr<EncodedFrame> EncodeFrame(void* resource, uint32_t width, uint32_t height, bool iFrame)
+	{
+		return Encoder::EncodeFrame(NV_ENC_INPUT_RESOURCE_TYPE_CUDADEVICEPTR, resource, NV_ENC_BUFFER_FORMAT_ABGR, width * 4, width, height, iFrame);
+	}
+};
+
+
+
+struct Options
+{
+	std::string library;
+	uint32_t frames = 20000;
+	uint32_t width = 1920;
+	uint32_t height = 1080;
+	uint32_t bitrate = 20 * 1024 * 1024;
+	bool hevc = false;
+	uint32_t latency = 0;
+	uint32_t frameSize = 0;
+	uint32_t streams = 8;
+	bool trace = false;
+	std::string frameTrace;
+};
+
+
+
+/**
+ * @brief Per-frame times of one scenario, and what it cost in driver calls.
+ */
+struct Result
+{
+	std::string name;
+	std::vector<uint64_t> times;            // Nanoseconds per frame
+	uint64_t calls = 0;
+	uint64_t failures = 0;
+
+	double GetMean() const
+	{
+		uint64_t sum = 0;
+		for (uint64_t time : times)
+			sum += time;
+		return times.empty() ? 0.0 : (double)sum / times.size();
+	}
+
+	uint64_t GetPercentile(double percentile) const
+	{
+		if (times.empty())
+			return 0;
+
+		std::vector<uint64_t> sorted(times);
+		size_t index = (std::min)((size_t)(percentile * sorted.size()), sorted.size() - 1);
+		std::nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+		return sorted[index];
+	}
+};
+
+
+
+/**
+ * @brief Runs a scenario: a few unmeasured frames first, then frames timed one by one.
+ * @param name
+ * @param frame Encodes frame number n
+ * @return
+ */
+static Result Run(const std::string& name, uint32_t frames, const std::function<void(uint32_t)>& frame)
+{
+	const uint32_t warmupFrames = 1000;
+	for (uint32_t i = 0; i < warmupFrames; ++i)
+		frame(i);
+
+	Result result;
+	result.name = name;
+	result.times.reserve(frames);
+
+	NvEncStubStats before;
+	s_getStats(&before);
+
+	for (uint32_t i = 0; i < frames; ++i)
+	{
+		Clock::time_point start = Clock::now();
+		frame(warmupFrames + i);
+		result.times.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count());
+	}
+
+	NvEncStubStats after;
+	s_getStats(&after);
+
+	for (uint32_t call = 0; call < NVENC_STUB_CALL_COUNT; ++call)
+	{
+		result.calls += after.calls[call] - before.calls[call];
+		result.failures += after.failures[call] - before.failures[call];
+	}
+
+	return result;
+}
+
+
+
+/**
+ * @brief Throws if a driver call failed.
+ * @param status
+ * @param call
+ */
+static void Check(NVENCSTATUS status, const char* call)
+{
+	if (status != NV_ENC_SUCCESS)
+		throw std::runtime_error(std::string(call) + " failed with " + std::to_string(status));
+}
+
+
+
+/**
+ * @brief The driver calls an encoder makes for one frame, without the wrapper: map, encode, lock, copy, unlock, unmap.
+ */
+class DirectSession
+{
+public:
+	DirectSession(const Options& options)
+	{
+		typedef NVENCSTATUS(NVENCAPI *NvEncodeAPICreateInstance_Type)(NV_ENCODE_API_FUNCTION_LIST*);
+#if defined(_WIN32)
+		NvEncodeAPICreateInstance_Type createInstance = (NvEncodeAPICreateInstance_Type)(void *)(GetProcAddress(hEncodeDLL, "NvEncodeAPICreateInstance"));
+#else
+		NvEncodeAPICreateInstance_Type createInstance = (NvEncodeAPICreateInstance_Type)dlsym(hEncodeDLL, "NvEncodeAPICreateInstance");
+#endif
+		m_funcs = { NV_ENCODE_API_FUNCTION_LIST_VER };
+		Check(createInstance(&m_funcs), "NvEncodeAPICreateInstance");
+
+		NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS openSessionExParams = { NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS_VER };
+		openSessionExParams.deviceType = NV_ENC_DEVICE_TYPE_CUDA;
+		openSessionExParams.apiVersion = NVENCAPI_VERSION;
+		Check(m_funcs.nvEncOpenEncodeSessionEx(&openSessionExParams, &m_encoder), "nvEncOpenEncodeSessionEx");
+
+		NV_ENC_PRESET_CONFIG presetConfig = { NV_ENC_PRESET_CONFIG_VER,{ NV_ENC_CONFIG_VER } };
+		GUID codec = options.hevc ? NV_ENC_CODEC_HEVC_GUID : NV_ENC_CODEC_H264_GUID;
+		Check(m_funcs.nvEncGetEncodePresetConfig(m_encoder, codec, NV_ENC_PRESET_LOW_LATENCY_HQ_GUID, &presetConfig), "nvEncGetEncodePresetConfig");
+
+		m_config = presetConfig.presetCfg;
+		m_config.rcParams.averageBitRate = options.bitrate;
+		m_config.rcParams.maxBitRate = options.bitrate;
+
+		NV_ENC_INITIALIZE_PARAMS params = { NV_ENC_INITIALIZE_PARAMS_VER };
+		params.encodeGUID = codec;
+		params.presetGUID = NV_ENC_PRESET_LOW_LATENCY_HQ_GUID;
+		params.encodeWidth = options.width;
+		params.encodeHeight = options.height;
+		params.maxEncodeWidth = 4096;
+		params.maxEncodeHeight = 4096;
+		params.frameRateNum = 90;
+		params.frameRateDen = 1;
+		params.encodeConfig = &m_config;
+		params.enablePTD = 1;
+		Check(m_funcs.nvEncInitializeEncoder(m_encoder, &params), "nvEncInitializeEncoder");
+
+		NV_ENC_CREATE_BITSTREAM_BUFFER createBitstreamBuffer = { NV_ENC_CREATE_BITSTREAM_BUFFER_VER };
+		createBitstreamBuffer.size = options.width * options.height;
+		Check(m_funcs.nvEncCreateBitstreamBuffer(m_encoder, &createBitstreamBuffer), "nvEncCreateBitstreamBuffer");
+		m_bitstream = createBitstreamBuffer.bitstreamBuffer;
+
+		NV_ENC_REGISTER_RESOURCE registerResource = { NV_ENC_REGISTER_RESOURCE_VER };
+		registerResource.resourceType = NV_ENC_INPUT_RESOURCE_TYPE_CUDADEVICEPTR;
+		registerResource.resourceToRegister = &m_resource;
+		registerResource.width = options.width;
+		registerResource.height = options.height;
+		registerResource.pitch = options.width * 4;
+		registerResource.bufferFormat = NV_ENC_BUFFER_FORMAT_ABGR;
+		Check(m_funcs.nvEncRegisterResource(m_encoder, &registerResource), "nvEncRegisterResource");
+		m_registration = registerResource.registeredResource;
+
+		m_width = options.width;
+		m_height = options.height;
+	}
+
+	~DirectSession()
+	{
+		m_funcs.nvEncUnregisterResource(m_encoder, m_registration);
+		m_funcs.nvEncDestroyBitstreamBuffer(m_encoder, m_bitstream);
+		m_funcs.nvEncDestroyEncoder(m_encoder);
+	}
+
+	NV_ENC_LOCK_BITSTREAM Encode(uint32_t frame, bool copy, std::vector<uint8_t>& buffer, bool idr = false)
+	{
+		NV_ENC_MAP_INPUT_RESOURCE mapInputResource = { NV_ENC_MAP_INPUT_RESOURCE_VER };
+		mapInputResource.registeredResource = m_registration;
+		Check(m_funcs.nvEncMapInputResource(m_encoder, &mapInputResource), "nvEncMapInputResource");
+
+		NV_ENC_PIC_PARAMS picParams = {};
+		picParams.version = NV_ENC_PIC_PARAMS_VER;
+		picParams.pictureStruct = NV_ENC_PIC_STRUCT_FRAME;
+		picParams.inputBuffer = mapInputResource.mappedResource;
+		picParams.bufferFmt = NV_ENC_BUFFER_FORMAT_ABGR;
+		picParams.inputWidth = m_width;
+		picParams.inputHeight = m_height;
+		picParams.frameIdx = frame;
+		picParams.inputTimeStamp = frame;
+		picParams.outputBitstream = m_bitstream;
+		picParams.encodePicFlags = idr ? NV_ENC_PIC_FLAG_FORCEIDR : 0;
+		Check(m_funcs.nvEncEncodePicture(m_encoder, &picParams), "nvEncEncodePicture");
+
+		NV_ENC_LOCK_BITSTREAM lockBitstreamData = { NV_ENC_LOCK_BITSTREAM_VER };
+		lockBitstreamData.outputBitstream = m_bitstream;
+		Check(m_funcs.nvEncLockBitstream(m_encoder, &lockBitstreamData), "nvEncLockBitstream");
+
+		if (copy)
+		{
+			const uint8_t* data = (const uint8_t*)lockBitstreamData.bitstreamBufferPtr;
+			buffer.assign(data, data + lockBitstreamData.bitstreamSizeInBytes);
+		}
+
+		Check(m_funcs.nvEncUnlockBitstream(m_encoder, m_bitstream), "nvEncUnlockBitstream");
+		Check(m_funcs.nvEncUnmapInputResource(m_encoder, mapInputResource.mappedResource), "nvEncUnmapInputResource");
+		return lockBitstreamData;
+	}
+
+private:
+	NV_ENCODE_API_FUNCTION_LIST m_funcs;
+	NV_ENC_CONFIG m_config;
+	void* m_encoder = nullptr;
+	NV_ENC_OUTPUT_PTR m_bitstream = nullptr;
+	NV_ENC_REGISTERED_PTR m_registration = nullptr;
+	uint32_t m_resource = 0;
+	uint32_t m_width = 0;
+	uint32_t m_height = 0;
+};
+
+
+
+/**
+ * @brief Parses what the driver returns for a codec back with BitstreamParser: every access unit's parameter
+ * sets and first slice header have to give the session's size and Main profile, an IDR exactly where one was
+ * forced and a P slice otherwise, and the QP the driver reported. Runs at the configured size and at one that
+ * needs cropping in both codecs.
+ * @param options
+ * @param hevc
+ * @param frames Incremented per access unit checked
+ * @return Description of the first mismatch, or an empty string
+ */
+static std::string CheckBitstream(Options options, bool hevc, uint32_t& frames)
+{
+	const char* codec = hevc ? "HEVC" : "H.264";
+	const uint8_t profile = hevc ? 1 : 77;
+	options.hevc = hevc;
+
+	for (uint32_t size = 0; size < 2; ++size)
+	{
+		if (size == 1)
+		{
+			options.width = 1278;
+			options.height = 718;
+		}
+
+		DirectSession session(options);
+		BitstreamParser parser(hevc ? BitstreamParser::CODEC_HEVC : BitstreamParser::CODEC_H264);
+		std::vector<uint8_t> buffer;
+
+		for (uint32_t frame = 0; frame < 30; ++frame)
+		{
+			bool idr = frame % 10 == 0;
+			NV_ENC_LOCK_BITSTREAM lock = session.Encode(frame, true, buffer, idr);
+
+			std::string what = std::string(codec) + " " + std::to_string(options.width) + "x" + std::to_string(options.height) +
+				", frame " + std::to_string(frame) + ": ";
+
+			BitstreamFrameInfo info;
+			if (!parser.Parse(buffer.data(), buffer.size(), info))
+				return what + "does not parse";
+
+			if (info.width != options.width || info.height != options.height)
+				return what + std::to_string(info.width) + "x" + std::to_string(info.height) + " in the SPS";
+			if (info.profile != profile)
+				return what + "profile " + std::to_string(info.profile) + ", expected " + std::to_string(profile);
+			if (info.type != (idr ? BitstreamFrameInfo::TYPE_IDR : BitstreamFrameInfo::TYPE_P))
+				return what + "slice type " + std::to_string(info.type) + ", expected " + (idr ? "IDR" : "P");
+			if ((lock.pictureType == NV_ENC_PIC_TYPE_IDR) != idr)
+				return what + "picture type " + std::to_string(lock.pictureType) + " from the driver";
+			if (info.qp != (int32_t)lock.frameAvgQP)
+				return what + "QP " + std::to_string(info.qp) + ", the driver reported " + std::to_string(lock.frameAvgQP);
+			if (frame == 0 && !info.parameterSets)
+				return what + "no parameter sets in the first access unit";
+
+			++frames;
+		}
+	}
+
+	return std::string();
+}
+
+
+
+/**
+ * @brief Reports lost frames to the encoder and checks how the next frame recovers: by invalidating the
+ * references after a recent loss, with an IDR and no invalidation counted when the loss reaches back to the
+ * last IDR or further than the DPB, when the driver cannot invalidate references and when an invalidation
+ * fails. Injects one failure each into nvEncGetEncodeCaps and nvEncInvalidateRefFrames.
+ * @param config Stub configuration to restore after each fault
+ * @param hevc
+ * @param cases Incremented per loss checked
+ * @return Description of the first mismatch, or an empty string
+ */
+static std::string CheckInvalidation(const NvEncStubConfig& config, bool hevc, uint32_t& cases)
+{
+	const uint32_t width = 640;
+	const uint32_t height = 480;
+	uint32_t resource = 0;
+	uint64_t last = 0;
+
+	auto encode = [&](BenchmarkEncoder& encoder, bool iFrame)
+	{
+		std::shared_ptr<EncodedFrame> frame = encoder.EncodeFrame(&resource, width, height, iFrame);
+		last = frame->timestamp;
+		return frame->pictureType;
+	};
+
+	auto check = [&](BenchmarkEncoder& encoder, const char* what, uint64_t lost, bool idr) -> std::string
+	{
+		EncoderStats::Snapshot before;
+		encoder.GetStats().GetSnapshot(before);
+
+		encoder.InvalidateRefFrames(&lost, 1);
+		bool isIdr = encode(encoder, false) == NV_ENC_PIC_TYPE_IDR;
+
+		EncoderStats::Snapshot after;
+		encoder.GetStats().GetSnapshot(after);
+		uint64_t invalidations = after.invalidations - before.invalidations;
+
+		++cases;
+		if (isIdr == idr && invalidations == (idr ? 0u : 1u))
+			return std::string();
+
+		return std::string(what) + ": " + (isIdr ? "IDR" : "P frame") + " and " + std::to_string(invalidations) + " invalidations, expected " +
+			(idr ? "IDR and none" : "P frame and one");
+	};
+
+	std::string mismatch;
+	{
+		BenchmarkEncoder encoder(width, height, hevc, 10000000, 1);
+		for (uint32_t frame = 0; frame < 6; ++frame)
+			encode(encoder, false);
+
+		// The frame before the loss is still a reference
+		mismatch = check(encoder, "recent loss", last - 1, false);
+
+		// Nothing before the IDR can be referenced after it
+		if (mismatch.empty())
+		{
+			encode(encoder, true);
+			uint64_t idr = last;
+			encode(encoder, false);
+			mismatch = check(encoder, "loss of the last IDR", idr, true);
+		}
+
+		if (mismatch.empty())
+		{
+			encode(encoder, false);
+			encode(encoder, true);
+			uint64_t idr = last;
+			encode(encoder, false);
+			mismatch = check(encoder, "loss before the last IDR", idr - 1, true);
+		}
+
+		// Every reference the DPB holds comes after the lost frame
+		if (mismatch.empty())
+		{
+			for (uint32_t frame = 0; frame < Encoder::s_refFrames + 2; ++frame)
+				encode(encoder, false);
+			mismatch = check(encoder, "loss older than the DPB", last + 1 - Encoder::s_refFrames, true);
+		}
+
+		if (mismatch.empty())
+		{
+			NvEncStubConfig faultConfig = config;
+			faultConfig.faults[0].call = NVENC_STUB_CALL_INVALIDATE_REF_FRAMES;
+			faultConfig.faults[0].status = NV_ENC_ERR_GENERIC;
+			faultConfig.faults[0].first = 1;
+			faultConfig.faults[0].interval = 0;
+			s_setConfig(&faultConfig);
+
+			encode(encoder, false);
+			encode(encoder, false);
+			mismatch = check(encoder, "failed invalidation", last, true);
+			s_setConfig(&config);
+		}
+
+		// Recovers by invalidation again afterwards
+		if (mismatch.empty())
+		{
+			encode(encoder, false);
+			encode(encoder, false);
+			mismatch = check(encoder, "recent loss after a failed invalidation", last, false);
+		}
+	}
+
+	// Without invalidation support the encoder keeps no references to fall back to
+	if (mismatch.empty())
+	{
+		NvEncStubConfig faultConfig = config;
+		faultConfig.faults[0].call = NVENC_STUB_CALL_GET_ENCODE_CAPS;
+		faultConfig.faults[0].status = NV_ENC_ERR_UNSUPPORTED_PARAM;
+		faultConfig.faults[0].first = 1;
+		faultConfig.faults[0].interval = 0;
+		s_setConfig(&faultConfig);
+
+		BenchmarkEncoder encoder(width, height, hevc, 10000000, 1);
+		s_setConfig(&config);
+
+		for (uint32_t frame = 0; frame < 6; ++frame)
+			encode(encoder, false);
+		mismatch = check(encoder, "loss without invalidation support", last - 1, true);
+	}
+
+	return mismatch;
+}
+
+
+
+/**
+ * @brief Converts single-colour images with the scalar reference the kernels are compared to, and checks the
+ * result against BT.709 full range: Y = 0.2126 R + 0.7152 G + 0.0722 B, U = (B - Y) / 1.8556 + 128 and
+ * V = (R - Y) / 1.5748 + 128, each rounded and clamped to 0-255.
+ * @param cases Incremented per colour checked
+ * @return Description of the first mismatch, or an empty string
+ */
+static std::string CheckColorReference(uint32_t& cases)
+{
+	struct Colour
+	{
+		const char* name;
+		uint8_t rgb[3];
+		uint8_t yuv[3];
+	};
+
+	static const Colour colours[] =
+	{
+		{ "black", { 0, 0, 0 }, { 0, 128, 128 } },
+		{ "white", { 255, 255, 255 }, { 255, 128, 128 } },
+		{ "grey", { 128, 128, 128 }, { 128, 128, 128 } },
+		{ "red", { 255, 0, 0 }, { 54, 99, 255 } },
+		{ "green", { 0, 255, 0 }, { 182, 30, 12 } },
+		{ "blue", { 0, 0, 255 }, { 18, 255, 116 } }
+	};
+
+	ColorConverter reference(1, ColorConverter::KERNEL_SCALAR);
+
+	for (const Colour& colour : colours)
+	{
+		// One 2x2 block, so chroma averages four equal pixels
+		uint8_t rgba[16];
+		for (uint32_t i = 0; i < 4; ++i)
+		{
+			memcpy(rgba + 4 * i, colour.rgb, 3);
+			rgba[4 * i + 3] = 255;
+		}
+
+		uint8_t i420[6];
+		reference.ConvertToI420(rgba, 8, 2, 2, i420, 2, i420 + 4, 1, i420 + 5, 1);
+		uint8_t nv12[6];
+		reference.ConvertToNV12(rgba, 8, 2, 2, nv12, 2, nv12 + 4, 2);
+
+		const uint8_t expected[6] = { colour.yuv[0], colour.yuv[0], colour.yuv[0], colour.yuv[0], colour.yuv[1], colour.yuv[2] };
+		const char* format = nullptr;
+		const uint8_t* actual = nullptr;
+
+		if (memcmp(i420, expected, sizeof(expected)) != 0)
+		{
+			format = "I420";
+			actual = i420;
+		}
+		else if (memcmp(nv12, expected, sizeof(expected)) != 0)
+		{
+			format = "NV12";
+			actual = nv12;
+		}
+
+		if (format)
+		{
+			char text[128];
+			snprintf(text, sizeof(text), "%s %s: Y %u U %u V %u, expected %u %u %u", format, colour.name, actual[0], actual[4], actual[5],
+				colour.yuv[0], colour.yuv[1], colour.yuv[2]);
+			return text;
+		}
+
+		++cases;
+	}
+
+	return std::string();
+}
+
+
+
+/**
+ * @brief Converts random images with a kernel and with the scalar reference and compares every byte, padding
+ * included, for both output formats. Sizes cover odd widths and heights, tails shorter than any vector width,
+ * pitches wider than the rows, and with several threads the split into row bands.
+ * @param kernel
+ * @param cases Incremented per image size and thread count checked
+ * @return Description of the first mismatch, or an empty string
+ */
+static std::string CheckColorConversion(ColorConverter::Kernel kernel, uint32_t& cases)
+{
+	static const uint32_t sizes[][2] =
+	{
+		{ 1, 1 }, { 2, 2 }, { 3, 1 }, { 1, 3 }, { 5, 7 }, { 7, 4 }, { 15, 9 }, { 16, 16 }, { 17, 3 },
+		{ 31, 33 }, { 33, 31 }, { 63, 65 }, { 97, 51 }, { 130, 67 }, { 255, 129 }, { 641, 359 }, { 1920, 1080 }
+	};
+
+	ColorConverter reference(1, ColorConverter::KERNEL_SCALAR);
+	uint32_t seed = 1;
+
+	for (uint32_t threads : { 1u, 3u, 4u })
+	{
+		ColorConverter converter(threads, kernel);
+
+		for (const uint32_t* size : sizes)
+		{
+			for (uint32_t padding : { 0u, 13u })
+			{
+				uint32_t width = size[0];
+				uint32_t height = size[1];
+				uint32_t chromaWidth = (width + 1) / 2;
+				uint32_t chromaHeight = (height + 1) / 2;
+
+				uint32_t rgbaPitch = width * 4 + padding * 4;
+				uint32_t yPitch = width + padding;
+				uint32_t uPitch = chromaWidth + padding;
+				uint32_t uvPitch = chromaWidth * 2 + padding;
+
+				std::vector<uint8_t> rgba((size_t)rgbaPitch * height);
+				for (uint8_t& byte : rgba)
+				{
+					seed = seed * 1664525 + 1013904223;
+					byte = (uint8_t)(seed >> 24);
+				}
+
+				// Both start from the same pattern, so padding the kernel writes over shows up as a mismatch
+				std::vector<uint8_t> expected((size_t)yPitch * height + 2 * (size_t)uPitch * chromaHeight, 0xA5);
+				std::vector<uint8_t> actual(expected);
+
+				uint8_t* y = expected.data();
+				reference.ConvertToI420(rgba.data(), rgbaPitch, width, height, y, yPitch,
+					y + (size_t)yPitch * height, uPitch, y + (size_t)yPitch * height + (size_t)uPitch * chromaHeight, uPitch);
+				y = actual.data();
+				converter.ConvertToI420(rgba.data(), rgbaPitch, width, height, y, yPitch,
+					y + (size_t)yPitch * height, uPitch, y + (size_t)yPitch * height + (size_t)uPitch * chromaHeight, uPitch);
+
+				std::string what = std::to_string(width) + "x" + std::to_string(height) + ", padding " + std::to_string(padding) +
+					", " + std::to_string(threads) + " threads";
+
+				if (actual != expected)
+				{
+					size_t offset = std::mismatch(actual.begin(), actual.end(), expected.begin()).first - actual.begin();
+					return "I420 " + what + ": byte " + std::to_string(offset) + " differs";
+				}
+
+				expected.assign((size_t)yPitch * height + (size_t)uvPitch * chromaHeight, 0xA5);
+				actual = expected;
+
+				reference.ConvertToNV12(rgba.data(), rgbaPitch, width, height, expected.data(), yPitch, expected.data() + (size_t)yPitch * height, uvPitch);
+				converter.ConvertToNV12(rgba.data(), rgbaPitch, width, height, actual.data(), yPitch, actual.data() + (size_t)yPitch * height, uvPitch);
+
+				if (actual != expected)
+				{
+					size_t offset = std::mismatch(actual.begin(), actual.end(), expected.begin()).first - actual.begin();
+					return "NV12 " + what + ": byte " + std::to_string(offset) + " differs";
+				}
+
+				++cases;
+			}
+		}
+	}
+
+	return std::string();
+}
+
+
+
+/**
+ * @brief Replays a simulated network through the rate controller: 90 fps frames, a quarter larger or smaller
+ * than the rate it returns, go through a bottleneck of 30, then 60, then 20 Mbit/s with a 30 ms round trip,
+ * whose FIFO drops what would wait longer than 500 ms, and the client reports every fifth frame. Once each
+ * capacity had time to settle, the rate must stay close to it, neither overshoot nor back off far, and the
+ * queue must stay below the controller's maxQueueDelay.
+ * @param summary Rate range and worst queue per capacity
+ * @return Description of the first violation, or an empty string
+ */
+static std::string CheckRateControl(std::string& summary)
+{
+	static const double capacities[] = { 30e6, 60e6, 20e6 };
+	const uint64_t phase = 60000000;
+	const uint64_t settle = 30000000;
+	const uint64_t frameTime = 1000000 / 90;
+	const uint32_t baseRtt = 30000;
+
+	RateController controller((RateController::Config()));
+	uint32_t bitrate = 0;
+	controller.Update(0, bitrate);
+
+	double queue = 0.0;             // Bytes waiting at the bottleneck
+	uint64_t sent = 0;
+	uint64_t received = 0;
+	uint64_t dropped = 0;
+	uint32_t seed = 1;
+	std::string violation;
+
+	for (size_t i = 0; i < sizeof(capacities) / sizeof(capacities[0]); ++i)
+	{
+		double capacity = capacities[i];
+		double sum = 0.0;
+		double minRate = capacity * 10;
+		double maxRate = 0.0;
+		double maxDelay = 0.0;
+		uint32_t samples = 0;
+
+		for (uint64_t time = i * phase + frameTime; time <= (i + 1) * phase; time += frameTime)
+		{
+			// Frames vary in size around the rate, as an encoder's do
+			seed = seed * 1664525 + 1013904223;
+			uint32_t bytes = (uint32_t)(bitrate / 90 / 8 * (0.75 + (seed >> 8) / 33554432.0));
+			queue += bytes;
+			sent += bytes;
+
+			double drained = (std::min)(queue, capacity * frameTime / 8e6);
+			queue -= drained;
+			received += (uint64_t)drained;
+
+			double delay = queue * 8e6 / capacity;
+			if (delay > 500000)
+			{
+				double excess = queue - capacity * 0.5 / 8;
+				queue -= excess;
+				dropped += (uint64_t)excess;
+				delay = 500000;
+			}
+
+			controller.OnFrameEncoded(time, bytes);
+			if (time / frameTime % 5 == 0)
+			{
+				controller.OnFeedback(time, baseRtt + (uint32_t)delay, sent ? (float)dropped / sent : 0.0f, received);
+				sent = received = dropped = 0;
+			}
+
+			controller.Update(time, bitrate);
+
+			if (time > i * phase + settle)
+			{
+				sum += bitrate;
+				minRate = (std::min)(minRate, (double)bitrate);
+				maxRate = (std::max)(maxRate, (double)bitrate);
+				maxDelay = (std::max)(maxDelay, delay);
+				++samples;
+			}
+		}
+
+		double mean = sum / samples;
+		char text[128];
+		snprintf(text, sizeof(text), "%.0f Mbit/s: %.1f-%.1f, mean %.1f, queue up to %.0f ms",
+			capacity / 1e6, minRate / 1e6, maxRate / 1e6, mean / 1e6, maxDelay / 1000);
+		summary += std::string(summary.empty() ? "" : "; ") + text;
+
+		if (violation.empty() && (mean < 0.9 * capacity || minRate < 0.8 * capacity || maxRate > 1.08 * capacity || maxDelay > RateController::Config().maxQueueDelay))
+			violation = text;
+	}
+
+	return violation;
+}
+
+
+
+/**
+ * @brief Loads the stub and resolves its control functions.
+ * @param path
+ * @return false if the library is not found or is not the stub.
+ */
+static bool LoadStub(const std::string& path)
+{
+#if defined(_WIN32)
+	hEncodeDLL = LoadLibraryA(path.c_str());
+	auto resolve = [](const char* name) { return (void*)GetProcAddress(hEncodeDLL, name); };
+#else
+	hEncodeDLL = dlopen(path.c_str(), RTLD_NOW);
+	auto resolve = [](const char* name) { return dlsym(hEncodeDLL, name); };
+#endif
+
+	if (!hEncodeDLL)
+		return false;
+
+	s_getDefaultConfig = (NvEncStubGetDefaultConfig_Type)resolve("NvEncStubGetDefaultConfig");
+	s_setConfig = (NvEncStubSetConfig_Type)resolve("NvEncStubSetConfig");
+	s_getStats = (NvEncStubGetStats_Type)resolve("NvEncStubGetStats");
+	s_resetStats = (NvEncStubResetStats_Type)resolve("NvEncStubResetStats");
+	s_getCallName = (NvEncStubGetCallName_Type)resolve("NvEncStubGetCallName");
+
+	return s_getDefaultConfig && s_setConfig && s_getStats && s_resetStats && s_getCallName;
+}
+
+
+
+/**
+ * @brief Parses the command line.
+ * @param argc
+ * @param argv
+ * @param options
+ * @return false on unknown arguments.
+ */
+static bool ParseOptions(int argc, char** argv, Options& options)
+{
+#if defined(_WIN32)
+	options.library = "NvEncodeStub.dll";
+#else
+	options.library = "libNvEncodeStub.so";
+#endif
+
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+
+		if (arg == "--hevc")
+			options.hevc = true;
+		else if (arg == "--trace")
+			options.trace = true;
+		else if (arg == "--library" && hasValue)
+			options.library = argv[++i];
+		else if (arg == "--frames" && hasValue)
+			options.frames = (uint32_t)strtoul(argv[++i], nullptr, 0);
+		else if (arg == "--width" && hasValue)
+			options.width = (uint32_t)strtoul(argv[++i], nullptr, 0);
+		else if (arg == "--height" && hasValue)
+			options.height = (uint32_t)strtoul(argv[++i], nullptr, 0);
+		else if (arg == "--bitrate" && hasValue)
+			options.bitrate = (uint32_t)strtoul(argv[++i], nullptr, 0);
+		else if (arg == "--latency" && hasValue)
+			options.latency = (uint32_t)strtoul(argv[++i], nullptr, 0);
+		else if (arg == "--frame-size" && hasValue)
+			options.frameSize = (uint32_t)strtoul(argv[++i], nullptr, 0);
+		else if (arg == "--streams" && hasValue)
+			options.streams = (uint32_t)strtoul(argv[++i], nullptr, 0);
+		else if (arg == "--frame-trace" && hasValue)
+			options.frameTrace = argv[++i];
+		else
+			return false;
+	}
+
+	return options.frames > 0 && options.streams > 0 && options.width >= 64 && options.height >= 64 && options.width <= 2048 && options.height <= 2048;
+}
+
+
+
+/**
+ * @brief Prints one line of the result table.
+ * @param result
+ * @param baseline The same work done with direct driver calls, or nullptr
+ */
+static void Print(const Result& result, const Result* baseline)
+{
+	double mean = result.GetMean();
+
+	printf("%-34s %10.0f %10llu %10llu", result.name.c_str(), mean,
+		(unsigned long long)result.GetPercentile(0.5), (unsigned long long)result.GetPercentile(0.99));
+
+	if (baseline)
+		printf(" %10.0f", mean - baseline->GetMean());
+	else
+		printf(" %10s", "-");
+
+	printf(" %8.2f\n", (double)result.calls / result.times.size());
+}
+
+
+
+int main(int argc, char** argv)
+{
+	Options options;
+	if (!ParseOptions(argc, argv, options))
+	{
+		fprintf(stderr, "Usage: %s [--library <stub>] [--frames <n>] [--width <w>] [--height <h>] [--bitrate <bps>] [--hevc] [--latency <us>] [--frame-size <bytes>] [--streams <n>] [--trace] [--frame-trace <json>]\n", argv[0]);
+		fprintf(stderr, "Width and height go up to 2048, so resizing to twice the size stays within the encoder's limits.\n");
+		return 2;
+	}
+
+	// Runs first: it needs neither the stub nor a GPU
+	bool failed = false;
+
+	uint32_t referenceCases = 0;
+	std::string referenceMismatch = CheckColorReference(referenceCases);
+	if (!referenceMismatch.empty())
+	{
+		fprintf(stderr, "The scalar colour conversion is not BT.709 full range: %s\n", referenceMismatch.c_str());
+		failed = true;
+	}
+
+	std::string conversionSummary;
+
+	for (ColorConverter::Kernel kernel : { ColorConverter::KERNEL_SSE41, ColorConverter::KERNEL_AVX2, ColorConverter::KERNEL_NEON })
+	{
+		if (!ColorConverter::IsKernelSupported(kernel))
+			continue;
+
+		uint32_t cases = 0;
+		std::string mismatch = CheckColorConversion(kernel, cases);
+		if (!mismatch.empty())
+		{
+			fprintf(stderr, "Colour conversion kernel %s is not bit-exact: %s\n", ColorConverter::GetKernelName(kernel), mismatch.c_str());
+			failed = true;
+		}
+
+		conversionSummary += std::string(conversionSummary.empty() ? "" : ", ") + ColorConverter::GetKernelName(kernel) + " " +
+			(mismatch.empty() ? std::to_string(cases) + " cases bit-exact" : "MISMATCH");
+	}
+
+	std::string rateSummary;
+	std::string rateViolation = CheckRateControl(rateSummary);
+	if (!rateViolation.empty())
+	{
+		fprintf(stderr, "Rate control does not settle at the link capacity: %s\n", rateViolation.c_str());
+		failed = true;
+	}
+
+	if (!LoadStub(options.library))
+	{
+		fprintf(stderr, "Cannot load %s, or it is not the NvEncodeStub library\n", options.library.c_str());
+		return 2;
+	}
+
+	NvEncStubConfig config;
+	s_getDefaultConfig(&config);
+	config.encodeLatency = options.latency;
+	config.frameSize = options.frameSize;
+	config.idrFrameSize = options.frameSize ? 4 * options.frameSize : 0;
+	config.trace = options.trace ? 1 : 0;
+	s_setConfig(&config);
+
+	const uint32_t width = options.width;
+	const uint32_t height = options.height;
+	const uint32_t frames = options.frames;
+
+	// Stand-ins for device pointers, only compared and registered
+	std::vector<uint32_t> resources(16);
+
+	// Each scenario that does the same driver work as one of the direct ones is compared to it
+	std::vector<Result> results;
+	std::vector<int> baselines;
+	const int copyBaseline = 0;
+	const int zeroCopyBaseline = 1;
+	std::vector<uint8_t> buffer;
+
+	// First of the MP4 rows, and the size of the P frames they wrap
+	size_t mp4Results = 0;
+	size_t mp4FrameSize = 0;
+
+	// Where the time of a plain Encode goes, as the encoder's own stats see it
+	EncoderStats::Snapshot stages;
+
+	std::string bitstreamSummary;
+	std::string invalidationSummary;
+
+	try
+	{
+		for (bool hevc : { false, true })
+		{
+			uint32_t parsed = 0;
+			std::string mismatch = CheckBitstream(options, hevc, parsed);
+			if (!mismatch.empty())
+			{
+				fprintf(stderr, "The bitstream does not parse back to what was encoded: %s\n", mismatch.c_str());
+				failed = true;
+			}
+
+			bitstreamSummary += std::string(bitstreamSummary.empty() ? "" : ", ") + (hevc ? "HEVC " : "H.264 ") +
+				(mismatch.empty() ? std::to_string(parsed) + " access units match" : "MISMATCH");
+		}
+
+		uint32_t invalidationCases = 0;
+		std::string invalidationMismatch = CheckInvalidation(config, options.hevc, invalidationCases);
+		if (!invalidationMismatch.empty())
+		{
+			fprintf(stderr, "Loss recovery differs: %s\n", invalidationMismatch.c_str());
+			failed = true;
+		}
+
+		invalidationSummary = invalidationMismatch.empty() ? std::to_string(invalidationCases) + " losses recover as expected" : "MISMATCH";
+
+		{
+			DirectSession session(options);
+
+			results.push_back(Run("direct driver calls (copy)", frames, [&](uint32_t frame) { session.Encode(frame, true, buffer); }));
+			baselines.push_back(-1);
+
+			results.push_back(Run("direct driver calls (zero copy)", frames, [&](uint32_t frame) { session.Encode(frame, false, buffer); }));
+			baselines.push_back(-1);
+		}
+
+		{
+			BenchmarkEncoder encoder(width, height, options.hevc, options.bitrate, 1);
+
+			results.push_back(Run("Encode (copy)", frames, [&](uint32_t)
+			{
+				encoder.Encode(&resources[0], width, height, false, buffer);
+			}));
+			baselines.push_back(copyBaseline);
+
+			encoder.GetStats().GetSnapshot(stages, true);
+			if (stages.frames != frames + 1000 || stages.stages[EncoderStats::STAGE_LATENCY].count != frames + 1000)
+			{
+				fprintf(stderr, "Stats counted %llu frames, expected %u\n", (unsigned long long)stages.frames, frames + 1000);
+				failed = true;
+			}
+
+			encoder.SetStatsEnabled(false);
+			results.push_back(Run("Encode (copy), stats disabled", frames, [&](uint32_t)
+			{
+				encoder.Encode(&resources[0], width, height, false, buffer);
+			}));
+			baselines.push_back(copyBaseline);
+			encoder.SetStatsEnabled(true);
+
+			FrameTrace::Enable(1 << 16);
+			results.push_back(Run("Encode (copy), frame trace", frames, [&](uint32_t)
+			{
+				encoder.Encode(&resources[0], width, height, false, buffer);
+			}));
+			baselines.push_back(copyBaseline);
+			FrameTrace::Disable();
+
+			if (!options.frameTrace.empty() && !FrameTrace::WriteToFile(options.frameTrace))
+			{
+				fprintf(stderr, "Cannot write %s\n", options.frameTrace.c_str());
+				failed = true;
+			}
+
+			results.push_back(Run("EncodeFrame (zero copy)", frames, [&](uint32_t)
+			{
+				std::shared_ptr<EncodedFrame> frame = encoder.EncodeFrame(&resources[0], width, height, false);
+			}));
+			baselines.push_back(zeroCopyBaseline);
+
+			results.push_back(Run("Encode, forced IDR", frames, [&](uint32_t)
+			{
+				encoder.Encode(&resources[0], width, height, true, buffer);
+			}));
+			baselines.push_back(-1);
+
+			// Swapchain-like rotation within the registration cache
+			results.push_back(Run("Encode, 4 inputs (cached)", frames, [&](uint32_t frame)
+			{
+				encoder.Encode(&resources[frame % 4], width, height, false, buffer);
+			}));
+			baselines.push_back(copyBaseline);
+
+			// More inputs than the cache holds: a register and an unregister every frame
+			results.push_back(Run("Encode, 16 inputs (cache misses)", frames, [&](uint32_t frame)
+			{
+				encoder.Encode(&resources[frame % 16], width, height, false, buffer);
+			}));
+			baselines.push_back(-1);
+
+			results.push_back(Run("SetRate + Encode", frames, [&](uint32_t frame)
+			{
+				encoder.SetRate((frame & 1) ? options.bitrate : options.bitrate / 2);
+				encoder.Encode(&resources[0], width, height, false, buffer);
+			}));
+			baselines.push_back(-1);
+
+			results.push_back(Run("resize + Encode", frames / 10, [&](uint32_t frame)
+			{
+				uint32_t scale = (frame & 1) + 1;
+				encoder.Encode(&resources[scale], width * scale, height * scale, false, buffer);
+			}));
+			baselines.push_back(-1);
+		}
+
+		{
+			BenchmarkEncoder encoder(width, height, options.hevc, options.bitrate, 3);
+
+			results.push_back(Run("Submit/Retrieve, depth 3", frames, [&](uint32_t)
+			{
+				if (encoder.IsPipelineFull())
+					encoder.Retrieve(buffer, true);
+				encoder.Submit(&resources[0], width, height, false);
+			}));
+			baselines.push_back(copyBaseline);
+
+			while (encoder.Retrieve(buffer, true));
+		}
+
+		// Every tenth encode reports a busy engine; the wrapper has to throw and unmap the input
+		{
+			BenchmarkEncoder encoder(width, height, options.hevc, options.bitrate, 1);
+
+			NvEncStubConfig faultConfig = config;
+			faultConfig.faults[0].call = NVENC_STUB_CALL_ENCODE_PICTURE;
+			faultConfig.faults[0].status = NV_ENC_ERR_ENCODER_BUSY;
+			faultConfig.faults[0].first = 10;
+			faultConfig.faults[0].interval = 10;
+			s_setConfig(&faultConfig);
+
+			uint64_t errors = 0;
+			results.push_back(Run("Encode, 10% busy", frames, [&](uint32_t)
+			{
+				try
+				{
+					encoder.Encode(&resources[0], width, height, false, buffer);
+				}
+				catch (const std::runtime_error&)
+				{
+					++errors;
+				}
+			}));
+			baselines.push_back(-1);
+
+			s_setConfig(&config);
+
+			uint64_t expectedErrors = (frames + 1000) / 10;
+			if (errors != expectedErrors)
+			{
+				fprintf(stderr, "Expected %llu failed encodes, got %llu\n", (unsigned long long)expectedErrors, (unsigned long long)errors);
+				failed = true;
+			}
+		}
+
+		// Fragment build and serialization for several streams at 90 fps, one fragment per frame. The byte-wise
+		// row appends every byte of the box tree's output with push_back into a fresh buffer, the write
+		// pattern boxes were serialized with before they were stored in bulk into a pre-sized buffer.
+		{
+			BenchmarkEncoder encoder(width, height, options.hevc, options.bitrate, 1);
+
+			std::vector<uint8_t> idrFrame;
+			std::vector<uint8_t> frame;
+			encoder.Encode(&resources[0], width, height, true, idrFrame);
+			encoder.Encode(&resources[0], width, height, false, frame);
+
+			// Every stream gets a keyframe once a second
+			auto input = [&](uint32_t n) -> const std::vector<uint8_t>& { return (n / options.streams) % 90 == 0 ? idrFrame : frame; };
+
+			auto createMuxers = [&](bool headerTemplate)
+			{
+				std::vector<std::unique_ptr<MP4>> muxers(options.streams);
+				for (std::unique_ptr<MP4>& muxer : muxers)
+				{
+					muxer.reset(new MP4());
+					muxer->SetCodec(options.hevc ? MP4::CODEC_HEVC : MP4::CODEC_H264);
+					muxer->SetFrameRate(90, 1);
+					muxer->SetHeaderTemplate(headerTemplate);
+				}
+				return muxers;
+			};
+
+			std::string suffix = ", " + std::to_string(options.streams) + " streams";
+			std::vector<MP4Chunk> chunks;
+
+			{
+				std::vector<std::unique_ptr<MP4>> muxers = createMuxers(false);
+				results.push_back(Run("MP4 byte-wise" + suffix, frames, [&](uint32_t n)
+				{
+					const std::vector<uint8_t>& data = input(n);
+					muxers[n % options.streams]->WrapChunks(data.data(), data.size(), width, height, chunks);
+
+					std::vector<uint8_t> fragment;
+					for (const MP4Chunk& chunk : chunks)
+						for (size_t i = 0; i < chunk.size; ++i)
+							fragment.push_back(chunk.data[i]);
+				}));
+				baselines.push_back(-1);
+			}
+
+			{
+				std::vector<std::unique_ptr<MP4>> muxers = createMuxers(false);
+				results.push_back(Run("MP4 box serialization" + suffix, frames, [&](uint32_t n)
+				{
+					buffer.clear();
+					muxers[n % options.streams]->Wrap(input(n), width, height, buffer);
+				}));
+				baselines.push_back(-1);
+			}
+
+			{
+				std::vector<std::unique_ptr<MP4>> muxers = createMuxers(true);
+				results.push_back(Run("MP4 header template" + suffix, frames, [&](uint32_t n)
+				{
+					buffer.clear();
+					muxers[n % options.streams]->Wrap(input(n), width, height, buffer);
+				}));
+				baselines.push_back(-1);
+			}
+
+			{
+				std::vector<std::unique_ptr<MP4>> muxers = createMuxers(true);
+				results.push_back(Run("MP4 WrapChunks" + suffix, frames, [&](uint32_t n)
+				{
+					const std::vector<uint8_t>& data = input(n);
+					muxers[n % options.streams]->WrapChunks(data.data(), data.size(), width, height, chunks);
+				}));
+				baselines.push_back(-1);
+			}
+
+			mp4Results = results.size() - 4;
+			mp4FrameSize = frame.size();
+		}
+	}
+	catch (const std::exception& e)
+	{
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+
+	printf("%s %ux%u, %u frames, %u us latency; times in ns per frame\n\n", options.hevc ? "HEVC" : "H.264", width, height, frames, options.latency);
+	printf("%-34s %10s %10s %10s %10s %8s\n", "scenario", "mean", "p50", "p99", "overhead", "calls");
+	for (size_t i = 0; i < results.size(); ++i)
+		Print(results[i], baselines[i] >= 0 ? &results[baselines[i]] : nullptr);
+
+	// The share of one core the serialization takes with every stream at 90 fps
+	printf("\nMP4 fragments of %zu byte P frames, %u streams at 90 fps, share of one core:", mp4FrameSize, options.streams);
+	for (size_t i = mp4Results; i < mp4Results + 4; ++i)
+		printf(" %.3f%%", results[i].GetMean() * 90.0 * options.streams / 1e7);
+	printf(", bulk stores %.1fx faster than byte-wise\n", results[mp4Results].GetMean() / (std::max)(results[mp4Results + 1].GetMean(), 1.0));
+	printf("\nScalar colour conversion against BT.709 full range: %s\n",
+		referenceMismatch.empty() ? (std::to_string(referenceCases) + " colours exact").c_str() : "MISMATCH");
+	printf("Colour conversion against the scalar reference: %s\n", conversionSummary.empty() ? "no SIMD kernels on this CPU" : conversionSummary.c_str());
+	printf("Parameter sets and slice headers against the session: %s\n", bitstreamSummary.c_str());
+	printf("Reference invalidation and its IDR fallbacks: %s\n", invalidationSummary.c_str());
+	printf("Rate control on a simulated bottleneck, Mbit/s once settled: %s\n", rateSummary.c_str());
+
+	const char* stageNames[EncoderStats::STAGE_COUNT] = { "prepare", "register", "map", "encode", "lock", "unmap", "copy", "unlock", "submit to lock" };
+	printf("\nEncode (copy) by stage, as recorded by EncoderStats\n\n");
+	printf("%-34s %10s %10s %10s %10s\n", "stage", "mean", "p50", "p99", "p99.9");
+	for (uint32_t stage = 0; stage < EncoderStats::STAGE_COUNT; ++stage)
+	{
+		const LatencyHistogram::Summary& summary = stages.stages[stage];
+		printf("%-34s %10llu %10llu %10llu %10llu\n", stageNames[stage], (unsigned long long)summary.mean,
+			(unsigned long long)summary.p50, (unsigned long long)summary.p99, (unsigned long long)summary.p999);
+	}
+
+	// With every session gone, anything still alive in the driver was leaked by the wrapper
+	NvEncStubStats stats;
+	s_getStats(&stats);
+	if (stats.sessions || stats.bitstreamBuffers || stats.registrations || stats.mappings || stats.lockedBitstreams)
+	{
+		fprintf(stderr, "Leaked driver objects: %u sessions, %u bitstream buffers, %u registrations, %u mappings, %u locked bitstreams\n",
+			stats.sessions, stats.bitstreamBuffers, stats.registrations, stats.mappings, stats.lockedBitstreams);
+		failed = true;
+	}
+
+	// Only the injected faults may have failed
+	for (uint32_t call = 0; call < NVENC_STUB_CALL_COUNT; ++call)
+	{
+		uint64_t expected = 0;
+		if (call == NVENC_STUB_CALL_ENCODE_PICTURE)
+			expected = (frames + 1000) / 10;
+		else if (call == NVENC_STUB_CALL_GET_ENCODE_CAPS || call == NVENC_STUB_CALL_INVALIDATE_REF_FRAMES)
+			expected = 1;
+
+		if (stats.failures[call] != expected)
+		{
+			fprintf(stderr, "%s failed %llu times\n", s_getCallName(call), (unsigned long long)stats.failures[call]);
+			failed = true;
+		}
+	}
+
+	return failed ? 1 : 0;
+}